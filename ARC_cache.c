@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cache.h"
+
+// Buffer sizes used by the test driver; the cache itself stores any length
+#define KEY_SIZE 32
+#define VALUE_SIZE 256
+#define CACHE_CAPACITY 5
+#define CACHE_MAX_BYTES 4096
+#define ENDEC_KEY 3
+
+// Adaptive Replacement Cache (ARC, Megiddo and Modha).
+// Resident entries are split between T1 (seen once recently) and T2 (seen
+// at least twice). Entries evicted from them are kept as key-only ghosts
+// in B1 and B2. A miss that hits B1 means T1 was too small, so the target
+// size p of T1 grows; a hit in B2 shrinks it. Eviction takes from T1 while
+// it is larger than p and from T2 otherwise, so the cache moves between
+// LRU-like and frequency-like behaviour on its own, and a one-off scan only
+// ever flows through T1 without pushing out the entries in T2.
+//
+// All four lists are the usual doubly-linked list of entries drawn from one
+// slab and indexed by the same hash index; a ghost is an entry whose value
+// has been released. At most capacity entries are resident and at most
+// 2 * capacity entries (resident plus ghost) exist at once.
+
+enum { ARC_T1, ARC_T2, ARC_B1, ARC_B2, ARC_LISTS };
+
+typedef struct CacheEntry {
+    KeyValue kv;
+    struct CacheEntry *next;
+    struct CacheEntry *prev;
+    uint8_t list;   // which of T1, T2, B1, B2 the entry is on
+} CacheEntry;
+
+typedef struct ArcList {
+    CacheEntry *head;   // most recently used
+    CacheEntry *tail;   // least recently used
+    size_t size;
+} ArcList;
+
+typedef struct Cache {
+    Index index;
+    Slab entries;
+    Arena arena;
+    ArcList lists[ARC_LISTS];
+    size_t p;          // target size of T1
+    size_t capacity;   // maximum number of resident entries
+    size_t bytes;      // resident entry structs plus arena blocks currently charged
+    size_t max_bytes;  // memory budget; entries are evicted to stay under it
+    TimerWheel timers; // deadlines of resident entries added with a TTL
+    CacheStats *stats; // counters, shared through CacheOptions or owned by the cache
+    int own_stats;
+    StatsSlot *counts; // this instance's own slot in stats
+    FileTier *tier;    // evicted values on disk, NULL without a file tier
+} Cache;
+
+// Function to create and initialize a cache holding up to capacity entries
+static Cache *cache_create(size_t capacity, const CacheOptions *options) {
+    Cache *cache = (Cache *)malloc(sizeof(Cache));
+    if (cache == NULL) {
+        perror("Failed to allocate memory for cache");
+        exit(EXIT_FAILURE);
+    }
+    Reclaim *reclaim = options ? options->reclaim : NULL;
+    index_init(&cache->index, options ? options->initial_entries : 0, reclaim);
+    // Room for the resident entries and as many ghosts
+    slab_init(&cache->entries, sizeof(CacheEntry), 2 * capacity, reclaim);
+    arena_init(&cache->arena, reclaim);
+    cache->arena.cipher = options ? options->cipher : NULL;
+    wheel_init(&cache->timers);
+    cache->own_stats = !(options && options->stats);
+    cache->stats = cache->own_stats ? stats_create() : options->stats;
+    cache->counts = stats_own(cache->stats);
+    cache->index.stats = cache->stats;
+    cache->tier = tier_open(options, cache->stats);
+    memset(cache->lists, 0, sizeof(cache->lists));
+    cache->p = 0;
+    cache->bytes = 0;
+    cache->capacity = capacity;
+    cache->max_bytes = (options && options->max_bytes) ? options->max_bytes : SIZE_MAX;
+    return cache;
+}
+
+static size_t resident(const Cache *cache) {
+    return cache->lists[ARC_T1].size + cache->lists[ARC_T2].size;
+}
+
+static size_t ghosts(const Cache *cache) {
+    return cache->lists[ARC_B1].size + cache->lists[ARC_B2].size;
+}
+
+// Function to unlink an entry from the list it is on
+static void list_remove(Cache *cache, CacheEntry *entry) {
+    ArcList *list = &cache->lists[entry->list];
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        list->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        list->tail = entry->prev;
+    }
+    list->size--;
+}
+
+// Function to put an entry at the most recently used end of a list
+static void list_push_head(Cache *cache, CacheEntry *entry, int which) {
+    ArcList *list = &cache->lists[which];
+    entry->list = (uint8_t)which;
+    entry->prev = NULL;
+    entry->next = list->head;
+    if (list->head) {
+        list->head->prev = entry;
+    } else {
+        list->tail = entry;
+    }
+    list->head = entry;
+    list->size++;
+}
+
+// Function to remove an entry (resident or ghost) from the cache altogether
+static void delete_entry(Cache *cache, CacheEntry *entry) {
+    if (entry->list == ARC_T1 || entry->list == ARC_T2) {
+        size_t freed = sizeof(CacheEntry) + kv_bytes(&entry->kv);
+        cache->bytes -= freed;
+        stats_add(cache->counts, STAT_BYTES_REMOVED, freed);
+    }
+    list_remove(cache, entry);
+    index_remove(&cache->index, kv_key(&entry->kv), entry->kv.hash);
+    wheel_cancel(&cache->timers, &entry->kv);
+    kv_release(&entry->kv, &cache->arena);
+    slab_free(&cache->entries, entry);
+}
+
+// Function to turn the LRU entry of T1 or T2 into a ghost on B1 or B2
+static void demote(Cache *cache, int from, int to) {
+    CacheEntry *entry = cache->lists[from].tail;
+    // Keep resident plus ghost entries within 2 * capacity
+    if (resident(cache) + ghosts(cache) >= 2 * cache->capacity) {
+        ArcList *ghost = cache->lists[to].size ? &cache->lists[to] : &cache->lists[ARC_B1 + ARC_B2 - to];
+        delete_entry(cache, ghost->tail);
+    }
+    list_remove(cache, entry);
+    size_t freed = sizeof(CacheEntry) + kv_bytes(&entry->kv);
+    cache->bytes -= freed;
+    stats_add(cache->counts, STAT_BYTES_REMOVED, freed);
+    tier_put(cache->tier, &entry->kv);
+    wheel_cancel(&cache->timers, &entry->kv);
+    kv_drop_value(&entry->kv, &cache->arena);
+    list_push_head(cache, entry, to);
+}
+
+// Function to evict one resident entry: from T1 while it is above its
+// target size p, from T2 otherwise. in_b2 is set when the key being added
+// was found in B2, which breaks the tie at |T1| == p towards T1; reason is
+// the STAT_EVICT_ counter the eviction is charged to.
+static void replace(Cache *cache, int in_b2, int reason) {
+    stats_add(cache->counts, reason, 1);
+    size_t t1 = cache->lists[ARC_T1].size;
+    if (t1 > 0 && (t1 > cache->p || (in_b2 && t1 == cache->p) || cache->lists[ARC_T2].size == 0)) {
+        demote(cache, ARC_T1, ARC_B1);
+    } else {
+        demote(cache, ARC_T2, ARC_B2);
+    }
+}
+
+// Function to count a hit on a resident entry: it moves to the head of T2
+static void hit(Cache *cache, CacheEntry *entry) {
+    if (entry->list == ARC_T2 && entry == cache->lists[ARC_T2].head) {
+        return;
+    }
+    list_remove(cache, entry);
+    list_push_head(cache, entry, ARC_T2);
+}
+
+// Function called by the timer wheel for a resident entry whose TTL has run
+// out. It leaves no ghost: a key that expired was not evicted too early.
+static void expire_entry(void *cache, KeyValue *kv) {
+    stats_add(((Cache *)cache)->counts, STAT_EXPIRED, 1);
+    delete_entry((Cache *)cache, (CacheEntry *)kv);
+}
+
+// Function to add an entry to the cache; ttl_ms of 0 keeps it until it is evicted
+static void add_to_cache(Cache *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    stats_open(cache->counts, STATS_PUT);
+    uint64_t h = key_hash(key);
+    // A copy in the file tier is out of date from now on
+    tier_remove(cache->tier, key, h);
+    // Expired entries go first, so they make room before any live one is evicted
+    wheel_expire(&cache->timers, expire_entry, cache);
+    CacheEntry *entry = index_find(&cache->index, key, h);
+
+    // Resident: update the value and count it as a hit
+    if (entry && (entry->list == ARC_T1 || entry->list == ARC_T2)) {
+        hit(cache, entry);
+        size_t freed = kv_bytes(&entry->kv);
+        cache->bytes -= freed;
+        stats_add(cache->counts, STAT_BYTES_REMOVED, freed);
+        kv_set_value(&entry->kv, &cache->arena, value);
+        size_t added = kv_bytes(&entry->kv);
+        cache->bytes += added;
+        stats_add(cache->counts, STAT_BYTES_ADDED, added);
+        wheel_set_ttl(&cache->timers, &entry->kv, ttl_ms);
+        while (cache->bytes > cache->max_bytes && resident(cache) > 0) {
+            replace(cache, 0, STAT_EVICT_BYTES);
+        }
+        stats_close(cache->counts, STAT_UPDATES, STATS_PUT);
+        return;
+    }
+
+    // An entry larger than the whole budget is never cached
+    size_t need = sizeof(CacheEntry) + kv_size(&cache->arena, key, value);
+    if (need > cache->max_bytes || cache->capacity == 0) {
+        if (entry) {
+            delete_entry(cache, entry);
+        }
+        stats_close(cache->counts, STAT_REJECTED, STATS_PUT);
+        return;
+    }
+
+    if (entry) {
+        // Ghost hit: the list it was evicted from should have been bigger
+        size_t b1 = cache->lists[ARC_B1].size;
+        size_t b2 = cache->lists[ARC_B2].size;
+        int in_b2 = entry->list == ARC_B2;
+        if (!in_b2) {
+            size_t delta = b2 > b1 ? b2 / b1 : 1;
+            cache->p = cache->p + delta < cache->capacity ? cache->p + delta : cache->capacity;
+        } else {
+            size_t delta = b1 > b2 ? b1 / b2 : 1;
+            cache->p = cache->p > delta ? cache->p - delta : 0;
+        }
+        // Take the ghost off its list first so making room cannot delete it
+        list_remove(cache, entry);
+        entry->list = ARC_T2;
+        while (resident(cache) > 0 &&
+               (resident(cache) >= cache->capacity || cache->bytes + need > cache->max_bytes)) {
+            replace(cache, in_b2, resident(cache) >= cache->capacity ? STAT_EVICT_CAPACITY : STAT_EVICT_BYTES);
+        }
+        kv_set_value(&entry->kv, &cache->arena, value);
+        wheel_set_ttl(&cache->timers, &entry->kv, ttl_ms);
+        list_push_head(cache, entry, ARC_T2);
+        size_t added = sizeof(CacheEntry) + kv_bytes(&entry->kv);
+        cache->bytes += added;
+        stats_add(cache->counts, STAT_BYTES_ADDED, added);
+        stats_close(cache->counts, STAT_INSERTS, STATS_PUT);
+        return;
+    }
+
+    // Not seen recently at all
+    size_t l1 = cache->lists[ARC_T1].size + cache->lists[ARC_B1].size;
+    if (l1 >= cache->capacity) {
+        if (cache->lists[ARC_T1].size < cache->capacity) {
+            delete_entry(cache, cache->lists[ARC_B1].tail);
+        } else {
+            // T1 alone fills the cache: drop its LRU entry without a ghost
+            stats_add(cache->counts, STAT_EVICT_CAPACITY, 1);
+            tier_put(cache->tier, &cache->lists[ARC_T1].tail->kv);
+            delete_entry(cache, cache->lists[ARC_T1].tail);
+        }
+    } else if (resident(cache) + ghosts(cache) >= 2 * cache->capacity) {
+        delete_entry(cache, cache->lists[ARC_B2].tail);
+    }
+    while (resident(cache) > 0 &&
+           (resident(cache) >= cache->capacity || cache->bytes + need > cache->max_bytes)) {
+        replace(cache, 0, resident(cache) >= cache->capacity ? STAT_EVICT_CAPACITY : STAT_EVICT_BYTES);
+    }
+
+    entry = slab_alloc(&cache->entries);
+    if (entry == NULL) {
+        fprintf(stderr, "Cache entry slab exhausted\n");
+        exit(EXIT_FAILURE);
+    }
+    kv_set(&entry->kv, &cache->arena, key, h, value);
+    list_push_head(cache, entry, ARC_T1);
+    index_insert(&cache->index, kv_key(&entry->kv), h, entry);
+    wheel_set_ttl(&cache->timers, &entry->kv, ttl_ms);
+    cache->bytes += need;
+    stats_add(cache->counts, STAT_BYTES_ADDED, need);
+    stats_close(cache->counts, STAT_INSERTS, STATS_PUT);
+}
+
+// Function to bring a key back from the file tier into the cache, if the tier has it, and return its entry.
+// A key whose ghost is still on B1 or B2 comes back as a ghost hit, into T2.
+static CacheEntry *promote(Cache *cache, const char *key, uint64_t h) {
+    uint64_t ttl_ms;
+    const char *value = tier_get(cache->tier, cache->arena.cipher, key, h, &ttl_ms);
+    if (value == NULL) {
+        return NULL;
+    }
+    add_to_cache(cache, key, value, ttl_ms);
+    CacheEntry *entry = index_find(&cache->index, key, h);
+    return entry && (entry->list == ARC_T1 || entry->list == ARC_T2) ? entry : NULL;
+}
+
+// Function to return the value corresponding to a key, if it is resident
+static const char *retrieve_from_cache(Cache *cache, const char *key) {
+    stats_open(cache->counts, STATS_GET);
+    uint64_t h = key_hash(key);
+    CacheEntry *entry = index_find(&cache->index, key, h);
+    if (entry == NULL || entry->list == ARC_B1 || entry->list == ARC_B2 || kv_expired(&entry->kv)) {
+        entry = promote(cache, key, h);
+        stats_close(cache->counts, entry ? STAT_TIER_HITS : STAT_MISSES, STATS_GET);
+        return entry ? entry->kv.value : NULL;
+    }
+    hit(cache, entry);
+    stats_close(cache->counts, STAT_HITS, STATS_GET);
+    return entry->kv.value;
+}
+
+// Function to free the memory allocated
+static void free_memory(Cache *cache) {
+    slab_destroy(&cache->entries);
+    arena_destroy(&cache->arena);
+    index_free(&cache->index);
+    tier_close(cache->tier);
+    stats_disown(cache->counts);
+    if (cache->own_stats) {
+        stats_destroy(cache->stats);
+    }
+    free(cache);
+}
+
+// Adapters exposing this policy through the common CachePolicy interface
+static void *policy_create(size_t capacity, const CacheOptions *options) {
+    return cache_create(capacity, options);
+}
+
+static void policy_add(void *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    add_to_cache((Cache *)cache, key, value, ttl_ms);
+}
+
+static const char *policy_get(void *cache, const char *key) {
+    return retrieve_from_cache((Cache *)cache, key);
+}
+
+static void *policy_lookup(void *cache, const char *key, uint64_t hash) {
+    return index_find(&((Cache *)cache)->index, key, hash);
+}
+
+static void policy_prefetch(void *cache, uint64_t hash) {
+    index_prefetch(&((Cache *)cache)->index, hash);
+}
+
+static void policy_touch(void *cache, void *entry) {
+    CacheEntry *e = (CacheEntry *)entry;
+    if (e->list == ARC_T1 || e->list == ARC_T2) {
+        hit((Cache *)cache, e);
+    }
+}
+
+// Same choice replace() makes for a key that is in neither ghost list
+static void *policy_victim(void *cache) {
+    Cache *c = (Cache *)cache;
+    wheel_expire(&c->timers, expire_entry, c);
+    if (resident(c) < c->capacity) {
+        return NULL;
+    }
+    size_t t1 = c->lists[ARC_T1].size;
+    if (t1 > 0 && (t1 > c->p || c->lists[ARC_T2].size == 0)) {
+        return c->lists[ARC_T1].tail;
+    }
+    return c->lists[ARC_T2].tail;
+}
+
+// The resident entries, T1 then T2, each from its least recently used end; ghosts are left out
+static void policy_walk(void *cache, VisitFn visit, void *arg) {
+    Cache *c = (Cache *)cache;
+    for (int l = ARC_T1; l <= ARC_T2; l++) {
+        for (CacheEntry *entry = c->lists[l].tail; entry; entry = entry->prev) {
+            visit(arg, &entry->kv);
+        }
+    }
+}
+
+static void policy_destroy(void *cache) {
+    free_memory((Cache *)cache);
+}
+
+static CacheStats *policy_stats(void *cache) {
+    return ((Cache *)cache)->stats;
+}
+
+// Ghosts are entries too, but they only serve the policy: they count as metadata
+static void policy_memory(void *cache, CacheMemory *memory) {
+    Cache *c = (Cache *)cache;
+    memory_measure(memory, &c->index, &c->entries, &c->arena, c->own_stats ? c->stats : NULL);
+    size_t ghost_bytes = ghosts(c) * sizeof(KeyValue);
+    memory->entries -= ghost_bytes;
+    memory->metadata += ghost_bytes + sizeof(Cache) + tier_memory(c->tier);
+}
+
+const CachePolicy arc_policy = {"ARC", policy_create, policy_add, policy_get, policy_lookup, policy_prefetch, policy_touch, policy_victim, policy_walk, policy_destroy, policy_stats, policy_memory};
+
+// The test driver below is left out when the policy is built into the library
+#ifndef CACHE_LIBRARY
+
+// function to print all the entries of the cache with their values decrypted into a buffer
+static void print_decrypted(Cache *cache)
+{
+  char value[VALUE_SIZE];
+  for(int l=ARC_T1;l<=ARC_T2;l++)
+  {
+    for(CacheEntry *temp=cache->lists[l].head;temp;temp=temp->next)
+    {
+      cipher_read(cache->arena.cipher,temp->kv.value,value,sizeof(value));
+      printf("Key: %s and Value: %s\n",kv_key(&temp->kv),value);
+    }
+  }
+  printf("\n");
+}
+
+// function to print the resident entries of each list and the ghost keys
+static void print_func(Cache *cache)
+{
+    static const char *names[ARC_LISTS]={"T1","T2","B1","B2"};
+    printf("Target size of T1: %zu\n",cache->p);
+    for(int l=0;l<ARC_LISTS;l++)
+    {
+        for(CacheEntry *temp=cache->lists[l].head;temp;temp=temp->next)
+        {
+            if(l<=ARC_T2)
+                printf("%s Key: %s and Value: %s\n",names[l],kv_key(&temp->kv),temp->kv.value);
+            else
+                printf("%s Key: %s (ghost)\n",names[l],kv_key(&temp->kv));
+        }
+    }
+    printf("\n");
+}
+
+// Function to test the working of the logic and implementation
+static void test() {
+    Cipher cipher;
+    cipher_init_caesar(&cipher, ENDEC_KEY);
+    CacheOptions options = {CACHE_MAX_BYTES, 0, NULL, NULL, &cipher, NULL, 0};
+    Cache *cache = cache_create(CACHE_CAPACITY, &options);
+    clock_t start,end;
+    start=clock();
+
+
+    int lo = 0;
+    int hi = 7;
+    int miss = 0;
+    int hit = 0;
+
+    for (int i = 0; i < 5; i++) {
+        char k[KEY_SIZE];
+        int el = (rand() % (hi - lo + 1)) + lo;
+        snprintf(k, KEY_SIZE, "%d", el);
+        trim_newline(k);
+        char v[VALUE_SIZE];
+        fgets(v, VALUE_SIZE, stdin);
+        trim_newline(v);
+        add_to_cache(cache, k, v, 0);
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        int key = (rand() % (hi - lo + 1)) + lo;
+        char s[KEY_SIZE];
+        snprintf(s, KEY_SIZE, "%d", key);
+        const char *value = retrieve_from_cache(cache, s);
+        if (value) {
+            hit++;
+        } else {
+            miss++;
+        }
+    }
+
+    printf("Stored encrypted: \n");
+    print_func(cache);
+    printf("After decryption: \n");
+    print_decrypted(cache);
+
+    end = clock();
+    double diff = (double)(end - start) / CLOCKS_PER_SEC;
+    CacheMemory memory;
+    policy_memory(cache, &memory);
+    // A lookup the file tier answered returned a value too; count it apart from the hits
+    int tier_hit=(int)stats_total(cache->stats,STAT_TIER_HITS);
+    metric(hit-tier_hit,miss,tier_hit);
+
+    printf("| %-30s | %f seconds         |\n", "Time utilized", diff);
+    metric_memory(&memory);
+    printf("-------------------------------------------------\n");
+
+    free_memory(cache);
+}
+
+int main() {
+    test();
+    return 0;
+}
+
+#endif
@@ -0,0 +1,391 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cache.h"
+
+// Buffer sizes used by the test driver; the cache itself stores any length
+#define KEY_SIZE 32
+#define VALUE_SIZE 256
+#define CACHE_CAPACITY 5
+#define CACHE_MAX_BYTES 4096
+#define ENDEC_KEY 3
+
+// CLOCK (second chance) replacement.
+// The entries sit in the slab in slot order, and that order is the clock
+// face. A hit only sets the entry's reference bit; nothing is unlinked or
+// relinked. To evict, the hand sweeps the slots: a referenced entry has its
+// bit cleared and is passed over once, the first unreferenced entry is the
+// victim. This approximates LRU while the read path writes at most one byte,
+// and none at all when the bit is already set.
+
+// Define a structure for cache entry
+typedef struct CacheEntry {
+    KeyValue kv;          // first, so the slab free list link never touches the flags
+    uint8_t referenced;   // set on every hit, cleared as the hand passes
+    uint8_t in_use;       // slot holds a live entry
+} CacheEntry;
+
+// Define a structure for cache
+typedef struct Cache {
+    Index index;       // Hash index mapping keys to entries
+    Slab entries;      // Fixed pool the entries are drawn from; also the clock face
+    Arena arena;       // Out-of-line storage for keys and values
+    size_t hand;       // Slab slot the clock hand points at
+    size_t size;
+    size_t capacity;   // Maximum number of entries
+    size_t bytes;      // Entry structs plus arena blocks currently charged
+    size_t max_bytes;  // Memory budget the cache evicts to stay under
+    TimerWheel timers; // Deadlines of entries added with a TTL
+    CacheStats *stats; // Counters, shared through CacheOptions or owned by the cache
+    int own_stats;
+    StatsSlot *counts; // this instance's own slot in stats
+    FileTier *tier;    // Evicted entries on disk, NULL without a file tier
+} Cache;
+
+// Function to create and initialize a cache holding up to capacity entries
+static Cache *cache_create(size_t capacity, const CacheOptions *options) {
+    Cache *cache = (Cache *)malloc(sizeof(Cache));
+    if (cache == NULL) {
+        perror("Failed to allocate memory for cache");
+        exit(EXIT_FAILURE);
+    }
+    Reclaim *reclaim = options ? options->reclaim : NULL;
+    index_init(&cache->index, options ? options->initial_entries : 0, reclaim);
+    slab_init(&cache->entries, sizeof(CacheEntry), capacity, reclaim);
+    arena_init(&cache->arena, reclaim);
+    cache->arena.cipher = options ? options->cipher : NULL;
+    wheel_init(&cache->timers);
+    cache->own_stats = !(options && options->stats);
+    cache->stats = cache->own_stats ? stats_create() : options->stats;
+    cache->counts = stats_own(cache->stats);
+    cache->index.stats = cache->stats;
+    cache->tier = tier_open(options, cache->stats);
+    cache->hand = 0;
+    cache->size = 0;
+    cache->bytes = 0;
+    cache->capacity = capacity;
+    cache->max_bytes = (options && options->max_bytes) ? options->max_bytes : SIZE_MAX;
+    return cache;
+}
+
+// Function to remove an entry from the cache and free its memory
+static void remove_entry(Cache *cache, CacheEntry *entry) {
+    index_remove(&cache->index, kv_key(&entry->kv), entry->kv.hash);
+    wheel_cancel(&cache->timers, &entry->kv);
+    size_t freed = sizeof(CacheEntry) + kv_bytes(&entry->kv);
+    cache->bytes -= freed;
+    stats_add(cache->counts, STAT_BYTES_REMOVED, freed);
+    kv_release(&entry->kv, &cache->arena);
+    entry->in_use = 0;
+    slab_free(&cache->entries, entry);
+    cache->size--;
+}
+
+// Function to advance the hand until it finds an unreferenced entry and evict
+// it; reason is the STAT_EVICT_ counter the eviction is charged to
+static void evict_one(Cache *cache, int reason) {
+    for (;;) {
+        if (cache->hand >= cache->entries.bump) {
+            cache->hand = 0;
+        }
+        CacheEntry *entry = slab_object(&cache->entries, cache->hand);
+        cache->hand++;
+        if (!entry->in_use) {
+            continue;
+        }
+        if (entry->referenced) {
+            // Second chance: clear the bit and move on
+            entry->referenced = 0;
+            continue;
+        }
+        stats_add(cache->counts, reason, 1);
+        tier_put(cache->tier, &entry->kv);
+        remove_entry(cache, entry);
+        return;
+    }
+}
+
+// Function called by the timer wheel for an entry whose TTL has run out
+static void expire_entry(void *cache, KeyValue *kv) {
+    stats_add(((Cache *)cache)->counts, STAT_EXPIRED, 1);
+    remove_entry((Cache *)cache, (CacheEntry *)kv);
+}
+
+// Function to add an entry to the cache; ttl_ms of 0 keeps it until it is evicted
+static void add_to_cache(Cache *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    stats_open(cache->counts, STATS_PUT);
+    uint64_t h = key_hash(key);
+    // A copy in the file tier is out of date from now on
+    tier_remove(cache->tier, key, h);
+    // Expired entries go first, so they make room before any live one is evicted
+    wheel_expire(&cache->timers, expire_entry, cache);
+    // Check if the key already exists
+    CacheEntry *existing = index_find(&cache->index, key, h);
+    if (existing) {
+        // Update value if key already exists and count it as a use
+        size_t freed = kv_bytes(&existing->kv);
+        cache->bytes -= freed;
+        stats_add(cache->counts, STAT_BYTES_REMOVED, freed);
+        kv_set_value(&existing->kv, &cache->arena, value);
+        size_t added = kv_bytes(&existing->kv);
+        cache->bytes += added;
+        stats_add(cache->counts, STAT_BYTES_ADDED, added);
+        wheel_set_ttl(&cache->timers, &existing->kv, ttl_ms);
+        existing->referenced = 1;
+
+        // A bigger value may exceed the budget
+        while (cache->bytes > cache->max_bytes && cache->size > 0) {
+            evict_one(cache, STAT_EVICT_BYTES);
+        }
+        stats_close(cache->counts, STAT_UPDATES, STATS_PUT);
+        return;
+    }
+
+    // An entry larger than the whole budget is never cached, and a cache of
+    // capacity 0 caches nothing
+    size_t need = sizeof(CacheEntry) + kv_size(&cache->arena, key, value);
+    if (need > cache->max_bytes || cache->capacity == 0) {
+        stats_close(cache->counts, STAT_REJECTED, STATS_PUT);
+        return;
+    }
+
+    // Sweep the hand until the entry count and the byte budget both leave room
+    while (cache->size == cache->capacity || cache->bytes + need > cache->max_bytes) {
+        evict_one(cache, cache->size == cache->capacity ? STAT_EVICT_CAPACITY : STAT_EVICT_BYTES);
+    }
+
+    // Create a new entry; the slab hands back the slot just freed by the
+    // hand, so the new entry takes the victim's place on the clock
+    CacheEntry *entry = slab_alloc(&cache->entries);
+    if (entry == NULL) {
+        fprintf(stderr, "Cache entry slab exhausted\n");
+        exit(EXIT_FAILURE);
+    }
+    kv_set(&entry->kv, &cache->arena, key, h, value);
+    entry->referenced = 0;
+    entry->in_use = 1;
+    index_insert(&cache->index, kv_key(&entry->kv), h, entry);
+    wheel_set_ttl(&cache->timers, &entry->kv, ttl_ms);
+    cache->size++;
+    cache->bytes += need;
+    stats_add(cache->counts, STAT_BYTES_ADDED, need);
+    stats_close(cache->counts, STAT_INSERTS, STATS_PUT);
+}
+
+// Function to bring a key back from the file tier into the cache, if the tier has it, and return its entry
+static CacheEntry *promote(Cache *cache, const char *key, uint64_t h) {
+    uint64_t ttl_ms;
+    const char *value = tier_get(cache->tier, cache->arena.cipher, key, h, &ttl_ms);
+    if (value == NULL) {
+        return NULL;
+    }
+    add_to_cache(cache, key, value, ttl_ms);
+    return index_find(&cache->index, key, h);
+}
+
+// Function to return the value corresponding to a key, if it exists
+static const char *retrieve_from_cache(Cache *cache, const char *key) {
+    stats_open(cache->counts, STATS_GET);
+    uint64_t h = key_hash(key);
+    CacheEntry *entry = index_find(&cache->index, key, h);
+    if (entry == NULL || kv_expired(&entry->kv)) {
+        entry = promote(cache, key, h);
+        stats_close(cache->counts, entry ? STAT_TIER_HITS : STAT_MISSES, STATS_GET);
+        return entry ? entry->kv.value : NULL;
+    }
+    // The only write on a hit, skipped when the bit is already set
+    if (!entry->referenced) {
+        entry->referenced = 1;
+    }
+    stats_close(cache->counts, STAT_HITS, STATS_GET);
+    return entry->kv.value;
+}
+
+// Function to free the memory allocated
+static void free_memory(Cache *cache) {
+    slab_destroy(&cache->entries);
+    arena_destroy(&cache->arena);
+    index_free(&cache->index);
+    tier_close(cache->tier);
+    stats_disown(cache->counts);
+    if (cache->own_stats) {
+        stats_destroy(cache->stats);
+    }
+    free(cache);
+}
+
+// Adapters exposing this policy through the common CachePolicy interface
+static void *policy_create(size_t capacity, const CacheOptions *options) {
+    return cache_create(capacity, options);
+}
+
+static void policy_add(void *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    add_to_cache((Cache *)cache, key, value, ttl_ms);
+}
+
+static const char *policy_get(void *cache, const char *key) {
+    return retrieve_from_cache((Cache *)cache, key);
+}
+
+static void *policy_lookup(void *cache, const char *key, uint64_t hash) {
+    return index_find(&((Cache *)cache)->index, key, hash);
+}
+
+static void policy_prefetch(void *cache, uint64_t hash) {
+    index_prefetch(&((Cache *)cache)->index, hash);
+}
+
+static void policy_touch(void *cache, void *entry) {
+    ((CacheEntry *)entry)->referenced = 1;
+}
+
+// Peeks at where the hand would stop without clearing any bits. If every
+// entry is referenced the hand clears them all and stops at the first one.
+static void *policy_victim(void *cache) {
+    Cache *c = (Cache *)cache;
+    wheel_expire(&c->timers, expire_entry, c);
+    if (c->size < c->capacity) {
+        return NULL;
+    }
+    CacheEntry *first = NULL;
+    size_t slots = c->entries.bump;
+    for (size_t i = 0; i < slots; i++) {
+        CacheEntry *entry = slab_object(&c->entries, (c->hand + i) % slots);
+        if (!entry->in_use) {
+            continue;
+        }
+        if (!entry->referenced) {
+            return entry;
+        }
+        if (first == NULL) {
+            first = entry;
+        }
+    }
+    return first;
+}
+
+// Around the clock face from the hand, the order the hand would reach the entries in
+static void policy_walk(void *cache, VisitFn visit, void *arg) {
+    Cache *c = (Cache *)cache;
+    size_t slots = c->entries.bump;
+    for (size_t i = 0; i < slots; i++) {
+        CacheEntry *entry = slab_object(&c->entries, (c->hand + i) % slots);
+        if (entry->in_use) {
+            visit(arg, &entry->kv);
+        }
+    }
+}
+
+static void policy_destroy(void *cache) {
+    free_memory((Cache *)cache);
+}
+
+static CacheStats *policy_stats(void *cache) {
+    return ((Cache *)cache)->stats;
+}
+
+static void policy_memory(void *cache, CacheMemory *memory) {
+    Cache *c = (Cache *)cache;
+    memory_measure(memory, &c->index, &c->entries, &c->arena, c->own_stats ? c->stats : NULL);
+    memory->metadata += sizeof(Cache) + tier_memory(c->tier);
+}
+
+const CachePolicy clock_policy = {"CLOCK", policy_create, policy_add, policy_get, policy_lookup, policy_prefetch, policy_touch, policy_victim, policy_walk, policy_destroy, policy_stats, policy_memory};
+
+// The test driver below is left out when the policy is built into the library
+#ifndef CACHE_LIBRARY
+
+// function to print all the entries of the cache with their values decrypted into a buffer
+static void print_decrypted(Cache *cache)
+{
+  char value[VALUE_SIZE];
+  for(size_t i=0;i<cache->entries.bump;i++)
+  {
+    CacheEntry *temp=slab_object(&cache->entries,i);
+    if(!temp->in_use)
+      continue;
+    cipher_read(cache->arena.cipher,temp->kv.value,value,sizeof(value));
+    printf("Key: %s and Value: %s\n",kv_key(&temp->kv),value);
+  }
+  printf("\n");
+}
+
+// function to print all the entries of the cache in clock order
+static void print_func(Cache *cache)
+{
+    for(size_t i=0;i<cache->entries.bump;i++)
+    {
+         CacheEntry *temp=slab_object(&cache->entries,i);
+         if(!temp->in_use)
+           continue;
+         printf("Key: %s and Value: %s%s\n",kv_key(&temp->kv),temp->kv.value,
+                i==cache->hand ? "   <- hand" : "");
+    }
+    printf("\n");
+}
+
+// Function to test the working of the logic and implementation
+static void test() {
+    Cipher cipher;
+    cipher_init_caesar(&cipher, ENDEC_KEY);
+    CacheOptions options = {CACHE_MAX_BYTES, 0, NULL, NULL, &cipher, NULL, 0};
+    Cache *cache = cache_create(CACHE_CAPACITY, &options);
+    clock_t start,end;
+    start=clock();
+
+
+    int lo = 0;
+    int hi = 7;
+    int miss = 0;
+    int hit = 0;
+
+    for (int i = 0; i < 5; i++) {
+        char k[KEY_SIZE];
+        int el = (rand() % (hi - lo + 1)) + lo;
+        snprintf(k, KEY_SIZE, "%d", el);
+        trim_newline(k);
+        char v[VALUE_SIZE];
+        fgets(v, VALUE_SIZE, stdin);
+        trim_newline(v);
+        add_to_cache(cache, k, v, 0);
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        int key = (rand() % (hi - lo + 1)) + lo;
+        char s[KEY_SIZE];
+        snprintf(s, KEY_SIZE, "%d", key);
+        const char *value = retrieve_from_cache(cache, s);
+        if (value) {
+            hit++;
+        } else {
+            miss++;
+        }
+    }
+
+    printf("Stored encrypted: \n");
+    print_func(cache);
+    printf("After decryption: \n");
+    print_decrypted(cache);
+
+    end = clock();
+    double diff = (double)(end - start) / CLOCKS_PER_SEC;
+    CacheMemory memory;
+    policy_memory(cache, &memory);
+    // A lookup the file tier answered returned a value too; count it apart from the hits
+    int tier_hit=(int)stats_total(cache->stats,STAT_TIER_HITS);
+    metric(hit-tier_hit,miss,tier_hit);
+
+    printf("| %-30s | %f seconds         |\n", "Time utilized", diff);
+    metric_memory(&memory);
+    printf("-------------------------------------------------\n");
+
+    free_memory(cache);
+}
+
+int main() {
+    test();
+    return 0;
+}
+
+#endif
@@ -2,116 +2,247 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <sys/resource.h>
 #include "cache.h"
 
-#define CACHE_SIZE 1000
+// Buffer sizes used by the test driver; the cache itself stores any length
 #define KEY_SIZE 32
 #define VALUE_SIZE 256
 #define CACHE_CAPACITY 5
+#define CACHE_MAX_BYTES 4096
 
 
 // define a structure for cache entry
 
 typedef struct CacheEntry{
-    char key[KEY_SIZE];
-    char value[VALUE_SIZE];
+    KeyValue kv;
 }CacheEntry;
 
 
 // define a structure for cache
 typedef struct Cache{
-   CacheEntry *items[CACHE_SIZE];
-   int curr_size;
+   Index index;
+   Slab entries;
+   Arena arena;
+   size_t curr_size;
+   size_t capacity;   // maximum number of entries
+   size_t bytes;      // entry structs plus arena blocks currently charged
+   size_t max_bytes;  // memory budget; new keys are refused beyond it
+   TimerWheel timers; // deadlines of entries added with a TTL
+   CacheStats *stats; // counters, shared through CacheOptions or owned by the cache
+   int own_stats;
+   StatsSlot *counts; // this instance's own slot in stats
 }Cache;
 
 
-//initialize cache  
-void init(Cache *cache)
+//create and initialize a cache holding up to capacity entries
+static Cache *cache_create(size_t capacity,const CacheOptions *options)
 {
-    for(int i=0;i<CACHE_SIZE;i++)
+    Cache *cache=(Cache *)malloc(sizeof(Cache));
+    if(cache==NULL)
     {
-        cache->items[i]=NULL;
+        perror("Failed to allocate memory for cache");
+        exit(EXIT_FAILURE);
     }
+    Reclaim *reclaim=options ? options->reclaim : NULL;
+    index_init(&cache->index,options ? options->initial_entries : 0,reclaim);
+    slab_init(&cache->entries,sizeof(CacheEntry),capacity,reclaim);
+    arena_init(&cache->arena,reclaim);
+    cache->arena.cipher=options ? options->cipher : NULL;
+    wheel_init(&cache->timers);
+    cache->own_stats=!(options && options->stats);
+    cache->stats=cache->own_stats ? stats_create() : options->stats;
+    cache->counts=stats_own(cache->stats);
+    cache->index.stats=cache->stats;
     cache->curr_size=0;
+    cache->bytes=0;
+    cache->capacity=capacity;
+    cache->max_bytes=(options && options->max_bytes) ? options->max_bytes : SIZE_MAX;
+    return cache;
+}
+
+// function to drop an entry from the cache
+static void remove_from_cache(Cache *cache,CacheEntry *entry)
+{
+    index_remove(&cache->index,kv_key(&entry->kv),entry->kv.hash);
+    wheel_cancel(&cache->timers,&entry->kv);
+    size_t freed=sizeof(CacheEntry)+kv_bytes(&entry->kv);
+    cache->bytes-=freed;
+    stats_add(cache->counts,STAT_BYTES_REMOVED,freed);
+    kv_release(&entry->kv,&cache->arena);
+    slab_free(&cache->entries,entry);
+    cache->curr_size--;
 }
 
-// function to add an entry to  cache 
-void add_to_cache(Cache* cache,const char *key,const char *value)
+// called by the timer wheel for an entry whose TTL has run out
+static void expire_entry(void *cache,KeyValue *kv)
 {
-    unsigned int index=hash(key);
-    CacheEntry *entry=cache->items[index];
+    stats_add(((Cache *)cache)->counts,STAT_EXPIRED,1);
+    remove_from_cache((Cache *)cache,(CacheEntry *)kv);
+}
+
+// function to add an entry to  cache; ttl_ms of 0 keeps it until it is removed
+static void add_to_cache(Cache* cache,const char *key,const char *value,uint64_t ttl_ms)
+{
+    stats_open(cache->counts,STATS_PUT);
+    uint64_t h=key_hash(key);
+    // expired entries are dropped first, so their room goes to new keys
+    wheel_expire(&cache->timers,expire_entry,cache);
+    CacheEntry *entry=index_find(&cache->index,key,h);
    
     // checks if key already exists and update the value if found
     if(entry!=NULL)
     {
-            strncpy(entry->value,value,VALUE_SIZE-1);
-            entry->value[VALUE_SIZE-1]='\0';
+            size_t freed=kv_bytes(&entry->kv);
+            cache->bytes-=freed;
+            stats_add(cache->counts,STAT_BYTES_REMOVED,freed);
+            kv_set_value(&entry->kv,&cache->arena,value);
+            size_t added=kv_bytes(&entry->kv);
+            cache->bytes+=added;
+            stats_add(cache->counts,STAT_BYTES_ADDED,added);
+            wheel_set_ttl(&cache->timers,&entry->kv,ttl_ms);
+
+            // there is no eviction here, so a value that no longer fits the
+            // budget drops the key rather than leaving a stale value behind
+            if(cache->bytes > cache->max_bytes)
+            {
+                stats_add(cache->counts,STAT_EVICT_BYTES,1);
+                remove_from_cache(cache,entry);
+            }
+            stats_close(cache->counts,STAT_UPDATES,STATS_PUT);
             return ;
     }
 
-    // if key not found, create a new entry
-    CacheEntry *newentry=(CacheEntry *)malloc(sizeof(CacheEntry));
-    if(newentry==NULL)
+    // if key not found, create a new entry (this cache has no eviction,
+    // so once the slab or the byte budget is used up new keys are simply
+    // not cached)
+    size_t need=sizeof(CacheEntry)+kv_size(&cache->arena,key,value);
+    CacheEntry *newentry=NULL;
+    if(cache->bytes+need > cache->max_bytes || cache->curr_size==cache->capacity ||
+       (newentry=slab_alloc(&cache->entries))==NULL)
     {
-        perror("Failed to allocate memory !");
-        exit(EXIT_FAILURE);
+        stats_close(cache->counts,STAT_REJECTED,STATS_PUT);
+        return ;
     }
 
-    strncpy(newentry->key,key,KEY_SIZE-1);
-    newentry->key[KEY_SIZE-1]='\0';
-    strncpy(newentry->value,value,VALUE_SIZE-1);
-    newentry->value[VALUE_SIZE-1]='\0';
-    cache->items[index]=newentry;
+    kv_set(&newentry->kv,&cache->arena,key,h,value);
+    index_insert(&cache->index,kv_key(&newentry->kv),h,newentry);
+    wheel_set_ttl(&cache->timers,&newentry->kv,ttl_ms);
     cache->curr_size++;
+    cache->bytes+=need;
+    stats_add(cache->counts,STAT_BYTES_ADDED,need);
+    stats_close(cache->counts,STAT_INSERTS,STATS_PUT);
 }
 
 // function to retrieve an entry from the cache
-const char* retrieve_from_cache(Cache *cache,const char *key)
+static const char* retrieve_from_cache(Cache *cache,const char *key)
 {
-    unsigned int index=hash(key);
-    CacheEntry *entry=cache->items[index];
-    if(entry!=NULL)
-     return entry->value;
+    stats_open(cache->counts,STATS_GET);
+    CacheEntry *entry=index_find(&cache->index,key,key_hash(key));
+    if(entry!=NULL && !kv_expired(&entry->kv))
+    {
+     stats_close(cache->counts,STAT_HITS,STATS_GET);
+     return entry->kv.value;
+    }
  
     //key not found in cache 
+    stats_close(cache->counts,STAT_MISSES,STATS_GET);
     return NULL;
 }
 
 // function to free the memory used by cache ->memory deallocation
-void free_cache(Cache *cache)
+static void free_cache(Cache *cache)
 {
-    for(int i=0;i<CACHE_CAPACITY;i++)
+    slab_destroy(&cache->entries);
+    arena_destroy(&cache->arena);
+    index_free(&cache->index);
+    stats_disown(cache->counts);
+    if(cache->own_stats)
+        stats_destroy(cache->stats);
+    free(cache);
+}
+
+// Adapters exposing this policy through the common CachePolicy interface
+static void *policy_create(size_t capacity,const CacheOptions *options)
+{
+    return cache_create(capacity,options);
+}
+
+static void policy_add(void *cache,const char *key,const char *value,uint64_t ttl_ms)
+{
+    add_to_cache((Cache *)cache,key,value,ttl_ms);
+}
+
+static const char *policy_get(void *cache,const char *key)
+{
+    return retrieve_from_cache((Cache *)cache,key);
+}
+
+static void *policy_lookup(void *cache,const char *key,uint64_t hash)
+{
+    return index_find(&((Cache *)cache)->index,key,hash);
+}
+
+static void policy_prefetch(void *cache,uint64_t hash)
+{
+    index_prefetch(&((Cache *)cache)->index,hash);
+}
+
+// Index order: the hashmap keeps no order of its own
+static void policy_walk(void *cache,VisitFn visit,void *arg)
+{
+    Cache *c=(Cache *)cache;
+    size_t pos=0;
+    void *item;
+    while(index_next(&c->index,&pos,&item))
     {
-        if(cache->items[i]!=NULL)
-        {
-        CacheEntry *entry=cache->items[i];
-        free(entry);
-        }
+        visit(arg,&((CacheEntry *)item)->kv);
     }
 }
+
+static void policy_destroy(void *cache)
+{
+    free_cache((Cache *)cache);
+}
+
+static CacheStats *policy_stats(void *cache)
+{
+    return ((Cache *)cache)->stats;
+}
+
+static void policy_memory(void *cache,CacheMemory *memory)
+{
+    Cache *c=(Cache *)cache;
+    memory_measure(memory,&c->index,&c->entries,&c->arena,c->own_stats ? c->stats : NULL);
+    memory->metadata+=sizeof(Cache);
+}
+
+const CachePolicy hashmap_policy={"HASHMAP",policy_create,policy_add,policy_get,policy_lookup,policy_prefetch,NULL,NULL,policy_walk,policy_destroy,policy_stats,policy_memory};
+
+// The test driver below is left out when the policy is built into the library
+#ifndef CACHE_LIBRARY
+
 // function to print all the cache entries
-void print_cache(Cache *cache)
+static void print_cache(Cache *cache)
 {
    printf("Keys             Values\n");
-   for(int i=0;i<CACHE_SIZE;i++)
+   size_t pos=0;
+   void *item;
+   while(index_next(&cache->index,&pos,&item))
    {
-    if(cache->items[i]!=NULL)
-      printf("Key:%s    --->    Value:%s\n",cache->items[i]->key,cache->items[i]->value);
+      CacheEntry *entry=item;
+      printf("Key:%s    --->    Value:%s\n",kv_key(&entry->kv),entry->kv.value);
    }
    printf("\n");
 }
 
 // function to test the working of cache 
-void test_cache()
+static void test_cache()
 {
     clock_t start,end;
     start=clock();
-    struct rusage usage_start,usage_end;
-    getrusage(RUSAGE_SELF,&usage_start);
 
-    Cache cache;
-    init(&cache);
+    CacheOptions options={CACHE_MAX_BYTES,0,NULL,NULL,NULL,NULL,0};
+    Cache *cache=cache_create(CACHE_CAPACITY,&options);
 
     int lo=0;
     int hi=10;
@@ -127,7 +258,7 @@ void test_cache()
          char v[VALUE_SIZE];
          fgets(v,VALUE_SIZE,stdin);
          trim_newline(v);
-         add_to_cache(&cache,k,v);
+         add_to_cache(cache,k,v,0);
     }
   
     for(int i=0;i<500;i++)
@@ -135,24 +266,25 @@ void test_cache()
         int key=(rand()%(hi-lo+1))+lo;
         char s[KEY_SIZE];
         snprintf(s,KEY_SIZE,"%d",key);
-        const char *value = retrieve_from_cache(&cache, s);
+        const char *value = retrieve_from_cache(cache, s);
         if (value) 
             hit++;
         else
             miss++;
     }
-    print_cache(&cache);
-    metric(hit,miss);
+    end=clock();
+    print_cache(cache);
+    CacheMemory memory;
+    policy_memory(cache,&memory);
+    metric(hit,miss,0);
 
     double diff= (double)(end-start)/(CLOCKS_PER_SEC);
-    getrusage(RUSAGE_SELF, &usage_end);
-    long mem_used = usage_end.ru_maxrss - usage_start.ru_maxrss;
 
     printf("| %-30s | %f seconds         |\n", "Time utilized", diff);
-    printf("| %-30s | %ld KB             |\n", "Memory Used", mem_used);
+    metric_memory(&memory);
     printf("-------------------------------------------------\n");
 
-    free_cache(&cache);
+    free_cache(cache);
 }
 
 int main()
@@ -160,3 +292,5 @@ int main()
    test_cache();
    return 0;
 }
+
+#endif
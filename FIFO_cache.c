@@ -2,218 +2,317 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <sys/resource.h>
 #include "cache.h"
 
-#define CACHE_SIZE 2000
+// Buffer sizes used by the test driver; the cache itself stores any length
 #define KEY_SIZE 32
 #define VALUE_SIZE 256
 #define CACHE_CAPACITY 5
+#define CACHE_MAX_BYTES 4096
 #define ENDEC_KEY 3
 
-// define a structure for cache entry
+// define a structure for cache entry; its place in the queue is kept in Cache.queue
 typedef struct CacheEntry{
-    char key[KEY_SIZE];
-    char value[VALUE_SIZE];
-    // struct CacheEntry *next;
+    KeyValue kv;
 }CacheEntry;
 
 
-// define a queue linked list with front and rear pointers to maintain the FIFO order
-typedef struct QueueNode{
-   CacheEntry *entry;
-   struct QueueNode *next;
-}QueueNode;
-
-
 // define a structure for cache
 
 typedef struct Cache{
-   CacheEntry *items[CACHE_SIZE];
-   QueueNode *front;
-   QueueNode *rear;
-   int size;
+   Index index;
+   Slab entries;
+   Arena arena;
+   SlotList queue;    // entry slots in FIFO order, oldest at the head
+   size_t size;
+   size_t capacity;   // maximum number of entries
+   size_t bytes;      // entries, their queue links and arena blocks currently charged
+   size_t max_bytes;  // memory budget; oldest entries are evicted to stay under it
+   TimerWheel timers; // deadlines of entries added with a TTL
+   CacheStats *stats; // counters, shared through CacheOptions or owned by the cache
+   int own_stats;
+   StatsSlot *counts; // this instance's own slot in stats
+   FileTier *tier;    // evicted entries on disk, NULL without a file tier
 }Cache;
 
 
-//initialize cache  
+//create and initialize a cache holding up to capacity entries
 
-void init(Cache *cache)
+static Cache *cache_create(size_t capacity,const CacheOptions *options)
 {
-    for(int i=0;i<CACHE_SIZE;i++)
+    Cache *cache=(Cache *)malloc(sizeof(Cache));
+    if(cache==NULL)
     {
-        cache->items[i]=NULL;
+        perror("Failed to allocate memory for cache");
+        exit(EXIT_FAILURE);
     }
-    cache->front=NULL;
-    cache->rear=NULL;
+    Reclaim *reclaim=options ? options->reclaim : NULL;
+    index_init(&cache->index,options ? options->initial_entries : 0,reclaim);
+    slab_init(&cache->entries,sizeof(CacheEntry),capacity,reclaim);
+    slotlist_init(&cache->queue,&cache->entries);
+    arena_init(&cache->arena,reclaim);
+    cache->arena.cipher=options ? options->cipher : NULL;
+    wheel_init(&cache->timers);
+    cache->own_stats=!(options && options->stats);
+    cache->stats=cache->own_stats ? stats_create() : options->stats;
+    cache->counts=stats_own(cache->stats);
+    cache->index.stats=cache->stats;
+    cache->tier=tier_open(options,cache->stats);
     cache->size=0;
+    cache->bytes=0;
+    cache->capacity=capacity;
+    cache->max_bytes=(options && options->max_bytes) ? options->max_bytes : SIZE_MAX;
+    return cache;
 }
 
 
-//function to create a new queue node
+// function to get the oldest entry (front of the queue), or NULL while the cache is empty
+static CacheEntry* front_entry(Cache *cache)
+{
+     return cache->queue.head==SLOT_NONE ? NULL : slab_object(&cache->entries,cache->queue.head);
+}
 
-QueueNode* create_node(CacheEntry *entry)
+// function to unlink an entry from the queue and free it
+static void remove_entry(Cache *cache,CacheEntry *old_item)
 {
-      QueueNode *new_node=(QueueNode *)malloc(sizeof(QueueNode));
-     if (new_node == NULL) 
-     {
-        perror("Failed to allocate memory for queue node");
-        exit(EXIT_FAILURE);
-     }
-     new_node->entry=entry;
-     new_node->next=NULL;
-     return new_node;
+     slotlist_unlink(&cache->queue,slab_slot(&cache->entries,old_item));
+     cache->size--;
+
+     index_remove(&cache->index,kv_key(&old_item->kv),old_item->kv.hash);
+     wheel_cancel(&cache->timers,&old_item->kv);
+     size_t freed=sizeof(CacheEntry)+sizeof(SlotLink)+kv_bytes(&old_item->kv);
+     cache->bytes-=freed;
+     stats_add(cache->counts,STAT_BYTES_REMOVED,freed);
+     kv_release(&old_item->kv,&cache->arena);
+     slab_free(&cache->entries,old_item);
+}
+
+// function to evict the oldest entry (front of the queue); reason is the STAT_EVICT_ counter it is charged to
+static void evict_front(Cache *cache,int reason)
+{
+     stats_add(cache->counts,reason,1);
+     tier_put(cache->tier,&front_entry(cache)->kv);
+     remove_entry(cache,front_entry(cache));
+}
+
+// called by the timer wheel for an entry whose TTL has run out
+static void expire_entry(void *cache,KeyValue *kv)
+{
+     stats_add(((Cache *)cache)->counts,STAT_EXPIRED,1);
+     remove_entry((Cache *)cache,(CacheEntry *)kv);
 }
 
-// function to add an entry to  cache 
-void add_to_cache(Cache *cache,const char *key,const char *value)
+// function to add an entry to  cache; ttl_ms of 0 keeps it until it is evicted
+static void add_to_cache(Cache *cache,const char *key,const char *value,uint64_t ttl_ms)
 {
-    unsigned int index=hash(key);
-    CacheEntry *entry=cache->items[index];
+    stats_open(cache->counts,STATS_PUT);
+    uint64_t h=key_hash(key);
+    // a copy in the file tier is out of date from now on
+    tier_remove(cache->tier,key,h);
+    // expired entries go first, so they make room before any live one is evicted
+    wheel_expire(&cache->timers,expire_entry,cache);
+    CacheEntry *entry=index_find(&cache->index,key,h);
    
     // checks if key already exists and update the value if found
     if(entry!=NULL)
     {
-            strncpy(entry->value, value, VALUE_SIZE - 1);
-            entry->value[VALUE_SIZE-1]='\0';
+            size_t freed=kv_bytes(&entry->kv);
+            cache->bytes-=freed;
+            stats_add(cache->counts,STAT_BYTES_REMOVED,freed);
+            kv_set_value(&entry->kv,&cache->arena,value);
+            size_t added=kv_bytes(&entry->kv);
+            cache->bytes+=added;
+            stats_add(cache->counts,STAT_BYTES_ADDED,added);
+            wheel_set_ttl(&cache->timers,&entry->kv,ttl_ms);
+
+            // a bigger value may exceed the budget: evict in FIFO order
+            while(cache->bytes > cache->max_bytes && cache->size>0)
+                evict_front(cache,STAT_EVICT_BYTES);
+            stats_close(cache->counts,STAT_UPDATES,STATS_PUT);
             return ;
     }
 
+   // an entry larger than the whole budget is never cached, and a cache of
+   // capacity 0 caches nothing
+   size_t need=sizeof(CacheEntry)+sizeof(SlotLink)+kv_size(&cache->arena,key,value);
+   if(need > cache->max_bytes || cache->capacity==0)
+   {
+       stats_close(cache->counts,STAT_REJECTED,STATS_PUT);
+       return ;
+   }
+
+   // Evict the oldest entries first until both the entry count and the byte
+   // budget leave room, so their entry slots get reused
+   while(cache->size >= cache->capacity || cache->bytes+need > cache->max_bytes)
+       evict_front(cache,cache->size>=cache->capacity ? STAT_EVICT_CAPACITY : STAT_EVICT_BYTES);
+
     // if key not found, create a new entry
-    CacheEntry *newentry=(CacheEntry *)malloc(sizeof(CacheEntry));
+    CacheEntry *newentry=slab_alloc(&cache->entries);
     if(newentry==NULL)
     {
-        perror("Failed to allocate memory !");
+        fprintf(stderr,"Cache entry slab exhausted\n");
         exit(EXIT_FAILURE);
     }
 
-    strncpy(newentry->key,key,KEY_SIZE-1);
-    newentry->key[KEY_SIZE-1]='\0';
-    strncpy(newentry->value,value,VALUE_SIZE-1);
-    newentry->value[VALUE_SIZE-1]='\0';
-    cache->items[index]=newentry;
+    kv_set(&newentry->kv,&cache->arena,key,h,value);
+    index_insert(&cache->index,kv_key(&newentry->kv),h,newentry);
+    wheel_set_ttl(&cache->timers,&newentry->kv,ttl_ms);
  
-   // Simultaneously , add the entry to queue as well
-   QueueNode *new_node= create_node(newentry);
-   if(cache->front==NULL )
-   {
-    cache->front=cache->rear=new_node;
-   }
-   else
-   {
-      cache->rear->next=new_node;
-      cache->rear=new_node;
-   }
+   // Simultaneously , add the entry to the rear of the queue as well
+   slotlist_push_tail(&cache->queue,slab_slot(&cache->entries,newentry));
    cache->size++;
+   cache->bytes+=need;
+   stats_add(cache->counts,STAT_BYTES_ADDED,need);
+   stats_close(cache->counts,STAT_INSERTS,STATS_PUT);
+}
 
-   // Check if cache size exceeds capacity and evict if necessary 
-   if(cache->size > CACHE_CAPACITY)
-   {
-     QueueNode *old_item=cache->front;
-      cache->front = cache->front->next;
-        if (cache->front == NULL) {
-            cache->rear = NULL;
-        }
-        cache->size--;
-
-     unsigned int index=hash(old_item->entry->key);
-     CacheEntry *current=cache->items[index];
-     CacheEntry *prev=NULL;
-
-     if(current !=NULL)
-     {
-            if(prev==NULL)
-             cache->items[index]=current;
-            
-            free(current);
-     }
-
-     free(old_item);
-   }
+// function to bring a key back from the file tier into the cache, if the tier has it, and return its entry
+static CacheEntry* promote(Cache *cache,const char *key,uint64_t h)
+{
+    uint64_t ttl_ms;
+    const char *value=tier_get(cache->tier,cache->arena.cipher,key,h,&ttl_ms);
+    if(value==NULL)
+        return NULL;
+    add_to_cache(cache,key,value,ttl_ms);
+    return index_find(&cache->index,key,h);
 }
 
 // function to retrieve an entry from the cache
-const char* retrieve_from_cache(Cache *cache,const char *key)
+static const char* retrieve_from_cache(Cache *cache,const char *key)
 {
-    unsigned int index=hash(key);
-    CacheEntry *entry=cache->items[index];
+    stats_open(cache->counts,STATS_GET);
+    uint64_t h=key_hash(key);
+    CacheEntry *entry=index_find(&cache->index,key,h);
 
-    if(entry!=NULL)
+    if(entry!=NULL && !kv_expired(&entry->kv))
     {
-        return entry->value;
+        stats_close(cache->counts,STAT_HITS,STATS_GET);
+        return entry->kv.value;
     }
 
-    //key not found in cache 
-    return NULL;
+    //key not found in cache, but the file tier may still have it
+    entry=promote(cache,key,h);
+    stats_close(cache->counts,entry ? STAT_TIER_HITS : STAT_MISSES,STATS_GET);
+    return entry ? entry->kv.value : NULL;
 }
 
 
 // function to free the memory allocated -> memory deallocation
-void free_cache(Cache *cache)
+static void free_cache(Cache *cache)
 {
-     for (int i = 0; i < CACHE_SIZE; i++) 
-     {
-        CacheEntry *entry = cache->items[i];
-        if (entry != NULL)
-        {
-            free(entry);
-        }
-    }
+    slotlist_destroy(&cache->queue);
+    slab_destroy(&cache->entries);
+    arena_destroy(&cache->arena);
+    index_free(&cache->index);
+    tier_close(cache->tier);
+    stats_disown(cache->counts);
+    if(cache->own_stats)
+        stats_destroy(cache->stats);
+    free(cache);
+}
+
+// Adapters exposing this policy through the common CachePolicy interface
+static void *policy_create(size_t capacity,const CacheOptions *options)
+{
+    return cache_create(capacity,options);
+}
+
+static void policy_add(void *cache,const char *key,const char *value,uint64_t ttl_ms)
+{
+    add_to_cache((Cache *)cache,key,value,ttl_ms);
+}
 
-    while (cache->front != NULL) 
+static const char *policy_get(void *cache,const char *key)
+{
+    return retrieve_from_cache((Cache *)cache,key);
+}
+
+static void *policy_lookup(void *cache,const char *key,uint64_t hash)
+{
+    return index_find(&((Cache *)cache)->index,key,hash);
+}
+
+static void policy_prefetch(void *cache,uint64_t hash)
+{
+    index_prefetch(&((Cache *)cache)->index,hash);
+}
+
+static void *policy_victim(void *cache)
+{
+    Cache *c=(Cache *)cache;
+    wheel_expire(&c->timers,expire_entry,c);
+    return c->size<c->capacity ? NULL : front_entry(c);
+}
+
+// Oldest first, the order the entries were queued in
+static void policy_walk(void *cache,VisitFn visit,void *arg)
+{
+    Cache *c=(Cache *)cache;
+    for(uint32_t i=c->queue.head;i!=SLOT_NONE;i=c->queue.links[i].next)
     {
-        QueueNode *temp = cache->front;
-        cache->front = cache->front->next;
-        free(temp);
+        CacheEntry *entry=slab_object(&c->entries,i);
+        visit(arg,&entry->kv);
     }
 }
 
-// Encrypt funciton which encrypts  each entry in the cache 
-void encrypt(Cache *cache)
+static void policy_destroy(void *cache)
 {
-  QueueNode *temp=cache->front;
-  while(temp)
-  {
-    custom_encrypt(temp->entry->key);
-    custom_encrypt(temp->entry->value);
-    temp=temp->next;
-  }
+    free_cache((Cache *)cache);
 }
 
-// Decrypt funciton which decrypts  each entry in the cache 
-void decrypt(Cache *cache)
+static CacheStats *policy_stats(void *cache)
+{
+    return ((Cache *)cache)->stats;
+}
+
+// The queue links of entries in use are policy metadata, the rest wait for new entries
+static void policy_memory(void *cache,CacheMemory *memory)
+{
+    Cache *c=(Cache *)cache;
+    memory_measure(memory,&c->index,&c->entries,&c->arena,c->own_stats ? c->stats : NULL);
+    memory->metadata+=sizeof(Cache)+c->entries.in_use*sizeof(SlotLink)+tier_memory(c->tier);
+    memory->unused+=slotlist_memory(&c->queue)-c->entries.in_use*sizeof(SlotLink);
+}
+
+const CachePolicy fifo_policy={"FIFO",policy_create,policy_add,policy_get,policy_lookup,policy_prefetch,NULL,policy_victim,policy_walk,policy_destroy,policy_stats,policy_memory};
+
+// The test driver below is left out when the policy is built into the library
+#ifndef CACHE_LIBRARY
+
+// function to print all the entries of the cache with their values decrypted into a buffer
+static void print_decrypted(Cache *cache)
 {
-  QueueNode *temp=cache->front;
-  while(temp)
+  char value[VALUE_SIZE];
+  for(uint32_t i=cache->queue.head;i!=SLOT_NONE;i=cache->queue.links[i].next)
   {
-    custom_decrypt(temp->entry->key);
-    custom_decrypt(temp->entry->value);
-    temp=temp->next;
+    CacheEntry *temp=slab_object(&cache->entries,i);
+    cipher_read(cache->arena.cipher,temp->kv.value,value,sizeof(value));
+    printf("Key: %s and Value: %s\n",kv_key(&temp->kv),value);
   }
+  printf("\n");
 }
 
 // function to print all the entries of the cache
-void print_func(Cache *cache)
+static void print_func(Cache *cache)
 {
-    QueueNode *temp=cache->front;
-    while(temp)
+    for(uint32_t i=cache->queue.head;i!=SLOT_NONE;i=cache->queue.links[i].next)
     {
-         printf("Key: %s and Value: %s\n",temp->entry->key,temp->entry->value);
-         temp=temp->next;
+         CacheEntry *temp=slab_object(&cache->entries,i);
+         printf("Key: %s and Value: %s\n",kv_key(&temp->kv),temp->kv.value);
     }
     printf("\n");
 }
 
 // function to test the working of cache 
-void test_cache()
+static void test_cache()
 {
     clock_t start,end;
     start=clock();
-    struct rusage usage_start, usage_end;
-    getrusage(RUSAGE_SELF,&usage_start);
 
-    Cache cache;
-    init(&cache);
+    Cipher cipher;
+    cipher_init_caesar(&cipher,ENDEC_KEY);
+    CacheOptions options={CACHE_MAX_BYTES,0,NULL,NULL,&cipher,NULL,0};
+    Cache *cache=cache_create(CACHE_CAPACITY,&options);
 
     int lo=0;
     int hi=10;
@@ -229,7 +328,7 @@ void test_cache()
          char v[VALUE_SIZE];
          fgets(v,VALUE_SIZE,stdin);
          trim_newline(v);
-         add_to_cache(&cache,k,v);
+         add_to_cache(cache,k,v,0);
     }
   
     for(int i=0;i<500;i++)
@@ -237,7 +336,7 @@ void test_cache()
         int key=(rand()%(hi-lo+1))+lo;
         char s[KEY_SIZE];
 	    snprintf(s,KEY_SIZE,"%d",key);
-        const char *value = retrieve_from_cache(&cache, s);
+        const char *value = retrieve_from_cache(cache, s);
         if (value) 
         {
             hit++;
@@ -247,26 +346,24 @@ void test_cache()
             miss++;
         }
     }
-    printf("Before encryption: \n");
-    print_func(&cache);
-    encrypt(&cache);
-    printf("After encryption: \n");
-    print_func(&cache);
-    decrypt(&cache);
+    printf("Stored encrypted: \n");
+    print_func(cache);
     printf("After decryption: \n");
-    print_func(&cache);
+    print_decrypted(cache);
     
     end=clock();
     double diff= (double)(end-start)/(CLOCKS_PER_SEC);
     
-    metric(hit,miss);
-    getrusage(RUSAGE_SELF,&usage_end);
-    long mem_used=usage_end.ru_maxrss -  usage_start.ru_maxrss;
+    CacheMemory memory;
+    policy_memory(cache,&memory);
+    // A lookup the file tier answered returned a value too; count it apart from the hits
+    int tier_hit=(int)stats_total(cache->stats,STAT_TIER_HITS);
+    metric(hit-tier_hit,miss,tier_hit);
         
     printf("| %-30s | %f seconds         |\n", "Time utilized", diff);
-    printf("| %-30s | %ld KB             |\n", "Memory Used", mem_used);
+    metric_memory(&memory);
     printf("-------------------------------------------------\n");
-    free_cache(&cache);
+    free_cache(cache);
 
 }
 
@@ -276,3 +373,4 @@ int main()
    return 0;
 }
 
+#endif
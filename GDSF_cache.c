@@ -0,0 +1,421 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cache.h"
+
+// Buffer sizes used by the test driver; the cache itself stores any length
+#define KEY_SIZE 32
+#define VALUE_SIZE 256
+#define CACHE_CAPACITY 5
+#define CACHE_MAX_BYTES 4096
+#define ENDEC_KEY 3
+
+// GreedyDual-Size-Frequency (GDSF) replacement.
+// Every entry has a priority H = L + frequency * cost / size, with the same
+// cost for every object. The entry with the lowest H is evicted and the
+// inflation value L is raised to its priority, so entries that stop being
+// hit age out relative to newly inserted ones while small, popular objects
+// are kept ahead of large, rarely used ones.
+
+// Define a structure for cache entry
+typedef struct CacheEntry {
+    KeyValue kv;
+    double priority;         // H value, the heap is ordered on it
+    unsigned int frequency;  // number of inserts/updates/hits
+    size_t heap_pos;         // position of the entry in the heap array
+    size_t size;             // bytes charged against the budget
+} CacheEntry;
+
+// Define a structure for cache
+typedef struct Cache {
+    Index index;        // Hash index mapping keys to entries
+    Slab entries;       // Fixed pool the entries are drawn from
+    Arena arena;        // Out-of-line storage for keys and values
+    CacheEntry **heap;  // Min-heap on priority, heap[0] is the next victim
+    size_t size;
+    double inflation;   // L: priority of the last evicted entry
+    size_t capacity;    // Maximum number of entries
+    size_t bytes;       // Entry structs plus arena blocks currently charged
+    size_t max_bytes;   // Memory budget the cache evicts to stay under
+    TimerWheel timers;  // Deadlines of entries added with a TTL
+    CacheStats *stats;  // Counters, shared through CacheOptions or owned by the cache
+    int own_stats;
+    StatsSlot *counts; // this instance's own slot in stats
+    FileTier *tier;     // Evicted entries on disk, NULL without a file tier
+} Cache;
+
+// Function to create and initialize a cache holding up to capacity entries
+static Cache *cache_create(size_t capacity, const CacheOptions *options) {
+    Cache *cache = (Cache *)malloc(sizeof(Cache));
+    if (cache == NULL) {
+        perror("Failed to allocate memory for cache");
+        exit(EXIT_FAILURE);
+    }
+    Reclaim *reclaim = options ? options->reclaim : NULL;
+    index_init(&cache->index, options ? options->initial_entries : 0, reclaim);
+    slab_init(&cache->entries, sizeof(CacheEntry), capacity, reclaim);
+    arena_init(&cache->arena, reclaim);
+    cache->arena.cipher = options ? options->cipher : NULL;
+    wheel_init(&cache->timers);
+    cache->own_stats = !(options && options->stats);
+    cache->stats = cache->own_stats ? stats_create() : options->stats;
+    cache->counts = stats_own(cache->stats);
+    cache->index.stats = cache->stats;
+    cache->tier = tier_open(options, cache->stats);
+    cache->heap = (CacheEntry **)malloc((capacity ? capacity : 1) * sizeof(CacheEntry *));
+    if (cache->heap == NULL) {
+        perror("Failed to allocate memory for priority heap");
+        exit(EXIT_FAILURE);
+    }
+    cache->size = 0;
+    cache->inflation = 0.0;
+    cache->bytes = 0;
+    cache->capacity = capacity;
+    cache->max_bytes = (options && options->max_bytes) ? options->max_bytes : SIZE_MAX;
+    return cache;
+}
+
+// Function to compute the GDSF priority of an entry
+static double gdsf_priority(Cache *cache, CacheEntry *entry) {
+    return cache->inflation + (double)entry->frequency / (double)entry->size;
+}
+
+static void heap_set(Cache *cache, size_t pos, CacheEntry *entry) {
+    cache->heap[pos] = entry;
+    entry->heap_pos = pos;
+}
+
+// Function to move an entry towards the root while it has a lower priority than its parent
+static void sift_up(Cache *cache, size_t pos) {
+    CacheEntry *entry = cache->heap[pos];
+    while (pos > 0) {
+        size_t parent = (pos - 1) / 2;
+        if (cache->heap[parent]->priority <= entry->priority) {
+            break;
+        }
+        heap_set(cache, pos, cache->heap[parent]);
+        pos = parent;
+    }
+    heap_set(cache, pos, entry);
+}
+
+// Function to move an entry towards the leaves while a child has a lower priority
+static void sift_down(Cache *cache, size_t pos) {
+    CacheEntry *entry = cache->heap[pos];
+    for (;;) {
+        size_t child = 2 * pos + 1;
+        if (child >= cache->size) {
+            break;
+        }
+        if (child + 1 < cache->size && cache->heap[child + 1]->priority < cache->heap[child]->priority) {
+            child++;
+        }
+        if (entry->priority <= cache->heap[child]->priority) {
+            break;
+        }
+        heap_set(cache, pos, cache->heap[child]);
+        pos = child;
+    }
+    heap_set(cache, pos, entry);
+}
+
+// Function to take an entry out of the heap and the index and free its memory
+static void remove_entry(Cache *cache, CacheEntry *victim) {
+    size_t pos = victim->heap_pos;
+    cache->size--;
+    if (pos < cache->size) {
+        // The last entry fills the hole and may belong above or below it
+        CacheEntry *moved = cache->heap[cache->size];
+        heap_set(cache, pos, moved);
+        sift_up(cache, pos);
+        sift_down(cache, moved->heap_pos);
+    }
+
+    index_remove(&cache->index, kv_key(&victim->kv), victim->kv.hash);
+    wheel_cancel(&cache->timers, &victim->kv);
+    cache->bytes -= victim->size;
+    stats_add(cache->counts, STAT_BYTES_REMOVED, victim->size);
+    kv_release(&victim->kv, &cache->arena);
+    slab_free(&cache->entries, victim);
+}
+
+// Function to evict the entry with the lowest priority; reason is the STAT_EVICT_ counter it is charged to
+static void evict_min(Cache *cache, int reason) {
+    stats_add(cache->counts, reason, 1);
+    cache->inflation = cache->heap[0]->priority;
+    tier_put(cache->tier, &cache->heap[0]->kv);
+    remove_entry(cache, cache->heap[0]);
+}
+
+// Function called by the timer wheel for an entry whose TTL has run out.
+// Expiry is not an eviction, so it leaves the inflation value alone.
+static void expire_entry(void *cache, KeyValue *kv) {
+    stats_add(((Cache *)cache)->counts, STAT_EXPIRED, 1);
+    remove_entry((Cache *)cache, (CacheEntry *)kv);
+}
+
+// Function to count a use of an entry and restore heap order
+static void touch(Cache *cache, CacheEntry *entry) {
+    entry->frequency++;
+    entry->priority = gdsf_priority(cache, entry);
+    // The priority only grows, so the entry can only move down
+    sift_down(cache, entry->heap_pos);
+}
+
+// Function to add an entry to the cache; ttl_ms of 0 keeps it until it is evicted
+static void add_to_cache(Cache *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    stats_open(cache->counts, STATS_PUT);
+    uint64_t h = key_hash(key);
+    // A copy in the file tier is out of date from now on
+    tier_remove(cache->tier, key, h);
+    // Expired entries go first, so they make room before any live one is evicted
+    wheel_expire(&cache->timers, expire_entry, cache);
+    // Check if the key already exists
+    CacheEntry *existing = index_find(&cache->index, key, h);
+    if (existing) {
+        // Update value and size, then re-rank the entry
+        cache->bytes -= existing->size;
+        stats_add(cache->counts, STAT_BYTES_REMOVED, existing->size);
+        kv_set_value(&existing->kv, &cache->arena, value);
+        existing->size = sizeof(CacheEntry) + kv_bytes(&existing->kv);
+        cache->bytes += existing->size;
+        stats_add(cache->counts, STAT_BYTES_ADDED, existing->size);
+        wheel_set_ttl(&cache->timers, &existing->kv, ttl_ms);
+
+        existing->frequency++;
+        existing->priority = gdsf_priority(cache, existing);
+        sift_up(cache, existing->heap_pos);
+        sift_down(cache, existing->heap_pos);
+
+        // A bigger value may exceed the budget
+        while (cache->bytes > cache->max_bytes && cache->size > 0) {
+            evict_min(cache, STAT_EVICT_BYTES);
+        }
+        stats_close(cache->counts, STAT_UPDATES, STATS_PUT);
+        return;
+    }
+
+    // An entry larger than the whole budget is never cached, and a cache of
+    // capacity 0 caches nothing
+    size_t need = sizeof(CacheEntry) + kv_size(&cache->arena, key, value);
+    if (need > cache->max_bytes || cache->capacity == 0) {
+        stats_close(cache->counts, STAT_REJECTED, STATS_PUT);
+        return;
+    }
+
+    // Evict the lowest priority entries until the entry count and the
+    // byte budget both leave room
+    while (cache->size == cache->capacity || cache->bytes + need > cache->max_bytes) {
+        evict_min(cache, cache->size == cache->capacity ? STAT_EVICT_CAPACITY : STAT_EVICT_BYTES);
+    }
+
+    // Create a new entry
+    CacheEntry *entry = slab_alloc(&cache->entries);
+    if (entry == NULL) {
+        fprintf(stderr, "Cache entry slab exhausted\n");
+        exit(EXIT_FAILURE);
+    }
+    kv_set(&entry->kv, &cache->arena, key, h, value);
+    entry->frequency = 1;
+    entry->size = need;
+    entry->priority = gdsf_priority(cache, entry);
+    index_insert(&cache->index, kv_key(&entry->kv), h, entry);
+    wheel_set_ttl(&cache->timers, &entry->kv, ttl_ms);
+
+    heap_set(cache, cache->size, entry);
+    cache->size++;
+    sift_up(cache, entry->heap_pos);
+    cache->bytes += need;
+    stats_add(cache->counts, STAT_BYTES_ADDED, need);
+    stats_close(cache->counts, STAT_INSERTS, STATS_PUT);
+}
+
+// Function to bring a key back from the file tier into the cache, if the tier has it, and return its entry.
+// It comes back as a new entry, with a frequency of 1.
+static CacheEntry *promote(Cache *cache, const char *key, uint64_t h) {
+    uint64_t ttl_ms;
+    const char *value = tier_get(cache->tier, cache->arena.cipher, key, h, &ttl_ms);
+    if (value == NULL) {
+        return NULL;
+    }
+    add_to_cache(cache, key, value, ttl_ms);
+    return index_find(&cache->index, key, h);
+}
+
+// Function to return the value corresponding to a key, if it exists
+static const char *retrieve_from_cache(Cache *cache, const char *key) {
+    stats_open(cache->counts, STATS_GET);
+    uint64_t h = key_hash(key);
+    CacheEntry *entry = index_find(&cache->index, key, h);
+    if (entry == NULL || kv_expired(&entry->kv)) {
+        entry = promote(cache, key, h);
+        stats_close(cache->counts, entry ? STAT_TIER_HITS : STAT_MISSES, STATS_GET);
+        return entry ? entry->kv.value : NULL;
+    }
+    touch(cache, entry);
+    stats_close(cache->counts, STAT_HITS, STATS_GET);
+    return entry->kv.value;
+}
+
+// Function to free the memory allocated
+static void free_memory(Cache *cache) {
+    free(cache->heap);
+    slab_destroy(&cache->entries);
+    arena_destroy(&cache->arena);
+    index_free(&cache->index);
+    tier_close(cache->tier);
+    stats_disown(cache->counts);
+    if (cache->own_stats) {
+        stats_destroy(cache->stats);
+    }
+    free(cache);
+}
+
+// Adapters exposing this policy through the common CachePolicy interface
+static void *policy_create(size_t capacity, const CacheOptions *options) {
+    return cache_create(capacity, options);
+}
+
+static void policy_add(void *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    add_to_cache((Cache *)cache, key, value, ttl_ms);
+}
+
+static const char *policy_get(void *cache, const char *key) {
+    return retrieve_from_cache((Cache *)cache, key);
+}
+
+static void *policy_lookup(void *cache, const char *key, uint64_t hash) {
+    return index_find(&((Cache *)cache)->index, key, hash);
+}
+
+static void policy_prefetch(void *cache, uint64_t hash) {
+    index_prefetch(&((Cache *)cache)->index, hash);
+}
+
+static void policy_touch(void *cache, void *entry) {
+    touch((Cache *)cache, (CacheEntry *)entry);
+}
+
+static void *policy_victim(void *cache) {
+    Cache *c = (Cache *)cache;
+    wheel_expire(&c->timers, expire_entry, c);
+    return c->size == 0 || c->size < c->capacity ? NULL : c->heap[0];
+}
+
+// In heap order, which starts with the lowest priority
+static void policy_walk(void *cache, VisitFn visit, void *arg) {
+    Cache *c = (Cache *)cache;
+    for (size_t i = 0; i < c->size; i++) {
+        visit(arg, &c->heap[i]->kv);
+    }
+}
+
+static void policy_destroy(void *cache) {
+    free_memory((Cache *)cache);
+}
+
+static CacheStats *policy_stats(void *cache) {
+    return ((Cache *)cache)->stats;
+}
+
+static void policy_memory(void *cache, CacheMemory *memory) {
+    Cache *c = (Cache *)cache;
+    memory_measure(memory, &c->index, &c->entries, &c->arena, c->own_stats ? c->stats : NULL);
+    // The heap array is allocated for capacity entries up front
+    memory->metadata += sizeof(Cache) + c->size * sizeof(CacheEntry *) + tier_memory(c->tier);
+    memory->unused += (c->capacity - c->size) * sizeof(CacheEntry *);
+}
+
+const CachePolicy gdsf_policy = {"GDSF", policy_create, policy_add, policy_get, policy_lookup, policy_prefetch, policy_touch, policy_victim, policy_walk, policy_destroy, policy_stats, policy_memory};
+
+// The test driver below is left out when the policy is built into the library
+#ifndef CACHE_LIBRARY
+
+// function to print all the entries of the cache with their values decrypted into a buffer
+static void print_decrypted(Cache *cache)
+{
+  char value[VALUE_SIZE];
+  for(size_t i=0;i<cache->size;i++)
+  {
+    cipher_read(cache->arena.cipher,cache->heap[i]->kv.value,value,sizeof(value));
+    printf("Key: %s and Value: %s\n",kv_key(&cache->heap[i]->kv),value);
+  }
+  printf("\n");
+}
+
+// function to print all the entries of the cache, lowest priority first
+static void print_func(Cache *cache)
+{
+    for(size_t i=0;i<cache->size;i++)
+    {
+         CacheEntry *temp=cache->heap[i];
+         printf("Key: %s and Value: %s (hits %u, priority %f)\n",kv_key(&temp->kv),temp->kv.value,temp->frequency,temp->priority);
+    }
+    printf("\n");
+}
+
+// Function to test the working of the logic and implementation
+static void test() {
+    Cipher cipher;
+    cipher_init_caesar(&cipher, ENDEC_KEY);
+    CacheOptions options = {CACHE_MAX_BYTES, 0, NULL, NULL, &cipher, NULL, 0};
+    Cache *cache = cache_create(CACHE_CAPACITY, &options);
+    clock_t start,end;
+    start=clock();
+
+
+    int lo = 0;
+    int hi = 7;
+    int miss = 0;
+    int hit = 0;
+
+    for (int i = 0; i < 5; i++) {
+        char k[KEY_SIZE];
+        int el = (rand() % (hi - lo + 1)) + lo;
+        snprintf(k, KEY_SIZE, "%d", el);
+        trim_newline(k);
+        char v[VALUE_SIZE];
+        fgets(v, VALUE_SIZE, stdin);
+        trim_newline(v);
+        add_to_cache(cache, k, v, 0);
+    }
+
+    for (int i = 0; i < 1000; i++) {
+        int key = (rand() % (hi - lo + 1)) + lo;
+        char s[KEY_SIZE];
+        snprintf(s, KEY_SIZE, "%d", key);
+        const char *value = retrieve_from_cache(cache, s);
+        if (value) {
+            hit++;
+        } else {
+            miss++;
+        }
+    }
+
+    printf("Stored encrypted: \n");
+    print_func(cache);
+    printf("After decryption: \n");
+    print_decrypted(cache);
+
+    end = clock();
+    double diff = (double)(end - start) / CLOCKS_PER_SEC;
+    CacheMemory memory;
+    policy_memory(cache, &memory);
+    // A lookup the file tier answered returned a value too; count it apart from the hits
+    int tier_hit=(int)stats_total(cache->stats,STAT_TIER_HITS);
+    metric(hit-tier_hit,miss,tier_hit);
+
+    printf("| %-30s | %f seconds         |\n", "Time utilized", diff);
+    metric_memory(&memory);
+    printf("-------------------------------------------------\n");
+
+    free_memory(cache);
+}
+
+int main() {
+    test();
+    return 0;
+}
+
+#endif
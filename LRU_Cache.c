@@ -2,172 +2,294 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <sys/resource.h>
 #include "cache.h"
 
+// Buffer sizes used by the test driver; the cache itself stores any length
 #define KEY_SIZE 32
 #define VALUE_SIZE 256
-#define CACHE_SIZE 2000
 #define CACHE_CAPACITY 5
+#define CACHE_MAX_BYTES 4096
 #define ENDEC_KEY 3
 
 
+// The recency list lives in a SlotList beside the slab, so an entry is just its KeyValue
 typedef struct CacheEntry {
-    char key[KEY_SIZE];
-    char value[VALUE_SIZE];
-    struct CacheEntry *next;
-    struct CacheEntry *prev;
+    KeyValue kv;
 } CacheEntry;
 
 typedef struct Cache {
-    CacheEntry *items[CACHE_SIZE];
-    CacheEntry *head;
-    CacheEntry *tail;
-    int size;
+    Index index;
+    Slab entries;
+    Arena arena;
+    SlotList order;    // entry slots, most recently used at the head
+    size_t size;
+    size_t capacity;   // maximum number of entries
+    size_t bytes;      // entry structs, their links and arena blocks currently charged
+    size_t max_bytes;  // memory budget; entries are evicted to stay under it
+    TimerWheel timers; // deadlines of entries added with a TTL
+    CacheStats *stats; // counters, shared through CacheOptions or owned by the cache
+    int own_stats;
+    StatsSlot *counts; // this instance's own slot in stats
+    FileTier *tier;    // evicted entries on disk, NULL without a file tier
 } Cache;
 
-void init(Cache* cache) {
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        cache->items[i] = NULL;
+// Function to create and initialize a cache holding up to capacity entries
+static Cache *cache_create(size_t capacity, const CacheOptions *options) {
+    Cache *cache = (Cache *)malloc(sizeof(Cache));
+    if (cache == NULL) {
+        perror("Failed to allocate memory for cache");
+        exit(EXIT_FAILURE);
     }
-    cache->head = NULL;
-    cache->tail = NULL;
+    Reclaim *reclaim = options ? options->reclaim : NULL;
+    index_init(&cache->index, options ? options->initial_entries : 0, reclaim);
+    slab_init(&cache->entries, sizeof(CacheEntry), capacity, reclaim);
+    slotlist_init(&cache->order, &cache->entries);
+    arena_init(&cache->arena, reclaim);
+    cache->arena.cipher = options ? options->cipher : NULL;
+    wheel_init(&cache->timers);
+    cache->own_stats = !(options && options->stats);
+    cache->stats = cache->own_stats ? stats_create() : options->stats;
+    cache->counts = stats_own(cache->stats);
+    cache->index.stats = cache->stats;
+    cache->tier = tier_open(options, cache->stats);
     cache->size = 0;
+    cache->bytes = 0;
+    cache->capacity = capacity;
+    cache->max_bytes = (options && options->max_bytes) ? options->max_bytes : SIZE_MAX;
+    return cache;
+}
+
+// Unlinks an entry and puts it back at the head of the list
+static void move_to_head(Cache *cache, CacheEntry *entry) {
+    slotlist_move_to_head(&cache->order, slab_slot(&cache->entries, entry));
+}
+
+// The least recently used entry, or NULL while the cache is empty
+static CacheEntry *tail_entry(Cache *cache) {
+    return cache->order.tail == SLOT_NONE ? NULL : slab_object(&cache->entries, cache->order.tail);
+}
+
+// Removes an entry from the list and the index and gives its memory back
+static void remove_entry(Cache *cache, CacheEntry *entry) {
+    slotlist_unlink(&cache->order, slab_slot(&cache->entries, entry));
+    index_remove(&cache->index, kv_key(&entry->kv), entry->kv.hash);
+    wheel_cancel(&cache->timers, &entry->kv);
+    size_t freed = sizeof(CacheEntry) + sizeof(SlotLink) + kv_bytes(&entry->kv);
+    cache->bytes -= freed;
+    stats_add(cache->counts, STAT_BYTES_REMOVED, freed);
+    kv_release(&entry->kv, &cache->arena);
+    slab_free(&cache->entries, entry);
+    cache->size--;
 }
 
-void add_to_cache(Cache *cache, const char *key, const char *value) {
-    unsigned int ind = hash(key);
-
-    // If the cache is full, remove the least recently used entry
-    if (cache->size == CACHE_CAPACITY) {
-        CacheEntry *old_tail = cache->tail;
-        if (cache->tail) {
-            unsigned int old_ind = hash(cache->tail->key);
-            if (cache->tail->prev) {
-                cache->tail = cache->tail->prev;
-                cache->tail->next = NULL;
-            } else {
-                cache->head = cache->tail = NULL;
-            }
-            cache->items[old_ind] = NULL;
-            free(old_tail);
-            cache->size--;
+// Removes the least recently used entry; reason is the STAT_EVICT_ counter it is charged to
+static void evict_tail(Cache *cache, int reason) {
+    stats_add(cache->counts, reason, 1);
+    tier_put(cache->tier, &tail_entry(cache)->kv);
+    remove_entry(cache, tail_entry(cache));
+}
+
+// Called by the timer wheel for an entry whose TTL has run out
+static void expire_entry(void *cache, KeyValue *kv) {
+    stats_add(((Cache *)cache)->counts, STAT_EXPIRED, 1);
+    remove_entry((Cache *)cache, (CacheEntry *)kv);
+}
+
+// Function to add or update an entry; ttl_ms of 0 keeps it until it is evicted
+static void add_to_cache(Cache *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    stats_open(cache->counts, STATS_PUT);
+    uint64_t h = key_hash(key);
+    // A copy in the file tier is out of date from now on
+    tier_remove(cache->tier, key, h);
+    // Expired entries go first, so they make room before any live one is evicted
+    wheel_expire(&cache->timers, expire_entry, cache);
+    // If the key is already cached, update it in place
+    CacheEntry *existing = index_find(&cache->index, key, h);
+    if (existing) {
+        move_to_head(cache, existing);
+        size_t freed = kv_bytes(&existing->kv);
+        cache->bytes -= freed;
+        stats_add(cache->counts, STAT_BYTES_REMOVED, freed);
+        kv_set_value(&existing->kv, &cache->arena, value);
+        size_t added = kv_bytes(&existing->kv);
+        cache->bytes += added;
+        stats_add(cache->counts, STAT_BYTES_ADDED, added);
+        wheel_set_ttl(&cache->timers, &existing->kv, ttl_ms);
+
+        // A larger value may push the cache over budget; the entry itself
+        // goes last, only if its value alone does not fit
+        while (cache->bytes > cache->max_bytes && cache->size > 0) {
+            evict_tail(cache, STAT_EVICT_BYTES);
         }
+        stats_close(cache->counts, STAT_UPDATES, STATS_PUT);
+        return;
     }
 
-    // Create a new cache entry
-    CacheEntry *entry = (CacheEntry *)malloc(sizeof(CacheEntry));
+    // An entry larger than the whole budget is never cached, and a cache of
+    // capacity 0 caches nothing
+    size_t need = sizeof(CacheEntry) + sizeof(SlotLink) + kv_size(&cache->arena, key, value);
+    if (need > cache->max_bytes || cache->capacity == 0) {
+        stats_close(cache->counts, STAT_REJECTED, STATS_PUT);
+        return;
+    }
+
+    // Remove least recently used entries until both the entry count and
+    // the byte budget leave room for the new one
+    while (cache->size == cache->capacity || cache->bytes + need > cache->max_bytes) {
+        evict_tail(cache, cache->size == cache->capacity ? STAT_EVICT_CAPACITY : STAT_EVICT_BYTES);
+    }
+
+    // Create a new cache entry from the slab slot freed by eviction
+    CacheEntry *entry = slab_alloc(&cache->entries);
     if (entry == NULL) {
-        perror("Failed to allocate memory for cache entry");
+        fprintf(stderr, "Cache entry slab exhausted\n");
         exit(EXIT_FAILURE);
     }
-    strncpy(entry->key, key, KEY_SIZE - 1);
-    entry->key[KEY_SIZE - 1] = '\0';
-    strncpy(entry->value, value, VALUE_SIZE - 1);
-    entry->value[VALUE_SIZE - 1] = '\0';
-    entry->next = NULL;
-    entry->prev = NULL;
+    kv_set(&entry->kv, &cache->arena, key, h, value);
 
     // Add the entry to the head of the list
-    if (cache->head) {
-        cache->head->prev = entry;
-        entry->next = cache->head;
-    }
-    cache->head = entry;
-    if (cache->tail == NULL) {
-        cache->tail = entry;
-    }
+    slotlist_push_head(&cache->order, slab_slot(&cache->entries, entry));
 
-    cache->items[ind] = entry;
+    index_insert(&cache->index, kv_key(&entry->kv), h, entry);
+    wheel_set_ttl(&cache->timers, &entry->kv, ttl_ms);
     cache->size++;
+    cache->bytes += need;
+    stats_add(cache->counts, STAT_BYTES_ADDED, need);
+    stats_close(cache->counts, STAT_INSERTS, STATS_PUT);
 }
 
-const char *retrieve_from_cache(Cache *cache, const char *key) {
-    unsigned int ind = hash(key);
-    CacheEntry *entry = cache->items[ind];
-    while (entry) {
-        if (strncmp(entry->key, key, KEY_SIZE) == 0) {
-            // Move the entry to the head of the list
-            if (entry != cache->head) {
-                if (entry == cache->tail) {
-                    cache->tail = entry->prev;
-                }
-                if (entry->prev) {
-                    entry->prev->next = entry->next;
-                }
-                if (entry->next) {
-                    entry->next->prev = entry->prev;
-                }
-
-                entry->next = cache->head;
-                entry->prev = NULL;
-                cache->head->prev = entry;
-                cache->head = entry;
-            }
-            return entry->value;
-        }
-        entry = entry->next;
+// Brings key back from the file tier into the cache, if the tier has it, and returns its entry
+static CacheEntry *promote(Cache *cache, const char *key, uint64_t h) {
+    uint64_t ttl_ms;
+    const char *value = tier_get(cache->tier, cache->arena.cipher, key, h, &ttl_ms);
+    if (value == NULL) {
+        return NULL;
     }
-    return NULL;
+    add_to_cache(cache, key, value, ttl_ms);
+    return index_find(&cache->index, key, h);
 }
 
-void free_memory(Cache *cache) {
-    CacheEntry *temp = cache->head;
-    while (temp) {
-        CacheEntry *next = temp->next;
-        unsigned int ind = hash(temp->key);
-        if (cache->items[ind] == temp) {
-            cache->items[ind] = temp->next;
-        }
-        free(temp);
-        temp = next;
+static const char *retrieve_from_cache(Cache *cache, const char *key) {
+    stats_open(cache->counts, STATS_GET);
+    uint64_t h = key_hash(key);
+    CacheEntry *entry = index_find(&cache->index, key, h);
+    if (entry == NULL || kv_expired(&entry->kv)) {
+        entry = promote(cache, key, h);
+        stats_close(cache->counts, entry ? STAT_TIER_HITS : STAT_MISSES, STATS_GET);
+        return entry ? entry->kv.value : NULL;
     }
+    // Move the entry to the head of the list
+    move_to_head(cache, entry);
+    stats_close(cache->counts, STAT_HITS, STATS_GET);
+    return entry->kv.value;
 }
 
-// Encrypt funciton which encrypts  each entry in the cache 
-void encrypt(Cache *cache)
-{
-  CacheEntry *temp=cache->head;
-  while(temp)
-  {
-    custom_encrypt(temp->key);
-    custom_encrypt(temp->value);
-    temp=temp->next;
-  }
+static void free_memory(Cache *cache) {
+    slotlist_destroy(&cache->order);
+    slab_destroy(&cache->entries);
+    arena_destroy(&cache->arena);
+    index_free(&cache->index);
+    tier_close(cache->tier);
+    stats_disown(cache->counts);
+    if (cache->own_stats) {
+        stats_destroy(cache->stats);
+    }
+    free(cache);
 }
 
-// Decrypt funciton which decrypts  each entry in the cache 
-void decrypt(Cache *cache)
+// Adapters exposing this policy through the common CachePolicy interface
+static void *policy_create(size_t capacity, const CacheOptions *options) {
+    return cache_create(capacity, options);
+}
+
+static void policy_add(void *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    add_to_cache((Cache *)cache, key, value, ttl_ms);
+}
+
+static const char *policy_get(void *cache, const char *key) {
+    return retrieve_from_cache((Cache *)cache, key);
+}
+
+static void *policy_lookup(void *cache, const char *key, uint64_t hash) {
+    return index_find(&((Cache *)cache)->index, key, hash);
+}
+
+static void policy_prefetch(void *cache, uint64_t hash) {
+    index_prefetch(&((Cache *)cache)->index, hash);
+}
+
+static void policy_touch(void *cache, void *entry) {
+    move_to_head((Cache *)cache, (CacheEntry *)entry);
+}
+
+static void *policy_victim(void *cache) {
+    Cache *c = (Cache *)cache;
+    wheel_expire(&c->timers, expire_entry, c);
+    return c->size < c->capacity ? NULL : tail_entry(c);
+}
+
+// From the tail, so adding the entries again in this order puts the list back as it was
+static void policy_walk(void *cache, VisitFn visit, void *arg) {
+    Cache *c = (Cache *)cache;
+    for (uint32_t i = c->order.tail; i != SLOT_NONE; i = c->order.links[i].prev) {
+        CacheEntry *entry = slab_object(&c->entries, i);
+        visit(arg, &entry->kv);
+    }
+}
+
+static void policy_destroy(void *cache) {
+    free_memory((Cache *)cache);
+}
+
+static CacheStats *policy_stats(void *cache) {
+    return ((Cache *)cache)->stats;
+}
+
+static void policy_memory(void *cache, CacheMemory *memory) {
+    Cache *c = (Cache *)cache;
+    memory_measure(memory, &c->index, &c->entries, &c->arena, c->own_stats ? c->stats : NULL);
+    // The links of entries in use are metadata, the rest wait for new entries
+    memory->metadata += sizeof(Cache) + c->entries.in_use * sizeof(SlotLink) + tier_memory(c->tier);
+    memory->unused += slotlist_memory(&c->order) - c->entries.in_use * sizeof(SlotLink);
+}
+
+const CachePolicy lru_policy = {"LRU", policy_create, policy_add, policy_get, policy_lookup, policy_prefetch, policy_touch, policy_victim, policy_walk, policy_destroy, policy_stats, policy_memory};
+
+// The test driver below is left out when the policy is built into the library
+#ifndef CACHE_LIBRARY
+
+// function to print all the entries of the cache with their values decrypted into a buffer
+static void print_decrypted(Cache *cache)
 {
-  CacheEntry *temp=cache->head;
-  while(temp)
+  char value[VALUE_SIZE];
+  for(uint32_t i=cache->order.head;i!=SLOT_NONE;i=cache->order.links[i].next)
   {
-    custom_decrypt(temp->key);
-    custom_decrypt(temp->value);
-    temp=temp->next;
+    CacheEntry *temp=slab_object(&cache->entries,i);
+    cipher_read(cache->arena.cipher,temp->kv.value,value,sizeof(value));
+    printf("Key: %s and Value: %s\n",kv_key(&temp->kv),value);
   }
+  printf("\n");
 }
 
 // function to print all the entries of the cache
-void print_func(Cache *cache)
+static void print_func(Cache *cache)
 {
-    CacheEntry *temp=cache->head;
-    while(temp)
+    for(uint32_t i=cache->order.head;i!=SLOT_NONE;i=cache->order.links[i].next)
     {
-         printf("Key: %s and Value: %s\n",temp->key,temp->value);
-         temp=temp->next;
+         CacheEntry *temp=slab_object(&cache->entries,i);
+         printf("Key: %s and Value: %s\n",kv_key(&temp->kv),temp->kv.value);
     }
     printf("\n");
 }
 
-void test() {
+static void test() {
     clock_t start, end;
     start = clock();
-    struct rusage usage_start, usage_end;
-    getrusage(RUSAGE_SELF, &usage_start);
 
-    Cache cache;
-    init(&cache);
+    Cipher cipher;
+    cipher_init_caesar(&cipher, ENDEC_KEY);
+    CacheOptions options = {CACHE_MAX_BYTES, 0, NULL, NULL, &cipher, NULL, 0};
+    Cache *cache = cache_create(CACHE_CAPACITY, &options);
 
     int lo = 0;
     int hi = 7;
@@ -182,39 +304,37 @@ void test() {
         char v[VALUE_SIZE];
         fgets(v, VALUE_SIZE, stdin);
         trim_newline(v);
-        add_to_cache(&cache, k, v);
+        add_to_cache(cache, k, v, 0);
     }
 
     for (int i = 0; i < 1000; i++) {
         int key = (rand() % (hi - lo + 1)) + lo;
         char s[KEY_SIZE];
         snprintf(s, KEY_SIZE, "%d", key);
-        const char *value = retrieve_from_cache(&cache, s);
+        const char *value = retrieve_from_cache(cache, s);
         if (value) {
             hit++;
         } else {
             miss++;
         }
     }
-    printf("Before encryption: \n");
-    print_func(&cache);
-    encrypt(&cache);
-    printf("After encryption: \n");
-    print_func(&cache);
-    decrypt(&cache);
+    printf("Stored encrypted: \n");
+    print_func(cache);
     printf("After decryption: \n");
-    print_func(&cache);
+    print_decrypted(cache);
     
     end = clock();
     double diff = (double)(end - start) / CLOCKS_PER_SEC;
-    metric(hit,miss);
-    getrusage(RUSAGE_SELF, &usage_end);
-    long mem_used = usage_end.ru_maxrss - usage_start.ru_maxrss;
+    CacheMemory memory;
+    policy_memory(cache, &memory);
+    // A lookup the file tier answered returned a value too; count it apart from the hits
+    int tier_hit=(int)stats_total(cache->stats,STAT_TIER_HITS);
+    metric(hit-tier_hit,miss,tier_hit);
     printf("| %-30s | %f seconds         |\n", "Time utilized", diff);
-    printf("| %-30s | %ld KB             |\n", "Memory Used", mem_used);
+    metric_memory(&memory);
     printf("-------------------------------------------------\n");
 
-    free_memory(&cache);
+    free_memory(cache);
 }
 
 int main() {
@@ -222,3 +342,4 @@ int main() {
     return 0;
 }
 
+#endif
@@ -2,244 +2,298 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
-#include <sys/resource.h>
 #include "cache.h"
 
+// Buffer sizes used by the test driver; the cache itself stores any length
 #define KEY_SIZE 32
 #define VALUE_SIZE 256
-#define CACHE_SIZE 2000
 #define CACHE_CAPACITY 5
+#define CACHE_MAX_BYTES 4096
 #define ENDEC_KEY 3
 
 
-// Define a structure for cache entry
+// Define a structure for cache entry; its place in the list is kept in Cache.order
 typedef struct CacheEntry {
-    char key[KEY_SIZE];
-    char value[VALUE_SIZE];
-    struct CacheEntry *next;
-    struct CacheEntry *prev;
+    KeyValue kv;
 } CacheEntry;
 
 // Define a structure for cache
 typedef struct Cache {
-    CacheEntry *items[CACHE_SIZE]; // Hash table to store entries
-    CacheEntry *head;  // Most recently used entry
-    CacheEntry *tail;  // Least recently used entry
-    int size;
+    Index index;       // Hash index mapping keys to entries
+    Slab entries;      // Fixed pool the entries are drawn from
+    Arena arena;       // Out-of-line storage for keys and values
+    SlotList order;    // Entry slots, most recently used at the head
+    size_t size;
+    size_t capacity;   // Maximum number of entries
+    size_t bytes;      // Entry structs, their links and arena blocks currently charged
+    size_t max_bytes;  // Memory budget the cache evicts to stay under
+    TimerWheel timers; // Deadlines of entries added with a TTL
+    CacheStats *stats; // Counters, shared through CacheOptions or owned by the cache
+    int own_stats;
+    StatsSlot *counts; // this instance's own slot in stats
+    FileTier *tier;    // Evicted entries on disk, NULL without a file tier
 } Cache;
 
-// Function to initialize the cache and its items
-void init(Cache *cache) {
-    for (int i = 0; i < CACHE_SIZE; i++) {
-        cache->items[i] = NULL;
+// Function to create and initialize a cache holding up to capacity entries
+static Cache *cache_create(size_t capacity, const CacheOptions *options) {
+    Cache *cache = (Cache *)malloc(sizeof(Cache));
+    if (cache == NULL) {
+        perror("Failed to allocate memory for cache");
+        exit(EXIT_FAILURE);
     }
-    cache->head = NULL;
-    cache->tail = NULL;
+    Reclaim *reclaim = options ? options->reclaim : NULL;
+    index_init(&cache->index, options ? options->initial_entries : 0, reclaim);
+    slab_init(&cache->entries, sizeof(CacheEntry), capacity, reclaim);
+    slotlist_init(&cache->order, &cache->entries);
+    arena_init(&cache->arena, reclaim);
+    cache->arena.cipher = options ? options->cipher : NULL;
+    wheel_init(&cache->timers);
+    cache->own_stats = !(options && options->stats);
+    cache->stats = cache->own_stats ? stats_create() : options->stats;
+    cache->counts = stats_own(cache->stats);
+    cache->index.stats = cache->stats;
+    cache->tier = tier_open(options, cache->stats);
     cache->size = 0;
+    cache->bytes = 0;
+    cache->capacity = capacity;
+    cache->max_bytes = (options && options->max_bytes) ? options->max_bytes : SIZE_MAX;
+    return cache;
 }
 
-// Function to remove an entry from the linked list
-void remove_entry(Cache *cache, CacheEntry *entry) {
-    if (entry->prev) {
-        entry->prev->next = entry->next;
-    } else {
-        cache->head = entry->next;
-    }
-    if (entry->next) {
-        entry->next->prev = entry->prev;
-    } else {
-        cache->tail = entry->prev;
-    }
+// Function to get the entry at the tail of the list, or NULL while the cache is empty
+static CacheEntry *tail_entry(Cache *cache) {
+    return cache->order.tail == SLOT_NONE ? NULL : slab_object(&cache->entries, cache->order.tail);
+}
+
+// Function to drop an entry from the cache and free its memory
+static void delete_entry(Cache *cache, CacheEntry *to_remove) {
+    index_remove(&cache->index, kv_key(&to_remove->kv), to_remove->kv.hash);
+    slotlist_unlink(&cache->order, slab_slot(&cache->entries, to_remove));
+    wheel_cancel(&cache->timers, &to_remove->kv);
+    size_t freed = sizeof(CacheEntry) + sizeof(SlotLink) + kv_bytes(&to_remove->kv);
+    cache->bytes -= freed;
+    stats_add(cache->counts, STAT_BYTES_REMOVED, freed);
+    kv_release(&to_remove->kv, &cache->arena);
+    slab_free(&cache->entries, to_remove);
+    cache->size--;
+}
+
+// Function to evict the entry at the tail of the list; reason is the STAT_EVICT_ counter it is charged to
+static void evict_tail(Cache *cache, int reason) {
+    stats_add(cache->counts, reason, 1);
+    tier_put(cache->tier, &tail_entry(cache)->kv);
+    delete_entry(cache, tail_entry(cache));
+}
+
+// Function called by the timer wheel for an entry whose TTL has run out
+static void expire_entry(void *cache, KeyValue *kv) {
+    stats_add(((Cache *)cache)->counts, STAT_EXPIRED, 1);
+    delete_entry((Cache *)cache, (CacheEntry *)kv);
 }
 
-// Function to add an entry to the cache and linked list
-void add_to_cache(Cache *cache, const char *key, const char *value) {
-    int ind = hash(key);
+// Function to move an entry to the head of the list
+static void move_to_head(Cache *cache, CacheEntry *entry) {
+    slotlist_move_to_head(&cache->order, slab_slot(&cache->entries, entry));
+}
 
+// Function to add an entry to the cache and linked list; ttl_ms of 0 keeps it until it is evicted
+static void add_to_cache(Cache *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    stats_open(cache->counts, STATS_PUT);
+    uint64_t h = key_hash(key);
+    // A copy in the file tier is out of date from now on
+    tier_remove(cache->tier, key, h);
+    // Expired entries go first, so they make room before any live one is evicted
+    wheel_expire(&cache->timers, expire_entry, cache);
     // Check if the key already exists
-    CacheEntry *existing = cache->items[ind];
-    while (existing) {
-        if (strcmp(existing->key, key) == 0) {
-            // Update value if key already exists
-            strncpy(existing->value, value, VALUE_SIZE - 1);
-            existing->value[VALUE_SIZE - 1] = '\0';
-
-            // Move this entry to the head of the list
-            if (existing != cache->head) {
-                remove_entry(cache, existing);
-
-                // Add to head
-                existing->next = cache->head;
-                existing->prev = NULL;
-                if (cache->head) {
-                    cache->head->prev = existing;
-                }
-                cache->head = existing;
-                if (cache->tail == NULL) {
-                    cache->tail = existing;
-                }
-            }
-            return;
+    CacheEntry *existing = index_find(&cache->index, key, h);
+    if (existing) {
+        // Update value if key already exists
+        size_t freed = kv_bytes(&existing->kv);
+        cache->bytes -= freed;
+        stats_add(cache->counts, STAT_BYTES_REMOVED, freed);
+        kv_set_value(&existing->kv, &cache->arena, value);
+        size_t added = kv_bytes(&existing->kv);
+        cache->bytes += added;
+        stats_add(cache->counts, STAT_BYTES_ADDED, added);
+        wheel_set_ttl(&cache->timers, &existing->kv, ttl_ms);
+
+        // Move this entry to the head of the list
+        move_to_head(cache, existing);
+
+        // A bigger value may exceed the budget
+        while (cache->bytes > cache->max_bytes && cache->size > 0) {
+            evict_tail(cache, STAT_EVICT_BYTES);
         }
-        existing = existing->next;
+        stats_close(cache->counts, STAT_UPDATES, STATS_PUT);
+        return;
+    }
+
+    // An entry larger than the whole budget is never cached, and a cache of
+    // capacity 0 caches nothing
+    size_t need = sizeof(CacheEntry) + sizeof(SlotLink) + kv_size(&cache->arena, key, value);
+    if (need > cache->max_bytes || cache->capacity == 0) {
+        stats_close(cache->counts, STAT_REJECTED, STATS_PUT);
+        return;
+    }
+
+    // Eviction logic, done first so the new entry reuses the freed slot:
+    // remove the tail (least recently used) until the entry count and the
+    // byte budget both leave room
+    while (cache->size == cache->capacity || cache->bytes + need > cache->max_bytes) {
+        evict_tail(cache, cache->size == cache->capacity ? STAT_EVICT_CAPACITY : STAT_EVICT_BYTES);
     }
 
     // Create a new entry
-    CacheEntry *entry = (CacheEntry *)malloc(sizeof(CacheEntry));
-    strncpy(entry->key, key, KEY_SIZE - 1);
-    entry->key[KEY_SIZE - 1] = '\0';
-    strncpy(entry->value, value, VALUE_SIZE - 1);
-    entry->value[VALUE_SIZE - 1] = '\0';
-    entry->next = cache->items[ind];
-    entry->prev = NULL;
-    if (cache->items[ind]) {
-        cache->items[ind]->prev = entry;
+    CacheEntry *entry = slab_alloc(&cache->entries);
+    if (entry == NULL) {
+        fprintf(stderr, "Cache entry slab exhausted\n");
+        exit(EXIT_FAILURE);
     }
-    cache->items[ind] = entry;
+    kv_set(&entry->kv, &cache->arena, key, h, value);
+    index_insert(&cache->index, kv_key(&entry->kv), h, entry);
+    wheel_set_ttl(&cache->timers, &entry->kv, ttl_ms);
 
     // Add entry to the head of the linked list
-    entry->next = cache->head;
-    entry->prev = NULL;
-    if (cache->head) {
-        cache->head->prev = entry;
+    slotlist_push_head(&cache->order, slab_slot(&cache->entries, entry));
+    cache->size++;
+    cache->bytes += need;
+    stats_add(cache->counts, STAT_BYTES_ADDED, need);
+    stats_close(cache->counts, STAT_INSERTS, STATS_PUT);
+}
+
+// Function to bring a key back from the file tier into the cache, if the tier has it, and return its entry
+static CacheEntry *promote(Cache *cache, const char *key, uint64_t h) {
+    uint64_t ttl_ms;
+    const char *value = tier_get(cache->tier, cache->arena.cipher, key, h, &ttl_ms);
+    if (value == NULL) {
+        return NULL;
     }
-    cache->head = entry;
-    if (cache->tail == NULL) {
-        cache->tail = entry;
+    add_to_cache(cache, key, value, ttl_ms);
+    return index_find(&cache->index, key, h);
+}
+
+// Function to return the value corresponding to a key, if it exists
+static const char *retrieve_from_cache(Cache *cache, const char *key) {
+    stats_open(cache->counts, STATS_GET);
+    uint64_t h = key_hash(key);
+    CacheEntry *entry = index_find(&cache->index, key, h);
+    if (entry == NULL || kv_expired(&entry->kv)) {
+        entry = promote(cache, key, h);
+        stats_close(cache->counts, entry ? STAT_TIER_HITS : STAT_MISSES, STATS_GET);
+        return entry ? entry->kv.value : NULL;
     }
+    move_to_head(cache, entry);
+    stats_close(cache->counts, STAT_HITS, STATS_GET);
+    return entry->kv.value;
+}
 
-    // Eviction logic
-    if (cache->size == CACHE_CAPACITY) {
-        // Remove the tail (least recently used)
-        CacheEntry *to_remove = cache->tail;
-        if (to_remove) {
-            int tail_index = hash(to_remove->key);
-            CacheEntry *entry_to_remove = cache->items[tail_index];
-            CacheEntry *prev = NULL;
-            while (entry_to_remove) {
-                if (entry_to_remove == to_remove) {
-                    if (prev) {
-                        prev->next = entry_to_remove->next;
-                    } else {
-                        cache->items[tail_index] = entry_to_remove->next;
-                    }
-                    if (entry_to_remove->next) {
-                        entry_to_remove->next->prev = prev;
-                    }
-                    break;
-                }
-                prev = entry_to_remove;
-                entry_to_remove = entry_to_remove->next;
-            }
-            remove_entry(cache, to_remove);
-            cache->size--;
-        }
-    } else {
-        cache->size++;
+// Function to free the memory allocated
+static void free_memory(Cache *cache) {
+    slotlist_destroy(&cache->order);
+    slab_destroy(&cache->entries);
+    arena_destroy(&cache->arena);
+    index_free(&cache->index);
+    tier_close(cache->tier);
+    stats_disown(cache->counts);
+    if (cache->own_stats) {
+        stats_destroy(cache->stats);
     }
+    free(cache);
 }
 
-// Function to return the value corresponding to a key, if it exists
-const char *retrieve_from_cache(Cache *cache, const char *key) {
-    int ind = hash(key);
-    CacheEntry *entry = cache->items[ind];
-    while (entry) {
-        if (strcmp(entry->key, key) == 0) {
-            // Move entry to the head of the list
-            if (entry != cache->head) {
-                remove_entry(cache, entry);
-
-                // Add to head
-                entry->next = cache->head;
-                entry->prev = NULL;
-                if (cache->head) {
-                    cache->head->prev = entry;
-                }
-                cache->head = entry;
-                if (cache->tail == NULL) {
-                    cache->tail = entry;
-                }
-            }
-            return entry->value;
-        }
-        entry = entry->next;
+// Adapters exposing this policy through the common CachePolicy interface
+static void *policy_create(size_t capacity, const CacheOptions *options) {
+    return cache_create(capacity, options);
+}
+
+static void policy_add(void *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    add_to_cache((Cache *)cache, key, value, ttl_ms);
+}
+
+static const char *policy_get(void *cache, const char *key) {
+    return retrieve_from_cache((Cache *)cache, key);
+}
+
+static void *policy_lookup(void *cache, const char *key, uint64_t hash) {
+    return index_find(&((Cache *)cache)->index, key, hash);
+}
+
+static void policy_prefetch(void *cache, uint64_t hash) {
+    index_prefetch(&((Cache *)cache)->index, hash);
+}
+
+static void policy_touch(void *cache, void *entry) {
+    move_to_head((Cache *)cache, (CacheEntry *)entry);
+}
+
+static void *policy_victim(void *cache) {
+    Cache *c = (Cache *)cache;
+    wheel_expire(&c->timers, expire_entry, c);
+    return c->size < c->capacity ? NULL : tail_entry(c);
+}
+
+// From the tail, so adding the entries again in this order puts the list back as it was
+static void policy_walk(void *cache, VisitFn visit, void *arg) {
+    Cache *c = (Cache *)cache;
+    for (uint32_t i = c->order.tail; i != SLOT_NONE; i = c->order.links[i].prev) {
+        CacheEntry *entry = slab_object(&c->entries, i);
+        visit(arg, &entry->kv);
     }
-    return NULL;
 }
 
-// Encrypt funciton which encrypts  each entry in the cache 
-void encrypt(Cache *cache)
-{
-  CacheEntry *temp=cache->head;
-  while(temp)
-  {
-    custom_encrypt(temp->key);
-    custom_encrypt(temp->value);
-    temp=temp->next;
-  }
+static void policy_destroy(void *cache) {
+    free_memory((Cache *)cache);
+}
+
+static CacheStats *policy_stats(void *cache) {
+    return ((Cache *)cache)->stats;
 }
 
-// Decrypt funciton which decrypts  each entry in the cache 
-void decrypt(Cache *cache)
+static void policy_memory(void *cache, CacheMemory *memory) {
+    Cache *c = (Cache *)cache;
+    memory_measure(memory, &c->index, &c->entries, &c->arena, c->own_stats ? c->stats : NULL);
+    memory->metadata += sizeof(Cache) + c->entries.in_use * sizeof(SlotLink) + tier_memory(c->tier);
+    memory->unused += slotlist_memory(&c->order) - c->entries.in_use * sizeof(SlotLink);
+}
+
+const CachePolicy mru_policy = {"MRU", policy_create, policy_add, policy_get, policy_lookup, policy_prefetch, policy_touch, policy_victim, policy_walk, policy_destroy, policy_stats, policy_memory};
+
+// The test driver below is left out when the policy is built into the library
+#ifndef CACHE_LIBRARY
+
+// function to print all the entries of the cache with their values decrypted into a buffer
+static void print_decrypted(Cache *cache)
 {
-  CacheEntry *temp=cache->head;
-  while(temp)
+  char value[VALUE_SIZE];
+  for(uint32_t i=cache->order.head;i!=SLOT_NONE;i=cache->order.links[i].next)
   {
-    custom_decrypt(temp->key);
-    custom_decrypt(temp->value);
-    temp=temp->next;
+    CacheEntry *temp=slab_object(&cache->entries,i);
+    cipher_read(cache->arena.cipher,temp->kv.value,value,sizeof(value));
+    printf("Key: %s and Value: %s\n",kv_key(&temp->kv),value);
   }
+  printf("\n");
 }
 
 // function to print all the entries of the cache
-void print_func(Cache *cache)
+static void print_func(Cache *cache)
 {
-    CacheEntry *temp=cache->head;
-    while(temp)
+    for(uint32_t i=cache->order.head;i!=SLOT_NONE;i=cache->order.links[i].next)
     {
-         printf("Key: %s and Value: %s\n",temp->key,temp->value);
-         temp=temp->next;
+         CacheEntry *temp=slab_object(&cache->entries,i);
+         printf("Key: %s and Value: %s\n",kv_key(&temp->kv),temp->kv.value);
     }
     printf("\n");
 }
 
-// Function to free the memory allocated
-void free_memory(Cache *cache) {
-    CacheEntry *temp = cache->head;
-    while (temp) {
-        CacheEntry *item = temp;
-        temp = temp->next;
-        int ind = hash(item->key);
-        CacheEntry *entry = cache->items[ind];
-        CacheEntry *prev = NULL;
-        while (entry) {
-            if (entry == item) {
-                if (prev) {
-                    prev->next = entry->next;
-                } else {
-                    cache->items[ind] = entry->next;
-                }
-                if (entry->next) {
-                    entry->next->prev = prev;
-                }
-                break;
-            }
-            prev = entry;
-            entry = entry->next;
-        }
-        free(item);
-    }
-}
-
 // Function to test the working of the logic and implementation
-void test() {
-    Cache cache;
-    init(&cache);
+static void test() {
+    Cipher cipher;
+    cipher_init_caesar(&cipher, ENDEC_KEY);
+    CacheOptions options = {CACHE_MAX_BYTES, 0, NULL, NULL, &cipher, NULL, 0};
+    Cache *cache = cache_create(CACHE_CAPACITY, &options);
     clock_t start,end;
     start=clock();
     
-    struct rusage usage_start,usage_end;
-    getrusage(RUSAGE_SELF,&usage_start);
 
     int lo = 0;
     int hi = 7;
@@ -254,14 +308,14 @@ void test() {
         char v[VALUE_SIZE];
         fgets(v, VALUE_SIZE, stdin);
         trim_newline(v);
-        add_to_cache(&cache, k, v);
+        add_to_cache(cache, k, v, 0);
     }
 
     for (int i = 0; i < 1000; i++) {
         int key = (rand() % (hi - lo + 1)) + lo;
         char s[KEY_SIZE];
         snprintf(s, KEY_SIZE, "%d", key);
-        const char *value = retrieve_from_cache(&cache, s);
+        const char *value = retrieve_from_cache(cache, s);
         if (value) {
             hit++;
         } else {
@@ -269,29 +323,29 @@ void test() {
         }
     }
 
-    printf("Before encryption: \n");
-    print_func(&cache);
-    encrypt(&cache);
-    printf("After encryption: \n");
-    print_func(&cache);
-    decrypt(&cache);
+    printf("Stored encrypted: \n");
+    print_func(cache);
     printf("After decryption: \n");
-    print_func(&cache);
+    print_decrypted(cache);
   
     end = clock();
     double diff = (double)(end - start) / CLOCKS_PER_SEC;
-    metric(hit,miss);
-    getrusage(RUSAGE_SELF, &usage_end);
-    long mem_used = usage_end.ru_maxrss - usage_start.ru_maxrss;
+    CacheMemory memory;
+    policy_memory(cache, &memory);
+    // A lookup the file tier answered returned a value too; count it apart from the hits
+    int tier_hit=(int)stats_total(cache->stats,STAT_TIER_HITS);
+    metric(hit-tier_hit,miss,tier_hit);
 
     printf("| %-30s | %f seconds         |\n", "Time utilized", diff);
-    printf("| %-30s | %ld KB             |\n", "Memory Used", mem_used);
+    metric_memory(&memory);
     printf("-------------------------------------------------\n");
 
-    free_memory(&cache);
+    free_memory(cache);
 }
 
 int main() {
     test();
     return 0;
 }
+
+#endif
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+// Header in front of every oversized block so the arena can free them on teardown
+typedef struct LargeBlock {
+    struct LargeBlock *prev;
+    struct LargeBlock *next;
+} LargeBlock;
+
+#define MIN_CLASS_SIZE 16
+
+// Size of class c: 16, 24, 32, 48, 64, 96, ... 65536
+static size_t class_size(int c) {
+    return (c & 1) ? (size_t)24 << (c / 2) : (size_t)16 << (c / 2);
+}
+
+// Smallest class that holds size bytes, or -1 if it needs a large block
+static int class_of(size_t size) {
+    if (size <= MIN_CLASS_SIZE)
+        return 0;
+    int k = 63 - __builtin_clzll((unsigned long long)(size - 1));
+    size_t p = (size_t)1 << k;
+    int c = (size <= p + p / 2) ? 2 * (k - 4) + 1 : 2 * (k - 4) + 2;
+    return c < ARENA_CLASSES ? c : -1;
+}
+
+// Function to get the number of bytes actually reserved for a request of size bytes
+size_t arena_block_size(size_t size) {
+    int c = class_of(size);
+    return c < 0 ? size : class_size(c);
+}
+
+// Function to get the size class a request of size bytes is served from,
+// or -1 if it takes a block of its own
+int arena_class(size_t size) {
+    return class_of(size);
+}
+
+static void *checked_malloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+        perror("Failed to allocate memory for arena");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// Function to initialize an empty arena
+void arena_init(Arena *arena, Reclaim *reclaim) {
+    memset(arena, 0, sizeof(*arena));
+    arena->reclaim = reclaim;
+}
+
+// Function to allocate a block of at least size bytes
+char *arena_alloc(Arena *arena, size_t size) {
+    int c = class_of(size);
+    if (c < 0) {
+        LargeBlock *block = checked_malloc(sizeof(LargeBlock) + size);
+        block->prev = NULL;
+        block->next = arena->large;
+        if (arena->large)
+            ((LargeBlock *)arena->large)->prev = block;
+        arena->large = block;
+        arena->bytes_used += size;
+        arena->bytes_reserved += sizeof(LargeBlock) + size;
+        return (char *)(block + 1);
+    }
+
+    size_t block_size = class_size(c);
+    arena->bytes_used += block_size;
+    if (arena->free_lists[c]) {
+        char *block = arena->free_lists[c];
+        arena->free_lists[c] = *(void **)block;
+        return block;
+    }
+
+    // Carve from the current chunk, starting a new one when it runs out
+    if (arena->chunk_left < block_size) {
+        size_t chunk_size = sizeof(void *) + ARENA_CHUNK_SIZE;
+        char *chunk = checked_malloc(chunk_size);
+        *(void **)chunk = arena->chunks;
+        arena->chunks = chunk;
+        arena->chunk_pos = chunk + sizeof(void *);
+        arena->chunk_left = ARENA_CHUNK_SIZE;
+        arena->bytes_reserved += chunk_size;
+    }
+    char *block = arena->chunk_pos;
+    arena->chunk_pos += block_size;
+    arena->chunk_left -= block_size;
+    return block;
+}
+
+// Puts a block back on its class free list, or frees it if it is large
+static void arena_release(void *owner, void *ptr, size_t size) {
+    Arena *arena = (Arena *)owner;
+    char *block = (char *)ptr;
+    int c = class_of(size);
+    if (c < 0) {
+        LargeBlock *large = (LargeBlock *)block - 1;
+        if (large->prev)
+            large->prev->next = large->next;
+        else
+            arena->large = large->next;
+        if (large->next)
+            large->next->prev = large->prev;
+        arena->bytes_used -= size;
+        arena->bytes_reserved -= sizeof(LargeBlock) + size;
+        free(large);
+        return;
+    }
+    *(void **)block = arena->free_lists[c];
+    arena->free_lists[c] = block;
+    arena->bytes_used -= class_size(c);
+}
+
+// Function to return a block; size must be the size it was allocated with
+void arena_free(Arena *arena, char *block, size_t size) {
+    if (block == NULL)
+        return;
+    if (arena->reclaim) {
+        reclaim_retire(arena->reclaim, arena_release, arena, block, size);
+        return;
+    }
+    arena_release(arena, block, size);
+}
+
+// Function to release every chunk and large block owned by the arena
+void arena_destroy(Arena *arena) {
+    void *chunk = arena->chunks;
+    while (chunk) {
+        void *next = *(void **)chunk;
+        free(chunk);
+        chunk = next;
+    }
+    LargeBlock *large = arena->large;
+    while (large) {
+        LargeBlock *next = large->next;
+        free(large);
+        large = next;
+    }
+    free(arena->packed.buf);
+    memset(arena, 0, sizeof(*arena));
+}
+
+// Copies len bytes plus a terminating NUL into a fresh arena block
+static char *store(Arena *arena, const char *str, size_t len) {
+    char *block = arena_alloc(arena, len + 1);
+    memcpy(block, str, len);
+    block[len] = '\0';
+    return block;
+}
+
+// Compresses a value through the arena's cipher, unless it is the one
+// compressed last; returns the packed length left in arena->packed, or 0
+// if the value is to be stored as it is
+static size_t value_pack(Arena *arena, const char *value, size_t len) {
+    Cipher *cipher = arena->cipher;
+    if (cipher == NULL || cipher->compress_above == 0 || len <= cipher->compress_above) {
+        return 0;
+    }
+    PackedValue *memo = &arena->packed;
+    uint64_t hash = key_hash(value);
+    if (memo->src == value && memo->src_len == len && memo->hash == hash) {
+        return memo->len;
+    }
+    size_t bound = cipher_pack_bound(len);
+    if (bound > memo->size) {
+        free(memo->buf);
+        arena->bytes_reserved += bound - memo->size;
+        memo->size = bound;
+        memo->buf = (char *)malloc(bound);
+        if (memo->buf == NULL) {
+            perror("Failed to allocate memory for compression");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memo->src = value;
+    memo->src_len = len;
+    memo->hash = hash;
+    memo->len = cipher_pack(cipher, value, len, memo->buf);
+    return memo->len;
+}
+
+// Bytes a value of len bytes is stored in, before the terminating NUL, given what value_pack returned
+static size_t value_stored(const Arena *arena, size_t len, size_t packed) {
+    return cipher_overhead(arena->cipher) + (packed ? packed : len);
+}
+
+// Writes a value into block, which holds value_stored() + 1 bytes
+static void value_write(Arena *arena, char *block, const char *value, size_t len, size_t packed) {
+    if (packed)
+        cipher_write_packed(arena->cipher, block, arena->packed.buf, packed);
+    else if (arena->cipher)
+        cipher_write(arena->cipher, block, value, len);
+    else
+        memcpy(block, value, len + 1);
+}
+
+// Stores a value, through the arena's cipher if it has one; returns the
+// block and sets *stored to the bytes it holds before the terminating NUL
+static char *store_value(Arena *arena, const char *value, size_t len, uint32_t *stored) {
+    size_t packed = value_pack(arena, value, len);
+    *stored = (uint32_t)value_stored(arena, len, packed);
+    char *block = arena_alloc(arena, *stored + 1);
+    value_write(arena, block, value, len, packed);
+    return block;
+}
+
+// Function to fill in the key and value of a new entry
+void kv_set(KeyValue *kv, Arena *arena, const char *key, uint64_t hash, const char *value) {
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+
+    kv->hash = hash;
+    kv->key_len = (uint32_t)key_len;
+    if (key_len < KEY_INLINE)
+        memcpy(kv->key.inline_key, key, key_len + 1);
+    else
+        kv->key.ptr = store(arena, key, key_len);
+
+    kv->timer.next = NULL;
+    kv->timer.pprev = NULL;
+    __atomic_store_n(&kv->timer.expires, 0, __ATOMIC_RELAXED);
+
+    // Published last: a lock-free reader still holding a reused entry must
+    // not see the block before its contents (and cipher header) are written
+    char *block = store_value(arena, value, value_len, &kv->value_len);
+    __atomic_store_n(&kv->value, block, __ATOMIC_RELEASE);
+}
+
+// Function to replace the value of an existing entry, reusing its block when the size class allows.
+// When readers may be copying the old value, the new one always goes into a
+// fresh block that is published with a single pointer store.
+void kv_set_value(KeyValue *kv, Arena *arena, const char *value) {
+    size_t value_len = strlen(value);
+    size_t packed = value_pack(arena, value, value_len);
+    size_t stored = value_stored(arena, value_len, packed);
+    if (kv->value && arena->reclaim == NULL && arena_block_size(stored + 1) == arena_block_size(kv->value_len + 1)) {
+        value_write(arena, kv->value, value, value_len, packed);
+        kv->value_len = (uint32_t)stored;
+    } else {
+        char *old = kv->value;
+        uint32_t old_len = kv->value_len;
+        __atomic_store_n(&kv->value, store_value(arena, value, value_len, &kv->value_len), __ATOMIC_RELEASE);
+        arena_free(arena, old, old_len + 1);
+    }
+}
+
+// Function to give back an entry's value but keep its key, for entries that
+// stay indexed without data (ARC ghost entries); kv_set_value fills it again
+void kv_drop_value(KeyValue *kv, Arena *arena) {
+    char *value = kv->value;
+    __atomic_store_n(&kv->value, NULL, __ATOMIC_RELEASE);
+    arena_free(arena, value, kv->value_len + 1);
+    kv->value_len = 0;
+}
+
+// Function to get the NUL-terminated key of an entry
+char *kv_key(KeyValue *kv) {
+    return kv->key_len < KEY_INLINE ? kv->key.inline_key : kv->key.ptr;
+}
+
+// Function to give the entry's out-of-line storage back to the arena
+void kv_release(KeyValue *kv, Arena *arena) {
+    if (kv->key_len >= KEY_INLINE)
+        arena_free(arena, kv->key.ptr, kv->key_len + 1);
+    arena_free(arena, kv->value, kv->value_len + 1);
+    __atomic_store_n(&kv->value, NULL, __ATOMIC_RELEASE);
+}
+
+// Function to get the arena bytes kv_set would use for this key and value.
+// A value the cipher compresses is compressed here, once, for the kv_set
+// or kv_set_value that follows.
+size_t kv_size(Arena *arena, const char *key, const char *value) {
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    size_t bytes = arena_block_size(value_stored(arena, value_len, value_pack(arena, value, value_len)) + 1);
+    if (key_len >= KEY_INLINE)
+        bytes += arena_block_size(key_len + 1);
+    return bytes;
+}
+
+// Function to get the arena bytes currently held by an entry's key and value
+size_t kv_bytes(const KeyValue *kv) {
+    size_t bytes = arena_block_size(kv->value_len + 1);
+    if (kv->key_len >= KEY_INLINE)
+        bytes += arena_block_size(kv->key_len + 1);
+    return bytes;
+}
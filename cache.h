@@ -1,6 +1,937 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
 unsigned int hash(const char* );
+uint64_t hash64(const void *, size_t);
+uint64_t key_hash(const char *);
 void trim_newline(char *);
 void custom_encrypt(char *);
 void custom_decrypt(char *);
-void metric(double,double);
+void metric(int,int,int);
+
+// One column of metric_table(): the metric() figures for one cache
+typedef struct MetricColumn {
+    const char *name;
+    size_t hit;
+    size_t miss;
+    size_t ops;       // every request served, writes included
+    double seconds;   // time taken to serve them
+    size_t memory;    // bytes the cache had allocated when it finished, 0 if not measured
+    size_t tier_hit;  // lookups that missed memory but were found in a file tier, in neither hit nor miss
+} MetricColumn;
+
+void metric_table(const MetricColumn *, int);
+
+// Bytes one cache instance has taken from malloc, by what they hold
+// (policy->memory). The parts add up to everything the instance allocated.
+typedef struct CacheMemory {
+    size_t index;      // hash index tables, including one a resize is still draining
+    size_t entries;    // the KeyValue of every live entry, short keys included
+    size_t metadata;   // what the policy keeps besides: links and flags in the entries,
+                       // queue nodes, heaps, ghosts, the Cache struct, its own statistics
+    size_t payload;    // arena blocks holding keys and values, rounded up to their size class
+    size_t unused;     // allocated but holding nothing yet: free slab slots, arena free lists
+} CacheMemory;
+
+size_t memory_total(const CacheMemory *);
+void metric_memory(const CacheMemory *);
+
+#define CACHE_LINE_SIZE 64
+
+// Epoch-based reclamation (reclaim.c) for caches that are read without a
+// lock. A reader publishes the epoch it started in for the length of one
+// lookup. Memory a writer releases meanwhile is parked on a Reclaim list
+// tagged with the current epoch and only handed back (to the slab, the
+// arena or free()) once no reader is left in that epoch, so a lookup never
+// touches memory that has been reused. Index, Slab and Arena take an
+// optional Reclaim; with NULL they release memory immediately as before.
+#define EPOCH_MAX_READERS 256
+#define RECLAIM_BATCH 64
+
+typedef struct EpochReader {
+    uint64_t active;   // epoch the reader entered in, 0 while outside a lookup
+    int in_use;        // slot claimed by a thread
+    void *data;        // per-thread state owned by whoever registered the slot
+} __attribute__((aligned(CACHE_LINE_SIZE))) EpochReader;
+
+typedef struct EpochDomain {
+    uint64_t epoch;              // advanced by writers that want to reclaim
+    unsigned int readers_high;   // slots below this have been claimed at some point
+    pthread_mutex_t register_lock;
+    EpochReader readers[EPOCH_MAX_READERS];
+} EpochDomain;
+
+typedef void (*ReleaseFn)(void *owner, void *ptr, size_t size);
+
+typedef struct Retired {
+    ReleaseFn release;  // performs the real free once it is safe
+    void *owner;
+    void *ptr;
+    size_t size;
+    uint64_t epoch;     // epoch current when ptr was retired
+} Retired;
+
+typedef struct Reclaim {
+    EpochDomain *domain;
+    Retired *items;     // oldest first
+    size_t count;
+    size_t capacity;
+} Reclaim;
+
+void epoch_init(EpochDomain *domain);
+EpochReader *epoch_register(EpochDomain *domain, void *data);
+void epoch_unregister(EpochReader *reader);
+void epoch_enter(EpochDomain *domain, EpochReader *reader);
+void epoch_exit(EpochReader *reader);
+void epoch_destroy(EpochDomain *domain);
+void reclaim_init(Reclaim *reclaim, EpochDomain *domain);
+void reclaim_retire(Reclaim *reclaim, ReleaseFn release, void *owner, void *ptr, size_t size);
+size_t reclaim_collect(Reclaim *reclaim);
+void reclaim_synchronize(Reclaim *reclaim);
+void reclaim_destroy(Reclaim *reclaim);
+
+// Cache statistics (stats.c), always on. Counts go into cache-line
+// aligned slots that each have one writer at a time, so counting an event
+// is a plain increment and no cache line moves between cores; stats_read()
+// sums the slots. A policy instance is only ever driven by one thread at a
+// time, and so is a thread's reader of a sharded cache, so each owns a slot
+// (stats_own) and counts into it with no lookup. Other code any thread may
+// run at once (the index, the file tier, TinyLFU) counts into the calling
+// thread's slot, allocated on first use; threads past STATS_MAX_THREADS
+// share one extra slot, updated atomically. Latency is timed on one
+// operation in STATS_SAMPLE_EVERY, so most calls never read the clock, and
+// kept in log-linear (HDR-style) histograms with STATS_LATENCY_SUB buckets
+// per power of two nanoseconds.
+#define STATS_MAX_THREADS 256
+#define STATS_SAMPLE_EVERY 1024        // a power of two
+#define STATS_PROBE_BUCKETS 8          // lookups that probed 2 to 8 index groups, then 9 or more
+#define STATS_LATENCY_SUB_BITS 4
+#define STATS_LATENCY_SUB (1 << STATS_LATENCY_SUB_BITS)
+#define STATS_LATENCY_MAX_BITS 36      // about 68 s; slower operations land in the last bucket
+#define STATS_LATENCY_BUCKETS ((STATS_LATENCY_MAX_BITS - STATS_LATENCY_SUB_BITS + 1) << STATS_LATENCY_SUB_BITS)
+
+enum {
+    STAT_HITS,
+    STAT_MISSES,
+    STAT_INSERTS,
+    STAT_UPDATES,
+    STAT_REJECTED,          // new keys not cached: larger than the budget, or refused by admission
+    STAT_EVICT_CAPACITY,    // evicted to stay within the entry count
+    STAT_EVICT_BYTES,       // evicted to stay within the byte budget
+    STAT_EXPIRED,           // reaped after their TTL ran out
+    STAT_BYTES_ADDED,       // bytes charged to the budget
+    STAT_BYTES_REMOVED,     // bytes given back; added - removed is what the cache holds
+    STAT_LOADS,             // misses a read-through loader was called for
+    STAT_LOAD_WAITS,        // misses that waited for another caller's load of the same key
+    STAT_STALE_HITS,        // hits served stale while the value was reloaded (also counted as hits)
+    STAT_TIER_HITS,         // lookups that missed memory but were found in the file tier (not counted as hits)
+    STAT_TIER_WRITES,       // evicted entries appended to the file tier
+    STAT_COMPRESS_IN,       // bytes of values over the compression threshold
+    STAT_COMPRESS_OUT,      // bytes those values were stored in, compressed or not
+    STAT_COMPRESSED,        // values stored compressed
+    STAT_COMPRESS_NS,       // nanoseconds spent compressing
+    STAT_DECOMPRESSED,      // compressed values read back
+    STAT_DECOMPRESS_NS,     // nanoseconds spent decompressing
+    STAT_COUNTERS
+};
+
+enum { STATS_GET, STATS_PUT, STATS_OPS };
+
+typedef struct StatsSnapshot {
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t probes[STATS_PROBE_BUCKETS];
+    uint64_t latency[STATS_OPS][STATS_LATENCY_BUCKETS];   // sampled operations by nanoseconds
+} StatsSnapshot;
+
+// An owned slot counts the gets and puts it starts in ops and leaves its
+// hits and inserts for stats_read to work out, as the operations that
+// ended no other way; a hit then stores nothing when it ends.
+typedef struct StatsSlot {
+    int countdown;            // thread slots: operations left until the next one is timed
+    int shared;               // the overflow slot, written by several threads
+    int idle;                 // owned slots: handed back by stats_disown, free for stats_own to reuse
+    struct StatsSlot *next;   // owned slots: the one handed out before
+    uint64_t ops[STATS_OPS];  // owned slots: gets and puts started
+    uint64_t start[STATS_OPS];// owned slots: start of the timed get or put under way, 0 for none
+    StatsSnapshot data;
+} __attribute__((aligned(CACHE_LINE_SIZE))) StatsSlot;
+
+typedef struct CacheStats {
+    // Indexed by stats_thread: [1, STATS_MAX_THREADS] are per thread id and
+    // allocated on first use; [0] (no id yet) and [STATS_MAX_THREADS + 1]
+    // (past the limit) stay NULL, so those threads take the slow paths
+    StatsSlot *slots[STATS_MAX_THREADS + 2];
+    StatsSlot *shared;        // the slot threads past the limit count into
+    StatsSlot *owned;         // slots handed out by stats_own, newest first
+} CacheStats;
+
+CacheStats *stats_create(void);
+void stats_destroy(CacheStats *stats);
+StatsSlot *stats_slot(CacheStats *stats);
+StatsSlot *stats_own(CacheStats *stats);
+void stats_disown(StatsSlot *slot);
+StatsSlot *stats_sample(CacheStats *stats, uint64_t *start);
+void stats_finish(StatsSlot *slot, int event, int op, uint64_t start);
+void stats_count_slow(CacheStats *stats, size_t word, uint64_t n);
+uint64_t stats_clock(void);
+void stats_timed(StatsSlot *slot, int op);
+void stats_read(CacheStats *stats, StatsSnapshot *out);
+uint64_t stats_total(CacheStats *stats, int event);
+uint64_t stats_percentile(const StatsSnapshot *snapshot, int op, double q);
+void stats_print(const StatsSnapshot *snapshot);
+size_t stats_memory(CacheStats *stats);
+
+// Background thread printing one line of rates every interval (stats_dump_start)
+typedef struct StatsDumper {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    CacheStats *stats;
+    unsigned int interval_ms;
+    StatsSnapshot last;
+} StatsDumper;
+
+StatsDumper *stats_dump_start(CacheStats *stats, unsigned int interval_ms);
+void stats_dump_stop(StatsDumper *dumper);
+
+// Counting is inline because every cache operation goes through it several
+// times. Into an owned slot, starting an operation is one add and a test
+// and ending it is a test, plus an add unless it was a hit or an insert.
+// Into a thread's slot, the fast path is a thread-local load, an array load
+// and a plain add; a thread without a slot of its own, the timed
+// operations and the shared slot all go through the out-of-line functions,
+// so the inline code never checks which kind of slot it has.
+extern __thread int stats_thread;   // 1 + the calling thread's slot index, 0 until assigned
+#define STATS_UNTIMED 1             // start of an operation counted in the shared slot but not timed
+
+// Function to add n to a counter only the calling thread writes
+static inline void stats_bump(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+// Function to count n occurrences of an event
+static inline void stats_count(CacheStats *stats, int event, uint64_t n) {
+    StatsSlot *slot = stats->slots[stats_thread];
+    if (__builtin_expect(slot != NULL, 1)) {
+        stats_bump(&slot->data.counters[event], n);
+    } else {
+        stats_count_slow(stats, offsetof(StatsSnapshot, counters[event]) / sizeof(uint64_t), n);
+    }
+}
+
+// Function to start an operation: sets *start to its start time if this one
+// is timed, 0 otherwise, and returns the slot to pass to stats_end
+static inline StatsSlot *stats_begin(CacheStats *stats, uint64_t *start) {
+    StatsSlot *slot = stats->slots[stats_thread];
+    if (__builtin_expect(slot != NULL, 1) && __builtin_expect(--slot->countdown > 0, 1)) {
+        *start = 0;
+        return slot;
+    }
+    return stats_sample(stats, start);
+}
+
+// Function to finish an operation: counts its event and, if it was timed, its latency
+static inline void stats_end(StatsSlot *slot, int event, int op, uint64_t start) {
+    if (__builtin_expect(start != 0, 0)) {
+        stats_finish(slot, event, op, start);
+    } else {
+        stats_bump(&slot->data.counters[event], 1);
+    }
+}
+
+// Function to count n occurrences of an event into an owned slot
+static inline void stats_add(StatsSlot *slot, int event, uint64_t n) {
+    stats_bump(&slot->data.counters[event], n);
+}
+
+// Function to start a get or put on an owned slot, timing it if it is the
+// STATS_SAMPLE_EVERY-th of its kind
+static inline void stats_open(StatsSlot *slot, int op) {
+    uint64_t n = __atomic_load_n(&slot->ops[op], __ATOMIC_RELAXED) + 1;
+    __atomic_store_n(&slot->ops[op], n, __ATOMIC_RELAXED);
+    if (__builtin_expect((n & (STATS_SAMPLE_EVERY - 1)) == 0, 0)) {
+        slot->start[op] = stats_clock();
+    }
+}
+
+// Function to end it: counts how it ended and, if it was timed, its latency
+static inline void stats_close(StatsSlot *slot, int event, int op) {
+    if (event != STAT_HITS && event != STAT_INSERTS) {
+        stats_bump(&slot->data.counters[event], 1);
+    }
+    if (__builtin_expect(slot->start[op] != 0, 0)) {
+        stats_timed(slot, op);
+    }
+}
+
+// Function to count an index lookup going on to look at its groups-th
+// group (groups > 1); stats_read turns these into lookups by groups probed
+static inline void stats_probe(CacheStats *stats, size_t groups) {
+    StatsSlot *slot = stats->slots[stats_thread];
+    size_t b = groups - 2;
+    if (b >= STATS_PROBE_BUCKETS) {
+        return;
+    }
+    if (__builtin_expect(slot != NULL, 1)) {
+        stats_bump(&slot->data.probes[b], 1);
+    } else {
+        stats_count_slow(stats, offsetof(StatsSnapshot, probes[b]) / sizeof(uint64_t), 1);
+    }
+}
+
+// Open-addressing hash index shared by every cache policy (index.c).
+// Slots are grouped 16 at a time; each slot has a one-byte control word
+// holding a 7-bit fingerprint of the key hash, so a lookup scans one group
+// of control bytes and only compares keys whose fingerprint matches.
+// Callers pass the 64-bit key_hash() they computed once for the key.
+// The table grows by incremental rehashing: when it fills up a table twice
+// the size is allocated and every later insert or remove moves a bounded
+// batch of slots across, so no single call pays for the whole resize.
+// Each table is one allocation reached through a single pointer, and a
+// slot's control byte is written after the slot itself, so index_find can
+// run next to a writer as long as retired tables go through a Reclaim.
+#define INDEX_GROUP_WIDTH 16
+#define INDEX_MIGRATE_STEP 32
+
+typedef struct IndexSlot {
+    uint64_t hash;     // full key hash, checked before the key itself
+    const char *key;   // points at the key stored inside the entry
+    void *entry;
+} IndexSlot;
+
+typedef struct IndexTable {
+    uint8_t *ctrl;     // control byte per slot: empty, deleted or fingerprint
+    IndexSlot *slots;
+    size_t mask;       // number of slots - 1, always a power of two
+    size_t used;       // live keys
+    size_t deleted;    // tombstones waiting for the next rehash
+    const struct Index *index;   // the index it belongs to, whose stats count long probes
+} IndexTable;
+
+typedef struct Index {
+    IndexTable *table;  // table receiving new keys
+    IndexTable *old;    // table being drained while a resize is in progress
+    size_t migrate_pos;
+    size_t used;        // live keys across both tables
+    Reclaim *reclaim;   // where drained tables are retired, NULL to free them at once
+    CacheStats *stats;  // where lookups that probe past their first group are counted, NULL for none
+} Index;
+
+void index_init(Index *index, size_t capacity, Reclaim *reclaim);
+void *index_find(const Index *index, const char *key, uint64_t hash);
+void index_prefetch(const Index *index, uint64_t hash);
+void index_insert(Index *index, const char *key, uint64_t hash, void *entry);
+void *index_remove(Index *index, const char *key, uint64_t hash);
+int index_next(const Index *index, size_t *pos, void **entry);
+void index_free(Index *index);
+size_t index_memory(const Index *index);
+
+// Fixed-capacity slab allocator (slab.c). All objects live in one
+// contiguous block sized up front; freed objects go on a free list and are
+// handed out again, so a full cache inserts and evicts without malloc/free.
+typedef struct Slab {
+    char *memory;       // contiguous block holding every object
+    void *free_list;    // freed objects, linked through their first word
+    size_t object_size;
+    size_t capacity;
+    size_t bump;        // objects handed out from memory so far
+    size_t in_use;
+    unsigned int shift; // log2(object_size) when it is a power of two, else 0
+    Reclaim *reclaim;   // where freed objects wait for readers, NULL to reuse them at once
+} Slab;
+
+void slab_init(Slab *slab, size_t object_size, size_t capacity, Reclaim *reclaim);
+void *slab_alloc(Slab *slab);
+void slab_free(Slab *slab, void *object);
+void *slab_object(const Slab *slab, size_t i);
+void slab_destroy(Slab *slab);
+size_t slab_memory(const Slab *slab);
+
+// Function to get the slot number of an object, the inverse of slab_object()
+static inline uint32_t slab_slot(const Slab *slab, const void *object) {
+    size_t offset = (size_t)((const char *)object - slab->memory);
+    return (uint32_t)(slab->shift ? offset >> slab->shift : offset / slab->object_size);
+}
+
+// Doubly linked list over the slots of a slab (slab.c). The links are
+// 32-bit slot numbers in an array of their own, apart from the entries, so
+// relinking an entry writes 8 bytes of a dense array instead of two
+// pointers in each neighbouring entry, and the entries carry no links.
+#define SLOT_NONE UINT32_MAX
+
+typedef struct SlotLink {
+    uint32_t prev;
+    uint32_t next;
+} SlotLink;
+
+typedef struct SlotList {
+    SlotLink *links;    // one per slab slot
+    size_t slots;
+    uint32_t head;      // SLOT_NONE while the list is empty
+    uint32_t tail;
+} SlotList;
+
+void slotlist_init(SlotList *list, const Slab *slab);
+void slotlist_destroy(SlotList *list);
+size_t slotlist_memory(const SlotList *list);
+
+static inline void slotlist_unlink(SlotList *list, uint32_t slot) {
+    SlotLink *link = &list->links[slot];
+    if (link->prev != SLOT_NONE) {
+        list->links[link->prev].next = link->next;
+    } else {
+        list->head = link->next;
+    }
+    if (link->next != SLOT_NONE) {
+        list->links[link->next].prev = link->prev;
+    } else {
+        list->tail = link->prev;
+    }
+}
+
+static inline void slotlist_push_head(SlotList *list, uint32_t slot) {
+    list->links[slot].prev = SLOT_NONE;
+    list->links[slot].next = list->head;
+    if (list->head != SLOT_NONE) {
+        list->links[list->head].prev = slot;
+    } else {
+        list->tail = slot;
+    }
+    list->head = slot;
+}
+
+static inline void slotlist_push_tail(SlotList *list, uint32_t slot) {
+    list->links[slot].next = SLOT_NONE;
+    list->links[slot].prev = list->tail;
+    if (list->tail != SLOT_NONE) {
+        list->links[list->tail].next = slot;
+    } else {
+        list->head = slot;
+    }
+    list->tail = slot;
+}
+
+static inline void slotlist_move_to_head(SlotList *list, uint32_t slot) {
+    if (slot != list->head) {
+        slotlist_unlink(list, slot);
+        slotlist_push_head(list, slot);
+    }
+}
+
+// Value encryption (cipher.c). A cache given a Cipher in its options
+// encrypts every value as it is written into the arena, and cipher_read()
+// decrypts a stored value into the caller's buffer; keys stay in the clear
+// because the index hashes and compares them. CIPHER_CAESAR rotates letters
+// and digits and stores a value at its own length. CIPHER_CHACHA20 XORs a
+// ChaCha20 keystream and stores a CIPHER_HEADER of nonce and length in
+// front of the value. Both have SSE2 and AVX2 kernels, chosen at init from
+// what the CPU supports, with a scalar fallback. CIPHER_NONE stores values
+// as they are, for caches that only want compression.
+//
+// cipher_set_compression() makes any mode compress values longer than a
+// threshold with compress.c before encrypting them, keeping a value as it
+// is when that does not make it smaller. Values then carry their length in
+// a CIPHER_FRAME word (inside the ChaCha20 header), its top bit telling
+// compressed ones apart; a compressed value holds its plain length and the
+// LZ block. Readers need not know: cipher_read() gives back plain values.
+// cipher_check() encrypts a fixed block under the key or shift, for stores
+// that must tell whether values were written under the same one.
+#define CIPHER_HEADER 12
+#define CIPHER_FRAME 4
+#define CIPHER_PACKED 0x80000000u
+#define CIPHER_CHECK 16
+
+// LZ block codec (compress.c): LZ4-style sequences of literals and
+// matches of at least COMPRESS_MIN_MATCH bytes up to 64 KB back, with no
+// entropy stage, so it runs at memory-copy speeds. A CompressDict is a
+// sample of typical values that matches may also point into, which is
+// what makes values of a few hundred bytes compress at all; build one from
+// known content or train it on sample values.
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_DICT_MAX (64 * 1024)
+
+typedef struct CompressDict {
+    char *data;
+    size_t len;
+    uint32_t *table;         // position + 1 of the last 4 bytes hashing to each slot
+    uint32_t id;             // hash of the contents, recorded in snapshots
+} CompressDict;
+
+size_t compress_bound(size_t len);
+size_t compress_block(const CompressDict *dict, const char *src, size_t len, char *dst);
+long decompress_block(const CompressDict *dict, const char *src, size_t len, char *dst, size_t cap);
+CompressDict *compress_dict_create(const char *data, size_t len);
+CompressDict *compress_dict_train(const char *const *samples, size_t count, size_t size);
+void compress_dict_free(CompressDict *dict);
+
+typedef enum CipherMode { CIPHER_CAESAR, CIPHER_CHACHA20, CIPHER_NONE } CipherMode;
+
+typedef struct Cipher {
+    CipherMode mode;
+    unsigned int shift;      // Caesar shift
+    uint32_t key[8];         // ChaCha20 key, as little-endian words
+    uint64_t nonce;          // next ChaCha20 nonce, taken atomically by writers
+    void (*caesar)(char *dst, const char *src, size_t len, int letters, int digits);
+    void (*chacha)(uint8_t *dst, const uint8_t *src, size_t len, const uint32_t key[8], const uint32_t nonce[3]);
+    size_t compress_above;   // values longer than this are compressed, 0 for no compression
+    const CompressDict *dict;   // shared dictionary, NULL for none; must outlive the caches
+    CacheStats *stats;       // where compression is counted and timed, NULL for nowhere
+} Cipher;
+
+void cipher_init_caesar(Cipher *cipher, unsigned int shift);
+void cipher_init_chacha20(Cipher *cipher, const uint8_t key[32]);
+void cipher_init_plain(Cipher *cipher);
+void cipher_set_compression(Cipher *cipher, size_t above, const CompressDict *dict, CacheStats *stats);
+size_t cipher_overhead(const Cipher *cipher);
+size_t cipher_pack_bound(size_t len);
+size_t cipher_pack(const Cipher *cipher, const char *value, size_t len, char *out);
+void cipher_write(Cipher *cipher, char *block, const char *value, size_t len);
+void cipher_write_packed(Cipher *cipher, char *block, const char *packed, size_t len);
+long cipher_read(const Cipher *cipher, const char *block, char *buf, size_t size);
+void cipher_check(const Cipher *cipher, uint8_t check[CIPHER_CHECK]);
+
+// Size-class segregated byte arena (arena.c). Blocks are carved out of
+// 64 KB chunks in classes spaced at 1x and 1.5x powers of two (16, 24, 32,
+// 48, ... 64 KB); freed blocks go back on their class free list. Larger
+// blocks are allocated individually.
+#define ARENA_CLASSES 25
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+// The last value the arena compressed, so the store after kv_size() does
+// not compress it a second time
+typedef struct PackedValue {
+    const char *src;
+    size_t src_len;
+    uint64_t hash;           // key_hash() of the value, in case the caller reused its buffer
+    size_t len;              // packed length, 0 if the value is stored as it is
+    char *buf;
+    size_t size;
+} PackedValue;
+
+typedef struct Arena {
+    void *free_lists[ARENA_CLASSES];
+    void *chunks;            // chunk list, linked through each chunk's first word
+    char *chunk_pos;         // next unused byte of the newest chunk
+    size_t chunk_left;
+    void *large;             // oversized blocks, doubly linked for teardown
+    size_t bytes_used;       // bytes handed out, rounded up to the class size
+    size_t bytes_reserved;   // bytes obtained from malloc
+    Reclaim *reclaim;        // where freed blocks wait for readers, NULL to reuse them at once
+    Cipher *cipher;          // values are encrypted through it when stored, NULL to keep them plain
+    PackedValue packed;
+} Arena;
+
+void arena_init(Arena *arena, Reclaim *reclaim);
+char *arena_alloc(Arena *arena, size_t size);
+void arena_free(Arena *arena, char *block, size_t size);
+size_t arena_block_size(size_t size);
+int arena_class(size_t size);
+void arena_destroy(Arena *arena);
+
+// Key/value storage embedded in every cache entry. Both strings carry their
+// length; keys shorter than KEY_INLINE bytes live inside the entry itself,
+// longer keys and all values are stored NUL-terminated in the arena. Under
+// the arena's cipher a value is stored encrypted and value_len counts the
+// bytes stored, cipher header included.
+#define KEY_INLINE 16
+
+// Link of an entry on a TimerWheel (timerwheel.c)
+typedef struct TimerNode {
+    struct TimerNode *next;
+    struct TimerNode **pprev;   // link pointing at this node, NULL while off the wheel
+    uint64_t expires;           // deadline in wheel_now() milliseconds, 0 for no TTL
+} TimerNode;
+
+typedef struct KeyValue {
+    uint64_t hash;     // key_hash() of the key, computed once on insert
+    uint32_t key_len;
+    uint32_t value_len;
+    union {
+        char inline_key[KEY_INLINE];
+        char *ptr;
+    } key;
+    char *value;
+    TimerNode timer;   // expiry, for entries added with a TTL
+} KeyValue;
+
+void kv_set(KeyValue *kv, Arena *arena, const char *key, uint64_t hash, const char *value);
+void kv_set_value(KeyValue *kv, Arena *arena, const char *value);
+void kv_drop_value(KeyValue *kv, Arena *arena);
+char *kv_key(KeyValue *kv);
+void kv_release(KeyValue *kv, Arena *arena);
+size_t kv_size(Arena *arena, const char *key, const char *value);
+size_t kv_bytes(const KeyValue *kv);
+
+// Hierarchical timing wheel (timerwheel.c) that expires entries added with
+// a TTL. WHEEL_LEVELS levels of WHEEL_SLOTS slots, each level 64 times
+// coarser than the one below, cover about 4.6 hours at millisecond
+// resolution; later deadlines wait in the top level until they come in
+// range. Policies turn their wheel before evicting anything, so expired
+// entries are reclaimed ahead of live ones.
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOTS 64
+
+typedef void (*ExpireFn)(void *owner, KeyValue *kv);
+
+typedef struct TimerWheel {
+    uint64_t now;                       // tick the wheel has turned to
+    uint64_t occupied[WHEEL_LEVELS];    // bit s set while slots[level][s] is not empty
+    TimerNode *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    size_t count;                       // entries on the wheel
+} TimerWheel;
+
+uint64_t wheel_now(void);
+void wheel_init(TimerWheel *wheel);
+void wheel_set_ttl(TimerWheel *wheel, KeyValue *kv, uint64_t ttl_ms);
+void wheel_cancel(TimerWheel *wheel, KeyValue *kv);
+void wheel_advance(TimerWheel *wheel, uint64_t now, ExpireFn expire, void *owner);
+void wheel_expire(TimerWheel *wheel, ExpireFn expire, void *owner);
+int kv_expired(const KeyValue *kv);
+
+// Runtime options accepted by every policy's cache_create()
+typedef struct CacheOptions {
+    size_t max_bytes;        // memory budget in bytes, 0 for no byte limit
+    size_t initial_entries;  // keys the index holds before its first resize, 0 to start small
+    Reclaim *reclaim;        // set by wrappers that look entries up without a lock
+    CacheStats *stats;       // shared statistics, NULL for the cache to keep its own
+    Cipher *cipher;          // encrypts stored values, NULL to keep them plain; must outlive the cache
+    const char *tier_dir;    // directory for a file tier under the cache, NULL for none
+    size_t tier_bytes;       // size of the file tier's log
+} CacheOptions;
+
+// File tier (tier.c): a second, larger level under a policy's cache on
+// local disk. Entries the policy evicts are appended to a log file, and a
+// lookup that misses memory reads the entry back with pread() and adds it
+// to the cache again, taking it out of the tier. The log is cut into
+// regions of TIER_REGION_BYTES written whole and in order, so the disk only
+// sees large sequential writes; the newest region is filled in memory, and
+// once every region is used the oldest is overwritten, dropping everything
+// in it at once. The in-memory index keeps no keys, only a 32-bit tag, the
+// record length and its position in the log, 16 bytes an entry: the key is
+// checked against the record before it is read back or dropped for an
+// update, so a key sharing the tag keeps its record. Entries whose region
+// has been overwritten are dropped when they are next probed. Each cache gets
+// its own unnamed file in tier_dir (O_TMPFILE), which disappears when it is
+// closed; like the cache itself a tier is used by one thread at a time.
+// Values are written as stored, so under a cipher they are encrypted on disk.
+#define TIER_REGION_BYTES (1 << 20)
+#define TIER_MIN_REGIONS 2
+
+typedef struct TierSlot {
+    uint32_t tag;    // high half of the key's hash
+    uint32_t len;    // bytes of the record, 0 for an empty slot
+    uint64_t pos;    // log position of the record
+} TierSlot;
+
+typedef struct FileTier {
+    int fd;
+    size_t regions;        // regions in the file
+    uint64_t head;         // log position the next record is written at
+    char *buffer;          // the region being filled, written out when full
+    TierSlot *slots;       // open addressing, linear probing
+    size_t mask;           // slots - 1
+    size_t count;          // slots in use, stale ones included
+    char *scratch;         // a record read back from the file, then its plain value
+    size_t scratch_size;
+    CacheStats *stats;
+} FileTier;
+
+FileTier *tier_open(const CacheOptions *options, CacheStats *stats);
+void tier_put(FileTier *tier, KeyValue *kv);
+const char *tier_get(FileTier *tier, const Cipher *cipher, const char *key, uint64_t hash, uint64_t *ttl_ms);
+void tier_remove(FileTier *tier, const char *key, uint64_t hash);
+size_t tier_memory(const FileTier *tier);
+void tier_close(FileTier *tier);
+
+// Function to fill in the parts every policy shares: the index, an entry
+// slab whose objects begin with their KeyValue, the arena, and the cache's
+// own statistics (NULL if they are shared). Policies then move their extra
+// structures and per-entry links into metadata.
+void memory_measure(CacheMemory *memory, const Index *index, const Slab *entries, const Arena *arena, CacheStats *stats);
+
+// Operations every policy file exports as a CachePolicy (lru_policy, ...),
+// so wrappers and tools can drive any policy without knowing its Cache
+// layout. Built with -DCACHE_LIBRARY a policy file leaves out its test
+// driver and only exports this table.
+// lookup finds an entry (every entry starts with its KeyValue) without
+// counting it as a use and without writing anything, so it may run next to
+// a writer when the cache was created with a Reclaim. touch counts the use
+// afterwards, under the writer's lock; it is NULL for policies that keep
+// no recency or frequency. victim returns the entry the next new key would
+// evict, or NULL while the cache has room; it reaps expired entries first
+// and is NULL for policies that never evict. add takes a TTL in
+// milliseconds, 0 for an entry that never expires; lookup still finds
+// expired entries that have not been reaped, so callers check kv_expired().
+// stats returns the CacheStats the instance counts into, and memory fills in
+// what the instance has allocated. prefetch starts loading the index group a
+// lookup of hash will read; like lookup it writes nothing, and batched
+// lookups issue it for every key before looking any of them up. get returns
+// the value as stored: with a cipher in the options, pass it to
+// cipher_read() to get the plain value. walk visits every resident entry,
+// reaped or not, in the order add would have to see them to rebuild the
+// policy's order (LRU and MRU least recent first, FIFO oldest first), and
+// writes nothing, so it may run under the writer's lock next to readers.
+typedef void (*VisitFn)(void *arg, KeyValue *kv);
+
+typedef struct CachePolicy {
+    const char *name;
+    void *(*create)(size_t capacity, const CacheOptions *options);
+    void (*add)(void *cache, const char *key, const char *value, uint64_t ttl_ms);
+    const char *(*get)(void *cache, const char *key);
+    void *(*lookup)(void *cache, const char *key, uint64_t hash);
+    void (*prefetch)(void *cache, uint64_t hash);
+    void (*touch)(void *cache, void *entry);
+    void *(*victim)(void *cache);
+    void (*walk)(void *cache, VisitFn visit, void *arg);
+    void (*destroy)(void *cache);
+    CacheStats *(*stats)(void *cache);
+    void (*memory)(void *cache, CacheMemory *memory);
+} CachePolicy;
+
+extern const CachePolicy hashmap_policy;
+extern const CachePolicy fifo_policy;
+extern const CachePolicy lru_policy;
+extern const CachePolicy mru_policy;
+extern const CachePolicy gdsf_policy;
+extern const CachePolicy clock_policy;
+extern const CachePolicy arc_policy;
+
+// TinyLFU admission filter (tinylfu.c). A count-min sketch of 4-bit
+// counters estimates how often each key was accessed recently, and a Bloom
+// filter (the doorkeeper) takes each key's first access so keys seen only
+// once never reach the sketch. Every sample_size accesses the counters are
+// halved and the doorkeeper is emptied.
+#define SKETCH_DEPTH 4
+
+typedef struct TinyLFU {
+    uint64_t *table;           // SKETCH_DEPTH rows of counters, sixteen per word
+    size_t table_mask;         // words - 1, a power of two
+    uint64_t *doorkeeper;      // Bloom filter bits
+    size_t doorkeeper_mask;    // bits - 1, a power of two
+    size_t additions;          // accesses recorded since the counters were last halved
+    size_t sample_size;        // accesses between two halvings
+} TinyLFU;
+
+void tinylfu_init(TinyLFU *filter, size_t capacity);
+void tinylfu_record(TinyLFU *filter, uint64_t hash);
+unsigned int tinylfu_estimate(const TinyLFU *filter, uint64_t hash);
+int tinylfu_admit(const TinyLFU *filter, uint64_t candidate, uint64_t victim);
+void tinylfu_free(TinyLFU *filter);
+
+// Any policy behind a TinyLFU filter. Hits and adds are recorded, and a
+// new key that would force an eviction is only added when the filter
+// estimates it more popular than the policy's victim.
+typedef struct AdmissionCache {
+    const CachePolicy *policy;
+    void *cache;
+    TinyLFU filter;
+    size_t rejected;   // new keys the filter turned away
+} AdmissionCache;
+
+AdmissionCache *admission_create(const CachePolicy *policy, size_t capacity, const CacheOptions *options);
+void admission_add(AdmissionCache *cache, const char *key, const char *value, uint64_t ttl_ms);
+const char *admission_get(AdmissionCache *cache, const char *key);
+void admission_destroy(AdmissionCache *cache);
+
+// Thread-safe cache split into shards (sharded.c). Each shard is an
+// independent policy instance behind its own mutex, and the key hash picks
+// the shard, so threads working on different keys rarely wait on each
+// other. Shards are aligned to a cache line so neighbouring locks never
+// share one.
+// Lookups take no lock at all: a reader holds an epoch while it searches
+// the index and copies the value, and records the hit in a per-thread
+// buffer. The buffered hits are handed to the policy in a batch, under the
+// shard lock, once the buffer fills.
+// sharded_get_many and sharded_add_many take keys SHARDED_BATCH at a time.
+#define RECENCY_BUFFER_SIZE 16
+#define SHARDED_BATCH 64
+
+typedef struct RecencyBuffer {
+    unsigned int count;
+    void *entries[RECENCY_BUFFER_SIZE];
+    uint64_t hashes[RECENCY_BUFFER_SIZE];   // to tell whether an entry still holds the same key
+} RecencyBuffer;
+
+// Read-through loading (sharded_get_or_load). load fetches a key the cache
+// does not hold from the backing store and returns its value in memory
+// from malloc, which the cache takes over, or NULL if there is none.
+// Concurrent misses on one key share a single call to load: the first
+// caller makes it and the others wait on the shard for its result. With
+// stale_ms, loaded values are kept stale_ms past ttl_ms, and a lookup in
+// that window returns the old value at once and reloads it on a
+// background thread, one reload per key at a time.
+typedef struct CacheLoader {
+    char *(*load)(void *arg, const char *key);
+    void *arg;           // passed to load; must outlive the cache
+    uint64_t ttl_ms;     // TTL of loaded values, 0 for none
+    uint64_t stale_ms;   // how long a value is served past ttl_ms while it reloads, 0 to always wait
+} CacheLoader;
+
+// A load in progress, found by key while it runs and freed by the last caller to read its result
+typedef struct Flight {
+    struct Flight *next;
+    uint64_t hash;
+    char *key;           // owned copy of the key being loaded
+    char *value;         // what load returned, once done
+    int done;
+    int refs;            // the loading thread and every caller waiting for the result
+} Flight;
+
+typedef struct CacheShard {
+    pthread_mutex_t lock;   // serialises writers and recency updates
+    void *cache;
+    Reclaim reclaim;        // memory the shard released while lookups may still read it
+    Flight *flights;        // loads in progress for keys of this shard
+    pthread_cond_t landed;  // broadcast under the lock whenever a load finishes
+    int refreshing;         // background reloads still running
+} __attribute__((aligned(CACHE_LINE_SIZE))) CacheShard;
+
+typedef struct ShardedCache {
+    const CachePolicy *policy;
+    CacheShard *shards;
+    size_t shard_mask;          // shard count - 1, always a power of two
+    EpochDomain *domain;        // epochs of the threads currently looking something up
+    pthread_key_t reader_key;   // each thread's reader slot and recency buffers
+    CacheStats *stats;          // shared by every shard, so one snapshot covers the whole cache
+    int own_stats;
+    Cipher *cipher;             // the shards' value cipher, for copying values out
+} ShardedCache;
+
+ShardedCache *sharded_create(const CachePolicy *policy, size_t shards, size_t capacity, const CacheOptions *options);
+void sharded_add(ShardedCache *cache, const char *key, const char *value, uint64_t ttl_ms);
+long sharded_get(ShardedCache *cache, const char *key, char *buf, size_t size);
+size_t sharded_get_many(ShardedCache *cache, const char *const *keys, size_t n, char *const *bufs, size_t size, long *lens);
+void sharded_add_many(ShardedCache *cache, const char *const *keys, const char *const *values, size_t n, uint64_t ttl_ms);
+long sharded_get_or_load(ShardedCache *cache, const char *key, const CacheLoader *loader, char *buf, size_t size);
+void sharded_destroy(ShardedCache *cache);
+CacheStats *sharded_stats(ShardedCache *cache);
+void sharded_memory(ShardedCache *cache, CacheMemory *memory);
+
+// Shared-memory LRU cache (shmcache.c) for worker processes on one host.
+// The whole cache lives in one mapped region, a memfd inherited across
+// fork() or a named POSIX shared memory object, so every worker sees the
+// same single copy. Nothing in the region is a pointer: entries are slot
+// numbers, chained into hash buckets and ordered on a SlotList whose links
+// sit in the region, and keys and values are kept in arena size classes
+// addressed by offset. One robust process-shared mutex serialises every
+// operation; if a worker dies holding it the region is emptied, since its
+// change may be half made. Values larger than the largest arena class are
+// not cached, and TTLs use wheel_now(), which every process on the host
+// reads from the same clock.
+#define SHM_CACHE_MAGIC "CACHESHM"
+
+typedef struct ShmEntry {
+    uint64_t hash;
+    uint64_t expires;     // wheel_now() deadline, 0 for no TTL
+    uint64_t block;       // region offset of the NUL-terminated key followed by the value
+    uint32_t key_len;
+    uint32_t value_len;
+    uint32_t chain;       // next slot in the same bucket, SLOT_NONE at the end
+    uint32_t block_size;  // bytes of the block, an arena class size
+} ShmEntry;
+
+typedef struct ShmHeader {
+    char magic[8];
+    int ready;                            // set once the creator has laid the region out
+    pthread_mutex_t lock;                 // process-shared and robust
+    uint64_t size;                        // bytes of the whole region
+    uint64_t capacity;                    // entry slots
+    uint64_t bucket_mask;                 // buckets - 1, a power of two
+    uint64_t buckets, entries, links;     // region offsets of the arrays
+    uint64_t data, data_end;              // region offsets bounding the key/value area
+    uint64_t data_pos;                    // next unused byte of the key/value area
+    uint64_t free_lists[ARENA_CLASSES];   // freed blocks per class, linked by offset, 0 if none
+    uint32_t head, tail;                  // LRU order, most recent at the head
+    uint32_t free_slot;                   // unused slots, linked through their links' next
+    uint64_t used;                        // entries cached
+    uint64_t data_used;                   // bytes of blocks handed out
+    uint64_t hits, misses, inserts, evictions, expirations, rejected;
+} ShmHeader;
+
+typedef struct ShmCache {
+    ShmHeader *header;    // the mapped region, at a different address in every process
+    int fd;
+} ShmCache;
+
+ShmCache *shm_cache_open(const char *name, size_t capacity, size_t data_bytes);
+void shm_cache_add(ShmCache *cache, const char *key, const char *value, uint64_t ttl_ms);
+long shm_cache_get(ShmCache *cache, const char *key, char *buf, size_t size);
+void shm_cache_memory(ShmCache *cache, CacheMemory *memory);
+void shm_cache_close(ShmCache *cache);
+int shm_cache_unlink(const char *name);
+
+// Snapshots (snapshot.c): a cache's entries written to a binary file in
+// walk order, to warm a cache up again after a restart. The file has a
+// header, a table of sections and then the sections themselves, one per
+// shard. Each record holds the key, the value as stored (still encrypted
+// under the cache's cipher) and the wall-clock deadline of its TTL.
+// Restoring maps the file and adds the records back in order, so LRU, MRU
+// and FIFO caches come back in the order they were saved in; expired
+// records are skipped. A sharded cache is saved one shard at a time, so a
+// shard is locked only while its own entries are copied, and restored with
+// a thread per section. The header keeps a cipher_check() of the cipher, so
+// a snapshot is only restored under the key or shift it was saved with.
+#define SNAPSHOT_MAGIC "CACHESNP"
+#define SNAPSHOT_VERSION 2
+
+typedef struct SnapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t cipher;        // 0 for plain values, else the CipherMode + 1 they were stored under,
+                            // plus 0x100 if compressed and the dictionary id's low 16 bits << 16
+    uint64_t sections;
+    uint8_t check[CIPHER_CHECK];   // cipher_check() of the cipher the values were stored under
+} SnapshotHeader;
+
+typedef struct SnapshotSection {
+    uint64_t offset;        // from the start of the file
+    uint64_t size;          // bytes of records
+    uint64_t count;         // records
+} SnapshotSection;
+
+// Followed by the key and the stored value, each NUL-terminated
+typedef struct SnapshotRecord {
+    uint32_t key_len;
+    uint32_t value_len;     // stored bytes, cipher header included
+    uint64_t deadline;      // CLOCK_REALTIME milliseconds the entry expires at, 0 for no TTL
+} SnapshotRecord;
+
+int cache_snapshot(const CachePolicy *policy, void *cache, const Cipher *cipher, const char *path);
+long cache_restore(const CachePolicy *policy, void *cache, const Cipher *cipher, const char *path);
+int sharded_snapshot(ShardedCache *cache, const char *path);
+long sharded_restore(ShardedCache *cache, const char *path);
+
+// Trace reader (trace.c) shared by the replay and analysis tools. The file
+// is mapped into memory and parsed in place, one line at a time. A trace
+// has one operation per line: "get <key>", "set <key> [value bytes] [ttl ms]"
+// or a bare key, or a JSON object with "key", "op", "size" and "ttl"
+// members of which only "key" is needed. A JSON line without "key" is keyed
+// by its first string member, so any JSON-lines log reads as a key trace.
+#define TRACE_VALUE_SIZE 64   // value bytes of an operation that gives none
+
+typedef struct TraceRecord {
+    const char *key;     // NUL-terminated, valid until the next trace_next call
+    size_t key_len;
+    uint32_t value_len;
+    uint32_t ttl_ms;
+    int is_set;          // set/put; anything else is a lookup
+} TraceRecord;
+
+typedef struct TraceReader {
+    const char *data;    // the whole trace file, mapped read-only
+    size_t size;
+    size_t pos;          // start of the next line
+    char *scratch;       // NUL-terminated copy of the current key
+    size_t scratch_size;
+} TraceReader;
+
+int trace_open(TraceReader *reader, const char *path);
+int trace_next(TraceReader *reader, TraceRecord *record);
+void trace_close(TraceReader *reader);
 
+#endif
@@ -0,0 +1,502 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CIPHER_AVX2
+#endif
+#include "cache.h"
+
+// Value encryption applied as entries are written into the arena.
+// The Caesar mode rotates letters within their case and digits among
+// digits and leaves every other byte alone, so it is lossless, never makes
+// a NUL, and a value keeps its length. The ChaCha20 mode (RFC 7539) XORs a
+// keystream drawn from a fresh nonce per write; a stored value starts with
+// that nonce and its length, so a lock-free reader decrypts exactly the
+// block it loaded. Each mode has a scalar, an SSE2 and an AVX2 kernel, and
+// the init functions pick the widest one the CPU runs.
+// With compression on, a value is compressed before it is encrypted, and
+// the whole frame (plain length and LZ block) is what gets encrypted.
+
+#define CHACHA_BLOCK 64
+#define UNPACK_STACK 4096    // compressed values up to this size are decrypted on the stack
+
+static uint32_t load32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+// Rotates c within [first, first + count) by shift, which is below count
+static unsigned char rotate_class(unsigned char c, unsigned char first, unsigned char count, unsigned char shift) {
+    unsigned int o = (unsigned int)(c - first) + shift;
+    return (unsigned char)(first + (o >= count ? o - count : o));
+}
+
+static void caesar_scalar(char *dst, const char *src, size_t len, int letters, int digits) {
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)src[i];
+        if ((unsigned char)(c - 'a') < 26)
+            c = rotate_class(c, 'a', 26, (unsigned char)letters);
+        else if ((unsigned char)(c - 'A') < 26)
+            c = rotate_class(c, 'A', 26, (unsigned char)letters);
+        else if ((unsigned char)(c - '0') < 10)
+            c = rotate_class(c, '0', 10, (unsigned char)digits);
+        dst[i] = (char)c;
+    }
+}
+
+#ifdef __SSE2__
+// Rotates the bytes of x that fall in [first, first + count). Bytes of 0x80
+// and up compare as negative and are never in a class; the offsets stay
+// below 2 * count, so the signed compares do not overflow.
+static __m128i rotate_class_sse2(__m128i x, char first, char count, char shift) {
+    __m128i in = _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8((char)(first - 1))),
+                               _mm_cmplt_epi8(x, _mm_set1_epi8((char)(first + count))));
+    __m128i o = _mm_add_epi8(_mm_sub_epi8(x, _mm_set1_epi8(first)), _mm_set1_epi8(shift));
+    o = _mm_sub_epi8(o, _mm_and_si128(_mm_cmpgt_epi8(o, _mm_set1_epi8((char)(count - 1))), _mm_set1_epi8(count)));
+    o = _mm_add_epi8(o, _mm_set1_epi8(first));
+    return _mm_or_si128(_mm_and_si128(in, o), _mm_andnot_si128(in, x));
+}
+
+static void caesar_sse2(char *dst, const char *src, size_t len, int letters, int digits) {
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(src + i));
+        x = rotate_class_sse2(x, 'a', 26, (char)letters);
+        x = rotate_class_sse2(x, 'A', 26, (char)letters);
+        x = rotate_class_sse2(x, '0', 10, (char)digits);
+        _mm_storeu_si128((__m128i *)(dst + i), x);
+    }
+    caesar_scalar(dst + i, src + i, len - i, letters, digits);
+}
+#endif
+
+#ifdef CIPHER_AVX2
+__attribute__((target("avx2")))
+static __m256i rotate_class_avx2(__m256i x, char first, char count, char shift) {
+    __m256i in = _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8((char)(first - 1))),
+                                  _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(first + count)), x));
+    __m256i o = _mm256_add_epi8(_mm256_sub_epi8(x, _mm256_set1_epi8(first)), _mm256_set1_epi8(shift));
+    o = _mm256_sub_epi8(o, _mm256_and_si256(_mm256_cmpgt_epi8(o, _mm256_set1_epi8((char)(count - 1))), _mm256_set1_epi8(count)));
+    o = _mm256_add_epi8(o, _mm256_set1_epi8(first));
+    return _mm256_blendv_epi8(x, o, in);
+}
+
+__attribute__((target("avx2")))
+static void caesar_avx2(char *dst, const char *src, size_t len, int letters, int digits) {
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(src + i));
+        x = rotate_class_avx2(x, 'a', 26, (char)letters);
+        x = rotate_class_avx2(x, 'A', 26, (char)letters);
+        x = rotate_class_avx2(x, '0', 10, (char)digits);
+        _mm256_storeu_si256((__m256i *)(dst + i), x);
+    }
+    caesar_scalar(dst + i, src + i, len - i, letters, digits);
+}
+#endif
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER(a, b, c, d)                         \
+    do {                                            \
+        a += b; d ^= a; d = ROTL32(d, 16);          \
+        c += d; b ^= c; b = ROTL32(b, 12);          \
+        a += b; d ^= a; d = ROTL32(d, 8);           \
+        c += d; b ^= c; b = ROTL32(b, 7);           \
+    } while (0)
+
+// Fills state with the ChaCha20 input block: constants, key, counter, nonce
+static void chacha_state(uint32_t state[16], const uint32_t key[8], const uint32_t nonce[3], uint32_t counter) {
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    memcpy(state + 4, key, 8 * sizeof(uint32_t));
+    state[12] = counter;
+    state[13] = nonce[0];
+    state[14] = nonce[1];
+    state[15] = nonce[2];
+}
+
+static void chacha_scalar(uint8_t *dst, const uint8_t *src, size_t len, const uint32_t key[8], const uint32_t nonce[3]) {
+    uint32_t state[16], x[16];
+    chacha_state(state, key, nonce, 0);
+    for (size_t pos = 0; pos < len; pos += CHACHA_BLOCK) {
+        memcpy(x, state, sizeof(x));
+        for (int round = 0; round < 10; round++) {
+            QUARTER(x[0], x[4], x[8], x[12]);
+            QUARTER(x[1], x[5], x[9], x[13]);
+            QUARTER(x[2], x[6], x[10], x[14]);
+            QUARTER(x[3], x[7], x[11], x[15]);
+            QUARTER(x[0], x[5], x[10], x[15]);
+            QUARTER(x[1], x[6], x[11], x[12]);
+            QUARTER(x[2], x[7], x[8], x[13]);
+            QUARTER(x[3], x[4], x[9], x[14]);
+        }
+        size_t n = len - pos < CHACHA_BLOCK ? len - pos : CHACHA_BLOCK;
+        for (size_t i = 0; i < n; i++) {
+            uint32_t word = x[i / 4] + state[i / 4];
+            dst[pos + i] = src[pos + i] ^ (uint8_t)(word >> (8 * (i % 4)));
+        }
+        state[12]++;
+    }
+}
+
+// XORs the keystream bytes in ks into the last n < 64 bytes of the message
+static void xor_tail(uint8_t *dst, const uint8_t *src, const uint8_t *ks, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = src[i] ^ ks[i];
+    }
+}
+
+#ifdef __SSE2__
+#define ROTL128(v, n) _mm_or_si128(_mm_slli_epi32(v, n), _mm_srli_epi32(v, 32 - (n)))
+
+// One ChaCha20 block with each row of the state in a register: a column
+// round works on all four columns at once, and rotating rows b, c and d
+// lines the diagonals up for the diagonal round
+static void chacha_sse2(uint8_t *dst, const uint8_t *src, size_t len, const uint32_t key[8], const uint32_t nonce[3]) {
+    uint32_t state[16];
+    chacha_state(state, key, nonce, 0);
+    __m128i s0 = _mm_loadu_si128((const __m128i *)state);
+    __m128i s1 = _mm_loadu_si128((const __m128i *)(state + 4));
+    __m128i s2 = _mm_loadu_si128((const __m128i *)(state + 8));
+    __m128i s3 = _mm_loadu_si128((const __m128i *)(state + 12));
+    for (size_t pos = 0; pos < len; pos += CHACHA_BLOCK) {
+        __m128i a = s0, b = s1, c = s2, d = s3;
+        for (int round = 0; round < 10; round++) {
+            a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = ROTL128(d, 16);
+            c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = ROTL128(b, 12);
+            a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = ROTL128(d, 8);
+            c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = ROTL128(b, 7);
+            b = _mm_shuffle_epi32(b, 0x39);
+            c = _mm_shuffle_epi32(c, 0x4E);
+            d = _mm_shuffle_epi32(d, 0x93);
+            a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = ROTL128(d, 16);
+            c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = ROTL128(b, 12);
+            a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a); d = ROTL128(d, 8);
+            c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c); b = ROTL128(b, 7);
+            b = _mm_shuffle_epi32(b, 0x93);
+            c = _mm_shuffle_epi32(c, 0x4E);
+            d = _mm_shuffle_epi32(d, 0x39);
+        }
+        __m128i ks[4] = {_mm_add_epi32(a, s0), _mm_add_epi32(b, s1), _mm_add_epi32(c, s2), _mm_add_epi32(d, s3)};
+        if (len - pos >= CHACHA_BLOCK) {
+            for (int i = 0; i < 4; i++) {
+                __m128i m = _mm_loadu_si128((const __m128i *)(src + pos + 16 * i));
+                _mm_storeu_si128((__m128i *)(dst + pos + 16 * i), _mm_xor_si128(m, ks[i]));
+            }
+        } else {
+            xor_tail(dst + pos, src + pos, (const uint8_t *)ks, len - pos);
+        }
+        s3 = _mm_add_epi32(s3, _mm_set_epi32(0, 0, 0, 1));
+    }
+}
+#endif
+
+#ifdef CIPHER_AVX2
+#define ROTL256(v, n) _mm256_or_si256(_mm256_slli_epi32(v, n), _mm256_srli_epi32(v, 32 - (n)))
+
+// Two ChaCha20 blocks at a time, block n in the low 128-bit lane of every
+// row and block n + 1 in the high lane; the message is XORed 32 bytes at once
+__attribute__((target("avx2")))
+static void chacha_avx2(uint8_t *dst, const uint8_t *src, size_t len, const uint32_t key[8], const uint32_t nonce[3]) {
+    uint32_t state[16];
+    chacha_state(state, key, nonce, 0);
+    __m256i s0 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)state));
+    __m256i s1 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(state + 4)));
+    __m256i s2 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(state + 8)));
+    __m256i s3 = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)(state + 12)));
+    s3 = _mm256_add_epi32(s3, _mm256_set_epi32(0, 0, 0, 1, 0, 0, 0, 0));
+    for (size_t pos = 0; pos < len; pos += 2 * CHACHA_BLOCK) {
+        __m256i a = s0, b = s1, c = s2, d = s3;
+        for (int round = 0; round < 10; round++) {
+            a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = ROTL256(d, 16);
+            c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = ROTL256(b, 12);
+            a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = ROTL256(d, 8);
+            c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = ROTL256(b, 7);
+            b = _mm256_shuffle_epi32(b, 0x39);
+            c = _mm256_shuffle_epi32(c, 0x4E);
+            d = _mm256_shuffle_epi32(d, 0x93);
+            a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = ROTL256(d, 16);
+            c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = ROTL256(b, 12);
+            a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a); d = ROTL256(d, 8);
+            c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c); b = ROTL256(b, 7);
+            b = _mm256_shuffle_epi32(b, 0x93);
+            c = _mm256_shuffle_epi32(c, 0x4E);
+            d = _mm256_shuffle_epi32(d, 0x39);
+        }
+        a = _mm256_add_epi32(a, s0);
+        b = _mm256_add_epi32(b, s1);
+        c = _mm256_add_epi32(c, s2);
+        d = _mm256_add_epi32(d, s3);
+        // Both blocks of keystream in message order
+        __m256i ks[4] = {_mm256_permute2x128_si256(a, b, 0x20), _mm256_permute2x128_si256(c, d, 0x20),
+                         _mm256_permute2x128_si256(a, b, 0x31), _mm256_permute2x128_si256(c, d, 0x31)};
+        size_t n = len - pos < 2 * CHACHA_BLOCK ? len - pos : 2 * CHACHA_BLOCK;
+        size_t i = 0;
+        for (; i + 32 <= n; i += 32) {
+            __m256i m = _mm256_loadu_si256((const __m256i *)(src + pos + i));
+            _mm256_storeu_si256((__m256i *)(dst + pos + i), _mm256_xor_si256(m, ks[i / 32]));
+        }
+        if (i < n) {
+            xor_tail(dst + pos + i, src + pos + i, (const uint8_t *)ks + i, n - i);
+        }
+        s3 = _mm256_add_epi32(s3, _mm256_set_epi32(0, 0, 0, 2, 0, 0, 0, 2));
+    }
+}
+#endif
+
+static void cipher_pick(Cipher *cipher) {
+    cipher->caesar = caesar_scalar;
+    cipher->chacha = chacha_scalar;
+#ifdef __SSE2__
+    cipher->caesar = caesar_sse2;
+    cipher->chacha = chacha_sse2;
+#endif
+#ifdef CIPHER_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        cipher->caesar = caesar_avx2;
+        cipher->chacha = chacha_avx2;
+    }
+#endif
+}
+
+// Function to set up a Caesar cipher that moves letters and digits shift places forward
+void cipher_init_caesar(Cipher *cipher, unsigned int shift) {
+    memset(cipher, 0, sizeof(*cipher));
+    cipher->mode = CIPHER_CAESAR;
+    cipher->shift = shift;
+    cipher_pick(cipher);
+}
+
+// Function to set up a ChaCha20 cipher under a 256-bit key. Nonces count up
+// from a value taken from the clock, so restarting with the same key does
+// not repeat the nonces of the previous run.
+void cipher_init_chacha20(Cipher *cipher, const uint8_t key[32]) {
+    memset(cipher, 0, sizeof(*cipher));
+    cipher->mode = CIPHER_CHACHA20;
+    for (int i = 0; i < 8; i++) {
+        cipher->key[i] = load32(key + 4 * i);
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    cipher->nonce = (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+    cipher_pick(cipher);
+}
+
+// Function to set up a cipher that leaves values as they are, to be given compression
+void cipher_init_plain(Cipher *cipher) {
+    memset(cipher, 0, sizeof(*cipher));
+    cipher->mode = CIPHER_NONE;
+    cipher_pick(cipher);
+}
+
+// Function to have the cipher compress values longer than above bytes
+// (0 turns compression off), with dict as the shared dictionary if not
+// NULL, and count the work in stats if not NULL. Values stored before the
+// call cannot be read after it, so set it up before the cache takes any.
+void cipher_set_compression(Cipher *cipher, size_t above, const CompressDict *dict, CacheStats *stats) {
+    cipher->compress_above = above;
+    cipher->dict = dict;
+    cipher->stats = stats;
+}
+
+static uint64_t elapsed_ns(const struct timespec *start) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)(ts.tv_sec - start->tv_sec) * 1000000000u + (uint64_t)ts.tv_nsec - (uint64_t)start->tv_nsec;
+}
+
+// Values written with a length word: every ChaCha20 value, and all of them once compression is on
+static int framed(const Cipher *cipher) {
+    return cipher && (cipher->mode == CIPHER_CHACHA20 || cipher->compress_above != 0);
+}
+
+// Function to get the bytes a cipher stores in front of every value
+size_t cipher_overhead(const Cipher *cipher) {
+    if (cipher && cipher->mode == CIPHER_CHACHA20) {
+        return CIPHER_HEADER;
+    }
+    return framed(cipher) ? CIPHER_FRAME : 0;
+}
+
+// Function to get the bytes cipher_pack may write for a value of len bytes
+size_t cipher_pack_bound(size_t len) {
+    return sizeof(uint32_t) + compress_bound(len);
+}
+
+// Function to compress len bytes of value into out, which holds
+// cipher_pack_bound(len) bytes, for cipher_write_packed. Returns the packed
+// length, or 0 if the value is at most the threshold or does not shrink
+// and should go to cipher_write as it is.
+size_t cipher_pack(const Cipher *cipher, const char *value, size_t len, char *out) {
+    if (cipher == NULL || cipher->compress_above == 0 || len <= cipher->compress_above || len >= CIPHER_PACKED) {
+        return 0;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint32_t raw_len = (uint32_t)len;
+    memcpy(out, &raw_len, sizeof(raw_len));
+    size_t packed = sizeof(raw_len) + compress_block(cipher->dict, value, len, out + sizeof(raw_len));
+    if (packed >= len) {
+        packed = 0;
+    }
+    if (cipher->stats) {
+        stats_count(cipher->stats, STAT_COMPRESS_NS, elapsed_ns(&start));
+        stats_count(cipher->stats, STAT_COMPRESS_IN, len);
+        stats_count(cipher->stats, STAT_COMPRESS_OUT, packed ? packed : len);
+        stats_count(cipher->stats, STAT_COMPRESSED, packed ? 1 : 0);
+    }
+    return packed;
+}
+
+// Encrypts len bytes of payload into block behind the mode's header; flags
+// go into the length word of framed values
+static void seal(Cipher *cipher, char *block, const char *payload, size_t len, uint32_t flags) {
+    uint32_t word = (uint32_t)len | flags;
+    if (cipher->mode == CIPHER_CHACHA20) {
+        uint64_t n = __atomic_fetch_add(&cipher->nonce, 1, __ATOMIC_RELAXED);
+        uint32_t nonce[3] = {0, (uint32_t)n, (uint32_t)(n >> 32)};
+        memcpy(block, &n, sizeof(n));
+        memcpy(block + sizeof(n), &word, sizeof(word));
+        cipher->chacha((uint8_t *)block + CIPHER_HEADER, (const uint8_t *)payload, len, cipher->key, nonce);
+        len += CIPHER_HEADER;
+    } else {
+        size_t at = cipher_overhead(cipher);
+        memmove(block + at, payload, len);
+        if (cipher->mode == CIPHER_CAESAR) {
+            cipher->caesar(block + at, block + at, len, (int)(cipher->shift % 26), (int)(cipher->shift % 10));
+        }
+        if (at) {
+            memcpy(block, &word, sizeof(word));
+        }
+        len += at;
+    }
+    block[len] = '\0';
+}
+
+// Function to encrypt len bytes of value into block, which holds
+// cipher_overhead() + len + 1 bytes; block may be value itself unless the
+// cipher compresses or is ChaCha20
+void cipher_write(Cipher *cipher, char *block, const char *value, size_t len) {
+    seal(cipher, block, value, len, 0);
+}
+
+// Function to encrypt a value cipher_pack compressed to len bytes into
+// block, which holds cipher_overhead() + len + 1 bytes
+void cipher_write_packed(Cipher *cipher, char *block, const char *packed, size_t len) {
+    seal(cipher, block, packed, len, CIPHER_PACKED);
+}
+
+// Decrypts the first len bytes of a payload; n is the ChaCha20 nonce
+static void unseal(const Cipher *cipher, char *dst, const char *src, size_t len, uint64_t n) {
+    if (cipher->mode == CIPHER_CHACHA20) {
+        uint32_t nonce[3] = {0, (uint32_t)n, (uint32_t)(n >> 32)};
+        cipher->chacha((uint8_t *)dst, (const uint8_t *)src, len, cipher->key, nonce);
+    } else if (cipher->mode == CIPHER_CAESAR) {
+        // Moving every class back by its shift is the same as moving it forward by the rest
+        cipher->caesar(dst, src, len, (int)((26 - cipher->shift % 26) % 26), (int)((10 - cipher->shift % 10) % 10));
+    } else {
+        memmove(dst, src, len);
+    }
+}
+
+// Reads a compressed payload of len bytes, as cipher_read does
+static long unpack(const Cipher *cipher, const char *payload, size_t len, uint64_t n, char *buf, size_t size) {
+    uint32_t raw_len;
+    if (len < sizeof(raw_len)) {
+        return -1;
+    }
+    unseal(cipher, (char *)&raw_len, payload, sizeof(raw_len), n);
+    if (size == 0) {
+        return (long)raw_len;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    char stack[UNPACK_STACK];
+    char *plain = (char *)payload;
+    if (cipher->mode != CIPHER_NONE) {
+        plain = len <= sizeof(stack) ? stack : (char *)malloc(len);
+        if (plain == NULL) {
+            perror("Failed to allocate memory for decompression");
+            exit(EXIT_FAILURE);
+        }
+        unseal(cipher, plain, payload, len, n);
+    }
+    size_t want = raw_len < size ? raw_len : size - 1;
+    long got = decompress_block(cipher->dict, plain + sizeof(raw_len), len - sizeof(raw_len), buf, want);
+    if (plain != payload && plain != stack) {
+        free(plain);
+    }
+    if (got != (long)want) {
+        buf[0] = '\0';
+        return -1;
+    }
+    buf[want] = '\0';
+    if (cipher->stats) {
+        stats_count(cipher->stats, STAT_DECOMPRESS_NS, elapsed_ns(&start));
+        stats_count(cipher->stats, STAT_DECOMPRESSED, 1);
+    }
+    return (long)raw_len;
+}
+
+// Function to decrypt a value stored by cipher_write or cipher_write_packed
+// into buf, NUL-terminated and cut to size - 1 bytes, returning its full
+// length, or -1 if a compressed value does not decompress. With size 0
+// only the length is found. With a NULL cipher block is a plain string
+// and is copied as it is. Unless the cipher is ChaCha20 or compresses,
+// buf may be block itself.
+long cipher_read(const Cipher *cipher, const char *block, char *buf, size_t size) {
+    size_t len;
+    if (framed(cipher)) {
+        uint64_t n = 0;
+        uint32_t word;
+        if (cipher->mode == CIPHER_CHACHA20) {
+            memcpy(&n, block, sizeof(n));
+            memcpy(&word, block + sizeof(n), sizeof(word));
+        } else {
+            memcpy(&word, block, sizeof(word));
+        }
+        block += cipher_overhead(cipher);
+        len = word & ~CIPHER_PACKED;
+        if (word & CIPHER_PACKED) {
+            return unpack(cipher, block, len, n, buf, size);
+        }
+        if (size > 0) {
+            size_t copy = len < size ? len : size - 1;
+            unseal(cipher, buf, block, copy, n);
+            buf[copy] = '\0';
+        }
+        return (long)len;
+    }
+    len = strlen(block);
+    if (size > 0) {
+        size_t copy = len < size ? len : size - 1;
+        if (cipher) {
+            unseal(cipher, buf, block, copy, 0);
+        } else {
+            memmove(buf, block, copy);
+        }
+        buf[copy] = '\0';
+    }
+    return (long)len;
+}
+
+// Function to fill check with a fixed block encrypted under the cipher's
+// key or shift, all zeros for a NULL or CIPHER_NONE cipher. ChaCha20 takes
+// a nonce whose first word is 1, which no value is ever written under, so
+// the check gives away no keystream a stored value uses.
+void cipher_check(const Cipher *cipher, uint8_t check[CIPHER_CHECK]) {
+    static const char block[CIPHER_CHECK + 1] = "abcdefgh01234567";
+    memset(check, 0, CIPHER_CHECK);
+    if (cipher && cipher->mode == CIPHER_CHACHA20) {
+        uint32_t nonce[3] = {1, 0, 0};
+        cipher->chacha(check, (const uint8_t *)block, CIPHER_CHECK, cipher->key, nonce);
+    } else if (cipher && cipher->mode == CIPHER_CAESAR) {
+        cipher->caesar((char *)check, block, CIPHER_CHECK, (int)(cipher->shift % 26), (int)(cipher->shift % 10));
+    }
+}
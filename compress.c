@@ -0,0 +1,366 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+// LZ77 block codec for large values, in the spirit of LZ4: no entropy
+// coding, so it compresses at hundreds of MB/s and decompresses faster.
+// A block is a run of sequences, each a token byte (literal count in the
+// high nibble, match length - COMPRESS_MIN_MATCH in the low one, 15 in
+// either meaning more length bytes follow, each added until one is below
+// 255), the literals, then a 2-byte little-endian match offset and any
+// match length bytes. The last sequence has literals only; the decoder
+// knows it from the end of the input. Matches may reach back into a
+// dictionary as if its bytes came just before the value.
+
+#define HASH_BITS_MIN 8
+#define HASH_BITS_MAX 12
+#define DICT_HASH_BITS 14
+#define MAX_OFFSET 65535
+#define SKIP_SHIFT 5         // after 32 failed probes in a row, step two bytes at a time, and so on
+
+// Segment length and d-gram length of dictionary training
+#define TRAIN_SEGMENT 64
+#define TRAIN_GRAM 8
+#define TRAIN_HASH_BITS 18
+
+static uint32_t load32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t load64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// Length of the common prefix of a and b, reading no further than b_end
+static size_t common(const uint8_t *a, const uint8_t *b, const uint8_t *b_end) {
+    const uint8_t *start = b;
+    while (b + 8 <= b_end) {
+        uint64_t diff = load64(a) ^ load64(b);
+        if (diff) {
+            return (size_t)(b - start) + (size_t)__builtin_ctzll(diff) / 8;
+        }
+        a += 8;
+        b += 8;
+    }
+    while (b < b_end && *a == *b) {
+        a++;
+        b++;
+    }
+    return (size_t)(b - start);
+}
+
+static uint32_t hash4(uint32_t v, int bits) {
+    return (v * 2654435761u) >> (32 - bits);
+}
+
+static uint8_t *put_length(uint8_t *op, size_t n) {
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = (uint8_t)n;
+    return op;
+}
+
+// Writes one sequence: literals [lit, lit + lit_len) and, if match_len is not 0, a match
+static uint8_t *put_sequence(uint8_t *op, const uint8_t *lit, size_t lit_len, size_t offset, size_t match_len) {
+    uint8_t *token = op++;
+    size_t m = match_len ? match_len - COMPRESS_MIN_MATCH : 0;
+    *token = (uint8_t)((lit_len < 15 ? lit_len : 15) << 4 | (m < 15 ? m : 15));
+    if (lit_len >= 15) {
+        op = put_length(op, lit_len - 15);
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len) {
+        *op++ = (uint8_t)offset;
+        *op++ = (uint8_t)(offset >> 8);
+        if (m >= 15) {
+            op = put_length(op, m - 15);
+        }
+    }
+    return op;
+}
+
+// Function to get the most bytes compress_block can write for len bytes of input
+size_t compress_bound(size_t len) {
+    return len + len / 255 + 16;
+}
+
+// Function to compress len bytes of src into dst, which holds
+// compress_bound(len) bytes, and return the bytes written. dict, if not
+// NULL, is the dictionary decompress_block must be given too.
+size_t compress_block(const CompressDict *dict, const char *src, size_t len, char *dst) {
+    const uint8_t *in = (const uint8_t *)src;
+    uint8_t *op = (uint8_t *)dst;
+    int bits = HASH_BITS_MIN;
+    while (bits < HASH_BITS_MAX && ((size_t)1 << bits) < len) {
+        bits++;
+    }
+    uint32_t table[1 << HASH_BITS_MAX];   // position + 1 of the last 4 bytes hashing to each slot
+    memset(table, 0, sizeof(uint32_t) << bits);
+    const uint8_t *dict_data = dict ? (const uint8_t *)dict->data : NULL;
+    size_t dict_len = dict ? dict->len : 0;
+
+    size_t anchor = 0, i = 0, misses = 0;
+    while (i + COMPRESS_MIN_MATCH <= len) {
+        uint32_t seq = load32(in + i);
+        uint32_t h = hash4(seq, bits);
+        size_t cand = table[h];
+        table[h] = (uint32_t)(i + 1);
+        size_t offset = 0;
+        if (cand && i - (cand - 1) <= MAX_OFFSET && load32(in + cand - 1) == seq) {
+            offset = i - (cand - 1);
+        } else if (dict && i + dict_len <= MAX_OFFSET + dict_len) {
+            size_t dc = dict->table[hash4(seq, DICT_HASH_BITS)];
+            if (dc && i + dict_len - (dc - 1) <= MAX_OFFSET && load32(dict_data + dc - 1) == seq) {
+                offset = i + dict_len - (dc - 1);
+            }
+        }
+        if (offset == 0) {
+            i += 1 + (misses++ >> SKIP_SHIFT);
+            continue;
+        }
+        misses = 0;
+
+        // Extend the match; one that starts in the dictionary runs on into the value
+        size_t match_len = COMPRESS_MIN_MATCH;
+        if (offset > i) {
+            size_t ref = dict_len - (offset - i) + match_len;
+            size_t end = len - i < dict_len - ref + match_len ? len : i + match_len + (dict_len - ref);
+            match_len += common(dict_data + ref, in + i + match_len, in + end);
+            if (ref + match_len - COMPRESS_MIN_MATCH == dict_len) {
+                match_len += common(in, in + i + match_len, in + len);
+            }
+        } else {
+            match_len += common(in + i + match_len - offset, in + i + match_len, in + len);
+        }
+        op = put_sequence(op, in + anchor, i - anchor, offset, match_len);
+        i += match_len;
+        anchor = i;
+    }
+    op = put_sequence(op, in + anchor, len - anchor, 0, 0);
+    return (size_t)(op - (uint8_t *)dst);
+}
+
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *n) {
+    uint8_t b;
+    do {
+        if (*ip == end) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Function to decompress len bytes of src into dst, stopping once cap bytes
+// are written, and return the bytes written, or -1 if src is not a valid
+// block for this dictionary. Never reads or writes out of bounds, whatever
+// src holds.
+long decompress_block(const CompressDict *dict, const char *src, size_t len, char *dst, size_t cap) {
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *end = ip + len;
+    uint8_t *out = (uint8_t *)dst;
+    const uint8_t *dict_data = dict ? (const uint8_t *)dict->data : NULL;
+    size_t dict_len = dict ? dict->len : 0;
+    size_t pos = 0;
+
+    while (ip < end && pos < cap) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && get_length(&ip, end, &lit_len) != 0) {
+            return -1;
+        }
+        if (lit_len > (size_t)(end - ip)) {
+            return -1;
+        }
+        size_t n = lit_len < cap - pos ? lit_len : cap - pos;
+        if (n <= 16 && end - ip >= 16 && cap - pos >= 16) {
+            // Copying a fixed 16 bytes beats a memcpy call; the excess is overwritten later
+            memcpy(out + pos, ip, 16);
+        } else {
+            memcpy(out + pos, ip, n);
+        }
+        pos += n;
+        ip += lit_len;
+        if (ip == end || pos == cap) {
+            break;
+        }
+
+        if (end - ip < 2) {
+            return -1;
+        }
+        size_t offset = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t match_len = (token & 15) + COMPRESS_MIN_MATCH;
+        if ((token & 15) == 15 && get_length(&ip, end, &match_len) != 0) {
+            return -1;
+        }
+        if (offset == 0 || offset > pos + dict_len) {
+            return -1;
+        }
+        if (match_len > cap - pos) {
+            match_len = cap - pos;
+        }
+        // The part of the match still in the dictionary
+        if (offset > pos) {
+            size_t from = dict_len - (offset - pos);
+            n = offset - pos < match_len ? offset - pos : match_len;
+            if (n <= 16 && dict_len - from >= 16 && cap - pos >= 16) {
+                memcpy(out + pos, dict_data + from, 16);
+            } else {
+                memcpy(out + pos, dict_data + from, n);
+            }
+            pos += n;
+            match_len -= n;
+        }
+        if (offset >= 8 && cap - pos >= match_len + 8) {
+            // 8 bytes at a time, each word already written even when the match overlaps itself
+            for (size_t k = 0; k < match_len; k += 8) {
+                memcpy(out + pos + k, out + pos + k - offset, 8);
+            }
+            pos += match_len;
+        } else if (match_len <= offset) {
+            memcpy(out + pos, out + pos - offset, match_len);
+            pos += match_len;
+        } else {
+            // Overlapping: the match repeats its last offset bytes
+            for (; match_len > 0; match_len--, pos++) {
+                out[pos] = out[pos - offset];
+            }
+        }
+    }
+    return (long)pos;
+}
+
+// Function to make a dictionary of len bytes of data; only the last
+// COMPRESS_DICT_MAX bytes are kept, since matches cannot reach further back
+CompressDict *compress_dict_create(const char *data, size_t len) {
+    if (len > COMPRESS_DICT_MAX) {
+        data += len - COMPRESS_DICT_MAX;
+        len = COMPRESS_DICT_MAX;
+    }
+    CompressDict *dict = (CompressDict *)malloc(sizeof(CompressDict));
+    char *copy = (char *)malloc(len ? len : 1);
+    uint32_t *table = (uint32_t *)calloc((size_t)1 << DICT_HASH_BITS, sizeof(uint32_t));
+    if (dict == NULL || copy == NULL || table == NULL) {
+        perror("Failed to allocate memory for compression dictionary");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(copy, data, len);
+    dict->data = copy;
+    dict->len = len;
+    dict->table = table;
+    // Later positions overwrite earlier ones, so matches take the nearest copy
+    for (size_t i = 0; i + COMPRESS_MIN_MATCH <= len; i++) {
+        table[hash4(load32((const uint8_t *)copy + i), DICT_HASH_BITS)] = (uint32_t)(i + 1);
+    }
+    // FNV-1a, so a snapshot can tell which dictionary its values need
+    uint32_t id = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        id = (id ^ (uint8_t)copy[i]) * 16777619u;
+    }
+    dict->id = id;
+    return dict;
+}
+
+static uint32_t gram_hash(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ull) >> (64 - TRAIN_HASH_BITS));
+}
+
+// Function to train a dictionary of up to size bytes on count sample values.
+// The samples are split into one stretch per TRAIN_SEGMENT bytes of
+// dictionary, and from each stretch the segment whose 8-byte substrings
+// are most common across all samples is taken. Substrings a chosen segment
+// covers stop counting, so later segments add new content (the COVER
+// method, with one pass over the samples).
+CompressDict *compress_dict_train(const char *const *samples, size_t count, size_t size) {
+    if (size > COMPRESS_DICT_MAX) {
+        size = COMPRESS_DICT_MAX;
+    }
+    size_t total = 0;
+    for (size_t s = 0; s < count; s++) {
+        total += strlen(samples[s]);
+    }
+    char *all = (char *)malloc(total ? total : 1);
+    uint32_t *freq = (uint32_t *)calloc((size_t)1 << TRAIN_HASH_BITS, sizeof(uint32_t));
+    char *out = (char *)malloc(size ? size : 1);
+    if (all == NULL || freq == NULL || out == NULL) {
+        perror("Failed to allocate memory for dictionary training");
+        exit(EXIT_FAILURE);
+    }
+    size_t at = 0;
+    for (size_t s = 0; s < count; s++) {
+        size_t len = strlen(samples[s]);
+        memcpy(all + at, samples[s], len);
+        at += len;
+    }
+
+    size_t used = 0;
+    if (total <= size) {
+        // Too little to choose from: keep all of it
+        memcpy(out, all, total);
+        used = total;
+    } else if (total >= TRAIN_SEGMENT) {
+        const uint8_t *data = (const uint8_t *)all;
+        for (size_t i = 0; i + TRAIN_GRAM <= total; i++) {
+            freq[gram_hash(data + i)]++;
+        }
+        size_t epochs = size / TRAIN_SEGMENT ? size / TRAIN_SEGMENT : 1;
+        size_t epoch_len = total / epochs;
+        const size_t grams = TRAIN_SEGMENT - TRAIN_GRAM + 1;   // substrings starting in a segment
+        for (size_t e = 0; e < epochs && used + TRAIN_SEGMENT <= size; e++) {
+            size_t first = e * epoch_len;
+            size_t last = e + 1 == epochs ? total : first + epoch_len;
+            if (last - first < TRAIN_SEGMENT) {
+                continue;
+            }
+            // Slide a segment over the stretch, keeping the sum of its substrings' counts
+            uint64_t score = 0, best_score = 0;
+            size_t best = first;
+            for (size_t g = 0; g < grams; g++) {
+                score += freq[gram_hash(data + first + g)];
+            }
+            best_score = score;
+            for (size_t s = first + 1; s + TRAIN_SEGMENT <= last; s++) {
+                score += freq[gram_hash(data + s + grams - 1)];
+                score -= freq[gram_hash(data + s - 1)];
+                if (score > best_score) {
+                    best_score = score;
+                    best = s;
+                }
+            }
+            if (best_score == 0) {
+                continue;
+            }
+            memcpy(out + used, data + best, TRAIN_SEGMENT);
+            used += TRAIN_SEGMENT;
+            for (size_t g = 0; g < grams; g++) {
+                freq[gram_hash(data + best + g)] = 0;
+            }
+        }
+    }
+    CompressDict *dict = compress_dict_create(out, used);
+    free(out);
+    free(freq);
+    free(all);
+    return dict;
+}
+
+void compress_dict_free(CompressDict *dict) {
+    if (dict == NULL) {
+        return;
+    }
+    free(dict->data);
+    free(dict->table);
+    free(dict);
+}
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cache.h"
+
+// Benchmark for value compression under a fixed byte budget.
+// Every key's value is a JSON record of about 1 KB, built from the key so
+// a miss can be filled as a backend would fill it. The same skewed mix of
+// read-through lookups and writes runs against an LRU cache of the same
+// budget three times: storing values as they are, compressed, and
+// compressed with a dictionary trained on sample records. Compressed
+// values are smaller, so more of them fit and fewer lookups miss; hits are
+// read back with cipher_read(), so decompression is in the request rate.
+//
+// Usage: ./a.out [budget MB] [threshold bytes]
+
+#define KEY_SPACE 100000
+#define OPS 1000000
+#define READ_PERCENT 95
+#define VALUE_MAX 2048
+#define DICT_SAMPLES 1000
+#define DICT_BYTES (16 * 1024)
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, cheap enough not to show up next to a cache call
+static unsigned long next_random(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DUL;
+}
+
+// Function to write the JSON record of key k into value; version changes with every write
+static void make_value(char *value, unsigned long k, unsigned long version) {
+    static const char *cities[] = {"Springfield", "Riverside", "Franklin", "Greenville", "Fairview", "Madison"};
+    static const char *themes[] = {"dark", "light", "system"};
+    unsigned long h = k * 0x9E3779B97F4A7C15UL + version;
+    int len = snprintf(value, VALUE_MAX,
+                       "{\"id\":%lu,\"version\":%lu,\"user\":\"user%06lu\",\"email\":\"user%06lu@example.com\","
+                       "\"active\":%s,\"roles\":[\"reader\",\"writer\"],\"created\":\"2024-%02lu-%02luT%02lu:%02lu:00Z\","
+                       "\"address\":{\"street\":\"%lu Main Street\",\"city\":\"%s\",\"country\":\"US\",\"zip\":\"%05lu\"},"
+                       "\"preferences\":{\"theme\":\"%s\",\"language\":\"en-US\",\"notifications\":"
+                       "{\"email\":true,\"sms\":false,\"push\":%s}},\"orders\":[",
+                       k, version, k, k, h & 1 ? "true" : "false", (h >> 8) % 12 + 1, (h >> 12) % 28 + 1,
+                       (h >> 17) % 24, (h >> 22) % 60, (h >> 28) % 9999 + 1, cities[(h >> 34) % 6], (h >> 37) % 100000,
+                       themes[(h >> 54) % 3], h & 2 ? "true" : "false");
+    int orders = 4 + (int)((h >> 58) % 5);
+    for (int i = 0; i < orders; i++) {
+        unsigned long o = next_random(&h);
+        len += snprintf(value + len, VALUE_MAX - len,
+                        "%s{\"order\":%lu,\"sku\":\"SKU-%06lu\",\"qty\":%lu,\"price\":%lu.%02lu,\"status\":\"delivered\"}",
+                        i ? "," : "", o % 1000000, (o >> 20) % 1000000, (o >> 40) % 5 + 1, (o >> 44) % 500, (o >> 53) % 100);
+    }
+    snprintf(value + len, VALUE_MAX - len, "]}");
+}
+
+// Function to run the mix against a fresh LRU cache storing values through cipher (NULL for none)
+static void run(const char *name, size_t budget, Cipher *cipher, MetricColumn *column) {
+    CacheStats *stats = stats_create();
+    if (cipher) {
+        cipher->stats = stats;
+    }
+    CacheOptions options = {budget, 0, NULL, stats, cipher, NULL, 0};
+    void *cache = lru_policy.create(KEY_SPACE, &options);
+    char value[VALUE_MAX], buf[VALUE_MAX];
+    unsigned long seed = 0x2545F4914F6CDD1DUL;
+
+    memset(column, 0, sizeof(*column));
+    column->name = name;
+    double start = now_seconds();
+    for (long i = 0; i < OPS; i++) {
+        unsigned long r = next_random(&seed);
+        // Square the draw to skew accesses towards the low keys
+        unsigned long k = (r >> 32) % KEY_SPACE;
+        k = k * k / KEY_SPACE;
+        char key[16];
+        snprintf(key, sizeof(key), "user:%lu", k);
+        if ((r & 0xFF) % 100 < READ_PERCENT) {
+            const char *stored = lru_policy.get(cache, key);
+            if (stored && cipher_read(cipher, stored, buf, sizeof(buf)) >= 0) {
+                column->hit++;
+            } else {
+                // Read-through: a miss is built and cached, as after going to the backend
+                make_value(value, k, 0);
+                lru_policy.add(cache, key, value, 0);
+                column->miss++;
+            }
+        } else {
+            make_value(value, k, (unsigned long)i);
+            lru_policy.add(cache, key, value, 0);
+        }
+    }
+    column->seconds = now_seconds() - start;
+    column->ops = OPS;
+    CacheMemory memory;
+    lru_policy.memory(cache, &memory);
+    column->memory = memory_total(&memory);
+
+    StatsSnapshot *snapshot = (StatsSnapshot *)malloc(sizeof(StatsSnapshot));
+    if (snapshot) {
+        stats_read(stats, snapshot);
+        const uint64_t *c = snapshot->counters;
+        printf("%-12s %6llu entries", name, (unsigned long long)(c[STAT_INSERTS] - c[STAT_EVICT_CAPACITY] - c[STAT_EVICT_BYTES]));
+        if (c[STAT_COMPRESS_IN]) {
+            printf(", ratio %.2fx, compress %.0f MB/s, decompress %.0f ns per value",
+                   (double)c[STAT_COMPRESS_IN] / c[STAT_COMPRESS_OUT], 1e3 * c[STAT_COMPRESS_IN] / c[STAT_COMPRESS_NS],
+                   c[STAT_DECOMPRESSED] ? (double)c[STAT_DECOMPRESS_NS] / c[STAT_DECOMPRESSED] : 0.0);
+        }
+        printf("\n");
+        free(snapshot);
+    }
+    lru_policy.destroy(cache);
+    stats_destroy(stats);
+}
+
+int main(int argc, char **argv) {
+    size_t budget = (argc > 1 ? (size_t)atol(argv[1]) : 32) << 20;
+    size_t threshold = argc > 2 ? (size_t)atol(argv[2]) : 256;
+
+    // Train on records of keys the mix never asks for
+    char *samples = malloc((size_t)DICT_SAMPLES * VALUE_MAX);
+    const char **sample_ptrs = malloc(DICT_SAMPLES * sizeof(char *));
+    if (samples == NULL || sample_ptrs == NULL) {
+        perror("Failed to allocate samples");
+        return 1;
+    }
+    for (int i = 0; i < DICT_SAMPLES; i++) {
+        sample_ptrs[i] = samples + (size_t)i * VALUE_MAX;
+        make_value(samples + (size_t)i * VALUE_MAX, KEY_SPACE + i, 0);
+    }
+    CompressDict *dict = compress_dict_train(sample_ptrs, DICT_SAMPLES, DICT_BYTES);
+
+    Cipher packed, trained;
+    cipher_init_plain(&packed);
+    cipher_set_compression(&packed, threshold, NULL, NULL);
+    cipher_init_plain(&trained);
+    cipher_set_compression(&trained, threshold, dict, NULL);
+
+    printf("%zu MB budget, %d keys, values over %zu bytes compressed, %d%% reads\n", budget >> 20, KEY_SPACE,
+           threshold, READ_PERCENT);
+    MetricColumn columns[3];
+    run("Uncompressed", budget, NULL, &columns[0]);
+    run("Compressed", budget, &packed, &columns[1]);
+    run("Dictionary", budget, &trained, &columns[2]);
+    metric_table(columns, 3);
+
+    compress_dict_free(dict);
+    free(sample_ptrs);
+    free(samples);
+    return 0;
+}
@@ -1,14 +1,109 @@
-#define CACHE_SIZE 2000
+#include <string.h>
+#include "cache.h"
 
-// DJB2 Hash function to ensure uniform distribution & reduce collision.
-// Hashing -> to compute the index for a given key
+// 64-bit key hash used by every cache (wyhash, public domain).
+// It reads the key 8 bytes at a time and mixes with 64x64->128 bit
+// multiplies, so an 8-byte key costs a handful of instructions. The hash is
+// computed once per key, stored in the entry and masked to pick an index
+// slot, so no lookup or eviction pays for an integer division or a rehash.
 
-unsigned int hash(const char* key)
+static const uint64_t secret[4]={
+	0x2d358dccaa6c78a5ull,0x8bb84b93962eacc9ull,
+	0x4b33a62ed433d4a3ull,0x4d5a2da51de1aa47ull
+};
+
+static inline void mum(uint64_t *a,uint64_t *b)
+{
+	__uint128_t r=(__uint128_t)*a * *b;
+	*a=(uint64_t)r;
+	*b=(uint64_t)(r>>64);
+}
+
+static inline uint64_t mix(uint64_t a,uint64_t b)
+{
+	mum(&a,&b);
+	return a^b;
+}
+
+static inline uint64_t read8(const uint8_t *p)
+{
+	uint64_t v;
+	memcpy(&v,p,8);
+	return v;
+}
+
+static inline uint64_t read4(const uint8_t *p)
+{
+	uint32_t v;
+	memcpy(&v,p,4);
+	return v;
+}
+
+static inline uint64_t read3(const uint8_t *p,size_t k)
+{
+	return (((uint64_t)p[0])<<16)|(((uint64_t)p[k>>1])<<8)|p[k-1];
+}
+
+// Hashing -> to compute the 64-bit hash of len bytes
+uint64_t hash64(const void *data,size_t len)
 {
-	unsigned int hash=0;
-	while(*key)
+	const uint8_t *p=(const uint8_t *)data;
+	uint64_t seed=mix(secret[0],secret[1]);
+	uint64_t a,b;
+	if(len<=16)
 	{
-		hash=(hash<<5)+hash+*key++;
+		if(len>=4)
+		{
+			a=(read4(p)<<32)|read4(p+((len>>3)<<2));
+			b=(read4(p+len-4)<<32)|read4(p+len-4-((len>>3)<<2));
+		}
+		else if(len>0)
+		{
+			a=read3(p,len);
+			b=0;
+		}
+		else
+			a=b=0;
 	}
-	return (hash%CACHE_SIZE);
+	else
+	{
+		size_t i=len;
+		if(i>48)
+		{
+			uint64_t see1=seed,see2=seed;
+			do
+			{
+				seed=mix(read8(p)^secret[1],read8(p+8)^seed);
+				see1=mix(read8(p+16)^secret[2],read8(p+24)^see1);
+				see2=mix(read8(p+32)^secret[3],read8(p+40)^see2);
+				p+=48;
+				i-=48;
+			}while(i>48);
+			seed^=see1^see2;
+		}
+		while(i>16)
+		{
+			seed=mix(read8(p)^secret[1],read8(p+8)^seed);
+			i-=16;
+			p+=16;
+		}
+		a=read8(p+i-16);
+		b=read8(p+i-8);
+	}
+	a^=secret[1];
+	b^=seed;
+	mum(&a,&b);
+	return mix(a^secret[0]^len,b^secret[1]);
+}
+
+// Hashing -> to compute the 64-bit hash of a NUL-terminated key
+uint64_t key_hash(const char *key)
+{
+	return hash64(key,strlen(key));
+}
+
+// Hashing -> 32-bit hash of a key for callers that only need an int
+unsigned int hash(const char* key)
+{
+	return (unsigned int)key_hash(key);
 }
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "cache.h"
+
+// Open-addressing hash index in the style of SwissTable.
+// The low 7 bits of the 64-bit key hash are the fingerprint stored in the
+// slot's control byte, and the bits above them (h >> 7), masked to the
+// table size, pick a group of 16 slots. Tables stay far below 2^32 groups,
+// so the top 32 bits never pick a group; the sharded cache picks shards
+// with them (h >> 32), leaving the bits the index uses independent of the
+// shard. A lookup compares all 16 control bytes of a group at once,
+// then checks the full hash kept in the slot, and only calls strcmp when
+// both match, so a hit normally touches one line of control bytes and one
+// slot before reaching the entry.
+//
+// Full slots have the high bit set (0x80 | fingerprint) and an empty slot is
+// 0, so a freshly calloc'ed table is already valid: growing a large index
+// costs no up-front memset and the pages are faulted in as slots fill.
+
+#define CTRL_EMPTY   0x00
+#define CTRL_DELETED 0x01
+#define CTRL_FULL    0x80
+
+// Keep at most 7/8 of the slots occupied (live keys + tombstones)
+#define MAX_LOAD(slots) ((slots) - (slots) / 8)
+
+// Lock-free lookups read the index while the shard's writer changes it, so
+// every field a lookup reads is written with __atomic stores and read with
+// __atomic loads. Slot fields are relaxed; a control byte is stored with
+// release after its slot and loaded with acquire, two 8-byte words per
+// group, which on x86 are the same plain moves.
+
+static void ctrl_store(uint8_t *ctrl, uint8_t byte) {
+    __atomic_store_n(ctrl, byte, __ATOMIC_RELEASE);
+}
+
+static void slot_store(IndexSlot *slot, const char *key, uint64_t h, void *entry) {
+    __atomic_store_n(&slot->hash, h, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->key, key, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->entry, entry, __ATOMIC_RELAXED);
+}
+
+static void *slot_entry(const IndexSlot *slot) {
+    return __atomic_load_n(&slot->entry, __ATOMIC_RELAXED);
+}
+
+// Bitmask of the slots in a group whose control byte equals byte
+static unsigned int group_match(const uint8_t *ctrl, uint8_t byte) {
+#ifdef __SSE2__
+    const uint64_t *words = (const uint64_t *)ctrl;
+    __m128i group = _mm_set_epi64x((long long)__atomic_load_n(&words[1], __ATOMIC_ACQUIRE),
+                                   (long long)__atomic_load_n(&words[0], __ATOMIC_ACQUIRE));
+    return (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < INDEX_GROUP_WIDTH; i++) {
+        if (__atomic_load_n(&ctrl[i], __ATOMIC_ACQUIRE) == byte)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+// Bitmask of the slots in a group that are empty or deleted (high bit clear);
+// only the writer calls it, so it reads the control bytes directly
+static unsigned int group_match_free(const uint8_t *ctrl) {
+#ifdef __SSE2__
+    return ~(unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)ctrl)) & 0xFFFF;
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < INDEX_GROUP_WIDTH; i++) {
+        if (!(ctrl[i] & CTRL_FULL))
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
+
+static size_t slots_for(size_t capacity) {
+    size_t slots = INDEX_GROUP_WIDTH;
+    while (MAX_LOAD(slots) < capacity) {
+        slots <<= 1;
+    }
+    return slots;
+}
+
+// Bytes of a table of the given size: header, control bytes, then the slots
+static size_t table_size(size_t slots) {
+    return sizeof(IndexTable) + slots + slots * sizeof(IndexSlot);
+}
+
+// Allocates a table as one block
+static IndexTable *table_alloc(const Index *index, size_t slots) {
+    IndexTable *table = (IndexTable *)calloc(1, table_size(slots));
+    if (table == NULL) {
+        perror("Failed to allocate memory for cache index");
+        exit(EXIT_FAILURE);
+    }
+    table->ctrl = (uint8_t *)(table + 1);
+    table->slots = (IndexSlot *)(table->ctrl + slots);
+    table->mask = slots - 1;
+    table->index = index;
+    return table;
+}
+
+static void table_release(void *owner, void *table, size_t size) {
+    free(table);
+}
+
+// Frees a table nobody inserts into any more, or parks it while lookups may still be reading it
+static void table_retire(Index *index, IndexTable *table) {
+    if (index->reclaim) {
+        reclaim_retire(index->reclaim, table_release, index, table, 0);
+    } else {
+        free(table);
+    }
+}
+
+// Finds the slot holding key in one table, or returns -1 if it is not there.
+// Each step on to a further group is counted in the index's stats; a search
+// that ends in its first group, the common case, never reaches that code.
+static long table_find(const IndexTable *table, const char *key, uint64_t h) {
+    size_t groups_mask = (table->mask + 1) / INDEX_GROUP_WIDTH - 1;
+    size_t group = (h >> 7) & groups_mask;
+    uint8_t ctrl_byte = CTRL_FULL | (h & 0x7F);
+
+    // Triangular probing over groups visits every group exactly once
+    for (size_t step = 1; step <= groups_mask + 1; step++) {
+        const uint8_t *ctrl = table->ctrl + group * INDEX_GROUP_WIDTH;
+        // Acquire loads: slots are read only after their control byte (see table_place)
+        unsigned int match = group_match(ctrl, ctrl_byte);
+        while (match) {
+            size_t slot = group * INDEX_GROUP_WIDTH + __builtin_ctz(match);
+            const IndexSlot *s = &table->slots[slot];
+            if (__atomic_load_n(&s->hash, __ATOMIC_RELAXED) == h &&
+                strcmp(__atomic_load_n(&s->key, __ATOMIC_RELAXED), key) == 0)
+                return (long)slot;
+            match &= match - 1;
+        }
+        // An empty slot ends the probe sequence: the key was never placed further
+        if (group_match(ctrl, CTRL_EMPTY))
+            return -1;
+        group = (group + step) & groups_mask;
+        if (table->index->stats && step <= groups_mask)
+            stats_probe(table->index->stats, step + 1);
+    }
+    return -1;
+}
+
+// Places a key known to be absent into the first free slot of its probe sequence
+static void table_place(IndexTable *table, const char *key, uint64_t h, void *entry) {
+    size_t groups_mask = (table->mask + 1) / INDEX_GROUP_WIDTH - 1;
+    size_t group = (h >> 7) & groups_mask;
+
+    for (size_t step = 1;; step++) {
+        uint8_t *ctrl = table->ctrl + group * INDEX_GROUP_WIDTH;
+        unsigned int free_slots = group_match_free(ctrl);
+        if (free_slots) {
+            int i = __builtin_ctz(free_slots);
+            if (ctrl[i] == CTRL_DELETED)
+                table->deleted--;
+            slot_store(&table->slots[group * INDEX_GROUP_WIDTH + i], key, h, entry);
+            // Publish the control byte last, so a concurrent lookup that
+            // matches the fingerprint finds the slot filled in
+            ctrl_store(&ctrl[i], CTRL_FULL | (h & 0x7F));
+            table->used++;
+            return;
+        }
+        group = (group + step) & groups_mask;
+    }
+}
+
+// Clears a full slot. A group that still has an empty slot never ended a
+// probe sequence, so the slot can go straight back to empty; otherwise it
+// becomes a tombstone that later probes step over.
+static void table_erase(IndexTable *table, size_t slot) {
+    uint8_t *ctrl = table->ctrl + (slot & ~(size_t)(INDEX_GROUP_WIDTH - 1));
+    if (group_match(ctrl, CTRL_EMPTY)) {
+        ctrl_store(&table->ctrl[slot], CTRL_EMPTY);
+    } else {
+        ctrl_store(&table->ctrl[slot], CTRL_DELETED);
+        table->deleted++;
+    }
+    table->used--;
+}
+
+// Moves up to count slots of the old table into the current one
+static void migrate(Index *index, size_t count) {
+    IndexTable *old = index->old;
+    while (count-- > 0 && index->migrate_pos <= old->mask) {
+        size_t i = index->migrate_pos++;
+        if (old->ctrl[i] & CTRL_FULL) {
+            table_place(index->table, old->slots[i].key, old->slots[i].hash, old->slots[i].entry);
+            // Leave a tombstone so probes for keys still in the old table keep going
+            ctrl_store(&old->ctrl[i], CTRL_DELETED);
+            old->used--;
+        }
+    }
+    if (index->migrate_pos > old->mask) {
+        __atomic_store_n(&index->old, NULL, __ATOMIC_RELEASE);
+        table_retire(index, old);
+    }
+}
+
+// Starts moving every key into a new table of the given size
+static void start_resize(Index *index, size_t slots) {
+    // A resize still running is finished first; this only happens when the
+    // caller keeps inserting into a table far smaller than it needs
+    if (index->old) {
+        migrate(index, (size_t)-1);
+    }
+    // A lookup reads table before old, so old is set first and a key is
+    // always in one of the two tables it sees
+    __atomic_store_n(&index->old, index->table, __ATOMIC_RELEASE);
+    index->migrate_pos = 0;
+    __atomic_store_n(&index->table, table_alloc(index, slots), __ATOMIC_RELEASE);
+}
+
+// Function to initialize an index able to hold capacity keys before it first grows.
+// With a Reclaim, drained tables are retired to it instead of freed.
+void index_init(Index *index, size_t capacity, Reclaim *reclaim) {
+    memset(index, 0, sizeof(*index));
+    index->table = table_alloc(index, slots_for(capacity));
+    index->reclaim = reclaim;
+}
+
+// Function to look up the entry stored under key, h being key_hash(key).
+// Safe next to a writer while the caller holds an epoch; a key that is
+// moving between tables at that moment may be reported missing.
+void *index_find(const Index *index, const char *key, uint64_t h) {
+    const IndexTable *table = __atomic_load_n(&index->table, __ATOMIC_ACQUIRE);
+    void *entry = NULL;
+    long slot = table_find(table, key, h);
+    if (slot >= 0) {
+        entry = slot_entry(&table->slots[slot]);
+    } else {
+        const IndexTable *old = __atomic_load_n(&index->old, __ATOMIC_ACQUIRE);
+        if (old) {
+            slot = table_find(old, key, h);
+            if (slot >= 0)
+                entry = slot_entry(&old->slots[slot]);
+        }
+    }
+    return entry;
+}
+
+// Function to start loading the control bytes a lookup of h reads first,
+// so a lookup issued a little later does not wait on memory. Like
+// index_find, it is safe next to a writer while the caller holds an epoch.
+void index_prefetch(const Index *index, uint64_t h) {
+    const IndexTable *table = __atomic_load_n(&index->table, __ATOMIC_ACQUIRE);
+    size_t groups_mask = (table->mask + 1) / INDEX_GROUP_WIDTH - 1;
+    __builtin_prefetch(table->ctrl + ((h >> 7) & groups_mask) * INDEX_GROUP_WIDTH);
+}
+
+// Function to add a key that is not yet in the index.
+// key must stay valid (and unchanged) for as long as the entry is indexed.
+void index_insert(Index *index, const char *key, uint64_t h, void *entry) {
+    IndexTable *table = index->table;
+    size_t slots = table->mask + 1;
+    if (table->used + table->deleted + 1 > MAX_LOAD(slots)) {
+        // Mostly tombstones: rebuild at the same size, otherwise double
+        if (index->used + 1 <= MAX_LOAD(slots) / 2)
+            start_resize(index, slots);
+        else
+            start_resize(index, slots * 2);
+    }
+    table_place(index->table, key, h, entry);
+    index->used++;
+    if (index->old) {
+        migrate(index, INDEX_MIGRATE_STEP);
+    }
+}
+
+// Function to remove key from the index, returning the entry it mapped to
+void *index_remove(Index *index, const char *key, uint64_t h) {
+    void *entry = NULL;
+    long slot = table_find(index->table, key, h);
+    if (slot >= 0) {
+        entry = index->table->slots[slot].entry;
+        table_erase(index->table, (size_t)slot);
+    } else if (index->old && (slot = table_find(index->old, key, h)) >= 0) {
+        entry = index->old->slots[slot].entry;
+        table_erase(index->old, (size_t)slot);
+    } else {
+        return NULL;
+    }
+    index->used--;
+    if (index->old) {
+        migrate(index, INDEX_MIGRATE_STEP);
+    }
+    return entry;
+}
+
+// Function to walk every live entry: start with *pos = 0 and call until it returns 0
+int index_next(const Index *index, size_t *pos, void **entry) {
+    size_t table_slots = index->table->mask + 1;
+    while (*pos < table_slots) {
+        size_t i = (*pos)++;
+        if (index->table->ctrl[i] & CTRL_FULL) {
+            *entry = index->table->slots[i].entry;
+            return 1;
+        }
+    }
+    // Then whatever has not been migrated out of the old table yet
+    while (index->old && *pos - table_slots <= index->old->mask) {
+        size_t i = (*pos)++ - table_slots;
+        if (index->old->ctrl[i] & CTRL_FULL) {
+            *entry = index->old->slots[i].entry;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to get the bytes taken by the index's tables (entries are owned by the caller)
+size_t index_memory(const Index *index) {
+    return table_size(index->table->mask + 1) + (index->old ? table_size(index->old->mask + 1) : 0);
+}
+
+// Function to free the memory used by the index (entries are owned by the caller)
+void index_free(Index *index) {
+    free(index->table);
+    free(index->old);
+    memset(index, 0, sizeof(*index));
+}
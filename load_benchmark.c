@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "cache.h"
+
+// Multithreaded check of read-through loading in the sharded cache.
+// A slow backend counts how often each key is loaded and puts that count in
+// the value, so callers can tell which load they were served. Three rounds
+// run against one cache:
+//   cold     every thread asks for the same keys in the same order while
+//            none are cached, so each key has a crowd of callers at once;
+//            each key must be loaded exactly once and every waiter woken
+//            with the loaded value
+//   stale    once the keys are past their TTL but inside the stale window,
+//            every thread asks again; each call must return a value
+//            without waiting for the backend, and each key must be
+//            reloaded exactly once in the background
+//   destroy  stale hits start reloads again and the cache is destroyed at
+//            once; sharded_destroy must wait for every reload to finish
+// The program prints what each round saw and exits 1 if any check fails.
+//
+// Usage: ./a.out [policy] [threads] [load delay ms]
+//   policy is one of FIFO, LRU, MRU, GDSF, CLOCK, ARC (default LRU)
+
+#define KEYS 64
+#define TTL_MS 200
+#define STALE_MS 60000
+#define VALUE_SIZE 64
+
+typedef struct Backend {
+    unsigned int delay_us;
+    long calls[KEYS];     // loads started per key
+    long finished;        // loads returned, over all keys
+} Backend;
+
+typedef struct Worker {
+    pthread_t thread;
+    ShardedCache *cache;
+    const CacheLoader *loader;
+    pthread_barrier_t *start;
+    long expect;          // the load count every value must carry, 0 for any
+    long wrong;           // values missing or not from the expected load
+    uint64_t slowest;     // longest call, in nanoseconds
+} Worker;
+
+static const CachePolicy *policies[] = {
+    &fifo_policy, &lru_policy, &mru_policy, &gdsf_policy, &clock_policy, &arc_policy
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// CacheLoader.load: "value <key> v<n>" from the key's n-th load, after the backend's delay
+static char *load_value(void *arg, const char *key) {
+    Backend *backend = (Backend *)arg;
+    long k = strtol(key + 4, NULL, 10);
+    long n = __atomic_add_fetch(&backend->calls[k], 1, __ATOMIC_RELAXED);
+    usleep(backend->delay_us);
+    char *value = (char *)malloc(VALUE_SIZE);
+    if (value) {
+        snprintf(value, VALUE_SIZE, "value %ld v%ld", k, n);
+    }
+    __atomic_add_fetch(&backend->finished, 1, __ATOMIC_RELEASE);
+    return value;
+}
+
+static void *run_worker(void *arg) {
+    Worker *w = (Worker *)arg;
+    char key[16], buf[VALUE_SIZE], want[VALUE_SIZE];
+    pthread_barrier_wait(w->start);
+    for (int k = 0; k < KEYS; k++) {
+        snprintf(key, sizeof(key), "key:%d", k);
+        uint64_t t0 = now_ns();
+        long len = sharded_get_or_load(w->cache, key, w->loader, buf, sizeof(buf));
+        uint64_t ns = now_ns() - t0;
+        if (ns > w->slowest) {
+            w->slowest = ns;
+        }
+        int n = snprintf(want, sizeof(want), "value %d v", k);
+        if (len < 0 || strncmp(buf, want, n) != 0 || (w->expect && strtol(buf + n, NULL, 10) != w->expect)) {
+            w->wrong++;
+        }
+    }
+    return NULL;
+}
+
+// Function to run one pass of every thread over the keys, all starting together
+static void run_round(ShardedCache *cache, const CacheLoader *loader, int threads, long expect, long *wrong,
+                      uint64_t *slowest) {
+    Worker *workers = (Worker *)calloc(threads, sizeof(Worker));
+    pthread_barrier_t start;
+    if (workers == NULL) {
+        perror("Failed to allocate memory for workers");
+        exit(EXIT_FAILURE);
+    }
+    pthread_barrier_init(&start, NULL, (unsigned int)threads);
+    for (int t = 0; t < threads; t++) {
+        workers[t].cache = cache;
+        workers[t].loader = loader;
+        workers[t].start = &start;
+        workers[t].expect = expect;
+        pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+    }
+    *wrong = 0;
+    *slowest = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        *wrong += workers[t].wrong;
+        if (workers[t].slowest > *slowest) {
+            *slowest = workers[t].slowest;
+        }
+    }
+    pthread_barrier_destroy(&start);
+    free(workers);
+}
+
+// Function to count the keys the backend did not load exactly n times
+static int keys_not_loaded(const Backend *backend, long n) {
+    int off = 0;
+    for (int k = 0; k < KEYS; k++) {
+        if (__atomic_load_n(&backend->calls[k], __ATOMIC_RELAXED) != n) {
+            off++;
+        }
+    }
+    return off;
+}
+
+// Function to wait up to a few seconds for the backend to have returned count loads
+static void wait_for_loads(const Backend *backend, long count) {
+    for (int i = 0; i < 5000 && __atomic_load_n(&backend->finished, __ATOMIC_ACQUIRE) < count; i++) {
+        usleep(1000);
+    }
+}
+
+static void read_counters(ShardedCache *cache, uint64_t *loads, uint64_t *waits, uint64_t *stale) {
+    StatsSnapshot *snapshot = (StatsSnapshot *)malloc(sizeof(StatsSnapshot));
+    if (snapshot == NULL) {
+        perror("Failed to allocate memory for statistics");
+        exit(EXIT_FAILURE);
+    }
+    stats_read(sharded_stats(cache), snapshot);
+    *loads = snapshot->counters[STAT_LOADS];
+    *waits = snapshot->counters[STAT_LOAD_WAITS];
+    *stale = snapshot->counters[STAT_STALE_HITS];
+    free(snapshot);
+}
+
+static int check(int ok, const char *what) {
+    printf("  %-58s %s\n", what, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    const CachePolicy *policy = &lru_policy;
+    if (argc > 1) {
+        policy = NULL;
+        for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+            if (strcmp(argv[1], policies[i]->name) == 0) {
+                policy = policies[i];
+            }
+        }
+        if (policy == NULL) {
+            fprintf(stderr, "Unknown policy %s\n", argv[1]);
+            return 1;
+        }
+    }
+    int threads = argc > 2 ? atoi(argv[2]) : 8;
+    int delay_ms = argc > 3 ? atoi(argv[3]) : 20;
+    if (threads < 1 || delay_ms < 1) {
+        fprintf(stderr, "Usage: %s [policy] [threads] [load delay ms]\n", argv[0]);
+        return 1;
+    }
+
+    Backend backend;
+    memset(&backend, 0, sizeof(backend));
+    backend.delay_us = (unsigned int)delay_ms * 1000;
+    CacheLoader loader = {load_value, &backend, TTL_MS, STALE_MS};
+    ShardedCache *cache = sharded_create(policy, 8, 4 * KEYS, NULL);
+    uint64_t loads, waits, stale, slowest;
+    long wrong;
+    int failed = 0;
+    char line[128];
+
+    printf("%s cache, %d threads, %d keys, loads take %d ms\n", policy->name, threads, KEYS, delay_ms);
+
+    // Every thread misses every key, in the same order
+    uint64_t start = now_ns();
+    run_round(cache, &loader, threads, 1, &wrong, &slowest);
+    read_counters(cache, &loads, &waits, &stale);
+    printf("cold: %d requests in %.0f ms, %llu loads, %llu callers waited for another's load\n", threads * KEYS,
+           (now_ns() - start) / 1e6, (unsigned long long)loads, (unsigned long long)waits);
+    failed |= check(keys_not_loaded(&backend, 1) == 0, "every key loaded exactly once");
+    failed |= check(wrong == 0, "every caller got the value of that load");
+
+    // Past the TTL the values are stale: served at once, reloaded once each
+    usleep((TTL_MS + 50) * 1000);
+    uint64_t stale_before = stale;
+    run_round(cache, &loader, threads, 0, &wrong, &slowest);
+    read_counters(cache, &loads, &waits, &stale);
+    printf("stale: %llu stale hits, slowest call %.2f ms\n", (unsigned long long)(stale - stale_before),
+           slowest / 1e6);
+    snprintf(line, sizeof(line), "every call answered without waiting %d ms for a load", delay_ms);
+    failed |= check(wrong == 0 && slowest < backend.delay_us * 1000ull, line);
+    wait_for_loads(&backend, 2 * KEYS);
+    failed |= check(keys_not_loaded(&backend, 2) == 0, "every key reloaded exactly once in the background");
+    run_round(cache, &loader, 1, 2, &wrong, &slowest);
+    failed |= check(wrong == 0, "the reloaded values replaced the old ones");
+
+    // Reloads still running when the cache goes away
+    usleep((TTL_MS + 50) * 1000);
+    run_round(cache, &loader, 1, 2, &wrong, &slowest);
+    long pending = 3 * KEYS - __atomic_load_n(&backend.finished, __ATOMIC_ACQUIRE);
+    sharded_destroy(cache);
+    printf("destroy: %ld of %d reloads still running when destroy was called\n", pending, KEYS);
+    failed |= check(__atomic_load_n(&backend.finished, __ATOMIC_ACQUIRE) == 3 * KEYS && keys_not_loaded(&backend, 3) == 0,
+                    "sharded_destroy returned after every reload finished");
+
+    return failed;
+}
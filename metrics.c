@@ -1,16 +1,124 @@
 #include <stdio.h>
+#include "cache.h"
 
-void metric(int hit,int miss)
+// tier_hit counts lookups a file tier answered, which are in neither hit nor miss;
+// its rows only appear when there are some
+void metric(int hit,int miss,int tier_hit)
 {
 double hit_ratio=0.0;
 double miss_ratio=0.0;
-hit_ratio=(double)hit/500*100;
-miss_ratio=(100.0-hit_ratio);
+double tier_ratio=0.0;
+int total=hit+miss+tier_hit;
+if(total>0)
+{
+    hit_ratio=(double)hit/total*100;
+    tier_ratio=(double)tier_hit/total*100;
+    miss_ratio=(double)miss/total*100;
+}
 printf("\nCache Metrics:\n");
 printf("-------------------------------------------------\n");
 printf("| %-30s | %d                   |\n", "Total number of cache hits", hit);
 printf("| %-30s | %d                   |\n","Total number of cache miss", miss);
+if(tier_hit>0)
+    printf("| %-30s | %d                   |\n","File tier hits", tier_hit);
 printf("| %-30s | %.2f%%                |\n", "Hit ratio", hit_ratio);
+if(tier_hit>0)
+    printf("| %-30s | %.2f%%                |\n", "File tier hit ratio", tier_ratio);
 printf("| %-30s | %.2f%%                |\n", "Miss ratio", miss_ratio);
     
 }
+
+static void metric_rule(int count)
+{
+printf("----------------------------------");
+for(int i=0;i<count;i++)
+    printf("-----------------");
+printf("\n");
+}
+
+// Metric table -> the metric() rows for several caches side by side, one column per cache.
+// The file tier rows only appear when some cache has a tier that served a lookup.
+void metric_table(const MetricColumn *columns,int count)
+{
+int tiered=0;
+for(int i=0;i<count;i++)
+    if(columns[i].tier_hit>0)
+        tiered=1;
+printf("\nCache Metrics:\n");
+metric_rule(count);
+printf("| %-30s |","");
+for(int i=0;i<count;i++)
+    printf(" %-14s |",columns[i].name);
+printf("\n");
+metric_rule(count);
+printf("| %-30s |","Total number of cache hits");
+for(int i=0;i<count;i++)
+    printf(" %-14zu |",columns[i].hit);
+printf("\n| %-30s |","Total number of cache miss");
+for(int i=0;i<count;i++)
+    printf(" %-14zu |",columns[i].miss);
+if(tiered)
+{
+    printf("\n| %-30s |","File tier hits");
+    for(int i=0;i<count;i++)
+        printf(" %-14zu |",columns[i].tier_hit);
+}
+printf("\n| %-30s |","Hit ratio");
+for(int i=0;i<count;i++)
+{
+    size_t total=columns[i].hit+columns[i].miss+columns[i].tier_hit;
+    printf(" %13.2f%% |",total>0?(double)columns[i].hit/total*100:0.0);
+}
+if(tiered)
+{
+    printf("\n| %-30s |","File tier hit ratio");
+    for(int i=0;i<count;i++)
+    {
+        size_t total=columns[i].hit+columns[i].miss+columns[i].tier_hit;
+        printf(" %13.2f%% |",total>0?(double)columns[i].tier_hit/total*100:0.0);
+    }
+}
+printf("\n| %-30s |","Miss ratio");
+for(int i=0;i<count;i++)
+{
+    size_t total=columns[i].hit+columns[i].miss+columns[i].tier_hit;
+    printf(" %13.2f%% |",total>0?(double)columns[i].miss/total*100:0.0);
+}
+printf("\n| %-30s |","Requests per second");
+for(int i=0;i<count;i++)
+    printf(" %-14.0f |",columns[i].seconds>0?columns[i].ops/columns[i].seconds:0.0);
+printf("\n| %-30s |","Memory used (bytes)");
+for(int i=0;i<count;i++)
+    printf(" %-14zu |",columns[i].memory);
+printf("\n");
+metric_rule(count);
+}
+
+size_t memory_total(const CacheMemory *memory)
+{
+return memory->index+memory->entries+memory->metadata+memory->payload+memory->unused;
+}
+
+// Memory metric -> the rows of a cache's memory breakdown, after metric()
+void metric_memory(const CacheMemory *memory)
+{
+printf("| %-30s | %-21zu |\n", "Index (bytes)", memory->index);
+printf("| %-30s | %-21zu |\n", "Entries (bytes)", memory->entries);
+printf("| %-30s | %-21zu |\n", "Policy metadata (bytes)", memory->metadata);
+printf("| %-30s | %-21zu |\n", "Keys and values (bytes)", memory->payload);
+printf("| %-30s | %-21zu |\n", "Allocated, unused (bytes)", memory->unused);
+printf("| %-30s | %-21zu |\n", "Memory used (bytes)", memory_total(memory));
+}
+
+// Shared part of every policy's memory breakdown. Links and flags that
+// follow the KeyValue in an entry are policy metadata, and slab slots
+// never handed out or waiting on the free list are unused.
+void memory_measure(CacheMemory *memory,const Index *index,const Slab *entries,const Arena *arena,CacheStats *stats)
+{
+size_t live=entries->in_use;
+memory->index=index_memory(index);
+memory->entries=live*sizeof(KeyValue);
+memory->metadata=live*(entries->object_size-sizeof(KeyValue))+(stats?stats_memory(stats):0);
+memory->payload=arena->bytes_used;
+memory->unused=slab_memory(entries)-live*entries->object_size+arena->bytes_reserved-arena->bytes_used;
+}
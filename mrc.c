@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cache.h"
+
+// Single-pass LRU miss-ratio curve.
+// An LRU cache of c entries hits on a reference exactly when fewer than c
+// other keys were referenced since the key's previous reference (Mattson's
+// stack distance), so one pass that measures every stack distance gives
+// the hit ratio of every cache size at once.
+//
+// Each reference takes the next time slot, and a Fenwick tree over the
+// slots holds a 1 at the latest reference of every key. The stack distance
+// of a reference is the number of 1s after the key's previous slot, one
+// O(log n) prefix sum. When the slots run out they are renumbered to keep
+// only the marked ones, so the tree stays within twice the number of keys
+// however long the trace is.
+//
+// SHARDS sampling tracks only the keys whose hash falls below a threshold,
+// a fraction R of the key space, and scales their distances by 1/R. With a
+// fixed rate memory shrinks by R; with a bound on sampled keys the
+// threshold is lowered, dropping the keys with the largest hash values,
+// whenever the bound is exceeded, so memory stays fixed for any trace.
+// Sets move a key to the top of the stack like lookups do, but only
+// lookups are counted in the curve. TTLs and value sizes are ignored.
+//
+// Usage: ./a.out trace [sampling rate] [max sampled keys]
+//   sampling rate is in (0, 1], 1 (the default) for exact distances
+
+#define SAMPLE_BITS 24
+#define SAMPLE_MODULUS ((uint32_t)1 << SAMPLE_BITS)
+
+// Histogram of scaled distances: exact below 32, then 32 buckets per power of two
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+#define INITIAL_SLOTS 4096
+
+typedef struct StackEntry {
+    KeyValue kv;
+    size_t last;        // time slot of the key's latest reference
+    uint32_t sample;    // hash-derived sampling value, below SAMPLE_MODULUS
+    size_t heap_pos;    // position in the sample heap when the key count is bounded
+} StackEntry;
+
+typedef struct StackDistance {
+    Index index;            // key -> StackEntry
+    Arena arena;            // keys too long to sit in their entry
+    size_t *tree;           // Fenwick tree over the time slots, 1-based
+    StackEntry **owner;     // entry whose latest reference is in each slot
+    size_t slots;           // a power of two
+    size_t now;             // next free slot
+    size_t keys;            // keys being tracked
+    StackEntry **heap;      // tracked keys, largest sample value on top
+    size_t heap_capacity;
+    size_t max_keys;        // 0 for no bound
+    uint32_t threshold;     // keys with a sample value below this are tracked
+    double rate;            // threshold / SAMPLE_MODULUS
+    double hist[HIST_BUCKETS];   // sampled lookups by scaled stack distance
+    double cold;            // sampled lookups of keys not seen before
+    double sampled;         // sampled lookups
+    size_t max_bucket;      // highest histogram bucket in use
+} StackDistance;
+
+static void *checked_malloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+        perror("Failed to allocate memory for stack distances");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fenwick_add(size_t *tree, size_t slots, size_t i, long delta) {
+    for (i++; i <= slots; i += i & -i) {
+        tree[i] += delta;
+    }
+}
+
+// Sum of slots 0..i
+static size_t fenwick_prefix(const size_t *tree, size_t i) {
+    size_t sum = 0;
+    for (i++; i > 0; i -= i & -i) {
+        sum += tree[i];
+    }
+    return sum;
+}
+
+static size_t bucket_of(uint64_t v) {
+    if (v < HIST_SUB) {
+        return (size_t)v;
+    }
+    unsigned int e = 63 - __builtin_clzll(v);
+    return ((size_t)(e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Smallest distance and number of distances that fall into bucket b
+static void bucket_range(size_t b, double *low, double *width) {
+    if (b < HIST_SUB) {
+        *low = (double)b;
+        *width = 1;
+        return;
+    }
+    unsigned int e = (unsigned int)(b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    *low = (double)((uint64_t)(HIST_SUB + (b & (HIST_SUB - 1))) << (e - HIST_SUB_BITS));
+    *width = (double)((uint64_t)1 << (e - HIST_SUB_BITS));
+}
+
+static void heap_swap(StackEntry **heap, size_t i, size_t j) {
+    StackEntry *t = heap[i];
+    heap[i] = heap[j];
+    heap[j] = t;
+    heap[i]->heap_pos = i;
+    heap[j]->heap_pos = j;
+}
+
+static void heap_push(StackDistance *sd, StackEntry *e) {
+    if (sd->keys > sd->heap_capacity) {
+        sd->heap_capacity = sd->heap_capacity ? sd->heap_capacity * 2 : 1024;
+        sd->heap = (StackEntry **)realloc(sd->heap, sd->heap_capacity * sizeof(StackEntry *));
+        if (sd->heap == NULL) {
+            perror("Failed to allocate memory for stack distances");
+            exit(EXIT_FAILURE);
+        }
+    }
+    size_t i = sd->keys - 1;
+    sd->heap[i] = e;
+    e->heap_pos = i;
+    while (i > 0 && sd->heap[(i - 1) / 2]->sample < sd->heap[i]->sample) {
+        heap_swap(sd->heap, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+// Removes the top of the heap; sd->keys already counts it out
+static void heap_pop(StackDistance *sd) {
+    size_t n = sd->keys;
+    heap_swap(sd->heap, 0, n);
+    size_t i = 0;
+    for (;;) {
+        size_t largest = i, l = 2 * i + 1, r = l + 1;
+        if (l < n && sd->heap[l]->sample > sd->heap[largest]->sample) {
+            largest = l;
+        }
+        if (r < n && sd->heap[r]->sample > sd->heap[largest]->sample) {
+            largest = r;
+        }
+        if (largest == i) {
+            break;
+        }
+        heap_swap(sd->heap, i, largest);
+        i = largest;
+    }
+}
+
+static void stack_init(StackDistance *sd, double rate, size_t max_keys) {
+    memset(sd, 0, sizeof(*sd));
+    index_init(&sd->index, 1024, NULL);
+    arena_init(&sd->arena, NULL);
+    sd->slots = INITIAL_SLOTS;
+    sd->tree = (size_t *)calloc(sd->slots + 1, sizeof(size_t));
+    sd->owner = (StackEntry **)calloc(sd->slots, sizeof(StackEntry *));
+    if (sd->tree == NULL || sd->owner == NULL) {
+        perror("Failed to allocate memory for stack distances");
+        exit(EXIT_FAILURE);
+    }
+    sd->max_keys = max_keys;
+    sd->threshold = rate >= 1.0 ? SAMPLE_MODULUS : (uint32_t)(rate * SAMPLE_MODULUS);
+    if (sd->threshold == 0) {
+        sd->threshold = 1;
+    }
+    sd->rate = (double)sd->threshold / SAMPLE_MODULUS;
+}
+
+// Function to renumber the marked slots 0..keys-1, doubling the slots if
+// more than half of them would stay marked
+static void compact(StackDistance *sd) {
+    size_t j = 0;
+    for (size_t i = 0; i < sd->now; i++) {
+        if (sd->owner[i]) {
+            sd->owner[j] = sd->owner[i];
+            sd->owner[j]->last = j;
+            j++;
+        }
+    }
+    if (2 * sd->keys > sd->slots) {
+        sd->slots *= 2;
+        free(sd->tree);
+        sd->tree = (size_t *)checked_malloc((sd->slots + 1) * sizeof(size_t));
+        sd->owner = (StackEntry **)realloc(sd->owner, sd->slots * sizeof(StackEntry *));
+        if (sd->owner == NULL) {
+            perror("Failed to allocate memory for stack distances");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memset(sd->owner + j, 0, (sd->slots - j) * sizeof(StackEntry *));
+
+    // Build the tree for slots 0..j-1 marked in O(slots)
+    memset(sd->tree, 0, (sd->slots + 1) * sizeof(size_t));
+    for (size_t i = 1; i <= sd->slots; i++) {
+        sd->tree[i] += i <= j;
+        size_t parent = i + (i & -i);
+        if (parent <= sd->slots) {
+            sd->tree[parent] += sd->tree[i];
+        }
+    }
+    sd->now = j;
+}
+
+// Function to stop tracking the key with the largest sample value
+static void drop_top(StackDistance *sd) {
+    StackEntry *e = sd->heap[0];
+    fenwick_add(sd->tree, sd->slots, e->last, -1);
+    sd->owner[e->last] = NULL;
+    index_remove(&sd->index, kv_key(&e->kv), e->kv.hash);
+    sd->keys--;
+    heap_pop(sd);
+    kv_release(&e->kv, &sd->arena);
+    free(e);
+}
+
+// Function to lower the sampling threshold until the tracked keys fit
+// again. Everything counted so far was sampled at the old rate, so it is
+// scaled down by the ratio of the rates.
+static void lower_threshold(StackDistance *sd) {
+    while (sd->keys > sd->max_keys) {
+        uint32_t top = sd->heap[0]->sample;
+        while (sd->keys > 0 && sd->heap[0]->sample == top) {
+            drop_top(sd);
+        }
+        double scale = (double)top / sd->threshold;
+        sd->threshold = top;
+        sd->rate = (double)top / SAMPLE_MODULUS;
+        for (size_t b = 0; b <= sd->max_bucket; b++) {
+            sd->hist[b] *= scale;
+        }
+        sd->cold *= scale;
+        sd->sampled *= scale;
+    }
+}
+
+// Function to process one reference to a key
+static void stack_reference(StackDistance *sd, const char *key, int is_lookup) {
+    uint64_t h = key_hash(key);
+    uint32_t sample = (uint32_t)((h * 0x9E3779B97F4A7C15ULL) >> (64 - SAMPLE_BITS));
+    if (sample >= sd->threshold) {
+        return;
+    }
+    if (sd->now == sd->slots) {
+        compact(sd);
+    }
+
+    StackEntry *e = (StackEntry *)index_find(&sd->index, key, h);
+    if (e) {
+        // Keys referenced since this one's previous reference
+        size_t distance = sd->keys - fenwick_prefix(sd->tree, e->last);
+        if (is_lookup) {
+            size_t b = bucket_of((uint64_t)(distance / sd->rate));
+            sd->hist[b] += 1;
+            if (b > sd->max_bucket) {
+                sd->max_bucket = b;
+            }
+        }
+        fenwick_add(sd->tree, sd->slots, e->last, -1);
+        sd->owner[e->last] = NULL;
+    } else {
+        // Tracked keys are allocated one by one: how many there will be is not known up front
+        e = (StackEntry *)checked_malloc(sizeof(StackEntry));
+        kv_set(&e->kv, &sd->arena, key, h, "");
+        kv_drop_value(&e->kv, &sd->arena);
+        e->sample = sample;
+        index_insert(&sd->index, kv_key(&e->kv), h, e);
+        sd->keys++;
+        if (sd->max_keys) {
+            heap_push(sd, e);
+        }
+        if (is_lookup) {
+            sd->cold += 1;
+        }
+    }
+    if (is_lookup) {
+        sd->sampled += 1;
+    }
+    e->last = sd->now;
+    sd->owner[sd->now] = e;
+    fenwick_add(sd->tree, sd->slots, sd->now, 1);
+    sd->now++;
+
+    if (sd->max_keys && sd->keys > sd->max_keys) {
+        lower_threshold(sd);
+    }
+}
+
+// Function to estimate the hit ratio of an LRU cache of capacity entries,
+// assuming distances are spread evenly within a bucket
+static double stack_hit_ratio(const StackDistance *sd, double capacity, double lookups) {
+    double hits = 0;
+    for (size_t b = 0; b <= sd->max_bucket; b++) {
+        double low, width;
+        bucket_range(b, &low, &width);
+        if (low + width <= capacity) {
+            hits += sd->hist[b];
+        } else if (low < capacity) {
+            hits += sd->hist[b] * (capacity - low) / width;
+        }
+    }
+    if (lookups <= 0 || hits <= 0) {
+        return 0.0;
+    }
+    return hits < lookups ? hits / lookups : 1.0;
+}
+
+// Prints one row of the curve; returns 1 once capacity covers every distance seen
+static int print_size(const StackDistance *sd, double capacity, double lookups, double largest) {
+    double hit = stack_hit_ratio(sd, capacity, lookups);
+    printf("| %-12.0f | %11.2f%% | %11.2f%% |\n", capacity, (1 - hit) * 100, hit * 100);
+    return capacity >= largest;
+}
+
+static void stack_destroy(StackDistance *sd) {
+    size_t pos = 0;
+    void *entry;
+    while (index_next(&sd->index, &pos, &entry)) {
+        free(entry);
+    }
+    index_free(&sd->index);
+    arena_destroy(&sd->arena);
+    free(sd->tree);
+    free(sd->owner);
+    free(sd->heap);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s trace [sampling rate] [max sampled keys]\n", argv[0]);
+        return 1;
+    }
+    double rate = argc > 2 ? atof(argv[2]) : 1.0;
+    size_t max_keys = argc > 3 ? (size_t)atol(argv[3]) : 0;
+    if (rate <= 0 || rate > 1) {
+        fprintf(stderr, "Sampling rate must be in (0, 1]\n");
+        return 1;
+    }
+
+    TraceReader reader;
+    if (trace_open(&reader, argv[1]) != 0) {
+        return 1;
+    }
+    StackDistance *sd = (StackDistance *)checked_malloc(sizeof(StackDistance));
+    stack_init(sd, rate, max_keys);
+
+    size_t references = 0, lookups = 0;
+    double start = now_seconds();
+    TraceRecord record;
+    while (trace_next(&reader, &record)) {
+        references++;
+        lookups += !record.is_set;
+        stack_reference(sd, record.key, !record.is_set);
+    }
+    double elapsed = now_seconds() - start;
+    trace_close(&reader);
+
+    // SHARDS-adj: the sample should hold rate * lookups lookups (counts
+    // taken at a higher rate were scaled down to the final one). Any
+    // shortfall or excess comes from whether the hottest keys fell into the
+    // sample, and is put in the smallest distance, where it shifts every
+    // cache size alike.
+    double total = sd->sampled;
+    if (sd->rate < 1.0) {
+        double expected = lookups * sd->rate;
+        sd->hist[0] += expected - sd->sampled;
+        total = expected;
+    }
+
+    printf("%s: %zu references (%zu lookups) in %.2f s, %.0f references/sec\n", argv[1], references, lookups,
+           elapsed, elapsed > 0 ? references / elapsed : 0.0);
+    printf("Sampling rate %.6f, %zu keys tracked, about %.0f distinct keys\n", sd->rate, sd->keys,
+           sd->rate < 1.0 ? sd->keys / sd->rate : (double)sd->keys);
+    printf("-----------------------------------------------\n");
+    printf("| %-12s | %-12s | %-12s |\n", "LRU entries", "Miss ratio", "Hit ratio");
+    printf("-----------------------------------------------\n");
+    double low, width;
+    bucket_range(sd->max_bucket, &low, &width);
+    double largest = low + width;
+    // Powers of two and halfway between them, up to where the curve turns
+    // flat. Sampled distances are multiples of 1/rate, so smaller caches are
+    // left out.
+    uint64_t first = 1;
+    while (first < 1 / sd->rate) {
+        first *= 2;
+    }
+    for (uint64_t p = first; ; p *= 2) {
+        if (print_size(sd, (double)p, total, largest)) {
+            break;
+        }
+        if (p >= 2 && print_size(sd, (double)(p + p / 2), total, largest)) {
+            break;
+        }
+    }
+    printf("-----------------------------------------------\n");
+
+    stack_destroy(sd);
+    free(sd);
+    return 0;
+}
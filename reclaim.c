@@ -0,0 +1,155 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "cache.h"
+
+// Epoch-based reclamation.
+// The domain keeps a global epoch and one cache-line sized slot per reader
+// thread. A reader copies the global epoch into its own slot before a
+// lookup and clears it afterwards; it never writes anything shared, so
+// readers do not contend with each other or with writers.
+//
+// A writer that unlinks an object retires it with the current epoch
+// instead of freeing it. To reclaim, the writer advances the global epoch
+// and scans the reader slots: every reader still inside a lookup started
+// at or before the oldest epoch it finds, and anything retired before that
+// epoch can no longer be reached by anyone and is released for real.
+
+// Function to set up an epoch domain with no readers
+void epoch_init(EpochDomain *domain) {
+    memset(domain, 0, sizeof(*domain));
+    domain->epoch = 1;
+    pthread_mutex_init(&domain->register_lock, NULL);
+}
+
+// Function to claim a reader slot for the calling thread; returns NULL when all are taken
+EpochReader *epoch_register(EpochDomain *domain, void *data) {
+    EpochReader *reader = NULL;
+    pthread_mutex_lock(&domain->register_lock);
+    for (unsigned int i = 0; i < EPOCH_MAX_READERS; i++) {
+        if (!__atomic_load_n(&domain->readers[i].in_use, __ATOMIC_ACQUIRE)) {
+            reader = &domain->readers[i];
+            __atomic_store_n(&reader->in_use, 1, __ATOMIC_RELAXED);
+            reader->data = data;
+            __atomic_store_n(&reader->active, 0, __ATOMIC_RELEASE);
+            if (i >= domain->readers_high) {
+                __atomic_store_n(&domain->readers_high, i + 1, __ATOMIC_RELEASE);
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&domain->register_lock);
+    return reader;
+}
+
+// Function to give a reader slot back, called by the thread that owns it
+void epoch_unregister(EpochReader *reader) {
+    __atomic_store_n(&reader->active, 0, __ATOMIC_RELEASE);
+    reader->data = NULL;
+    // Released without the register lock, so the slot is read atomically elsewhere
+    __atomic_store_n(&reader->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// Function to mark the start of a lookup
+void epoch_enter(EpochDomain *domain, EpochReader *reader) {
+    __atomic_store_n(&reader->active, __atomic_load_n(&domain->epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    // The announcement must be visible before the lookup reads any pointer
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+// Function to mark the end of a lookup
+void epoch_exit(EpochReader *reader) {
+    __atomic_store_n(&reader->active, 0, __ATOMIC_RELEASE);
+}
+
+// Function to tear down a domain; no thread may still be registered
+void epoch_destroy(EpochDomain *domain) {
+    pthread_mutex_destroy(&domain->register_lock);
+}
+
+// Oldest epoch any reader is still running in, or UINT64_MAX if none is
+static uint64_t oldest_active(EpochDomain *domain) {
+    uint64_t oldest = UINT64_MAX;
+    unsigned int high = __atomic_load_n(&domain->readers_high, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; i < high; i++) {
+        uint64_t active = __atomic_load_n(&domain->readers[i].active, __ATOMIC_SEQ_CST);
+        if (active != 0 && active < oldest) {
+            oldest = active;
+        }
+    }
+    return oldest;
+}
+
+// Function to set up an empty retire list drawing its epochs from domain
+void reclaim_init(Reclaim *reclaim, EpochDomain *domain) {
+    reclaim->domain = domain;
+    reclaim->items = NULL;
+    reclaim->count = 0;
+    reclaim->capacity = 0;
+}
+
+// Function to park ptr until no reader can reach it, then call release(owner, ptr, size).
+// The caller holds the lock that serialises writers of this Reclaim.
+void reclaim_retire(Reclaim *reclaim, ReleaseFn release, void *owner, void *ptr, size_t size) {
+    if (reclaim->count == reclaim->capacity) {
+        size_t capacity = reclaim->capacity ? reclaim->capacity * 2 : 2 * RECLAIM_BATCH;
+        Retired *items = (Retired *)realloc(reclaim->items, capacity * sizeof(Retired));
+        if (items == NULL) {
+            perror("Failed to allocate memory for retire list");
+            exit(EXIT_FAILURE);
+        }
+        reclaim->items = items;
+        reclaim->capacity = capacity;
+    }
+    Retired *item = &reclaim->items[reclaim->count++];
+    item->release = release;
+    item->owner = owner;
+    item->ptr = ptr;
+    item->size = size;
+    item->epoch = __atomic_load_n(&reclaim->domain->epoch, __ATOMIC_RELAXED);
+}
+
+// Function to release everything no reader can still see; returns how many items it released
+size_t reclaim_collect(Reclaim *reclaim) {
+    if (reclaim->count == 0) {
+        return 0;
+    }
+    // Readers entering from now on start after everything already retired
+    __atomic_fetch_add(&reclaim->domain->epoch, 1, __ATOMIC_SEQ_CST);
+    uint64_t oldest = oldest_active(reclaim->domain);
+
+    size_t done = 0;
+    while (done < reclaim->count && reclaim->items[done].epoch < oldest) {
+        Retired *item = &reclaim->items[done];
+        item->release(item->owner, item->ptr, item->size);
+        done++;
+    }
+    if (done > 0) {
+        memmove(reclaim->items, reclaim->items + done, (reclaim->count - done) * sizeof(Retired));
+        reclaim->count -= done;
+    }
+    return done;
+}
+
+// Function to wait until every item retired so far has been released.
+// Lookups are short, so this only spins for as long as one of them takes.
+void reclaim_synchronize(Reclaim *reclaim) {
+    while (reclaim->count > 0) {
+        if (reclaim_collect(reclaim) == 0) {
+            sched_yield();
+        }
+    }
+}
+
+// Function to release every parked item and the list itself; no reader may be active
+void reclaim_destroy(Reclaim *reclaim) {
+    for (size_t i = 0; i < reclaim->count; i++) {
+        Retired *item = &reclaim->items[i];
+        item->release(item->owner, item->ptr, item->size);
+    }
+    free(reclaim->items);
+    reclaim->items = NULL;
+    reclaim->count = 0;
+    reclaim->capacity = 0;
+}
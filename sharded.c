@@ -0,0 +1,545 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+// Sharded wrapper around any cache policy.
+// A single lock around one cache serialises every call, and under load the
+// threads spend their time handing the lock's cache line back and forth.
+// Here the capacity and byte budget are split across a power-of-two number
+// of shards, each an ordinary policy instance with its own mutex. The shard
+// is picked from bits of the key hash the index does not use for probing,
+// so keys spread evenly over the shards and within each shard's index.
+//
+// Writers take the shard lock. Readers do not: each policy is created with
+// the shard's Reclaim, so nothing a reader can reach is reused or freed
+// until the reader has left its epoch, and the lookup itself writes
+// nothing shared. What a lookup would have changed in the policy (moving
+// an LRU entry, setting a CLOCK bit, bumping a GDSF frequency) is queued in
+// the reader's own buffer and applied later in one batch under the lock.
+// All shards count into one CacheStats, and each thread's reader counts its
+// lock-free lookups into a slot of its own.
+
+// Per-thread state: the thread's epoch slot and one recency buffer per shard
+typedef struct ShardReader {
+    EpochReader *epoch;
+    StatsSlot *counts;    // the thread's own slot in the cache's stats
+    RecencyBuffer buffers[];
+} ShardReader;
+
+// Releases a thread's reader state when the thread exits
+static void reader_exit(void *data) {
+    ShardReader *reader = (ShardReader *)data;
+    epoch_unregister(reader->epoch);
+    stats_disown(reader->counts);
+    free(reader);
+}
+
+// Function to get the calling thread's reader state, registering it on first use.
+// Returns NULL if every epoch slot is taken.
+static ShardReader *reader_for(ShardedCache *cache) {
+    ShardReader *reader = pthread_getspecific(cache->reader_key);
+    if (reader) {
+        return reader;
+    }
+    reader = (ShardReader *)calloc(1, sizeof(ShardReader) + (cache->shard_mask + 1) * sizeof(RecencyBuffer));
+    if (reader == NULL) {
+        return NULL;
+    }
+    reader->epoch = epoch_register(cache->domain, reader);
+    if (reader->epoch == NULL) {
+        free(reader);
+        return NULL;
+    }
+    reader->counts = stats_own(cache->stats);
+    pthread_setspecific(cache->reader_key, reader);
+    return reader;
+}
+
+// Copies the value a lock-free lookup found into buf, decrypted under the
+// cache's cipher, or returns -1 if the entry no longer holds key. value is
+// kv->value, loaded once by the caller: a slot rewritten while it was read
+// can lead to another key's entry, and an entry being evicted has its value
+// cleared. An expired entry is a miss even before its shard has reaped it.
+static long read_entry(ShardedCache *cache, KeyValue *kv, const char *value, const char *key, uint64_t h, char *buf, size_t size) {
+    if (value && kv->hash == h && strcmp(kv_key(kv), key) == 0 && !kv_expired(kv)) {
+        return cipher_read(cache->cipher, value, buf, size);
+    }
+    return -1;
+}
+
+// Applies buffered hits to the policy; the shard lock is held.
+// An entry may have been evicted, or evicted and reused for another key,
+// since it was buffered, so only entries the index still maps to the same
+// key are touched. Entry memory itself always stays in the slab.
+static void drain(ShardedCache *cache, CacheShard *shard, RecencyBuffer *buffer) {
+    for (unsigned int i = 0; i < buffer->count; i++) {
+        KeyValue *kv = (KeyValue *)buffer->entries[i];
+        uint64_t h = buffer->hashes[i];
+        if (kv->hash == h && cache->policy->lookup(shard->cache, kv_key(kv), h) == kv) {
+            cache->policy->touch(shard->cache, kv);
+        }
+    }
+    buffer->count = 0;
+}
+
+// Queues a hit; a full buffer is drained if the shard lock is free and
+// dropped otherwise, so a reader never waits for a writer
+static void record_hit(ShardedCache *cache, CacheShard *shard, RecencyBuffer *buffer, void *entry, uint64_t h) {
+    buffer->entries[buffer->count] = entry;
+    buffer->hashes[buffer->count] = h;
+    if (++buffer->count < RECENCY_BUFFER_SIZE) {
+        return;
+    }
+    if (pthread_mutex_trylock(&shard->lock) == 0) {
+        drain(cache, shard, buffer);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    buffer->count = 0;
+}
+
+// Function to create a cache of about capacity entries split over shards shards
+ShardedCache *sharded_create(const CachePolicy *policy, size_t shards, size_t capacity, const CacheOptions *options) {
+    size_t count = 1;
+    while (count < shards) {
+        count <<= 1;
+    }
+
+    ShardedCache *cache = (ShardedCache *)malloc(sizeof(ShardedCache));
+    if (cache == NULL) {
+        perror("Failed to allocate memory for sharded cache");
+        exit(EXIT_FAILURE);
+    }
+    cache->shards = (CacheShard *)aligned_alloc(CACHE_LINE_SIZE, count * sizeof(CacheShard));
+    cache->domain = (EpochDomain *)aligned_alloc(CACHE_LINE_SIZE, sizeof(EpochDomain));
+    if (cache->shards == NULL || cache->domain == NULL) {
+        perror("Failed to allocate memory for cache shards");
+        exit(EXIT_FAILURE);
+    }
+    cache->policy = policy;
+    cache->shard_mask = count - 1;
+    epoch_init(cache->domain);
+    if (pthread_key_create(&cache->reader_key, reader_exit) != 0) {
+        perror("Failed to create thread key for cache readers");
+        exit(EXIT_FAILURE);
+    }
+
+    cache->own_stats = !(options && options->stats);
+    cache->stats = cache->own_stats ? stats_create() : options->stats;
+
+    // Every shard gets an equal slice of the limits, rounded up
+    cache->cipher = options ? options->cipher : NULL;
+    // A file tier is not passed on: lock-free lookups never reach the policy's get to read it
+    CacheOptions shard_options = {0, 0, NULL, cache->stats, cache->cipher, NULL, 0};
+    if (options) {
+        shard_options.max_bytes = options->max_bytes ? (options->max_bytes + count - 1) / count : 0;
+        shard_options.initial_entries = (options->initial_entries + count - 1) / count;
+    }
+    size_t shard_capacity = (capacity + count - 1) / count;
+
+    for (size_t i = 0; i < count; i++) {
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_init(&shard->lock, NULL);
+        pthread_cond_init(&shard->landed, NULL);
+        shard->flights = NULL;
+        shard->refreshing = 0;
+        reclaim_init(&shard->reclaim, cache->domain);
+        shard_options.reclaim = &shard->reclaim;
+        shard->cache = policy->create(shard_capacity, &shard_options);
+    }
+    return cache;
+}
+
+// Function to add or update an entry; ttl_ms of 0 keeps it until it is evicted
+void sharded_add(ShardedCache *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    CacheShard *shard = &cache->shards[(key_hash(key) >> 32) & cache->shard_mask];
+    pthread_mutex_lock(&shard->lock);
+    cache->policy->add(shard->cache, key, value, ttl_ms);
+    if (shard->reclaim.count >= RECLAIM_BATCH) {
+        reclaim_collect(&shard->reclaim);
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Looks key up without the lock and copies its value, counting the hit or
+// miss. With expires, a hit also stores the entry's deadline there (0 for
+// none), read while the entry is still safe to read.
+static long lookup_copy(ShardedCache *cache, const char *key, uint64_t h, char *buf, size_t size, uint64_t *expires) {
+    size_t index = (h >> 32) & cache->shard_mask;
+    CacheShard *shard = &cache->shards[index];
+    long len = -1;
+
+    ShardReader *reader = reader_for(cache);
+    if (reader == NULL) {
+        // No epoch slot left for this thread: fall back to the lock
+        pthread_mutex_lock(&shard->lock);
+        const char *value = cache->policy->get(shard->cache, key);
+        if (value) {
+            len = cipher_read(cache->cipher, value, buf, size);
+            if (expires) {
+                *expires = ((KeyValue *)cache->policy->lookup(shard->cache, key, h))->timer.expires;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+        return len;
+    }
+
+    // The policy's get is bypassed, so the lookup is counted here
+    stats_open(reader->counts, STATS_GET);
+    epoch_enter(cache->domain, reader->epoch);
+    KeyValue *kv = (KeyValue *)cache->policy->lookup(shard->cache, key, h);
+    if (kv) {
+        len = read_entry(cache, kv, __atomic_load_n(&kv->value, __ATOMIC_ACQUIRE), key, h, buf, size);
+        if (len >= 0 && expires) {
+            *expires = __atomic_load_n(&kv->timer.expires, __ATOMIC_RELAXED);
+        }
+    }
+    epoch_exit(reader->epoch);
+    stats_close(reader->counts, len >= 0 ? STAT_HITS : STAT_MISSES, STATS_GET);
+
+    if (len >= 0 && cache->policy->touch) {
+        record_hit(cache, shard, &reader->buffers[index], kv, h);
+    }
+    return len;
+}
+
+// Function to copy the value stored under key into buf (truncated to size
+// bytes including the NUL). Returns the full value length, or -1 on a miss.
+long sharded_get(ShardedCache *cache, const char *key, char *buf, size_t size) {
+    return lookup_copy(cache, key, key_hash(key), buf, size, NULL);
+}
+
+// Function to look up n keys at once, copying the value of keys[i] into
+// bufs[i] (size bytes each) and its length, or -1 on a miss, into lens[i].
+// Returns the number of hits. Keys are resolved SHARDED_BATCH at a time in
+// stages, each of which starts loading what the next one reads for every
+// key in the batch: the index groups, then the entries, then the values.
+// A lookup then waits on at most one of its cache misses, not all three.
+size_t sharded_get_many(ShardedCache *cache, const char *const *keys, size_t n, char *const *bufs, size_t size, long *lens) {
+    size_t hits = 0;
+    ShardReader *reader = reader_for(cache);
+    if (reader == NULL) {
+        for (size_t i = 0; i < n; i++) {
+            lens[i] = sharded_get(cache, keys[i], bufs[i], size);
+            hits += lens[i] >= 0;
+        }
+        return hits;
+    }
+
+    for (size_t base = 0; base < n; base += SHARDED_BATCH) {
+        size_t count = n - base < SHARDED_BATCH ? n - base : SHARDED_BATCH;
+        const char *const *batch = keys + base;
+        uint64_t hashes[SHARDED_BATCH];
+        KeyValue *entries[SHARDED_BATCH];
+        const char *values[SHARDED_BATCH];
+        size_t batch_hits = 0;
+
+        epoch_enter(cache->domain, reader->epoch);
+        for (size_t i = 0; i < count; i++) {
+            hashes[i] = key_hash(batch[i]);
+            CacheShard *shard = &cache->shards[(hashes[i] >> 32) & cache->shard_mask];
+            cache->policy->prefetch(shard->cache, hashes[i]);
+        }
+        for (size_t i = 0; i < count; i++) {
+            CacheShard *shard = &cache->shards[(hashes[i] >> 32) & cache->shard_mask];
+            entries[i] = (KeyValue *)cache->policy->lookup(shard->cache, batch[i], hashes[i]);
+            if (entries[i]) {
+                __builtin_prefetch(entries[i]);
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            values[i] = entries[i] ? __atomic_load_n(&entries[i]->value, __ATOMIC_ACQUIRE) : NULL;
+            if (values[i]) {
+                __builtin_prefetch(values[i]);
+            }
+        }
+        for (size_t i = 0; i < count; i++) {
+            lens[base + i] = -1;
+            if (entries[i]) {
+                lens[base + i] = read_entry(cache, entries[i], values[i], batch[i], hashes[i], bufs[base + i], size);
+            }
+            batch_hits += lens[base + i] >= 0;
+        }
+        epoch_exit(reader->epoch);
+
+        // Batched lookups are counted but not timed, one batch is not one get
+        stats_count(cache->stats, STAT_HITS, batch_hits);
+        stats_count(cache->stats, STAT_MISSES, count - batch_hits);
+        hits += batch_hits;
+        if (cache->policy->touch) {
+            for (size_t i = 0; i < count; i++) {
+                if (lens[base + i] >= 0) {
+                    size_t index = (hashes[i] >> 32) & cache->shard_mask;
+                    record_hit(cache, &cache->shards[index], &reader->buffers[index], entries[i], hashes[i]);
+                }
+            }
+        }
+    }
+    return hits;
+}
+
+// Function to add or update n entries at once, all with the same ttl_ms.
+// Each shard's lock is taken once for all of the batch's keys that fall in
+// it, and their index groups are loaded before the first of them is added.
+// Keys in one shard are added in their order in keys, so a key that
+// appears twice ends up with its last value.
+void sharded_add_many(ShardedCache *cache, const char *const *keys, const char *const *values, size_t n, uint64_t ttl_ms) {
+    for (size_t base = 0; base < n; base += SHARDED_BATCH) {
+        size_t count = n - base < SHARDED_BATCH ? n - base : SHARDED_BATCH;
+        uint64_t hashes[SHARDED_BATCH];
+        unsigned char done[SHARDED_BATCH] = {0};
+        for (size_t i = 0; i < count; i++) {
+            hashes[i] = key_hash(keys[base + i]);
+        }
+        for (size_t i = 0; i < count; i++) {
+            if (done[i]) {
+                continue;
+            }
+            size_t index = (hashes[i] >> 32) & cache->shard_mask;
+            CacheShard *shard = &cache->shards[index];
+            pthread_mutex_lock(&shard->lock);
+            for (size_t j = i; j < count; j++) {
+                if (!done[j] && ((hashes[j] >> 32) & cache->shard_mask) == index) {
+                    cache->policy->prefetch(shard->cache, hashes[j]);
+                }
+            }
+            for (size_t j = i; j < count; j++) {
+                if (!done[j] && ((hashes[j] >> 32) & cache->shard_mask) == index) {
+                    cache->policy->add(shard->cache, keys[base + j], values[base + j], ttl_ms);
+                    done[j] = 1;
+                }
+            }
+            if (shard->reclaim.count >= RECLAIM_BATCH) {
+                reclaim_collect(&shard->reclaim);
+            }
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+}
+
+// Finds the load in progress for key; the shard lock is held
+static Flight *flight_find(CacheShard *shard, const char *key, uint64_t h) {
+    for (Flight *flight = shard->flights; flight; flight = flight->next) {
+        if (flight->hash == h && strcmp(flight->key, key) == 0) {
+            return flight;
+        }
+    }
+    return NULL;
+}
+
+// Registers a load of key, held by the caller; the shard lock is held
+static Flight *flight_start(CacheShard *shard, const char *key, uint64_t h) {
+    Flight *flight = (Flight *)calloc(1, sizeof(Flight));
+    char *copy = strdup(key);
+    if (flight == NULL || copy == NULL) {
+        perror("Failed to allocate memory for cache load");
+        exit(EXIT_FAILURE);
+    }
+    flight->hash = h;
+    flight->key = copy;
+    flight->refs = 1;
+    flight->next = shard->flights;
+    shard->flights = flight;
+    return flight;
+}
+
+// Caches what a load returned and wakes the callers waiting for it; the shard lock is held.
+// The flight stays readable until its last reference is dropped.
+static void flight_land(ShardedCache *cache, CacheShard *shard, Flight *flight, char *value, const CacheLoader *loader) {
+    if (value) {
+        cache->policy->add(shard->cache, flight->key, value, loader->ttl_ms ? loader->ttl_ms + loader->stale_ms : 0);
+        if (shard->reclaim.count >= RECLAIM_BATCH) {
+            reclaim_collect(&shard->reclaim);
+        }
+    }
+    flight->value = value;
+    flight->done = 1;
+    Flight **link = &shard->flights;
+    while (*link != flight) {
+        link = &(*link)->next;
+    }
+    *link = flight->next;
+    pthread_cond_broadcast(&shard->landed);
+}
+
+// Drops a reference to a finished load; the shard lock is held
+static void flight_release(Flight *flight) {
+    if (--flight->refs == 0) {
+        free(flight->value);
+        free(flight->key);
+        free(flight);
+    }
+}
+
+// A reload running on its own thread
+typedef struct Refresh {
+    ShardedCache *cache;
+    CacheShard *shard;
+    Flight *flight;
+    CacheLoader loader;
+} Refresh;
+
+static void *refresh_run(void *arg) {
+    Refresh *refresh = (Refresh *)arg;
+    char *value = refresh->loader.load(refresh->loader.arg, refresh->flight->key);
+    pthread_mutex_lock(&refresh->shard->lock);
+    refresh->shard->refreshing--;
+    flight_land(refresh->cache, refresh->shard, refresh->flight, value, &refresh->loader);
+    flight_release(refresh->flight);
+    pthread_mutex_unlock(&refresh->shard->lock);
+    free(refresh);
+    return NULL;
+}
+
+// Starts reloading a stale key on a background thread; the shard lock is held.
+// If no thread can be started the stale value stays, and a later lookup tries again.
+static void refresh_start(ShardedCache *cache, CacheShard *shard, const char *key, uint64_t h, const CacheLoader *loader) {
+    Refresh *refresh = (Refresh *)malloc(sizeof(Refresh));
+    if (refresh == NULL) {
+        return;
+    }
+    refresh->cache = cache;
+    refresh->shard = shard;
+    refresh->flight = flight_start(shard, key, h);
+    refresh->loader = *loader;
+    shard->refreshing++;
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, refresh_run, refresh) != 0) {
+        shard->refreshing--;
+        refresh->flight->done = 1;
+        shard->flights = refresh->flight->next;
+        flight_release(refresh->flight);
+        free(refresh);
+    } else {
+        stats_count(cache->stats, STAT_LOADS, 1);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Function to copy the value stored under key into buf like sharded_get,
+// calling loader->load to fetch and cache it on a miss. Returns the full
+// value length, or -1 if the key is neither cached nor loadable.
+// Only one load per key runs at a time: a miss while another caller is
+// loading the same key waits for that load instead of starting its own.
+long sharded_get_or_load(ShardedCache *cache, const char *key, const CacheLoader *loader, char *buf, size_t size) {
+    uint64_t h = key_hash(key);
+    CacheShard *shard = &cache->shards[(h >> 32) & cache->shard_mask];
+    uint64_t expires = 0;
+    long len = lookup_copy(cache, key, h, buf, size, &expires);
+    // A value is stale for the last stale_ms of its TTL
+    if (len >= 0 && (loader->stale_ms == 0 || expires == 0 || expires - loader->stale_ms > wheel_now())) {
+        return len;
+    }
+
+    pthread_mutex_lock(&shard->lock);
+    Flight *flight = flight_find(shard, key, h);
+    if (len >= 0) {
+        stats_count(cache->stats, STAT_STALE_HITS, 1);
+        if (flight == NULL) {
+            refresh_start(cache, shard, key, h, loader);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        return len;
+    }
+
+    if (flight == NULL) {
+        // A load may have finished between the lookup and taking the lock
+        KeyValue *kv = (KeyValue *)cache->policy->lookup(shard->cache, key, h);
+        if (kv && !kv_expired(kv)) {
+            len = cipher_read(cache->cipher, kv->value, buf, size);
+            pthread_mutex_unlock(&shard->lock);
+            return len;
+        }
+        flight = flight_start(shard, key, h);
+        stats_count(cache->stats, STAT_LOADS, 1);
+        pthread_mutex_unlock(&shard->lock);
+        char *value = loader->load(loader->arg, key);
+        pthread_mutex_lock(&shard->lock);
+        flight_land(cache, shard, flight, value, loader);
+    } else {
+        flight->refs++;
+        stats_count(cache->stats, STAT_LOAD_WAITS, 1);
+        while (!flight->done) {
+            pthread_cond_wait(&shard->landed, &shard->lock);
+        }
+    }
+    len = flight->value ? cipher_read(NULL, flight->value, buf, size) : -1;
+    flight_release(flight);
+    pthread_mutex_unlock(&shard->lock);
+    return len;
+}
+
+// Function to free every shard and the wrapper itself; no other thread may be using the cache
+void sharded_destroy(ShardedCache *cache) {
+    pthread_key_delete(cache->reader_key);
+    for (size_t i = 0; i <= cache->shard_mask; i++) {
+        CacheShard *shard = &cache->shards[i];
+        // Background reloads still write to the shard, so they are waited for
+        pthread_mutex_lock(&shard->lock);
+        while (shard->refreshing > 0) {
+            pthread_cond_wait(&shard->landed, &shard->lock);
+        }
+        pthread_mutex_unlock(&shard->lock);
+        // Parked memory goes back to the shard's slab and arena before they are torn down
+        reclaim_destroy(&shard->reclaim);
+        cache->policy->destroy(shard->cache);
+        pthread_cond_destroy(&shard->landed);
+        pthread_mutex_destroy(&shard->lock);
+    }
+    for (unsigned int i = 0; i < cache->domain->readers_high; i++) {
+        if (cache->domain->readers[i].in_use) {
+            stats_disown(((ShardReader *)cache->domain->readers[i].data)->counts);
+            free(cache->domain->readers[i].data);
+        }
+    }
+    epoch_destroy(cache->domain);
+    if (cache->own_stats) {
+        stats_destroy(cache->stats);
+    }
+    free(cache->domain);
+    free(cache->shards);
+    free(cache);
+}
+
+// Function to get the statistics every shard counts into
+CacheStats *sharded_stats(ShardedCache *cache) {
+    return cache->stats;
+}
+
+// Function to add up the memory of every shard and of the wrapper itself.
+// Memory parked until readers leave their epoch still counts where it came
+// from; the shards' retire lists and each reader's recency buffers are metadata.
+void sharded_memory(ShardedCache *cache, CacheMemory *memory) {
+    size_t shards = cache->shard_mask + 1;
+    memset(memory, 0, sizeof(*memory));
+    memory->metadata = sizeof(ShardedCache) + shards * sizeof(CacheShard) + sizeof(EpochDomain);
+    if (cache->own_stats) {
+        memory->metadata += stats_memory(cache->stats);
+    }
+    for (size_t i = 0; i < shards; i++) {
+        CacheShard *shard = &cache->shards[i];
+        CacheMemory part;
+        pthread_mutex_lock(&shard->lock);
+        cache->policy->memory(shard->cache, &part);
+        part.metadata += shard->reclaim.capacity * sizeof(Retired);
+        for (Flight *flight = shard->flights; flight; flight = flight->next) {
+            part.metadata += sizeof(Flight) + strlen(flight->key) + 1;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        memory->index += part.index;
+        memory->entries += part.entries;
+        memory->metadata += part.metadata;
+        memory->payload += part.payload;
+        memory->unused += part.unused;
+    }
+    unsigned int readers = __atomic_load_n(&cache->domain->readers_high, __ATOMIC_ACQUIRE);
+    for (unsigned int i = 0; i < readers; i++) {
+        if (__atomic_load_n(&cache->domain->readers[i].in_use, __ATOMIC_ACQUIRE)) {
+            memory->metadata += sizeof(ShardReader) + shards * sizeof(RecencyBuffer);
+        }
+    }
+}
@@ -0,0 +1,189 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "cache.h"
+
+// Multithreaded benchmark for the sharded cache.
+// Every thread runs the same mix of lookups and inserts over a shared key
+// space, once against a single shard (one global lock, as a plain cache
+// behind a mutex would be) and once against many shards. Throughput is
+// printed per thread count so the two can be compared side by side.
+// With a stats interval, every run also prints the cache's hit, eviction
+// and latency rates to stderr at that interval while it is running. With a
+// batch size above 1, each thread collects that many lookups (and,
+// separately, that many inserts) and issues them with sharded_get_many and
+// sharded_add_many, as a request handler holding many keys would.
+//
+// Usage: ./a.out [policy] [max threads] [shards] [stats interval ms] [batch]
+//   policy is one of FIFO, LRU, MRU, GDSF, CLOCK, ARC (default LRU)
+
+#define KEY_SPACE 200000
+#define CACHE_CAPACITY 100000
+#define TOTAL_OPS 4000000
+#define READ_PERCENT 95
+#define VALUE_SIZE 64
+#define MAX_BATCH 256
+
+typedef struct Worker {
+    pthread_t thread;
+    ShardedCache *cache;
+    char (*keys)[16];
+    unsigned long seed;
+    int batch;
+    long ops;
+    long hits;
+} Worker;
+
+static const CachePolicy *policies[] = {
+    &fifo_policy, &lru_policy, &mru_policy, &gdsf_policy, &clock_policy, &arc_policy
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, cheap enough not to show up next to a cache call
+static unsigned long next_random(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DUL;
+}
+
+// Function to issue a batch of lookups and count its hits
+static void flush_reads(Worker *w, const char **reads, int *count, char (*bufs)[VALUE_SIZE]) {
+    char *out[MAX_BATCH];
+    long lens[MAX_BATCH];
+    for (int i = 0; i < *count; i++) {
+        out[i] = bufs[i];
+    }
+    w->hits += sharded_get_many(w->cache, reads, *count, out, VALUE_SIZE, lens);
+    *count = 0;
+}
+
+static void *run_worker(void *arg) {
+    Worker *w = (Worker *)arg;
+    char buf[VALUE_SIZE];
+    char bufs[MAX_BATCH][VALUE_SIZE];
+    const char *reads[MAX_BATCH], *writes[MAX_BATCH];
+    int read_count = 0, write_count = 0;
+    for (long i = 0; i < w->ops; i++) {
+        unsigned long r = next_random(&w->seed);
+        // Square the draw to skew accesses towards the low keys
+        unsigned long k = (r >> 32) % KEY_SPACE;
+        k = k * k / KEY_SPACE;
+        const char *key = w->keys[k];
+        if ((r & 0xFF) % 100 < READ_PERCENT) {
+            if (w->batch > 1) {
+                reads[read_count++] = key;
+                if (read_count == w->batch) {
+                    flush_reads(w, reads, &read_count, bufs);
+                }
+            } else if (sharded_get(w->cache, key, buf, sizeof(buf)) >= 0) {
+                w->hits++;
+            }
+        } else if (w->batch > 1) {
+            writes[write_count++] = key;
+            if (write_count == w->batch) {
+                sharded_add_many(w->cache, writes, writes, write_count, 0);
+                write_count = 0;
+            }
+        } else {
+            sharded_add(w->cache, key, key, 0);
+        }
+    }
+    flush_reads(w, reads, &read_count, bufs);
+    sharded_add_many(w->cache, writes, writes, write_count, 0);
+    return NULL;
+}
+
+// Function to run TOTAL_OPS operations over threads threads and return ops/sec
+static double run(const CachePolicy *policy, size_t shards, int threads, char (*keys)[16], double *hit_ratio,
+                  unsigned int stats_interval, int batch) {
+    ShardedCache *cache = sharded_create(policy, shards, CACHE_CAPACITY, NULL);
+    for (int i = 0; i < KEY_SPACE; i += 2) {
+        sharded_add(cache, keys[i], keys[i], 0);
+    }
+    StatsDumper *dumper = stats_interval ? stats_dump_start(sharded_stats(cache), stats_interval) : NULL;
+
+    Worker *workers = calloc(threads, sizeof(Worker));
+    double start = now_seconds();
+    for (int t = 0; t < threads; t++) {
+        workers[t].cache = cache;
+        workers[t].keys = keys;
+        workers[t].seed = 0x9E3779B97F4A7C15UL * (t + 1);
+        workers[t].batch = batch;
+        workers[t].ops = TOTAL_OPS / threads;
+        pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+    }
+    long ops = 0, hits = 0;
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+        ops += workers[t].ops;
+        hits += workers[t].hits;
+    }
+    double elapsed = now_seconds() - start;
+    long reads = ops * READ_PERCENT / 100;
+    *hit_ratio = reads ? (double)hits / reads : 0.0;
+
+    if (dumper) {
+        stats_dump_stop(dumper);
+    }
+    free(workers);
+    sharded_destroy(cache);
+    return ops / elapsed;
+}
+
+int main(int argc, char **argv) {
+    const CachePolicy *policy = &lru_policy;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 32;
+    size_t shards = argc > 3 ? (size_t)atol(argv[3]) : 64;
+    unsigned int stats_interval = argc > 4 ? (unsigned int)atoi(argv[4]) : 0;
+    int batch = argc > 5 ? atoi(argv[5]) : 1;
+    if (argc > 1) {
+        policy = NULL;
+        for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+            if (strcmp(argv[1], policies[i]->name) == 0) {
+                policy = policies[i];
+            }
+        }
+        if (policy == NULL) {
+            fprintf(stderr, "Unknown policy %s\n", argv[1]);
+            return 1;
+        }
+    }
+    if (max_threads < 1) {
+        max_threads = 1;
+    }
+    if (batch < 1) {
+        batch = 1;
+    } else if (batch > MAX_BATCH) {
+        batch = MAX_BATCH;
+    }
+
+    char (*keys)[16] = malloc(KEY_SPACE * sizeof(*keys));
+    for (int i = 0; i < KEY_SPACE; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "key:%d", i);
+    }
+
+    printf("%s cache, %d entries, %d%% reads, batches of %d\n", policy->name, CACHE_CAPACITY, READ_PERCENT, batch);
+    printf("---------------------------------------------------------------------\n");
+    printf("| %-7s | %-20s | %-20s | %-9s |\n", "Threads", "1 shard (ops/sec)", "Sharded (ops/sec)", "Hit ratio");
+    printf("---------------------------------------------------------------------\n");
+    for (int threads = 1; threads <= max_threads; threads *= 2) {
+        double hit_single, hit_sharded;
+        double single = run(policy, 1, threads, keys, &hit_single, stats_interval, batch);
+        double sharded = run(policy, shards, threads, keys, &hit_sharded, stats_interval, batch);
+        printf("| %-7d | %-20.0f | %-20.0f | %8.2f%% |\n", threads, single, sharded, hit_sharded * 100);
+    }
+    printf("---------------------------------------------------------------------\n");
+
+    free(keys);
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "cache.h"
+
+// Benchmark for the shared-memory cache against per-process caches.
+// A prefork server's workers each run the same skewed mix of lookups and
+// inserts over one key space, first with a private LRU cache apiece that
+// gets an equal share of the entry budget, then all sharing one
+// shm_cache of the whole budget. The private caches each end up holding
+// their own copy of the hot keys, so between them they hold fewer
+// distinct keys and miss more; the shared cache holds every key once.
+// Each worker writes its counts into a MAP_SHARED array the parent reads
+// after wait(), and the two runs print side by side with metric_table().
+//
+// Usage: ./a.out [workers]
+
+#define KEY_SPACE 200000
+#define CACHE_CAPACITY 60000
+#define OPS_PER_WORKER 1000000
+#define READ_PERCENT 95
+#define VALUE_SIZE 64
+#define DATA_BYTES (CACHE_CAPACITY * 128)
+
+typedef struct WorkerResult {
+    size_t hit;
+    size_t miss;
+    size_t ops;
+    double seconds;
+    size_t memory;
+} WorkerResult;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, cheap enough not to show up next to a cache call
+static unsigned long next_random(unsigned long *state) {
+    unsigned long x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DUL;
+}
+
+// Function to run one worker's operations against either a private cache or the shared one
+static void run_worker(int id, int workers, ShmCache *shared, char (*keys)[16], WorkerResult *result) {
+    void *cache = NULL;
+    if (shared == NULL) {
+        cache = lru_policy.create(CACHE_CAPACITY / workers, NULL);
+    }
+    char value[VALUE_SIZE];
+    memset(value, 'v', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+    char buf[VALUE_SIZE];
+    unsigned long seed = 0x9E3779B97F4A7C15UL * (id + 1);
+
+    double start = now_seconds();
+    for (long i = 0; i < OPS_PER_WORKER; i++) {
+        unsigned long r = next_random(&seed);
+        // Square the draw to skew accesses towards the low keys
+        unsigned long k = (r >> 32) % KEY_SPACE;
+        k = k * k / KEY_SPACE;
+        const char *key = keys[k];
+        int found;
+        if ((r & 0xFF) % 100 < READ_PERCENT) {
+            found = shared ? shm_cache_get(shared, key, buf, sizeof(buf)) >= 0 : lru_policy.get(cache, key) != NULL;
+            if (!found) {
+                // Read-through: a miss is loaded and cached, as a worker would after going to the backend
+                if (shared) {
+                    shm_cache_add(shared, key, value, 0);
+                } else {
+                    lru_policy.add(cache, key, value, 0);
+                }
+                result->miss++;
+            } else {
+                result->hit++;
+            }
+        } else if (shared) {
+            shm_cache_add(shared, key, value, 0);
+        } else {
+            lru_policy.add(cache, key, value, 0);
+        }
+    }
+    result->seconds = now_seconds() - start;
+    result->ops = OPS_PER_WORKER;
+
+    if (cache) {
+        CacheMemory memory;
+        lru_policy.memory(cache, &memory);
+        result->memory = memory.index + memory.entries + memory.metadata + memory.payload + memory.unused;
+        lru_policy.destroy(cache);
+    }
+}
+
+// Function to fork the workers for one run and fold their results into a column
+static int run(const char *name, int workers, ShmCache *shared, char (*keys)[16], WorkerResult *results,
+               MetricColumn *column) {
+    memset(results, 0, workers * sizeof(WorkerResult));
+    for (int i = 0; i < workers; i++) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            return -1;
+        }
+        if (pid == 0) {
+            run_worker(i, workers, shared, keys, &results[i]);
+            _exit(0);
+        }
+    }
+    int failed = 0;
+    for (int i = 0; i < workers; i++) {
+        int status;
+        if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+    if (failed) {
+        fprintf(stderr, "A %s worker failed\n", name);
+        return -1;
+    }
+
+    memset(column, 0, sizeof(*column));
+    column->name = name;
+    for (int i = 0; i < workers; i++) {
+        column->hit += results[i].hit;
+        column->miss += results[i].miss;
+        column->ops += results[i].ops;
+        column->memory += results[i].memory;
+        // Workers run side by side, so the run takes as long as the slowest
+        if (results[i].seconds > column->seconds) {
+            column->seconds = results[i].seconds;
+        }
+    }
+    if (shared) {
+        CacheMemory memory;
+        shm_cache_memory(shared, &memory);
+        column->memory = memory.index + memory.entries + memory.metadata + memory.payload + memory.unused;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int workers = argc > 1 ? atoi(argv[1]) : 4;
+    if (workers < 1) {
+        workers = 1;
+    }
+
+    char (*keys)[16] = malloc(KEY_SPACE * sizeof(*keys));
+    if (keys == NULL) {
+        perror("Failed to allocate keys");
+        return 1;
+    }
+    for (int i = 0; i < KEY_SPACE; i++) {
+        snprintf(keys[i], sizeof(keys[i]), "key:%d", i);
+    }
+    WorkerResult *results = mmap(NULL, workers * sizeof(WorkerResult), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (results == MAP_FAILED) {
+        perror("Failed to map results");
+        return 1;
+    }
+    ShmCache *shared = shm_cache_open(NULL, CACHE_CAPACITY, DATA_BYTES);
+    if (shared == NULL) {
+        return 1;
+    }
+
+    printf("%d workers, %d entries in all, %d%% reads\n", workers, CACHE_CAPACITY, READ_PERCENT);
+    MetricColumn columns[2];
+    if (run("Private LRU", workers, NULL, keys, results, &columns[0]) != 0 ||
+        run("Shared LRU", workers, shared, keys, results, &columns[1]) != 0) {
+        return 1;
+    }
+    metric_table(columns, 2);
+
+    ShmHeader *h = shared->header;
+    printf("Shared cache: %lu entries, %lu evictions, %lu rejected\n", (unsigned long)h->used,
+           (unsigned long)h->evictions, (unsigned long)h->rejected);
+
+    shm_cache_close(shared);
+    munmap(results, workers * sizeof(WorkerResult));
+    free(keys);
+    return 0;
+}
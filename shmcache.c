@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+// LRU cache shared by the processes that map the same region.
+// The region starts with a ShmHeader and then holds, each on its own cache
+// line, the hash buckets (the first slot of each chain), the entries, the
+// order links and the key/value area:
+//
+//   | header | buckets | entries | links | keys and values ...          |
+//
+// Every reference inside the region is a slot number or an offset from its
+// start, so each process can map it wherever it likes. The order list is a
+// SlotList built over the links in the region, with its head and tail kept
+// in the header between operations.
+
+#define OPEN_WAIT_US 5000000   // how long a process opening a named cache waits for its creator
+
+static size_t align_line(size_t n) {
+    return (n + CACHE_LINE_SIZE - 1) & ~(size_t)(CACHE_LINE_SIZE - 1);
+}
+
+static char *at(ShmHeader *h, uint64_t offset) {
+    return (char *)h + offset;
+}
+
+static uint32_t *buckets(ShmHeader *h) {
+    return (uint32_t *)at(h, h->buckets);
+}
+
+static ShmEntry *entries(ShmHeader *h) {
+    return (ShmEntry *)at(h, h->entries);
+}
+
+static SlotLink *links(ShmHeader *h) {
+    return (SlotLink *)at(h, h->links);
+}
+
+// This process's view of the shared order list
+static SlotList order_view(ShmHeader *h) {
+    SlotList order = {links(h), h->capacity, h->head, h->tail};
+    return order;
+}
+
+static void order_save(ShmHeader *h, const SlotList *order) {
+    h->head = order->head;
+    h->tail = order->tail;
+}
+
+// Works out where everything goes in a region for capacity entries and data_bytes of keys and values
+static void plan_layout(ShmHeader *h, size_t capacity, size_t data_bytes) {
+    size_t buckets = 1;
+    while (buckets < capacity) {
+        buckets <<= 1;
+    }
+    h->capacity = capacity;
+    h->bucket_mask = buckets - 1;
+    h->buckets = align_line(sizeof(ShmHeader));
+    h->entries = align_line(h->buckets + buckets * sizeof(uint32_t));
+    h->links = align_line(h->entries + capacity * sizeof(ShmEntry));
+    h->data = align_line(h->links + capacity * sizeof(SlotLink));
+    h->data_end = h->data + data_bytes;
+    h->size = h->data_end;
+}
+
+// Empties the cache: every bucket and block free, every slot on the free list
+static void region_reset(ShmHeader *h) {
+    memset(buckets(h), 0xFF, (h->bucket_mask + 1) * sizeof(uint32_t));
+    SlotLink *link = links(h);
+    for (uint64_t i = 0; i < h->capacity; i++) {
+        link[i].prev = SLOT_NONE;
+        link[i].next = i + 1 < h->capacity ? (uint32_t)(i + 1) : SLOT_NONE;
+    }
+    h->free_slot = 0;
+    h->head = SLOT_NONE;
+    h->tail = SLOT_NONE;
+    memset(h->free_lists, 0, sizeof(h->free_lists));
+    h->data_pos = h->data;
+    h->used = 0;
+    h->data_used = 0;
+}
+
+static void shm_lock(ShmHeader *h) {
+    int rc = pthread_mutex_lock(&h->lock);
+    if (rc == EOWNERDEAD) {
+        // The holder died part way through a change, which may have left
+        // a chain or the order list half linked: start again from empty
+        region_reset(h);
+        pthread_mutex_consistent(&h->lock);
+    } else if (rc != 0) {
+        errno = rc;
+        perror("Failed to lock shared cache");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void shm_unlock(ShmHeader *h) {
+    pthread_mutex_unlock(&h->lock);
+}
+
+// Takes a block of the given class, from its free list or the unused end of the area; 0 if neither has one
+static uint64_t block_alloc(ShmHeader *h, size_t block_size) {
+    int c = arena_class(block_size);
+    uint64_t block = h->free_lists[c];
+    if (block) {
+        memcpy(&h->free_lists[c], at(h, block), sizeof(uint64_t));
+    } else if (h->data_end - h->data_pos >= block_size) {
+        block = h->data_pos;
+        h->data_pos += block_size;
+    } else {
+        return 0;
+    }
+    h->data_used += block_size;
+    return block;
+}
+
+static void block_free(ShmHeader *h, uint64_t block, size_t block_size) {
+    int c = arena_class(block_size);
+    memcpy(at(h, block), &h->free_lists[c], sizeof(uint64_t));
+    h->free_lists[c] = block;
+    h->data_used -= block_size;
+}
+
+static uint32_t find(ShmHeader *h, const char *key, size_t key_len, uint64_t hash) {
+    ShmEntry *e = entries(h);
+    for (uint32_t slot = buckets(h)[hash & h->bucket_mask]; slot != SLOT_NONE; slot = e[slot].chain) {
+        if (e[slot].hash == hash && e[slot].key_len == key_len && memcmp(at(h, e[slot].block), key, key_len) == 0) {
+            return slot;
+        }
+    }
+    return SLOT_NONE;
+}
+
+// Unchains an entry, unlinks it and gives its block and slot back
+static void remove_slot(ShmHeader *h, uint32_t slot) {
+    ShmEntry *e = entries(h);
+    uint32_t *link = &buckets(h)[e[slot].hash & h->bucket_mask];
+    while (*link != slot) {
+        link = &e[*link].chain;
+    }
+    *link = e[slot].chain;
+    SlotList order = order_view(h);
+    slotlist_unlink(&order, slot);
+    order_save(h, &order);
+    block_free(h, e[slot].block, e[slot].block_size);
+    links(h)[slot].next = h->free_slot;
+    h->free_slot = slot;
+    h->used--;
+}
+
+// Removes the least recently used entry; the list must not be empty
+static void evict_tail(ShmHeader *h) {
+    ShmEntry *e = &entries(h)[h->tail];
+    if (e->expires != 0 && e->expires <= wheel_now()) {
+        h->expirations++;
+    } else {
+        h->evictions++;
+    }
+    remove_slot(h, h->tail);
+}
+
+// Lays a new region out and marks it ready for the processes waiting on it
+static void region_init(ShmHeader *h, const ShmHeader *plan) {
+    memcpy(h, plan, sizeof(*h));
+    memcpy(h->magic, SHM_CACHE_MAGIC, sizeof(h->magic));
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&h->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    region_reset(h);
+    __atomic_store_n(&h->ready, 1, __ATOMIC_RELEASE);
+}
+
+// Function to create or attach to a shared cache of capacity entries and
+// data_bytes of keys and values. With a NULL name the region is an
+// anonymous memfd that worker processes forked afterwards share; with a
+// name it is the POSIX shared memory object /name, created by the first
+// process to open it and laid out as it asked, the others attaching to it
+// as it is. Returns NULL if the region cannot be set up.
+ShmCache *shm_cache_open(const char *name, size_t capacity, size_t data_bytes) {
+    if (capacity == 0 || capacity >= SLOT_NONE) {
+        fprintf(stderr, "Shared cache capacity must be between 1 and %u entries\n", SLOT_NONE - 1);
+        return NULL;
+    }
+    ShmHeader plan;
+    memset(&plan, 0, sizeof(plan));
+    plan_layout(&plan, capacity, data_bytes);
+
+    int created = 1;
+    int fd;
+    if (name == NULL) {
+        fd = memfd_create("cache", MFD_CLOEXEC);
+    } else {
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd < 0 && errno == EEXIST) {
+            fd = shm_open(name, O_RDWR, 0);
+            created = 0;
+        }
+    }
+    if (fd < 0) {
+        perror(name ? name : "memfd_create");
+        return NULL;
+    }
+
+    size_t size = plan.size;
+    if (created) {
+        if (ftruncate(fd, (off_t)size) != 0) {
+            perror("Failed to size shared cache");
+            close(fd);
+            if (name)
+                shm_unlink(name);
+            return NULL;
+        }
+    } else {
+        // The creator may not have sized the object yet
+        struct stat st;
+        long waited = 0;
+        while (fstat(fd, &st) == 0 && st.st_size == 0 && waited < OPEN_WAIT_US) {
+            usleep(1000);
+            waited += 1000;
+        }
+        size = (size_t)st.st_size;
+        if (size < sizeof(ShmHeader)) {
+            fprintf(stderr, "%s: not a shared cache\n", name);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    ShmHeader *h = (ShmHeader *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (h == MAP_FAILED) {
+        perror("Failed to map shared cache");
+        close(fd);
+        return NULL;
+    }
+    if (created) {
+        region_init(h, &plan);
+    } else {
+        long waited = 0;
+        while (!__atomic_load_n(&h->ready, __ATOMIC_ACQUIRE) && waited < OPEN_WAIT_US) {
+            usleep(1000);
+            waited += 1000;
+        }
+        if (!h->ready || memcmp(h->magic, SHM_CACHE_MAGIC, sizeof(h->magic)) != 0 || h->size != size) {
+            fprintf(stderr, "%s: not a shared cache\n", name);
+            munmap(h, size);
+            close(fd);
+            return NULL;
+        }
+    }
+
+    ShmCache *cache = (ShmCache *)malloc(sizeof(ShmCache));
+    if (cache == NULL) {
+        perror("Failed to allocate memory for shared cache");
+        exit(EXIT_FAILURE);
+    }
+    cache->header = h;
+    cache->fd = fd;
+    return cache;
+}
+
+// Function to add or update an entry; ttl_ms of 0 keeps it until it is evicted
+void shm_cache_add(ShmCache *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    ShmHeader *h = cache->header;
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    size_t block_size = arena_block_size(key_len + value_len + 2);
+    uint64_t hash = key_hash(key);
+
+    shm_lock(h);
+    uint32_t slot = find(h, key, key_len, hash);
+    if (slot != SLOT_NONE) {
+        remove_slot(h, slot);
+    }
+    // A key and value too big for any class is not cached
+    if (arena_class(block_size) < 0) {
+        h->rejected++;
+        shm_unlock(h);
+        return;
+    }
+    if (h->free_slot == SLOT_NONE) {
+        evict_tail(h);
+    }
+    uint64_t block;
+    while ((block = block_alloc(h, block_size)) == 0 && h->tail != SLOT_NONE) {
+        evict_tail(h);
+    }
+    if (block == 0) {
+        h->rejected++;
+        shm_unlock(h);
+        return;
+    }
+
+    slot = h->free_slot;
+    h->free_slot = links(h)[slot].next;
+    ShmEntry *e = &entries(h)[slot];
+    e->hash = hash;
+    e->expires = ttl_ms ? wheel_now() + ttl_ms : 0;
+    e->block = block;
+    e->block_size = (uint32_t)block_size;
+    e->key_len = (uint32_t)key_len;
+    e->value_len = (uint32_t)value_len;
+    memcpy(at(h, block), key, key_len + 1);
+    memcpy(at(h, block + key_len + 1), value, value_len + 1);
+
+    uint32_t *bucket = &buckets(h)[hash & h->bucket_mask];
+    e->chain = *bucket;
+    *bucket = slot;
+    SlotList order = order_view(h);
+    slotlist_push_head(&order, slot);
+    order_save(h, &order);
+    h->used++;
+    h->inserts++;
+    shm_unlock(h);
+}
+
+// Function to copy the value of key into buf (cut to size bytes including
+// the NUL) and return its full length, or -1 if it is not cached
+long shm_cache_get(ShmCache *cache, const char *key, char *buf, size_t size) {
+    ShmHeader *h = cache->header;
+    size_t key_len = strlen(key);
+    uint64_t hash = key_hash(key);
+    long len = -1;
+
+    shm_lock(h);
+    uint32_t slot = find(h, key, key_len, hash);
+    if (slot != SLOT_NONE) {
+        ShmEntry *e = &entries(h)[slot];
+        if (e->expires != 0 && e->expires <= wheel_now()) {
+            remove_slot(h, slot);
+            h->expirations++;
+        } else {
+            len = (long)e->value_len;
+            if (size > 0) {
+                size_t copy = e->value_len < size ? e->value_len : size - 1;
+                memcpy(buf, at(h, e->block + key_len + 1), copy);
+                buf[copy] = '\0';
+            }
+            SlotList order = order_view(h);
+            slotlist_move_to_head(&order, slot);
+            order_save(h, &order);
+        }
+    }
+    if (len >= 0) {
+        h->hits++;
+    } else {
+        h->misses++;
+    }
+    shm_unlock(h);
+    return len;
+}
+
+// Function to break the region down like policy->memory; the parts add up to the region's size
+void shm_cache_memory(ShmCache *cache, CacheMemory *memory) {
+    ShmHeader *h = cache->header;
+    shm_lock(h);
+    memory->index = (h->bucket_mask + 1) * sizeof(uint32_t);
+    memory->entries = h->used * sizeof(ShmEntry);
+    memory->metadata = sizeof(ShmHeader) + h->used * sizeof(SlotLink);
+    memory->payload = h->data_used;
+    memory->unused = h->size - memory->index - memory->entries - memory->metadata - memory->payload;
+    shm_unlock(h);
+}
+
+// Function to unmap this process's view; the region lives on while anyone maps it or it has a name
+void shm_cache_close(ShmCache *cache) {
+    munmap(cache->header, cache->header->size);
+    close(cache->fd);
+    free(cache);
+}
+
+// Function to remove the name of a shared cache once no new process should attach to it
+int shm_cache_unlink(const char *name) {
+    if (shm_unlink(name) != 0) {
+        perror(name);
+        return -1;
+    }
+    return 0;
+}
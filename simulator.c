@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include "cache.h"
+
+// Multi-policy trace simulator.
+// The trace is read and parsed once, by the main thread, into batches of
+// operations. Every configuration (one policy at one capacity) runs in its
+// own thread against its own cache, and each thread is fed through a
+// single-producer single-consumer ring of batch pointers. All threads read
+// the same batches; the last one to finish a batch hands it back to the
+// pool, so the main thread only waits once the slowest configuration is a
+// whole pool of batches behind. A lookup that misses is filled right away,
+// as in trace_replay.c, and each column of the report is what metric()
+// prints for that configuration. Given a directory, every configuration
+// also gets a file tier of tier bytes there, and lookups it serves are
+// reported on their own rows.
+//
+// Usage: ./a.out trace [policies] [capacities] [max bytes] [tier dir] [tier bytes]
+//   policies is a comma-separated list of HASHMAP, FIFO, LRU, MRU, GDSF, CLOCK, ARC (default all)
+//   capacities is a comma-separated list of entry counts (default 1000)
+
+#define BATCH_OPS 4096
+#define BATCH_POOL 16
+#define RING_SIZE 32          // a power of two above BATCH_POOL + 1, so a push never waits
+#define MAX_WORKERS 64
+#define VALUE_MAX 65536       // longer values in the trace are cut to this
+
+typedef struct SimOp {
+    uint32_t key;         // offset of the key in Batch.keys
+    uint32_t value_len;
+    uint32_t ttl_ms;
+    int is_set;
+} SimOp;
+
+typedef struct Batch {
+    size_t count;
+    SimOp ops[BATCH_OPS];
+    char *keys;           // the batch's keys, NUL-terminated, back to back
+    size_t keys_len;
+    size_t keys_capacity;
+    int pending;          // workers that have not finished the batch yet
+} Batch;
+
+// Single-producer single-consumer ring. Each index is written by one side
+// only and sits on its own cache line, so the two sides never write to the
+// same line.
+typedef struct Ring {
+    size_t head __attribute__((aligned(CACHE_LINE_SIZE)));   // next slot to read, owned by the worker
+    size_t tail __attribute__((aligned(CACHE_LINE_SIZE)));   // next slot to fill, owned by the main thread
+    Batch *slots[RING_SIZE];
+} Ring;
+
+typedef struct Worker {
+    pthread_t thread;
+    const CachePolicy *policy;
+    size_t capacity;
+    const CacheOptions *options;
+    Ring ring;
+    size_t hits;
+    size_t misses;
+    size_t tier_hits;     // lookups the file tier served, taken out of hits
+    size_t ops;
+    double seconds;       // time spent on operations, not waiting for batches
+    size_t memory;        // bytes the cache had allocated at the end of the trace
+    char name[32];
+} __attribute__((aligned(CACHE_LINE_SIZE))) Worker;
+
+static const CachePolicy *policies[] = {
+    &hashmap_policy, &fifo_policy, &lru_policy, &mru_policy, &gdsf_policy, &clock_policy, &arc_policy
+};
+
+static char values[VALUE_MAX + 1];
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void ring_push(Ring *ring, Batch *batch) {
+    while (ring->tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SIZE) {
+        sched_yield();
+    }
+    ring->slots[ring->tail & (RING_SIZE - 1)] = batch;
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+static Batch *ring_pop(Ring *ring) {
+    while (ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    Batch *batch = ring->slots[ring->head & (RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    return batch;
+}
+
+static void *run_worker(void *arg) {
+    Worker *w = (Worker *)arg;
+    void *cache = w->policy->create(w->capacity, w->options);
+    Batch *batch;
+    // A NULL batch marks the end of the trace
+    while ((batch = ring_pop(&w->ring)) != NULL) {
+        double start = now_seconds();
+        for (size_t i = 0; i < batch->count; i++) {
+            const SimOp *op = &batch->ops[i];
+            const char *key = batch->keys + op->key;
+            const char *value = values + (VALUE_MAX - op->value_len);
+            if (op->is_set) {
+                w->policy->add(cache, key, value, op->ttl_ms);
+            } else if (w->policy->get(cache, key)) {
+                w->hits++;
+            } else {
+                w->misses++;
+                w->policy->add(cache, key, value, op->ttl_ms);
+            }
+        }
+        w->ops += batch->count;
+        w->seconds += now_seconds() - start;
+        __atomic_sub_fetch(&batch->pending, 1, __ATOMIC_RELEASE);
+    }
+    CacheMemory memory;
+    w->policy->memory(cache, &memory);
+    w->memory = memory_total(&memory);
+    StatsSnapshot *stats = (StatsSnapshot *)malloc(sizeof(StatsSnapshot));
+    if (stats) {
+        stats_read(w->policy->stats(cache), stats);
+        w->tier_hits = stats->counters[STAT_TIER_HITS];
+        w->hits -= w->tier_hits;
+        free(stats);
+    }
+    w->policy->destroy(cache);
+    return NULL;
+}
+
+// Function to wait until every worker is done with a batch and empty it for reuse
+static void batch_reclaim(Batch *batch) {
+    while (__atomic_load_n(&batch->pending, __ATOMIC_ACQUIRE) > 0) {
+        sched_yield();
+    }
+    batch->count = 0;
+    batch->keys_len = 0;
+}
+
+static void batch_append(Batch *batch, const TraceRecord *record) {
+    if (batch->keys_len + record->key_len + 1 > batch->keys_capacity) {
+        while (batch->keys_len + record->key_len + 1 > batch->keys_capacity) {
+            batch->keys_capacity = batch->keys_capacity ? batch->keys_capacity * 2 : BATCH_OPS * 32;
+        }
+        batch->keys = (char *)realloc(batch->keys, batch->keys_capacity);
+        if (batch->keys == NULL) {
+            perror("Failed to allocate memory for batch");
+            exit(EXIT_FAILURE);
+        }
+    }
+    SimOp *op = &batch->ops[batch->count++];
+    op->key = (uint32_t)batch->keys_len;
+    op->value_len = record->value_len < VALUE_MAX ? record->value_len : VALUE_MAX;
+    op->ttl_ms = record->ttl_ms;
+    op->is_set = record->is_set;
+    memcpy(batch->keys + batch->keys_len, record->key, record->key_len + 1);
+    batch->keys_len += record->key_len + 1;
+}
+
+static void batch_publish(Batch *batch, Worker *workers, int count) {
+    batch->pending = count;
+    for (int i = 0; i < count; i++) {
+        ring_push(&workers[i].ring, batch);
+    }
+}
+
+static const CachePolicy *find_policy(const char *name) {
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(name, policies[i]->name) == 0) {
+            return policies[i];
+        }
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s trace [policies] [capacities] [max bytes] [tier dir] [tier bytes]\n", argv[0]);
+        return 1;
+    }
+    char policy_list[256], capacity_list[256];
+    snprintf(policy_list, sizeof(policy_list), "%s", argc > 2 ? argv[2] : "all");
+    snprintf(capacity_list, sizeof(capacity_list), "%s", argc > 3 ? argv[3] : "1000");
+    CacheOptions options = {argc > 4 ? (size_t)atol(argv[4]) : 0, 0, NULL, NULL, NULL,
+                            argc > 5 ? argv[5] : NULL, argc > 6 ? (size_t)atol(argv[6]) : 0};
+
+    const CachePolicy *selected[sizeof(policies) / sizeof(policies[0])];
+    int policy_count = 0;
+    if (strcmp(policy_list, "all") == 0) {
+        for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+            selected[policy_count++] = policies[i];
+        }
+    } else {
+        for (char *name = strtok(policy_list, ","); name; name = strtok(NULL, ",")) {
+            const CachePolicy *policy = find_policy(name);
+            if (policy == NULL) {
+                fprintf(stderr, "Unknown policy %s\n", name);
+                return 1;
+            }
+            if (policy_count < (int)(sizeof(selected) / sizeof(selected[0]))) {
+                selected[policy_count++] = policy;
+            }
+        }
+    }
+
+    static Worker workers[MAX_WORKERS];
+    int count = 0;
+    for (char *cap = strtok(capacity_list, ","); cap; cap = strtok(NULL, ",")) {
+        for (int p = 0; p < policy_count; p++) {
+            if (count == MAX_WORKERS) {
+                fprintf(stderr, "At most %d configurations\n", MAX_WORKERS);
+                return 1;
+            }
+            Worker *w = &workers[count++];
+            w->policy = selected[p];
+            w->capacity = (size_t)atol(cap);
+            w->options = &options;
+            snprintf(w->name, sizeof(w->name), "%s/%zu", w->policy->name, w->capacity);
+        }
+    }
+
+    TraceReader reader;
+    if (count == 0 || trace_open(&reader, argv[1]) != 0) {
+        return 1;
+    }
+    memset(values, 'v', VALUE_MAX);
+
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0) {
+            perror("Failed to start worker");
+            return 1;
+        }
+    }
+
+    static Batch pool[BATCH_POOL];
+    size_t next = 0, operations = 0;
+    Batch *batch = NULL;
+    TraceRecord record;
+    double start = now_seconds();
+    while (trace_next(&reader, &record)) {
+        if (batch == NULL) {
+            batch = &pool[next++ % BATCH_POOL];
+            batch_reclaim(batch);
+        }
+        batch_append(batch, &record);
+        operations++;
+        if (batch->count == BATCH_OPS) {
+            batch_publish(batch, workers, count);
+            batch = NULL;
+        }
+    }
+    if (batch) {
+        batch_publish(batch, workers, count);
+    }
+    for (int i = 0; i < count; i++) {
+        ring_push(&workers[i].ring, NULL);
+    }
+    for (int i = 0; i < count; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = now_seconds() - start;
+    trace_close(&reader);
+
+    printf("%s: %zu operations, %d configurations in %.2f s\n", argv[1], operations, count, elapsed);
+    MetricColumn columns[MAX_WORKERS];
+    for (int i = 0; i < count; i++) {
+        columns[i].name = workers[i].name;
+        columns[i].hit = workers[i].hits;
+        columns[i].miss = workers[i].misses;
+        columns[i].ops = workers[i].ops;
+        columns[i].seconds = workers[i].seconds;
+        columns[i].memory = workers[i].memory;
+        columns[i].tier_hit = workers[i].tier_hits;
+    }
+    metric_table(columns, count);
+
+    for (int i = 0; i < BATCH_POOL; i++) {
+        free(pool[i].keys);
+    }
+    return 0;
+}
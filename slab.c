@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "cache.h"
+
+// Objects are padded to a multiple of 8 bytes so every slot is pointer
+// aligned and can hold the free list link once it is released.
+#define SLAB_ALIGN 8
+
+// Function to set up a slab with room for capacity objects of object_size bytes.
+// With a Reclaim, freed objects are only reused once no reader can see them,
+// so the slab gets some spare objects to cover the ones still waiting.
+void slab_init(Slab *slab, size_t object_size, size_t capacity, Reclaim *reclaim) {
+    if (object_size < sizeof(void *)) {
+        object_size = sizeof(void *);
+    }
+    if (reclaim) {
+        capacity += 2 * RECLAIM_BATCH;
+    }
+    slab->object_size = (object_size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    slab->capacity = capacity;
+    slab->reclaim = reclaim;
+    slab->shift = 0;
+    if ((slab->object_size & (slab->object_size - 1)) == 0) {
+        slab->shift = (unsigned int)__builtin_ctzl(slab->object_size);
+    }
+    // Objects a whole number of cache lines long start on a line, so none straddles two
+    if (slab->object_size % CACHE_LINE_SIZE == 0) {
+        slab->memory = (char *)aligned_alloc(CACHE_LINE_SIZE, slab->object_size * (capacity ? capacity : 1));
+    } else {
+        slab->memory = (char *)malloc(slab->object_size * (capacity ? capacity : 1));
+    }
+    if (slab->memory == NULL) {
+        perror("Failed to allocate memory for slab");
+        exit(EXIT_FAILURE);
+    }
+    slab->free_list = NULL;
+    slab->bump = 0;
+    slab->in_use = 0;
+}
+
+// Function to take an object from the slab; returns NULL once all are in use
+void *slab_alloc(Slab *slab) {
+    void *object;
+    if (slab->free_list == NULL && slab->bump == slab->capacity && slab->reclaim) {
+        // Everything else is waiting on readers; wait for them to finish
+        reclaim_synchronize(slab->reclaim);
+    }
+    if (slab->free_list) {
+        // Reuse the most recently freed object, it is likely still in cache
+        object = slab->free_list;
+        slab->free_list = *(void **)object;
+    } else if (slab->bump < slab->capacity) {
+        // Never-used objects are handed out in address order
+        object = slab->memory + slab->bump * slab->object_size;
+        slab->bump++;
+    } else {
+        return NULL;
+    }
+    slab->in_use++;
+    return object;
+}
+
+// Puts an object back on the free list
+static void slab_release(void *owner, void *object, size_t size) {
+    Slab *slab = (Slab *)owner;
+    *(void **)object = slab->free_list;
+    slab->free_list = object;
+    slab->in_use--;
+}
+
+// Function to give an object back to the slab
+void slab_free(Slab *slab, void *object) {
+    if (object == NULL) {
+        return;
+    }
+    if (slab->reclaim) {
+        reclaim_retire(slab->reclaim, slab_release, slab, object, 0);
+        return;
+    }
+    slab_release(slab, object, 0);
+}
+
+// Function to get the object in slot i, for walking the slab in address order.
+// Only slots below slab->bump have ever been handed out.
+void *slab_object(const Slab *slab, size_t i) {
+    return slab->memory + i * slab->object_size;
+}
+
+// Function to get the bytes the slab took from malloc, used or not
+size_t slab_memory(const Slab *slab) {
+    return slab->memory ? slab->object_size * (slab->capacity ? slab->capacity : 1) : 0;
+}
+
+// Function to release the slab's memory and every object in it
+void slab_destroy(Slab *slab) {
+    free(slab->memory);
+    slab->memory = NULL;
+    slab->free_list = NULL;
+    slab->capacity = 0;
+    slab->bump = 0;
+    slab->in_use = 0;
+    slab->shift = 0;
+    slab->reclaim = NULL;
+}
+
+// Function to set up an empty list with a link for every slot of the slab
+void slotlist_init(SlotList *list, const Slab *slab) {
+    if (slab->capacity >= SLOT_NONE) {
+        fprintf(stderr, "Slab too large for 32-bit slot links\n");
+        exit(EXIT_FAILURE);
+    }
+    list->slots = slab->capacity ? slab->capacity : 1;
+    list->links = (SlotLink *)malloc(list->slots * sizeof(SlotLink));
+    if (list->links == NULL) {
+        perror("Failed to allocate memory for slot links");
+        exit(EXIT_FAILURE);
+    }
+    list->head = SLOT_NONE;
+    list->tail = SLOT_NONE;
+}
+
+// Function to get the bytes taken by the list's links, used or not
+size_t slotlist_memory(const SlotList *list) {
+    return list->links ? list->slots * sizeof(SlotLink) : 0;
+}
+
+// Function to release the list's links
+void slotlist_destroy(SlotList *list) {
+    free(list->links);
+    list->links = NULL;
+    list->slots = 0;
+    list->head = SLOT_NONE;
+    list->tail = SLOT_NONE;
+}
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include "cache.h"
+
+// Cache snapshots and warm restarts.
+// Saving walks a cache in its policy's order and appends one record per
+// live entry to a buffer, then writes the buffer out as a section. A sharded
+// cache holds each shard's lock only while that shard is walked, so traffic
+// to the other shards never stops and the longest pause is the copy of one
+// shard. The file is written under a temporary name and renamed over path
+// once complete, so a crash mid-save leaves the previous snapshot intact.
+// Restoring maps the file read-only and feeds the records of each section
+// to add in file order; values are added straight from the mapping unless
+// they have to be decrypted first.
+
+typedef void (*AddFn)(void *target, const char *key, const char *value, uint64_t ttl_ms);
+
+// Records of one section, appended by walk
+typedef struct SnapshotBuffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+    uint64_t count;
+    uint64_t now;       // wheel_now() when the walk started
+    uint64_t wall;      // wall-clock milliseconds at the same moment
+} SnapshotBuffer;
+
+typedef struct SnapshotWriter {
+    FILE *file;
+    char *tmp_path;
+    const char *path;
+    SnapshotSection *sections;
+    uint64_t count;      // sections written so far
+    uint64_t offset;     // where the next section starts
+} SnapshotWriter;
+
+typedef struct Snapshot {
+    const char *data;
+    size_t size;
+    const SnapshotSection *sections;
+    uint64_t count;
+} Snapshot;
+
+static uint64_t wall_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Values can only be read back under the same mode, compression setting and dictionary
+static uint32_t cipher_id(const Cipher *cipher) {
+    if (cipher == NULL || (cipher->mode == CIPHER_NONE && cipher->compress_above == 0)) {
+        return 0;
+    }
+    uint32_t id = (uint32_t)cipher->mode + 1;
+    if (cipher->compress_above) {
+        id |= 0x100;
+    }
+    if (cipher->dict) {
+        id |= (cipher->dict->id & 0xFFFF) << 16;
+    }
+    return id;
+}
+
+static void buffer_start(SnapshotBuffer *buffer) {
+    buffer->size = 0;
+    buffer->count = 0;
+    buffer->now = wheel_now();
+    buffer->wall = wall_now();
+}
+
+// VisitFn appending an entry's record; entries past their deadline are left out
+static void append_record(void *arg, KeyValue *kv) {
+    SnapshotBuffer *buffer = (SnapshotBuffer *)arg;
+    uint64_t expires = kv->timer.expires;
+    if (kv->value == NULL || (expires != 0 && expires <= buffer->now)) {
+        return;
+    }
+    SnapshotRecord record = {kv->key_len, kv->value_len, expires ? buffer->wall + (expires - buffer->now) : 0};
+    size_t need = sizeof(record) + kv->key_len + kv->value_len + 2;
+    if (buffer->size + need > buffer->capacity) {
+        while (buffer->size + need > buffer->capacity) {
+            buffer->capacity = buffer->capacity ? buffer->capacity * 2 : 1 << 20;
+        }
+        buffer->data = (char *)realloc(buffer->data, buffer->capacity);
+        if (buffer->data == NULL) {
+            perror("Failed to allocate memory for snapshot");
+            exit(EXIT_FAILURE);
+        }
+    }
+    char *p = buffer->data + buffer->size;
+    memcpy(p, &record, sizeof(record));
+    p += sizeof(record);
+    memcpy(p, kv_key(kv), kv->key_len + 1);
+    p += kv->key_len + 1;
+    memcpy(p, kv->value, kv->value_len);
+    p[kv->value_len] = '\0';
+    buffer->size += need;
+    buffer->count++;
+}
+
+static int writer_close(SnapshotWriter *writer, int ok);
+
+// Starts path's temporary file with the header and room for the section table
+static int writer_open(SnapshotWriter *writer, const char *path, const Cipher *cipher, uint64_t sections) {
+    memset(writer, 0, sizeof(*writer));
+    writer->path = path;
+    writer->tmp_path = (char *)malloc(strlen(path) + 5);
+    writer->sections = (SnapshotSection *)calloc(sections, sizeof(SnapshotSection));
+    if (writer->tmp_path == NULL || writer->sections == NULL) {
+        perror("Failed to allocate memory for snapshot");
+        exit(EXIT_FAILURE);
+    }
+    sprintf(writer->tmp_path, "%s.tmp", path);
+    writer->file = fopen(writer->tmp_path, "wb");
+    if (writer->file == NULL) {
+        perror(writer->tmp_path);
+        free(writer->tmp_path);
+        free(writer->sections);
+        return -1;
+    }
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.cipher = cipher_id(cipher);
+    header.sections = sections;
+    cipher_check(cipher, header.check);
+    writer->offset = sizeof(header) + sections * sizeof(SnapshotSection);
+    if (fwrite(&header, sizeof(header), 1, writer->file) != 1 ||
+        fwrite(writer->sections, sizeof(SnapshotSection), sections, writer->file) != sections) {
+        perror(writer->tmp_path);
+        writer_close(writer, 0);
+        return -1;
+    }
+    return 0;
+}
+
+static int writer_section(SnapshotWriter *writer, const SnapshotBuffer *buffer) {
+    SnapshotSection *section = &writer->sections[writer->count++];
+    section->offset = writer->offset;
+    section->size = buffer->size;
+    section->count = buffer->count;
+    writer->offset += buffer->size;
+    if (buffer->size > 0 && fwrite(buffer->data, buffer->size, 1, writer->file) != 1) {
+        perror(writer->tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Fills in the section table and moves the file into place, or drops it if anything failed
+static int writer_close(SnapshotWriter *writer, int ok) {
+    if (ok) {
+        ok = fseek(writer->file, sizeof(SnapshotHeader), SEEK_SET) == 0 &&
+             fwrite(writer->sections, sizeof(SnapshotSection), writer->count, writer->file) == writer->count &&
+             fflush(writer->file) == 0 && fsync(fileno(writer->file)) == 0;
+        if (!ok) {
+            perror(writer->tmp_path);
+        }
+    }
+    if (fclose(writer->file) != 0 && ok) {
+        perror(writer->tmp_path);
+        ok = 0;
+    }
+    if (ok && rename(writer->tmp_path, writer->path) != 0) {
+        perror(writer->path);
+        ok = 0;
+    }
+    if (!ok) {
+        unlink(writer->tmp_path);
+    }
+    free(writer->tmp_path);
+    free(writer->sections);
+    return ok ? 0 : -1;
+}
+
+// Maps a snapshot and checks that its header and section table hold together
+static int snapshot_map(Snapshot *snapshot, const char *path, const Cipher *cipher) {
+    memset(snapshot, 0, sizeof(*snapshot));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        fprintf(stderr, "%s: not a cache snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror(path);
+        return -1;
+    }
+    snapshot->data = (const char *)data;
+    snapshot->size = (size_t)st.st_size;
+
+    SnapshotHeader header;
+    memcpy(&header, snapshot->data, sizeof(header));
+    uint8_t check[CIPHER_CHECK];
+    cipher_check(cipher, check);
+    const char *problem = NULL;
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION) {
+        problem = "not a cache snapshot of this version";
+    } else if (header.cipher != cipher_id(cipher)) {
+        problem = "values were stored under a different cipher";
+    } else if (memcmp(header.check, check, sizeof(check)) != 0) {
+        problem = "values were stored under a different key";
+    } else if (header.sections > (snapshot->size - sizeof(header)) / sizeof(SnapshotSection)) {
+        problem = "truncated section table";
+    } else {
+        snapshot->sections = (const SnapshotSection *)(snapshot->data + sizeof(header));
+        snapshot->count = header.sections;
+        for (uint64_t i = 0; i < snapshot->count; i++) {
+            const SnapshotSection *section = &snapshot->sections[i];
+            if (section->offset > snapshot->size || section->size > snapshot->size - section->offset) {
+                problem = "section runs past the end of the file";
+            }
+        }
+    }
+    if (problem) {
+        fprintf(stderr, "%s: %s\n", path, problem);
+        munmap(data, snapshot->size);
+        return -1;
+    }
+    madvise(data, snapshot->size, MADV_WILLNEED);
+    return 0;
+}
+
+// Adds the records of one section in order and returns how many were
+// restored. A record that does not fit in its section ends it early.
+static long restore_section(const Snapshot *snapshot, uint64_t s, const Cipher *cipher, AddFn add, void *target) {
+    const SnapshotSection *section = &snapshot->sections[s];
+    const char *p = snapshot->data + section->offset;
+    const char *end = p + section->size;
+    size_t overhead = cipher_overhead(cipher);
+    uint64_t wall = wall_now();
+    char *plain = NULL;
+    size_t plain_size = 0;
+    long restored = 0;
+
+    while ((size_t)(end - p) >= sizeof(SnapshotRecord)) {
+        SnapshotRecord record;
+        memcpy(&record, p, sizeof(record));
+        size_t len = sizeof(record) + (size_t)record.key_len + record.value_len + 2;
+        if (len > (size_t)(end - p) || record.value_len < overhead) {
+            break;
+        }
+        const char *key = p + sizeof(record);
+        const char *value = key + record.key_len + 1;
+        if (key[record.key_len] != '\0' || value[record.value_len] != '\0') {
+            break;
+        }
+        p += len;
+        if (record.deadline != 0 && record.deadline <= wall) {
+            continue;
+        }
+        if (cipher) {
+            // add encrypts again, under a fresh nonce; a compressed value is longer plain
+            long plain_len = cipher_read(cipher, value, NULL, 0);
+            if (plain_len < 0) {
+                continue;
+            }
+            size_t need = (size_t)plain_len + 1;
+            if (need > plain_size) {
+                plain_size = need * 2;
+                plain = (char *)realloc(plain, plain_size);
+                if (plain == NULL) {
+                    perror("Failed to allocate memory for snapshot");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            if (cipher_read(cipher, value, plain, need) < 0) {
+                continue;
+            }
+            value = plain;
+        }
+        add(target, key, value, record.deadline ? record.deadline - wall : 0);
+        restored++;
+    }
+    free(plain);
+    return restored;
+}
+
+// Function to save every live entry of a single-threaded cache to path.
+// cipher is the one the cache was created with, NULL for plain values.
+int cache_snapshot(const CachePolicy *policy, void *cache, const Cipher *cipher, const char *path) {
+    SnapshotWriter writer;
+    if (writer_open(&writer, path, cipher, 1) != 0) {
+        return -1;
+    }
+    SnapshotBuffer buffer = {0};
+    buffer_start(&buffer);
+    policy->walk(cache, append_record, &buffer);
+    int ok = writer_section(&writer, &buffer) == 0;
+    free(buffer.data);
+    return writer_close(&writer, ok);
+}
+
+// Function to add the entries of a snapshot to a cache, returning how many
+// were restored or -1 if the file cannot be used. cipher must be set up as
+// it was when the snapshot was saved.
+long cache_restore(const CachePolicy *policy, void *cache, const Cipher *cipher, const char *path) {
+    Snapshot snapshot;
+    if (snapshot_map(&snapshot, path, cipher) != 0) {
+        return -1;
+    }
+    long restored = 0;
+    for (uint64_t s = 0; s < snapshot.count; s++) {
+        restored += restore_section(&snapshot, s, cipher, policy->add, cache);
+    }
+    munmap((void *)snapshot.data, snapshot.size);
+    return restored;
+}
+
+// Function to save a sharded cache to path while it keeps serving, one shard at a time
+int sharded_snapshot(ShardedCache *cache, const char *path) {
+    size_t count = cache->shard_mask + 1;
+    SnapshotWriter writer;
+    if (writer_open(&writer, path, cache->cipher, count) != 0) {
+        return -1;
+    }
+    SnapshotBuffer buffer = {0};
+    int ok = 1;
+    for (size_t i = 0; i < count && ok; i++) {
+        CacheShard *shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        buffer_start(&buffer);
+        cache->policy->walk(shard->cache, append_record, &buffer);
+        pthread_mutex_unlock(&shard->lock);
+        ok = writer_section(&writer, &buffer) == 0;
+    }
+    free(buffer.data);
+    return writer_close(&writer, ok);
+}
+
+typedef struct RestoreJob {
+    ShardedCache *cache;
+    const Snapshot *snapshot;
+    uint64_t next;       // next section to take, shared by the workers
+    long restored;
+} RestoreJob;
+
+static void add_sharded(void *target, const char *key, const char *value, uint64_t ttl_ms) {
+    sharded_add((ShardedCache *)target, key, value, ttl_ms);
+}
+
+static void *restore_worker(void *arg) {
+    RestoreJob *job = (RestoreJob *)arg;
+    uint64_t s;
+    while ((s = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->snapshot->count) {
+        long restored = restore_section(job->snapshot, s, job->cache->cipher, add_sharded, job->cache);
+        __atomic_add_fetch(&job->restored, restored, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+// Function to add the entries of a snapshot to a sharded cache, one thread
+// per section up to the number of CPUs. Saved with as many shards as the
+// cache has, each section fills exactly one shard and the threads never
+// share a lock; otherwise each shard gets the records of every section in
+// their own order, interleaved.
+long sharded_restore(ShardedCache *cache, const char *path) {
+    Snapshot snapshot;
+    if (snapshot_map(&snapshot, path, cache->cipher) != 0) {
+        return -1;
+    }
+    RestoreJob job = {cache, &snapshot, 0, 0};
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cpus > 0 ? (size_t)cpus : 1;
+    if (threads > snapshot.count) {
+        threads = snapshot.count ? (size_t)snapshot.count : 1;
+    }
+    pthread_t *workers = (pthread_t *)malloc(threads * sizeof(pthread_t));
+    if (workers == NULL) {
+        perror("Failed to allocate memory for snapshot");
+        exit(EXIT_FAILURE);
+    }
+    size_t started = 0;
+    while (started < threads && pthread_create(&workers[started], NULL, restore_worker, &job) == 0) {
+        started++;
+    }
+    // Without any thread the sections are restored here
+    if (started == 0) {
+        restore_worker(&job);
+    }
+    for (size_t i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    munmap((void *)snapshot.data, snapshot.size);
+    return job.restored;
+}
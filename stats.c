@@ -0,0 +1,450 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include "cache.h"
+
+// Always-on cache statistics.
+// Each policy instance, and each thread's reader of a sharded cache, owns a
+// slot that only the thread driving it writes, and hands it back for reuse
+// when it goes away. Each thread is also given a small id the first time it
+// counts anything outside a policy, and every CacheStats keeps one slot
+// per id, written only by the thread holding the id. Writers use relaxed
+// atomic loads and stores that compile to ordinary moves, and readers add
+// the slots up without stopping the writers. Ids are handed back when a
+// thread exits and reused by the next thread, which carries on counting in
+// the same slots. When every id is taken, further threads count into the
+// shared slot with atomic adds.
+//
+// Only one operation in STATS_SAMPLE_EVERY is timed, so the cost of
+// reading the monotonic clock is spread thin; the latency histograms
+// describe the sampled operations.
+
+static pthread_once_t ids_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ids_key;
+static pthread_mutex_t ids_lock = PTHREAD_MUTEX_INITIALIZER;
+static int free_ids[STATS_MAX_THREADS];
+static int free_count;
+static int next_id;
+
+__thread int stats_thread;
+
+static void release_id(void *data) {
+    pthread_mutex_lock(&ids_lock);
+    free_ids[free_count++] = (int)(intptr_t)data - 1;
+    pthread_mutex_unlock(&ids_lock);
+}
+
+static void create_key(void) {
+    pthread_key_create(&ids_key, release_id);
+}
+
+// Function to give the calling thread its slot index
+static int assign_slot(void) {
+    pthread_once(&ids_once, create_key);
+    pthread_mutex_lock(&ids_lock);
+    int id = free_count > 0 ? free_ids[--free_count] : next_id < STATS_MAX_THREADS ? next_id++ : -1;
+    pthread_mutex_unlock(&ids_lock);
+    if (id < 0) {
+        stats_thread = STATS_MAX_THREADS + 1;
+    } else {
+        pthread_setspecific(ids_key, (void *)(intptr_t)(id + 1));
+        stats_thread = id + 1;
+    }
+    return stats_thread;
+}
+
+static StatsSlot *slot_alloc(int shared) {
+    StatsSlot *slot = (StatsSlot *)aligned_alloc(CACHE_LINE_SIZE, sizeof(StatsSlot));
+    if (slot == NULL) {
+        perror("Failed to allocate memory for cache statistics");
+        exit(EXIT_FAILURE);
+    }
+    memset(slot, 0, sizeof(*slot));
+    slot->countdown = STATS_SAMPLE_EVERY;
+    slot->shared = shared;
+    return slot;
+}
+
+// Function to find the calling thread's slot, giving the thread an id and
+// allocating the slot on first use; threads past the limit get the shared slot
+StatsSlot *stats_slot(CacheStats *stats) {
+    int id = stats_thread ? stats_thread : assign_slot();
+    if (id > STATS_MAX_THREADS) {
+        return stats->shared;
+    }
+    StatsSlot *slot = __atomic_load_n(&stats->slots[id], __ATOMIC_ACQUIRE);
+    if (slot == NULL) {
+        // Only the owner of an id installs its slot, so no other thread races for it
+        slot = slot_alloc(0);
+        __atomic_store_n(&stats->slots[id], slot, __ATOMIC_RELEASE);
+    }
+    return slot;
+}
+
+// Function to give a policy instance or a sharded cache's reader a slot of
+// its own, reusing one handed back by stats_disown if there is one. Slots
+// stay with the statistics until stats_destroy, so counts outlive owners.
+StatsSlot *stats_own(CacheStats *stats) {
+    for (StatsSlot *slot = __atomic_load_n(&stats->owned, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        int idle = 1;
+        if (__atomic_load_n(&slot->idle, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&slot->idle, &idle, 0, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return slot;
+        }
+    }
+    StatsSlot *slot = slot_alloc(0);
+    slot->next = __atomic_load_n(&stats->owned, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&stats->owned, &slot->next, slot, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    return slot;
+}
+
+// Function to hand a slot from stats_own back when its owner goes away
+void stats_disown(StatsSlot *slot) {
+    __atomic_store_n(&slot->idle, 1, __ATOMIC_RELEASE);
+}
+
+// Function to add n to a word of a slot's data, atomically if the slot is shared
+static void slot_add(StatsSlot *slot, uint64_t *word, uint64_t n) {
+    if (slot->shared) {
+        __atomic_fetch_add(word, n, __ATOMIC_RELAXED);
+    } else {
+        stats_bump(word, n);
+    }
+}
+
+// Function to count into word (an index into StatsSnapshot seen as words)
+// for a thread stats_count found no slot for (the slow path of stats_count)
+void stats_count_slow(CacheStats *stats, size_t word, uint64_t n) {
+    StatsSlot *slot = stats_slot(stats);
+    slot_add(slot, (uint64_t *)&slot->data + word, n);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t latency_bucket(uint64_t ns) {
+    if (ns < STATS_LATENCY_SUB) {
+        return (size_t)ns;
+    }
+    if (ns >> STATS_LATENCY_MAX_BITS) {
+        return STATS_LATENCY_BUCKETS - 1;
+    }
+    unsigned int e = 63 - __builtin_clzll(ns);
+    return ((size_t)(e - STATS_LATENCY_SUB_BITS + 1) << STATS_LATENCY_SUB_BITS) +
+           ((ns >> (e - STATS_LATENCY_SUB_BITS)) & (STATS_LATENCY_SUB - 1));
+}
+
+// Largest latency that falls into bucket b
+static uint64_t bucket_high(size_t b) {
+    if (b < STATS_LATENCY_SUB) {
+        return b;
+    }
+    unsigned int e = (unsigned int)(b >> STATS_LATENCY_SUB_BITS) + STATS_LATENCY_SUB_BITS - 1;
+    uint64_t low = (uint64_t)(STATS_LATENCY_SUB + (b & (STATS_LATENCY_SUB - 1))) << (e - STATS_LATENCY_SUB_BITS);
+    return low + ((uint64_t)1 << (e - STATS_LATENCY_SUB_BITS)) - 1;
+}
+
+// Function to create an empty set of statistics; the shared slot exists from the start
+CacheStats *stats_create(void) {
+    CacheStats *stats = (CacheStats *)calloc(1, sizeof(CacheStats));
+    if (stats == NULL) {
+        perror("Failed to allocate memory for cache statistics");
+        exit(EXIT_FAILURE);
+    }
+    stats->shared = slot_alloc(1);
+    return stats;
+}
+
+// Function to free the statistics; no thread may be counting into them
+void stats_destroy(CacheStats *stats) {
+    for (int i = 1; i <= STATS_MAX_THREADS; i++) {
+        free(stats->slots[i]);
+    }
+    free(stats->shared);
+    while (stats->owned) {
+        StatsSlot *next = stats->owned->next;
+        free(stats->owned);
+        stats->owned = next;
+    }
+    free(stats);
+}
+
+// Function to get the bytes taken by the statistics and every thread's slot
+size_t stats_memory(CacheStats *stats) {
+    size_t bytes = sizeof(CacheStats) + sizeof(StatsSlot);
+    for (int i = 1; i <= STATS_MAX_THREADS; i++) {
+        if (__atomic_load_n(&stats->slots[i], __ATOMIC_ACQUIRE)) {
+            bytes += sizeof(StatsSlot);
+        }
+    }
+    for (StatsSlot *slot = __atomic_load_n(&stats->owned, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        bytes += sizeof(StatsSlot);
+    }
+    return bytes;
+}
+
+// Function to start an operation stats_begin did not finish on its fast
+// path: the calling thread has no slot yet, its countdown ran out, or it
+// counts into the shared slot. The shared slot's countdown is decremented
+// here, atomically, and its untimed operations get STATS_UNTIMED so that
+// stats_end sends them to stats_finish for an atomic add.
+StatsSlot *stats_sample(CacheStats *stats, uint64_t *start) {
+    StatsSlot *slot = stats_slot(stats);
+    if (slot->shared && __atomic_sub_fetch(&slot->countdown, 1, __ATOMIC_RELAXED) > 0) {
+        *start = STATS_UNTIMED;
+        return slot;
+    }
+    __atomic_store_n(&slot->countdown, STATS_SAMPLE_EVERY, __ATOMIC_RELAXED);
+    *start = now_ns();
+    return slot;
+}
+
+// Function to read the clock for stats_open
+uint64_t stats_clock(void) {
+    return now_ns();
+}
+
+// Function to record the latency of the timed operation stats_close ended
+void stats_timed(StatsSlot *slot, int op) {
+    stats_bump(&slot->data.latency[op][latency_bucket(now_ns() - slot->start[op])], 1);
+    slot->start[op] = 0;
+}
+
+// Function to work out the hits or inserts of an owned slot: the gets or
+// puts it started that have not ended any other way. One still under way
+// counts until it ends, and the reads are not taken at one instant, so the
+// result is held at 0 rather than let go below it.
+static uint64_t owned_outcome(const StatsSlot *slot, int event) {
+    const uint64_t *c = slot->data.counters;
+    uint64_t ops, other;
+    if (event == STAT_HITS) {
+        other = __atomic_load_n(&c[STAT_MISSES], __ATOMIC_RELAXED) + __atomic_load_n(&c[STAT_TIER_HITS], __ATOMIC_RELAXED);
+        ops = __atomic_load_n(&slot->ops[STATS_GET], __ATOMIC_RELAXED);
+    } else {
+        other = __atomic_load_n(&c[STAT_UPDATES], __ATOMIC_RELAXED) + __atomic_load_n(&c[STAT_REJECTED], __ATOMIC_RELAXED);
+        ops = __atomic_load_n(&slot->ops[STATS_PUT], __ATOMIC_RELAXED);
+    }
+    return ops > other ? ops - other : 0;
+}
+
+// Function to finish an operation stats_sample started: counts its event
+// and, unless it was only counted, records its latency
+void stats_finish(StatsSlot *slot, int event, int op, uint64_t start) {
+    slot_add(slot, &slot->data.counters[event], 1);
+    if (start != STATS_UNTIMED) {
+        slot_add(slot, &slot->data.latency[op][latency_bucket(now_ns() - start)], 1);
+    }
+}
+
+// Function to add up every slot. Writers are not stopped, so the
+// figures may be a few events apart from each other, never torn.
+void stats_read(CacheStats *stats, StatsSnapshot *out) {
+    memset(out, 0, sizeof(*out));
+    uint64_t *sum = (uint64_t *)out;
+    size_t words = sizeof(StatsSnapshot) / sizeof(uint64_t);
+    // slots[0] is never used, so 0 stands for the shared slot
+    for (int i = 0; i <= STATS_MAX_THREADS; i++) {
+        StatsSlot *slot = i == 0 ? stats->shared : __atomic_load_n(&stats->slots[i], __ATOMIC_ACQUIRE);
+        if (slot == NULL) {
+            continue;
+        }
+        uint64_t *data = (uint64_t *)&slot->data;
+        for (size_t w = 0; w < words; w++) {
+            sum[w] += __atomic_load_n(&data[w], __ATOMIC_RELAXED);
+        }
+    }
+    for (StatsSlot *slot = __atomic_load_n(&stats->owned, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        uint64_t *data = (uint64_t *)&slot->data;
+        for (size_t w = 0; w < words; w++) {
+            sum[w] += __atomic_load_n(&data[w], __ATOMIC_RELAXED);
+        }
+        out->counters[STAT_HITS] += owned_outcome(slot, STAT_HITS);
+        out->counters[STAT_INSERTS] += owned_outcome(slot, STAT_INSERTS);
+    }
+    // The slots count lookups reaching each group; keep only those that stopped there
+    for (int b = 0; b + 1 < STATS_PROBE_BUCKETS; b++) {
+        out->probes[b] = out->probes[b] > out->probes[b + 1] ? out->probes[b] - out->probes[b + 1] : 0;
+    }
+}
+
+// Function to add up one event's counter over every slot, without
+// the copy of the whole snapshot stats_read makes
+uint64_t stats_total(CacheStats *stats, int event) {
+    uint64_t total = 0;
+    // slots[0] is never used, so 0 stands for the shared slot
+    for (int i = 0; i <= STATS_MAX_THREADS; i++) {
+        StatsSlot *slot = i == 0 ? stats->shared : __atomic_load_n(&stats->slots[i], __ATOMIC_ACQUIRE);
+        if (slot) {
+            total += __atomic_load_n(&slot->data.counters[event], __ATOMIC_RELAXED);
+        }
+    }
+    for (StatsSlot *slot = __atomic_load_n(&stats->owned, __ATOMIC_ACQUIRE); slot; slot = slot->next) {
+        total += event == STAT_HITS || event == STAT_INSERTS ? owned_outcome(slot, event)
+                                                             : __atomic_load_n(&slot->data.counters[event], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+// Function to get the latency, in nanoseconds, below which a fraction q of
+// the timed operations of one kind fell (the top of the bucket holding it)
+uint64_t stats_percentile(const StatsSnapshot *snapshot, int op, double q) {
+    uint64_t total = 0;
+    for (size_t b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+        total += snapshot->latency[op][b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(q * total);
+    if (rank >= total) {
+        rank = total - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t b = 0; b < STATS_LATENCY_BUCKETS; b++) {
+        seen += snapshot->latency[op][b];
+        if (seen > rank) {
+            return bucket_high(b);
+        }
+    }
+    return bucket_high(STATS_LATENCY_BUCKETS - 1);
+}
+
+// Function to print a snapshot in the style of metric()
+void stats_print(const StatsSnapshot *s) {
+    const uint64_t *c = s->counters;
+    uint64_t lookups = c[STAT_HITS] + c[STAT_MISSES] + c[STAT_TIER_HITS];
+    uint64_t collisions = 0;
+    for (int b = 0; b < STATS_PROBE_BUCKETS; b++) {
+        collisions += s->probes[b];
+    }
+    printf("\nCache Statistics:\n");
+    printf("-------------------------------------------------\n");
+    printf("| %-30s | %-12llu |\n", "Hits", (unsigned long long)c[STAT_HITS]);
+    printf("| %-30s | %-12llu |\n", "Misses", (unsigned long long)c[STAT_MISSES]);
+    printf("| %-30s | %11.2f%% |\n", "Hit ratio", lookups ? 100.0 * c[STAT_HITS] / lookups : 0.0);
+    printf("| %-30s | %-12llu |\n", "Inserts", (unsigned long long)c[STAT_INSERTS]);
+    printf("| %-30s | %-12llu |\n", "Updates", (unsigned long long)c[STAT_UPDATES]);
+    printf("| %-30s | %-12llu |\n", "Rejected", (unsigned long long)c[STAT_REJECTED]);
+    printf("| %-30s | %-12llu |\n", "Evicted for entry count", (unsigned long long)c[STAT_EVICT_CAPACITY]);
+    printf("| %-30s | %-12llu |\n", "Evicted for byte budget", (unsigned long long)c[STAT_EVICT_BYTES]);
+    printf("| %-30s | %-12llu |\n", "Expired", (unsigned long long)c[STAT_EXPIRED]);
+    printf("| %-30s | %-12llu |\n", "Bytes used", (unsigned long long)(c[STAT_BYTES_ADDED] - c[STAT_BYTES_REMOVED]));
+    printf("| %-30s | %-12llu |\n", "Loads", (unsigned long long)c[STAT_LOADS]);
+    printf("| %-30s | %-12llu |\n", "Misses waiting on a load", (unsigned long long)c[STAT_LOAD_WAITS]);
+    printf("| %-30s | %-12llu |\n", "Stale hits", (unsigned long long)c[STAT_STALE_HITS]);
+    printf("| %-30s | %-12llu |\n", "File tier hits", (unsigned long long)c[STAT_TIER_HITS]);
+    printf("| %-30s | %-12llu |\n", "Written to file tier", (unsigned long long)c[STAT_TIER_WRITES]);
+    if (c[STAT_COMPRESS_IN]) {
+        printf("| %-30s | %-12llu |\n", "Values compressed", (unsigned long long)c[STAT_COMPRESSED]);
+        printf("| %-30s | %11.2fx |\n", "Compression ratio", (double)c[STAT_COMPRESS_IN] / c[STAT_COMPRESS_OUT]);
+        printf("| %-30s | %-12.0f |\n", "Compress MB/s", c[STAT_COMPRESS_NS] ? 1e3 * c[STAT_COMPRESS_IN] / c[STAT_COMPRESS_NS] : 0.0);
+        printf("| %-30s | %-12.0f |\n", "Decompress ns per value",
+               c[STAT_DECOMPRESSED] ? (double)c[STAT_DECOMPRESS_NS] / c[STAT_DECOMPRESSED] : 0.0);
+    }
+    printf("| %-30s | %-12llu |\n", "Lookups probing 2+ groups", (unsigned long long)collisions);
+    printf("| %-30s | %-12llu |\n", "Lookups probing 9+ groups", (unsigned long long)s->probes[STATS_PROBE_BUCKETS - 1]);
+    const char *names[STATS_OPS] = {"Get", "Put"};
+    for (int op = 0; op < STATS_OPS; op++) {
+        char label[32];
+        snprintf(label, sizeof(label), "%s p50/p99/p99.9 (ns)", names[op]);
+        char value[40];
+        snprintf(value, sizeof(value), "%llu/%llu/%llu", (unsigned long long)stats_percentile(s, op, 0.50),
+                 (unsigned long long)stats_percentile(s, op, 0.99), (unsigned long long)stats_percentile(s, op, 0.999));
+        printf("| %-30s | %-12s |\n", label, value);
+    }
+    printf("-------------------------------------------------\n");
+}
+
+// Prints the change since the last dump as one line of per-second rates
+static void dump_line(StatsDumper *dumper, const StatsSnapshot *now, double seconds) {
+    StatsSnapshot delta;
+    uint64_t *d = (uint64_t *)&delta;
+    const uint64_t *a = (const uint64_t *)now, *b = (const uint64_t *)&dumper->last;
+    for (size_t w = 0; w < sizeof(StatsSnapshot) / sizeof(uint64_t); w++) {
+        d[w] = a[w] - b[w];
+    }
+    const uint64_t *c = delta.counters;
+    uint64_t lookups = c[STAT_HITS] + c[STAT_MISSES] + c[STAT_TIER_HITS];
+    fprintf(stderr,
+            "stats: %.0f gets/s hit %.2f%% | %.0f inserts/s %.0f updates/s | evicted/s %.0f for count %.0f for bytes"
+            " | %.0f expired/s | %.0f loads/s | %llu bytes used | get p99 %llu ns put p99 %llu ns\n",
+            lookups / seconds, lookups ? 100.0 * c[STAT_HITS] / lookups : 0.0, c[STAT_INSERTS] / seconds,
+            c[STAT_UPDATES] / seconds, c[STAT_EVICT_CAPACITY] / seconds, c[STAT_EVICT_BYTES] / seconds,
+            c[STAT_EXPIRED] / seconds, c[STAT_LOADS] / seconds,
+            (unsigned long long)(now->counters[STAT_BYTES_ADDED] - now->counters[STAT_BYTES_REMOVED]),
+            (unsigned long long)stats_percentile(&delta, STATS_GET, 0.99),
+            (unsigned long long)stats_percentile(&delta, STATS_PUT, 0.99));
+    dumper->last = *now;
+}
+
+static void *run_dumper(void *arg) {
+    StatsDumper *dumper = (StatsDumper *)arg;
+    StatsSnapshot *now = (StatsSnapshot *)malloc(sizeof(StatsSnapshot));
+    if (now == NULL) {
+        return NULL;
+    }
+    pthread_mutex_lock(&dumper->lock);
+    uint64_t last = now_ns();
+    while (!dumper->stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += dumper->interval_ms / 1000;
+        until.tv_nsec += (long)(dumper->interval_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000;
+        }
+        while (!dumper->stop && pthread_cond_timedwait(&dumper->wake, &dumper->lock, &until) != ETIMEDOUT) {
+        }
+        if (dumper->stop) {
+            break;
+        }
+        uint64_t t = now_ns();
+        stats_read(dumper->stats, now);
+        dump_line(dumper, now, (t - last) / 1e9);
+        last = t;
+    }
+    pthread_mutex_unlock(&dumper->lock);
+    free(now);
+    return NULL;
+}
+
+// Function to print the rates of the statistics to stderr every interval_ms
+// milliseconds from a background thread, so a burst of evictions shows up
+// while it is happening
+StatsDumper *stats_dump_start(CacheStats *stats, unsigned int interval_ms) {
+    StatsDumper *dumper = (StatsDumper *)malloc(sizeof(StatsDumper));
+    if (dumper == NULL) {
+        perror("Failed to allocate memory for statistics dump");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&dumper->lock, NULL);
+    pthread_cond_init(&dumper->wake, NULL);
+    dumper->stop = 0;
+    dumper->stats = stats;
+    dumper->interval_ms = interval_ms ? interval_ms : 1000;
+    stats_read(stats, &dumper->last);
+    if (pthread_create(&dumper->thread, NULL, run_dumper, dumper) != 0) {
+        perror("Failed to start statistics dump");
+        exit(EXIT_FAILURE);
+    }
+    return dumper;
+}
+
+// Function to stop the dump thread and free it
+void stats_dump_stop(StatsDumper *dumper) {
+    pthread_mutex_lock(&dumper->lock);
+    dumper->stop = 1;
+    pthread_cond_signal(&dumper->wake);
+    pthread_mutex_unlock(&dumper->lock);
+    pthread_join(dumper->thread, NULL);
+    pthread_cond_destroy(&dumper->wake);
+    pthread_mutex_destroy(&dumper->lock);
+    free(dumper);
+}
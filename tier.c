@@ -0,0 +1,328 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "cache.h"
+
+// File tier under a policy's cache: evicted entries appended to a log of
+// regions on disk, found again through a compact in-memory index.
+// A record is a TierRecord header followed by the key and the value as
+// stored, neither NUL-terminated. Log positions only grow; position p lives
+// in region p / TIER_REGION_BYTES, which sits in the file at that number
+// modulo the region count. A record never straddles two regions.
+
+#define TIER_INITIAL_SLOTS 1024
+
+typedef struct TierRecord {
+    uint32_t key_len;
+    uint32_t value_len;   // bytes stored, cipher header included
+    uint64_t expires;     // wheel_now() deadline, 0 for no TTL
+} TierRecord;
+
+static void *checked_malloc(size_t size) {
+    void *p = malloc(size);
+    if (p == NULL) {
+        perror("Failed to allocate memory for file tier");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+static TierSlot *slots_alloc(size_t count) {
+    TierSlot *slots = checked_malloc(count * sizeof(TierSlot));
+    memset(slots, 0, count * sizeof(TierSlot));
+    return slots;
+}
+
+// First log position still on disk; records before it have been overwritten
+static uint64_t oldest(const FileTier *tier) {
+    uint64_t region = tier->head / TIER_REGION_BYTES;
+    return region + 1 > tier->regions ? (region + 1 - tier->regions) * TIER_REGION_BYTES : 0;
+}
+
+static int stale(const FileTier *tier, const TierSlot *slot) {
+    return slot->pos < oldest(tier);
+}
+
+// Empties slot i, shifting back later slots of the same run so probes need no tombstones
+static void slot_delete(FileTier *tier, size_t i) {
+    TierSlot *slots = tier->slots;
+    for (size_t j = (i + 1) & tier->mask; slots[j].len != 0; j = (j + 1) & tier->mask) {
+        size_t home = slots[j].tag & tier->mask;
+        // Move slot j down only if i lies between its home and j
+        if (((j - home) & tier->mask) >= ((j - i) & tier->mask)) {
+            slots[i] = slots[j];
+            i = j;
+        }
+    }
+    slots[i].len = 0;
+    tier->count--;
+}
+
+// Reads the first len bytes of slot's record into scratch, from the region
+// being filled or from the file; -1 if the read comes up short
+static int record_load(FileTier *tier, const TierSlot *slot, size_t len) {
+    if (tier->scratch_size < len + 1) {
+        free(tier->scratch);
+        tier->scratch_size = 2 * len + 2;
+        tier->scratch = checked_malloc(tier->scratch_size);
+    }
+    uint64_t region = slot->pos / TIER_REGION_BYTES;
+    if (region == tier->head / TIER_REGION_BYTES) {
+        memcpy(tier->scratch, tier->buffer + slot->pos % TIER_REGION_BYTES, len);
+    } else {
+        off_t offset = (off_t)(region % tier->regions) * TIER_REGION_BYTES + slot->pos % TIER_REGION_BYTES;
+        ssize_t n;
+        while ((n = pread(tier->fd, tier->scratch, len, offset)) < 0 && errno == EINTR) {
+        }
+        if (n != (ssize_t)len) {
+            return -1;
+        }
+    }
+    tier->scratch[len] = '\0';
+    return 0;
+}
+
+// Whether the record in scratch is key's
+static int record_is(const FileTier *tier, const char *key, size_t key_len) {
+    TierRecord record;
+    memcpy(&record, tier->scratch, sizeof(record));
+    return record.key_len == key_len && memcmp(tier->scratch + sizeof(record), key, key_len) == 0;
+}
+
+// Index of the slot with this tag, or of the empty slot ending its run
+static size_t slot_find(const FileTier *tier, uint32_t tag) {
+    size_t i = tag & tier->mask;
+    while (tier->slots[i].len != 0 && tier->slots[i].tag != tag) {
+        i = (i + 1) & tier->mask;
+    }
+    return i;
+}
+
+// Rebuilds the index without its stale slots, twice as large if it is still over half full
+static void slots_rebuild(FileTier *tier) {
+    size_t live = 0;
+    for (size_t i = 0; i <= tier->mask; i++) {
+        if (tier->slots[i].len != 0 && !stale(tier, &tier->slots[i])) {
+            live++;
+        }
+    }
+    size_t size = tier->mask + 1;
+    if (live * 2 > size) {
+        size *= 2;
+    }
+    TierSlot *old = tier->slots;
+    size_t old_size = tier->mask + 1;
+    tier->slots = slots_alloc(size);
+    tier->mask = size - 1;
+    tier->count = live;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].len != 0 && !stale(tier, &old[i])) {
+            tier->slots[slot_find(tier, old[i].tag)] = old[i];
+        }
+    }
+    free(old);
+}
+
+// Writes the region being filled out whole and moves the head to the next one
+static void region_flush(FileTier *tier) {
+    uint64_t region = tier->head / TIER_REGION_BYTES;
+    size_t used = tier->head - region * TIER_REGION_BYTES;
+    off_t offset = (off_t)(region % tier->regions) * TIER_REGION_BYTES;
+    size_t done = 0;
+    while (done < used) {
+        ssize_t n = pwrite(tier->fd, tier->buffer + done, used - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            perror("Failed to write file tier");
+            exit(EXIT_FAILURE);
+        }
+        done += (size_t)n;
+    }
+    tier->head = (region + 1) * TIER_REGION_BYTES;
+}
+
+// Function to open a file tier for one cache in options->tier_dir, or return
+// NULL if the options ask for none. A file that cannot be created ends the
+// process, as running out of memory for the cache would.
+FileTier *tier_open(const CacheOptions *options, CacheStats *stats) {
+    if (options == NULL || options->tier_dir == NULL) {
+        return NULL;
+    }
+    int fd = open(options->tier_dir, O_TMPFILE | O_RDWR, 0600);
+    if (fd < 0) {
+        // Filesystems without O_TMPFILE get a named file, unlinked straight away
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/cache-tier-XXXXXX", options->tier_dir);
+        fd = mkstemp(path);
+        if (fd >= 0) {
+            unlink(path);
+        }
+    }
+    if (fd < 0) {
+        perror(options->tier_dir);
+        exit(EXIT_FAILURE);
+    }
+
+    FileTier *tier = checked_malloc(sizeof(FileTier));
+    tier->fd = fd;
+    tier->regions = options->tier_bytes / TIER_REGION_BYTES;
+    if (tier->regions < TIER_MIN_REGIONS) {
+        tier->regions = TIER_MIN_REGIONS;
+    }
+    tier->head = 0;
+    tier->buffer = checked_malloc(TIER_REGION_BYTES);
+    tier->slots = slots_alloc(TIER_INITIAL_SLOTS);
+    tier->mask = TIER_INITIAL_SLOTS - 1;
+    tier->count = 0;
+    tier->scratch = NULL;
+    tier->scratch_size = 0;
+    tier->stats = stats;
+    return tier;
+}
+
+// Function to append an entry being evicted from memory to the tier. Entries
+// past their TTL, or too large for a region, are dropped instead.
+void tier_put(FileTier *tier, KeyValue *kv) {
+    if (tier == NULL || kv_expired(kv)) {
+        return;
+    }
+    size_t len = sizeof(TierRecord) + kv->key_len + kv->value_len;
+    if (len > TIER_REGION_BYTES) {
+        return;
+    }
+    tier_remove(tier, kv_key(kv), kv->hash);
+    if (tier->head % TIER_REGION_BYTES + len > TIER_REGION_BYTES) {
+        region_flush(tier);
+    }
+
+    TierRecord record = {kv->key_len, kv->value_len, __atomic_load_n(&kv->timer.expires, __ATOMIC_RELAXED)};
+    char *p = tier->buffer + tier->head % TIER_REGION_BYTES;
+    memcpy(p, &record, sizeof(record));
+    memcpy(p + sizeof(record), kv_key(kv), kv->key_len);
+    memcpy(p + sizeof(record) + kv->key_len, kv->value, kv->value_len);
+
+    // A slot still holding another key with the same tag is taken over, dropping that key
+    uint32_t tag = (uint32_t)(kv->hash >> 32);
+    TierSlot *slot = &tier->slots[slot_find(tier, tag)];
+    if (slot->len == 0) {
+        tier->count++;
+    }
+    slot->tag = tag;
+    slot->len = (uint32_t)len;
+    slot->pos = tier->head;
+    tier->head += len;
+    if (tier->count * 4 > (tier->mask + 1) * 3) {
+        slots_rebuild(tier);
+    }
+    if (tier->stats) {
+        stats_count(tier->stats, STAT_TIER_WRITES, 1);
+    }
+}
+
+// Function to take key out of the tier and return its plain value, or NULL
+// if the tier does not have it. The value stays valid until the next call
+// on the tier, and *ttl_ms is set to what is left of its TTL (0 for none).
+// The caller adds it back to the cache.
+const char *tier_get(FileTier *tier, const Cipher *cipher, const char *key, uint64_t hash, uint64_t *ttl_ms) {
+    if (tier == NULL) {
+        return NULL;
+    }
+    size_t i = slot_find(tier, (uint32_t)(hash >> 32));
+    TierSlot slot = tier->slots[i];
+    if (slot.len == 0) {
+        return NULL;
+    }
+    if (stale(tier, &slot)) {
+        slot_delete(tier, i);
+        return NULL;
+    }
+
+    // The record and a NUL after it, then the plain value once its length is known
+    if (record_load(tier, &slot, slot.len) != 0) {
+        slot_delete(tier, i);
+        return NULL;
+    }
+    // A different key with the same tag keeps its record
+    if (!record_is(tier, key, strlen(key))) {
+        return NULL;
+    }
+    slot_delete(tier, i);
+
+    TierRecord record;
+    memcpy(&record, tier->scratch, sizeof(record));
+    const char *stored_key = tier->scratch + sizeof(record);
+    uint64_t now = wheel_now();
+    if (record.expires != 0 && record.expires <= now) {
+        return NULL;
+    }
+    // A compressed value comes out longer than it was stored
+    long plain_len = cipher_read(cipher, stored_key + record.key_len, NULL, 0);
+    if (plain_len < 0) {
+        return NULL;
+    }
+    size_t need = (size_t)slot.len + 1 + (size_t)plain_len + 1;
+    if (tier->scratch_size < need) {
+        tier->scratch = (char *)realloc(tier->scratch, need);
+        if (tier->scratch == NULL) {
+            perror("Failed to allocate memory for file tier");
+            exit(EXIT_FAILURE);
+        }
+        tier->scratch_size = need;
+        stored_key = tier->scratch + sizeof(record);
+    }
+    *ttl_ms = record.expires ? record.expires - now : 0;
+    char *value = tier->scratch + slot.len + 1;
+    if (cipher_read(cipher, stored_key + record.key_len, value, (size_t)plain_len + 1) < 0) {
+        return NULL;
+    }
+    return value;
+}
+
+// Function to drop key from the tier once the cache holds a newer value for
+// it. A record with the same tag is read back (its header and key only) and
+// kept if it belongs to another key.
+void tier_remove(FileTier *tier, const char *key, uint64_t hash) {
+    if (tier == NULL) {
+        return;
+    }
+    size_t i = slot_find(tier, (uint32_t)(hash >> 32));
+    TierSlot slot = tier->slots[i];
+    if (slot.len == 0) {
+        return;
+    }
+    if (stale(tier, &slot)) {
+        slot_delete(tier, i);
+        return;
+    }
+    // A record shorter than key's header and key is another key's; one that cannot be read is dropped
+    size_t key_len = strlen(key);
+    size_t len = sizeof(TierRecord) + key_len;
+    if (len <= slot.len && (record_load(tier, &slot, len) != 0 || record_is(tier, key, key_len))) {
+        slot_delete(tier, i);
+    }
+}
+
+// Function to get the bytes the tier has taken from malloc
+size_t tier_memory(const FileTier *tier) {
+    if (tier == NULL) {
+        return 0;
+    }
+    return sizeof(FileTier) + TIER_REGION_BYTES + (tier->mask + 1) * sizeof(TierSlot) + tier->scratch_size;
+}
+
+void tier_close(FileTier *tier) {
+    if (tier == NULL) {
+        return;
+    }
+    close(tier->fd);
+    free(tier->buffer);
+    free(tier->slots);
+    free(tier->scratch);
+    free(tier);
+}
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include "cache.h"
+
+// Hierarchical timing wheel for entry expiry.
+// Time is counted in millisecond ticks. Level 0 has one slot per tick for
+// the next 64 ticks, level 1 one slot per 64 ticks for the next 4096, and
+// so on, each level 64 times coarser than the one below. An entry with a
+// TTL is linked into the slot of the coarsest level that still tells its
+// deadline apart from now, in O(1). When the wheel turns past the start of
+// a coarse slot, that slot's entries are moved down a level (cascaded),
+// and entries reaching a level 0 slot are expired as the wheel passes it.
+// Each entry is cascaded at most once per level, so expiring N entries
+// costs O(N) in total, and one occupancy bitmap per level lets the wheel
+// jump straight to the next slot with something in it.
+
+#define WHEEL_BITS 6
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+
+// Furthest tick ahead the top level can tell apart; later deadlines wait in its last slot
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+static KeyValue *kv_of(TimerNode *node) {
+    return (KeyValue *)((char *)node - offsetof(KeyValue, timer));
+}
+
+// Function to read the monotonic clock in milliseconds
+uint64_t wheel_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Function to set up an empty wheel at the current time
+void wheel_init(TimerWheel *wheel) {
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = wheel_now();
+}
+
+// Links node into the slot for its deadline, relative to wheel->now
+static void place(TimerWheel *wheel, TimerNode *node) {
+    uint64_t at = node->expires;
+    if (at < wheel->now) {
+        at = wheel->now;
+    }
+    uint64_t delta = at - wheel->now;
+    if (delta >= WHEEL_SPAN) {
+        at = wheel->now + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    unsigned int slot = (at >> (WHEEL_BITS * level)) & WHEEL_MASK;
+
+    node->next = wheel->slots[level][slot];
+    if (node->next) {
+        node->next->pprev = &node->next;
+    }
+    node->pprev = &wheel->slots[level][slot];
+    wheel->slots[level][slot] = node;
+    wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+// Unlinks node from whichever slot holds it
+static void unlink_node(TimerWheel *wheel, TimerNode *node) {
+    *node->pprev = node->next;
+    if (node->next) {
+        node->next->pprev = node->pprev;
+    } else if (node->pprev >= &wheel->slots[0][0] && node->pprev < &wheel->slots[0][0] + WHEEL_LEVELS * WHEEL_SLOTS) {
+        // It was alone in its slot, which is now empty
+        size_t i = node->pprev - &wheel->slots[0][0];
+        wheel->occupied[i / WHEEL_SLOTS] &= ~((uint64_t)1 << (i % WHEEL_SLOTS));
+    }
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+// Function to give an entry a TTL of ttl_ms from now, replacing any it had; 0 removes it
+void wheel_set_ttl(TimerWheel *wheel, KeyValue *kv, uint64_t ttl_ms) {
+    wheel_cancel(wheel, kv);
+    if (ttl_ms == 0) {
+        return;
+    }
+    uint64_t now = wheel_now();
+    if (wheel->count == 0) {
+        // Nothing is scheduled, so the wheel can jump straight to now
+        wheel->now = now;
+    }
+    __atomic_store_n(&kv->timer.expires, now + ttl_ms, __ATOMIC_RELAXED);
+    place(wheel, &kv->timer);
+    wheel->count++;
+}
+
+// Function to take an entry off the wheel, if it is on it, and clear its deadline
+void wheel_cancel(TimerWheel *wheel, KeyValue *kv) {
+    if (kv->timer.pprev) {
+        unlink_node(wheel, &kv->timer);
+        wheel->count--;
+    }
+    if (kv->timer.expires) {
+        __atomic_store_n(&kv->timer.expires, 0, __ATOMIC_RELAXED);
+    }
+}
+
+// Moves every node in a slot one or more levels down
+static void cascade(TimerWheel *wheel, int level, unsigned int slot) {
+    TimerNode *node = wheel->slots[level][slot];
+    wheel->slots[level][slot] = NULL;
+    wheel->occupied[level] &= ~((uint64_t)1 << slot);
+    while (node) {
+        TimerNode *next = node->next;
+        place(wheel, node);
+        node = next;
+    }
+}
+
+// Earliest tick after wheel->now at which a busy slot is due. A slot at
+// level l is due when its 64^l tick period starts; slots behind the current
+// position of a level belong to its next turn.
+static uint64_t next_tick(const TimerWheel *wheel) {
+    uint64_t best = UINT64_MAX;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        uint64_t bits = wheel->occupied[level];
+        if (bits == 0) {
+            continue;
+        }
+        unsigned int shift = WHEEL_BITS * level;
+        uint64_t start = (wheel->now >> shift) + 1;
+        uint64_t ahead = bits >> (start & WHEEL_MASK);
+        uint64_t period = ahead ? start + __builtin_ctzll(ahead) : (start | WHEEL_MASK) + 1 + __builtin_ctzll(bits);
+        if ((period << shift) < best) {
+            best = period << shift;
+        }
+    }
+    return best;
+}
+
+// Function to turn the wheel to now, calling expire(owner, kv) for every
+// entry whose deadline has passed. The entry is off the wheel by then, so
+// expire may release it; its deadline stays set, so readers that still
+// see it treat it as expired.
+void wheel_advance(TimerWheel *wheel, uint64_t now, ExpireFn expire, void *owner) {
+    while (wheel->count > 0) {
+        uint64_t tick = next_tick(wheel);
+        if (tick > now) {
+            break;
+        }
+        wheel->now = tick;
+
+        // Cascade from the coarsest level whose period starts here downwards
+        int top = 0;
+        while (top < WHEEL_LEVELS - 1 && (tick & (((uint64_t)1 << (WHEEL_BITS * (top + 1))) - 1)) == 0) {
+            top++;
+        }
+        for (int level = top; level >= 1; level--) {
+            cascade(wheel, level, (tick >> (WHEEL_BITS * level)) & WHEEL_MASK);
+        }
+
+        unsigned int slot = tick & WHEEL_MASK;
+        TimerNode *node = wheel->slots[0][slot];
+        wheel->slots[0][slot] = NULL;
+        wheel->occupied[0] &= ~((uint64_t)1 << slot);
+        while (node) {
+            TimerNode *next = node->next;
+            node->next = NULL;
+            node->pprev = NULL;
+            wheel->count--;
+            expire(owner, kv_of(node));
+            node = next;
+        }
+    }
+    if (now > wheel->now) {
+        wheel->now = now;
+    }
+}
+
+// Function to expire whatever is due; costs nothing while no entry has a TTL
+void wheel_expire(TimerWheel *wheel, ExpireFn expire, void *owner) {
+    if (wheel->count > 0) {
+        wheel_advance(wheel, wheel_now(), expire, owner);
+    }
+}
+
+// Function to tell whether an entry's TTL has run out; the wheel may not have reclaimed it yet
+int kv_expired(const KeyValue *kv) {
+    uint64_t expires = __atomic_load_n(&kv->timer.expires, __ATOMIC_RELAXED);
+    return expires != 0 && expires <= wheel_now();
+}
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cache.h"
+
+// TinyLFU admission.
+// A cache that inserts every miss lets keys seen once push out keys that
+// are read all the time. TinyLFU keeps an approximate access count for
+// every key, cached or not, and only lets a new key in when it has been
+// seen more often than the entry the policy would evict to make room.
+//
+// The counts live in a count-min sketch: SKETCH_DEPTH rows of 4-bit
+// counters, packed sixteen to a word, and a key's estimate is the smallest
+// of its counters. After sample_size recorded accesses every counter is
+// halved, so popularity that is no longer being renewed fades away.
+// In front of the sketch sits the doorkeeper, a small Bloom filter that
+// takes the first access to each key. Most keys on a skewed workload are
+// seen once per sample, and they never take up counters in the sketch.
+
+static const uint64_t row_seeds[SKETCH_DEPTH] = {
+    0x97CB3127F3E0DBD5ULL, 0xC2B2AE3D27D4EB4FULL, 0x165667B19E3779F9ULL, 0xD6E8FEB86659FD93ULL
+};
+
+// Every counter shifted right by one, with the bit that crosses into the next nibble masked off
+#define SKETCH_HALF_MASK 0x7777777777777777ULL
+
+// Smallest sketch, in words, and recorded accesses per word between two halvings
+#define SKETCH_MIN_WORDS 64
+#define SKETCH_SAMPLE_FACTOR 40
+
+static size_t next_power_of_two(size_t n) {
+    size_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+// Word and bit offset of the counter for hash in row i
+static void counter_for(const TinyLFU *filter, uint64_t hash, int i, size_t *word, unsigned int *shift) {
+    uint64_t x = (hash ^ row_seeds[i]) * 0x9E3779B97F4A7C15ULL;
+    x ^= x >> 32;
+    *word = x & filter->table_mask;
+    *shift = (unsigned int)(x >> 60) << 2;
+}
+
+// The two doorkeeper bits for hash
+static void doorkeeper_bits(const TinyLFU *filter, uint64_t hash, size_t *a, size_t *b) {
+    uint64_t x = hash * 0xFF51AFD7ED558CCDULL;
+    *a = x & filter->doorkeeper_mask;
+    *b = (x >> 32) & filter->doorkeeper_mask;
+}
+
+static int doorkeeper_contains(const TinyLFU *filter, size_t a, size_t b) {
+    return (filter->doorkeeper[a >> 6] >> (a & 63) & 1) && (filter->doorkeeper[b >> 6] >> (b & 63) & 1);
+}
+
+// Function to halve every counter and empty the doorkeeper
+static void age(TinyLFU *filter) {
+    for (size_t i = 0; i <= filter->table_mask; i++) {
+        filter->table[i] = (filter->table[i] >> 1) & SKETCH_HALF_MASK;
+    }
+    memset(filter->doorkeeper, 0, ((filter->doorkeeper_mask >> 6) + 1) * sizeof(uint64_t));
+    filter->additions /= 2;
+}
+
+// Function to size a filter for a cache of capacity entries: one sketch
+// word and sixteen doorkeeper bits per entry, rounded up to a power of two.
+// Tiny caches still get SKETCH_MIN_WORDS words, or a sample would be too
+// short to tell a popular key from a lucky one.
+void tinylfu_init(TinyLFU *filter, size_t capacity) {
+    size_t words = next_power_of_two(capacity < SKETCH_MIN_WORDS ? SKETCH_MIN_WORDS : capacity);
+    size_t bits = words * 16;
+    filter->table = (uint64_t *)calloc(words, sizeof(uint64_t));
+    filter->doorkeeper = (uint64_t *)calloc(bits >> 6, sizeof(uint64_t));
+    if (filter->table == NULL || filter->doorkeeper == NULL) {
+        perror("Failed to allocate memory for admission filter");
+        exit(EXIT_FAILURE);
+    }
+    filter->table_mask = words - 1;
+    filter->doorkeeper_mask = bits - 1;
+    filter->additions = 0;
+    filter->sample_size = words * SKETCH_SAMPLE_FACTOR;
+}
+
+// Function to count one access to the key with this hash
+void tinylfu_record(TinyLFU *filter, uint64_t hash) {
+    size_t a, b;
+    doorkeeper_bits(filter, hash, &a, &b);
+    if (!doorkeeper_contains(filter, a, b)) {
+        // First access this sample: only the doorkeeper remembers it
+        filter->doorkeeper[a >> 6] |= 1ULL << (a & 63);
+        filter->doorkeeper[b >> 6] |= 1ULL << (b & 63);
+    } else {
+        for (int i = 0; i < SKETCH_DEPTH; i++) {
+            size_t word;
+            unsigned int shift;
+            counter_for(filter, hash, i, &word, &shift);
+            if ((filter->table[word] >> shift & 0xF) < 0xF) {
+                filter->table[word] += 1ULL << shift;
+            }
+        }
+    }
+    if (++filter->additions >= filter->sample_size) {
+        age(filter);
+    }
+}
+
+// Function to estimate how often the key with this hash was accessed recently
+unsigned int tinylfu_estimate(const TinyLFU *filter, uint64_t hash) {
+    unsigned int min = 0xF;
+    for (int i = 0; i < SKETCH_DEPTH; i++) {
+        size_t word;
+        unsigned int shift;
+        counter_for(filter, hash, i, &word, &shift);
+        unsigned int count = filter->table[word] >> shift & 0xF;
+        if (count < min) {
+            min = count;
+        }
+    }
+    size_t a, b;
+    doorkeeper_bits(filter, hash, &a, &b);
+    return min + (doorkeeper_contains(filter, a, b) ? 1 : 0);
+}
+
+// Function to decide whether a new key may replace the victim: only when it is strictly more popular
+int tinylfu_admit(const TinyLFU *filter, uint64_t candidate, uint64_t victim) {
+    return tinylfu_estimate(filter, candidate) > tinylfu_estimate(filter, victim);
+}
+
+// Function to free the filter's tables
+void tinylfu_free(TinyLFU *filter) {
+    free(filter->table);
+    free(filter->doorkeeper);
+    filter->table = NULL;
+    filter->doorkeeper = NULL;
+}
+
+// Function to create a policy instance of capacity entries behind an admission filter
+AdmissionCache *admission_create(const CachePolicy *policy, size_t capacity, const CacheOptions *options) {
+    AdmissionCache *cache = (AdmissionCache *)malloc(sizeof(AdmissionCache));
+    if (cache == NULL) {
+        perror("Failed to allocate memory for admission cache");
+        exit(EXIT_FAILURE);
+    }
+    cache->policy = policy;
+    cache->cache = policy->create(capacity, options);
+    tinylfu_init(&cache->filter, capacity);
+    cache->rejected = 0;
+    return cache;
+}
+
+// Function to add or update an entry. Updates always go through; a new key
+// that would force an eviction goes in only if the filter prefers it.
+// The write is the access that gets counted, so a miss followed by an add
+// counts once, the same as a hit.
+void admission_add(AdmissionCache *cache, const char *key, const char *value, uint64_t ttl_ms) {
+    uint64_t h = key_hash(key);
+    tinylfu_record(&cache->filter, h);
+    KeyValue *kv = (KeyValue *)cache->policy->lookup(cache->cache, key, h);
+    // Entries without a value are ghosts (ARC) and, like expired ones, count as new keys
+    if ((kv == NULL || kv->value == NULL || kv_expired(kv)) && cache->policy->victim) {
+        KeyValue *victim = (KeyValue *)cache->policy->victim(cache->cache);
+        if (victim && !tinylfu_admit(&cache->filter, h, victim->hash)) {
+            cache->rejected++;
+            stats_count(cache->policy->stats(cache->cache), STAT_REJECTED, 1);
+            return;
+        }
+    }
+    cache->policy->add(cache->cache, key, value, ttl_ms);
+}
+
+// Function to look a key up; a hit is counted as an access, a miss is
+// counted by the add that fills it. A hit bypasses the policy's get, so it
+// goes into the policy's statistics here. A miss goes to the policy's get,
+// which counts it and brings the key back from the file tier if the tier
+// holds it; a key found there is counted as an access like a hit.
+const char *admission_get(AdmissionCache *cache, const char *key) {
+    uint64_t start;
+    StatsSlot *stats = stats_begin(cache->policy->stats(cache->cache), &start);
+    uint64_t h = key_hash(key);
+    KeyValue *kv = (KeyValue *)cache->policy->lookup(cache->cache, key, h);
+    if (kv == NULL || kv->value == NULL || kv_expired(kv)) {
+        const char *value = cache->policy->get(cache->cache, key);
+        if (value) {
+            tinylfu_record(&cache->filter, h);
+        }
+        return value;
+    }
+    tinylfu_record(&cache->filter, h);
+    if (cache->policy->touch) {
+        cache->policy->touch(cache->cache, kv);
+    }
+    stats_end(stats, STAT_HITS, STATS_GET, start);
+    return kv->value;
+}
+
+// Function to free the policy instance, the filter and the wrapper
+void admission_destroy(AdmissionCache *cache) {
+    cache->policy->destroy(cache->cache);
+    tinylfu_free(&cache->filter);
+    free(cache);
+}
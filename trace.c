@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+// Trace reader for the replay and analysis tools.
+// The trace file is mapped into memory and parsed in place: no line is
+// read into a buffer, and only the key of each operation is copied out so
+// it can be NUL-terminated. The kernel is told the mapping is read
+// sequentially, so it reads ahead and drops pages behind the reader, and a
+// trace far larger than memory streams through. Text lines are split on
+// whitespace; JSON lines are walked member by member at the top level only,
+// so a "key" nested inside another member is never mistaken for the line's
+// key. Blank lines, lines starting with '#' and JSON lines without any
+// string member are skipped.
+
+static const char *skip_space(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) {
+        p++;
+    }
+    return p;
+}
+
+// Returns the character after the JSON string starting at p (on its opening quote)
+static const char *skip_string(const char *p, const char *end) {
+    for (p++; p < end && *p != '"'; p++) {
+        if (*p == '\\' && p + 1 < end) {
+            p++;
+        }
+    }
+    return p < end ? p + 1 : p;
+}
+
+// Returns the character after the JSON value starting at p
+static const char *skip_value(const char *p, const char *end) {
+    if (p < end && *p == '"') {
+        return skip_string(p, end);
+    }
+    int depth = 0;
+    for (; p < end; p++) {
+        if (*p == '"') {
+            p = skip_string(p, end) - 1;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            if (depth == 0) {
+                return p;
+            }
+            if (--depth == 0) {
+                return p + 1;
+            }
+        } else if (*p == ',' && depth == 0) {
+            return p;
+        }
+    }
+    return p;
+}
+
+// Function to find the value of a top-level member of the JSON object in
+// [line, end). With name NULL it finds the first member whose value is a string.
+static const char *json_member(const char *line, const char *end, const char *name) {
+    const char *p = skip_space(line, end);
+    if (p == end || *p != '{') {
+        return NULL;
+    }
+    p = skip_space(p + 1, end);
+    while (p < end && *p == '"') {
+        const char *name_start = p + 1;
+        p = skip_string(p, end);
+        size_t name_len = (size_t)(p - 1 - name_start);
+        p = skip_space(p, end);
+        if (p == end || *p != ':') {
+            return NULL;
+        }
+        p = skip_space(p + 1, end);
+        if (p == end) {
+            return NULL;
+        }
+        if (name ? strlen(name) == name_len && strncmp(name_start, name, name_len) == 0 : *p == '"') {
+            return p;
+        }
+        p = skip_space(skip_value(p, end), end);
+        if (p == end || *p != ',') {
+            return NULL;
+        }
+        p = skip_space(p + 1, end);
+    }
+    return NULL;
+}
+
+// Function to copy a JSON string value into out, undoing simple escapes; returns its length
+static size_t json_string(const char *p, const char *end, char *out) {
+    size_t n = 0;
+    for (p++; p < end && *p != '"'; p++) {
+        if (*p == '\\' && p + 1 < end) {
+            p++;
+            switch (*p) {
+            case 'n': out[n++] = '\n'; break;
+            case 't': out[n++] = '\t'; break;
+            case 'r': out[n++] = '\r'; break;
+            default: out[n++] = *p; break;
+            }
+        } else {
+            out[n++] = *p;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+// Function to read an unsigned decimal number; the mapping is not NUL-terminated, so strtoul cannot be used
+static uint32_t parse_number(const char *p, const char *end) {
+    uint32_t n = 0;
+    for (; p < end && *p >= '0' && *p <= '9'; p++) {
+        n = n * 10 + (uint32_t)(*p - '0');
+    }
+    return n;
+}
+
+static int is_set_op(const char *op, size_t len) {
+    return len == 3 && (strncmp(op, "set", 3) == 0 || strncmp(op, "put", 3) == 0);
+}
+
+// Function to parse one JSON line; returns 0 if it has no key
+static int parse_json(TraceReader *reader, const char *line, const char *end, TraceRecord *record) {
+    const char *key = json_member(line, end, "key");
+    if (key == NULL || *key != '"') {
+        key = json_member(line, end, NULL);
+    }
+    if (key == NULL) {
+        return 0;
+    }
+    record->key_len = json_string(key, end, reader->scratch);
+    record->key = reader->scratch;
+
+    const char *op = json_member(line, end, "op");
+    record->is_set = op && *op == '"' && is_set_op(op + 1, skip_string(op, end) - op - 2);
+    const char *size = json_member(line, end, "size");
+    const char *ttl = json_member(line, end, "ttl");
+    record->value_len = size ? parse_number(size, end) : TRACE_VALUE_SIZE;
+    record->ttl_ms = ttl ? parse_number(ttl, end) : 0;
+    return 1;
+}
+
+// Function to parse one text line; returns 0 if it is blank
+static int parse_text(TraceReader *reader, const char *line, const char *end, TraceRecord *record) {
+    const char *fields[4];
+    size_t lengths[4];
+    int n = 0;
+    const char *p = skip_space(line, end);
+    while (p < end && n < 4) {
+        fields[n] = p;
+        while (p < end && *p != ' ' && *p != '\t' && *p != '\r') {
+            p++;
+        }
+        lengths[n] = (size_t)(p - fields[n]);
+        n++;
+        p = skip_space(p, end);
+    }
+    if (n == 0) {
+        return 0;
+    }
+    int k = n == 1 ? 0 : 1;   // a bare key is a lookup
+    memcpy(reader->scratch, fields[k], lengths[k]);
+    reader->scratch[lengths[k]] = '\0';
+    record->key = reader->scratch;
+    record->key_len = lengths[k];
+    record->is_set = n > 1 && is_set_op(fields[0], lengths[0]);
+    record->value_len = n > 2 ? parse_number(fields[2], end) : TRACE_VALUE_SIZE;
+    record->ttl_ms = n > 3 ? parse_number(fields[3], end) : 0;
+    return 1;
+}
+
+// Function to map a trace file for reading; returns -1 if it cannot be mapped
+int trace_open(TraceReader *reader, const char *path) {
+    memset(reader, 0, sizeof(*reader));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s: not a regular file\n", path);
+        close(fd);
+        return -1;
+    }
+    reader->size = (size_t)st.st_size;
+    if (reader->size > 0) {
+        void *data = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        madvise(data, reader->size, MADV_SEQUENTIAL);
+        reader->data = (const char *)data;
+    }
+    close(fd);
+    return 0;
+}
+
+// Function to read the next operation; returns 0 at the end of the trace
+int trace_next(TraceReader *reader, TraceRecord *record) {
+    if (reader->data == NULL) {
+        return 0;
+    }
+    const char *end_of_file = reader->data + reader->size;
+    while (reader->pos < reader->size) {
+        const char *line = reader->data + reader->pos;
+        const char *end = memchr(line, '\n', (size_t)(end_of_file - line));
+        if (end == NULL) {
+            end = end_of_file;
+        }
+        reader->pos = (size_t)(end - reader->data) + 1;
+
+        // A key is never longer than the line it came from
+        size_t len = (size_t)(end - line);
+        if (len + 1 > reader->scratch_size) {
+            char *scratch = (char *)realloc(reader->scratch, len + 1);
+            if (scratch == NULL) {
+                perror("Failed to allocate memory for trace");
+                exit(EXIT_FAILURE);
+            }
+            reader->scratch = scratch;
+            reader->scratch_size = len + 1;
+        }
+
+        const char *p = skip_space(line, end);
+        if (p == end || *p == '#') {
+            continue;
+        }
+        if (*p == '{' ? parse_json(reader, p, end, record) : parse_text(reader, p, end, record)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to unmap the trace and free the reader's buffer
+void trace_close(TraceReader *reader) {
+    if (reader->data) {
+        munmap((void *)reader->data, reader->size);
+    }
+    free(reader->scratch);
+    memset(reader, 0, sizeof(*reader));
+}
@@ -0,0 +1,389 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cache.h"
+
+// Trace-driven replay benchmark.
+// The whole trace is parsed into memory first, then replayed against one
+// policy or all of them through the CachePolicy interface. Every policy
+// gets two fresh caches: one replay without per-operation timing gives the
+// throughput, and a second one times every operation with the monotonic
+// clock for the latency percentiles. A lookup that misses is filled right
+// away, as a cache in front of a backing store would be, so the hit ratio
+// is hits over all lookups in the trace.
+// The trace format is the one trace.c reads (text or JSON lines).
+// With --admission every cache sits behind a TinyLFU admission filter, so
+// a miss is only filled when the filter admits the key. With --snapshot each
+// policy's cache is also saved to path after a third replay, restored into
+// a fresh cache and compared entry by entry.
+//
+// Usage: ./a.out [--admission] [--snapshot path] trace [policy|all] [capacity] [max bytes]
+//   policy is one of HASHMAP, FIFO, LRU, MRU, GDSF, CLOCK, ARC (default all)
+//   a capacity of 0 caches nothing, so every lookup misses
+
+#define DEFAULT_CAPACITY 1000
+
+typedef struct TraceOp {
+    size_t key;           // offset of the key in Trace.keys
+    uint32_t value_len;   // bytes stored by a set or by the fill after a miss
+    uint32_t ttl_ms;
+    int is_set;
+} TraceOp;
+
+typedef struct Trace {
+    TraceOp *ops;
+    size_t count;
+    size_t capacity;
+    char *keys;           // every key, NUL-terminated, back to back
+    size_t keys_len;
+    size_t keys_capacity;
+    size_t gets;
+    uint32_t max_value;
+} Trace;
+
+// A policy instance, reached through a TinyLFU filter with --admission
+typedef struct Target {
+    const CachePolicy *policy;
+    void *cache;
+    AdmissionCache *filter;   // NULL to call the policy directly
+} Target;
+
+typedef struct Result {
+    double ops_per_sec;
+    double hit_ratio;
+    uint32_t p50, p99, p999;   // nanoseconds
+} Result;
+
+static const CachePolicy *policies[] = {
+    &hashmap_policy, &fifo_policy, &lru_policy, &mru_policy, &gdsf_policy, &clock_policy, &arc_policy
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *checked_realloc(void *p, size_t size) {
+    p = realloc(p, size);
+    if (p == NULL) {
+        perror("Failed to allocate memory for trace");
+        exit(EXIT_FAILURE);
+    }
+    return p;
+}
+
+// Function to append one operation; the key is copied into the trace
+static void trace_add(Trace *trace, const TraceRecord *record) {
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 4096;
+        trace->ops = checked_realloc(trace->ops, trace->capacity * sizeof(TraceOp));
+    }
+    if (trace->keys_len + record->key_len + 1 > trace->keys_capacity) {
+        while (trace->keys_len + record->key_len + 1 > trace->keys_capacity) {
+            trace->keys_capacity = trace->keys_capacity ? trace->keys_capacity * 2 : 65536;
+        }
+        trace->keys = checked_realloc(trace->keys, trace->keys_capacity);
+    }
+    TraceOp *op = &trace->ops[trace->count++];
+    op->key = trace->keys_len;
+    op->value_len = record->value_len;
+    op->ttl_ms = record->ttl_ms;
+    op->is_set = record->is_set;
+    memcpy(trace->keys + trace->keys_len, record->key, record->key_len + 1);
+    trace->keys_len += record->key_len + 1;
+    if (!record->is_set) {
+        trace->gets++;
+    }
+    if (record->value_len > trace->max_value) {
+        trace->max_value = record->value_len;
+    }
+}
+
+// Function to read a whole trace file into memory
+static int load_trace(Trace *trace, const char *path) {
+    TraceReader reader;
+    if (trace_open(&reader, path) != 0) {
+        return -1;
+    }
+    memset(trace, 0, sizeof(*trace));
+    trace->max_value = TRACE_VALUE_SIZE;
+    TraceRecord record;
+    while (trace_next(&reader, &record)) {
+        trace_add(trace, &record);
+    }
+    trace_close(&reader);
+    return 0;
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Latency at quantile q of sorted samples
+static uint32_t percentile(const uint32_t *sorted, size_t n, double q) {
+    size_t i = (size_t)(q * n);
+    return sorted[i < n ? i : n - 1];
+}
+
+static void target_open(Target *target, const CachePolicy *policy, size_t capacity, const CacheOptions *options,
+                        int admission) {
+    target->policy = policy;
+    target->filter = admission ? admission_create(policy, capacity, options) : NULL;
+    target->cache = target->filter ? target->filter->cache : policy->create(capacity, options);
+}
+
+static void target_close(Target *target) {
+    if (target->filter) {
+        admission_destroy(target->filter);
+    } else {
+        target->policy->destroy(target->cache);
+    }
+}
+
+static const char *target_get(Target *target, const char *key) {
+    return target->filter ? admission_get(target->filter, key) : target->policy->get(target->cache, key);
+}
+
+static void target_add(Target *target, const char *key, const char *value, uint64_t ttl_ms) {
+    if (target->filter) {
+        admission_add(target->filter, key, value, ttl_ms);
+    } else {
+        target->policy->add(target->cache, key, value, ttl_ms);
+    }
+}
+
+// Function to replay the trace once on target; latencies, if given, gets one sample per operation
+static double replay(Target *target, const Trace *trace, const char *values, uint32_t *latencies, size_t *hits) {
+    *hits = 0;
+    uint64_t start = now_ns();
+    for (size_t i = 0; i < trace->count; i++) {
+        const TraceOp *op = &trace->ops[i];
+        const char *key = trace->keys + op->key;
+        const char *value = values + (trace->max_value - op->value_len);
+        uint64_t t0 = latencies ? now_ns() : 0;
+        if (op->is_set) {
+            target_add(target, key, value, op->ttl_ms);
+        } else if (target_get(target, key)) {
+            (*hits)++;
+        } else {
+            target_add(target, key, value, op->ttl_ms);
+        }
+        if (latencies) {
+            uint64_t ns = now_ns() - t0;
+            latencies[i] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+        }
+    }
+    return (now_ns() - start) / 1e9;
+}
+
+static Result run(const CachePolicy *policy, const Trace *trace, size_t capacity, const CacheOptions *options,
+                  int admission, const char *values, uint32_t *latencies) {
+    Result result;
+    size_t hits;
+    Target target;
+    target_open(&target, policy, capacity, options, admission);
+    double elapsed = replay(&target, trace, values, NULL, &hits);
+    target_close(&target);
+    result.ops_per_sec = elapsed > 0 ? trace->count / elapsed : 0.0;
+    result.hit_ratio = trace->gets ? (double)hits / trace->gets : 0.0;
+
+    target_open(&target, policy, capacity, options, admission);
+    replay(&target, trace, values, latencies, &hits);
+    target_close(&target);
+    qsort(latencies, trace->count, sizeof(uint32_t), compare_u32);
+    result.p50 = percentile(latencies, trace->count, 0.50);
+    result.p99 = percentile(latencies, trace->count, 0.99);
+    result.p999 = percentile(latencies, trace->count, 0.999);
+    return result;
+}
+
+typedef struct RoundTrip {
+    const CachePolicy *policy;
+    void *restored;
+    size_t entries;     // live entries of the saved cache
+    size_t differ;      // of those, missing from the restored cache or with another value
+} RoundTrip;
+
+// VisitFn looking a saved entry up in the restored cache; the values are plain
+static void compare_entry(void *arg, KeyValue *kv) {
+    RoundTrip *trip = (RoundTrip *)arg;
+    if (kv->value == NULL || kv_expired(kv)) {
+        return;
+    }
+    trip->entries++;
+    KeyValue *copy = (KeyValue *)trip->policy->lookup(trip->restored, kv_key(kv), kv->hash);
+    if (copy == NULL || copy->value_len != kv->value_len || memcmp(copy->value, kv->value, kv->value_len) != 0) {
+        trip->differ++;
+    }
+}
+
+// Function to replay the trace, save the cache to path, restore the file
+// into a fresh cache and check every live entry came back with its value
+static int check_snapshot(const CachePolicy *policy, const Trace *trace, size_t capacity, const CacheOptions *options,
+                          int admission, const char *values, const char *path) {
+    Target target;
+    target_open(&target, policy, capacity, options, admission);
+    void *cache = target.cache;
+    size_t hits;
+    replay(&target, trace, values, NULL, &hits);
+    uint64_t t0 = now_ns();
+    if (cache_snapshot(policy, cache, NULL, path) != 0) {
+        target_close(&target);
+        return -1;
+    }
+    uint64_t t1 = now_ns();
+    void *restored = policy->create(capacity, options);
+    long count = cache_restore(policy, restored, NULL, path);
+    uint64_t t2 = now_ns();
+    RoundTrip trip = {policy, restored, 0, 0};
+    if (count >= 0) {
+        policy->walk(cache, compare_entry, &trip);
+    }
+    printf("| %-7s | %-10zu | %-10ld | %-8zu | %-10.2f | %-12.2f |\n", policy->name, trip.entries, count,
+           trip.differ, (t1 - t0) / 1e6, (t2 - t1) / 1e6);
+    policy->destroy(restored);
+    target_close(&target);
+    return count < 0 || trip.differ ? -1 : 0;
+}
+
+// Smallest gap between two clock reads, which every latency sample includes
+static uint64_t clock_overhead(void) {
+    uint64_t best = UINT64_MAX;
+    for (int i = 0; i < 1000; i++) {
+        uint64_t t0 = now_ns();
+        uint64_t t1 = now_ns();
+        if (t1 - t0 < best) {
+            best = t1 - t0;
+        }
+    }
+    return best;
+}
+
+// Parses a decimal count, rejecting anything atol would quietly read as 0
+static int parse_size(const char *arg, const char *what, size_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(arg, &end, 10);
+    if (arg[0] == '-' || end == arg || *end != '\0' || errno == ERANGE) {
+        fprintf(stderr, "Invalid %s %s\n", what, arg);
+        return -1;
+    }
+    *out = (size_t)v;
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *program = argv[0];
+    const char *snapshot = NULL;
+    int admission = 0;
+    int options_end = 1;
+    while (options_end < argc && strncmp(argv[options_end], "--", 2) == 0) {
+        if (strcmp(argv[options_end], "--admission") == 0) {
+            admission = 1;
+            options_end++;
+        } else if (strcmp(argv[options_end], "--snapshot") == 0 && options_end + 1 < argc) {
+            snapshot = argv[options_end + 1];
+            options_end += 2;
+        } else {
+            argc = 0;
+            break;
+        }
+    }
+    // The positional arguments follow the options, from argv[1] on
+    argc -= options_end - 1;
+    argv += options_end - 1;
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s [--admission] [--snapshot path] trace [policy|all] [capacity] [max bytes]\n",
+                program);
+        return 1;
+    }
+    const char *which = argc > 2 ? argv[2] : "all";
+    size_t capacity = DEFAULT_CAPACITY;
+    CacheOptions options = {0, 0, NULL, NULL, NULL, NULL, 0};
+    if ((argc > 3 && parse_size(argv[3], "capacity", &capacity) != 0) ||
+        (argc > 4 && parse_size(argv[4], "max bytes", &options.max_bytes) != 0)) {
+        return 1;
+    }
+
+    int selected = 0;
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(which, "all") == 0 || strcmp(which, policies[i]->name) == 0) {
+            selected++;
+        }
+    }
+    if (selected == 0) {
+        fprintf(stderr, "Unknown policy %s\n", which);
+        return 1;
+    }
+
+    Trace trace;
+    if (load_trace(&trace, argv[1]) != 0) {
+        return 1;
+    }
+    if (trace.count == 0) {
+        fprintf(stderr, "No operations in %s\n", argv[1]);
+        return 1;
+    }
+
+    // Every value is a suffix of one buffer, so no value is built during the replay
+    char *values = malloc(trace.max_value + 1);
+    uint32_t *latencies = malloc(trace.count * sizeof(uint32_t));
+    if (values == NULL || latencies == NULL) {
+        perror("Failed to allocate memory for replay");
+        return 1;
+    }
+    memset(values, 'v', trace.max_value);
+    values[trace.max_value] = '\0';
+
+    printf("%s: %zu operations (%zu lookups, %zu sets), %zu entries", argv[1], trace.count, trace.gets,
+           trace.count - trace.gets, capacity);
+    if (options.max_bytes) {
+        printf(", %zu bytes", options.max_bytes);
+    }
+    if (admission) {
+        printf(", TinyLFU admission");
+    }
+    printf("\n");
+    printf("---------------------------------------------------------------------------------\n");
+    printf("| %-7s | %-14s | %-9s | %-12s | %-12s | %-12s |\n", "Policy", "Ops/sec", "Hit ratio", "p50 (ns)",
+           "p99 (ns)", "p99.9 (ns)");
+    printf("---------------------------------------------------------------------------------\n");
+    for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if (strcmp(which, "all") != 0 && strcmp(which, policies[i]->name) != 0) {
+            continue;
+        }
+        Result r = run(policies[i], &trace, capacity, &options, admission, values, latencies);
+        printf("| %-7s | %-14.0f | %8.2f%% | %-12u | %-12u | %-12u |\n", policies[i]->name, r.ops_per_sec,
+               r.hit_ratio * 100, r.p50, r.p99, r.p999);
+    }
+    printf("---------------------------------------------------------------------------------\n");
+    printf("Latencies include about %lu ns of clock overhead per operation\n", (unsigned long)clock_overhead());
+
+    int failed = 0;
+    if (snapshot) {
+        printf("\nSnapshot round trip through %s\n", snapshot);
+        printf("-------------------------------------------------------------------------------\n");
+        printf("| %-7s | %-10s | %-10s | %-8s | %-10s | %-12s |\n", "Policy", "Saved", "Restored", "Differ",
+               "Save (ms)", "Restore (ms)");
+        printf("-------------------------------------------------------------------------------\n");
+        for (size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+            if (strcmp(which, "all") != 0 && strcmp(which, policies[i]->name) != 0) {
+                continue;
+            }
+            if (check_snapshot(policies[i], &trace, capacity, &options, admission, values, snapshot) != 0) {
+                failed = 1;
+            }
+        }
+        printf("-------------------------------------------------------------------------------\n");
+    }
+
+    free(latencies);
+    free(values);
+    free(trace.ops);
+    free(trace.keys);
+    return failed;
+}